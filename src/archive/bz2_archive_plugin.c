@@ -19,6 +19,18 @@
 
 /**
   * single bz2 archive handling (requires libbz2)
+  *
+  * Seeking is implemented with an index of the bzip2 blocks.  Each
+  * block can be decompressed independently: it is copied (shifted to
+  * a byte boundary, because blocks are not byte aligned) into a
+  * synthetic single-block bzip2 stream, which is passed to libbz2.
+  * The index is built while decompressing, and saved next to the
+  * database.
+  *
+  * Because the blocks are independent, the following blocks are
+  * decompressed in advance by a pool of worker threads, while the
+  * stream's thread reads them from the archive and finds their
+  * boundaries.
   */
 
 #include "config.h"
@@ -26,26 +38,223 @@
 #include "archive_api.h"
 #include "input_plugin.h"
 #include "refcount.h"
+#include "text_file.h"
+#include "conf.h"
 
+#include <assert.h>
 #include <stdint.h>
 #include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <glib.h>
 #include <bzlib.h>
 
+#undef G_LOG_DOMAIN
+#define G_LOG_DOMAIN "bz2"
+
 #ifdef HAVE_OLDER_BZIP2
 #define BZ2_bzDecompressInit bzDecompressInit
 #define BZ2_bzDecompress bzDecompress
+#define BZ2_bzDecompressEnd bzDecompressEnd
 #endif
 
+/**
+ * The magic number at the beginning of each bzip2 block (the BCD
+ * representation of pi).
+ */
+#define BZ2_BLOCK_MAGIC G_GINT64_CONSTANT(0x314159265359U)
+
+/**
+ * The magic number at the end of a bzip2 stream (the BCD
+ * representation of sqrt(pi)), followed by the combined CRC.
+ */
+#define BZ2_EOS_MAGIC G_GINT64_CONSTANT(0x177245385090U)
+
+#define BZ2_MAGIC_MASK G_GINT64_CONSTANT(0xffffffffffffU)
+
+enum {
+	/**
+	 * The size of the stream header ("BZh9").
+	 */
+	BZ2_HEADER_SIZE = 4,
+
+	/**
+	 * The size of the block/end-of-stream magic plus the CRC
+	 * [bytes].
+	 */
+	BZ2_MAGIC_CRC_SIZE = 10,
+
+	/**
+	 * The size of each read from the archive file.
+	 */
+	BZ2_READ_SIZE = 64 * 1024,
+
+	/**
+	 * The number of magic matches which are skipped when a block
+	 * cannot be decompressed.  A false match is very unlikely, so
+	 * a block which still fails is corrupt.
+	 */
+	BZ2_MAX_FALSE_MATCHES = 4,
+
+	/**
+	 * The maximum number of worker threads which decompress
+	 * blocks.
+	 */
+	BZ2_MAX_THREADS = 4,
+};
+
+struct bz2_block {
+	/**
+	 * The position of the block magic in the archive [bits].
+	 */
+	goffset bit;
+
+	/**
+	 * The position of the block's first byte in the uncompressed
+	 * data.
+	 */
+	goffset offset;
+};
+
+/**
+ * The block index of an archive.  It is built incrementally, from
+ * the beginning: a block is added after the previous one has been
+ * decompressed, because only then its uncompressed offset is known.
+ * All indexes are protected by #bz2_mutex.
+ */
+struct bz2_index {
+	/**
+	 * References from #bz2_indexes and from bz2_archive_file
+	 * objects.
+	 */
+	unsigned refs;
+
+	/**
+	 * The modification time and the size of the archive file.
+	 * The index is discarded if they change.
+	 */
+	time_t mtime;
+	goffset archive_size;
+
+	/**
+	 * An array of struct bz2_block, sorted by position.
+	 */
+	GArray *blocks;
+
+	/**
+	 * The uncompressed size, or -1 if the index is not complete
+	 * yet.
+	 */
+	goffset size;
+};
+
+/**
+ * Maps archive paths to struct bz2_index.
+ */
+static GHashTable *bz2_indexes;
+
+static GMutex *bz2_mutex;
+
+/**
+ * The path of the index file, or NULL if there is no database.
+ */
+static char *bz2_index_path;
+
+/**
+ * Has an index been completed since the index file was loaded?
+ */
+static bool bz2_index_modified;
+
+/**
+ * A block which is decompressed by the worker pool.
+ */
+struct bz2_job {
+	/**
+	 * References from the stream and from the worker.  Protected
+	 * by #bz2_job_mutex.
+	 */
+	unsigned refs;
+
+	/**
+	 * Has the worker finished?  Then #output or #error is set.
+	 * Protected by #bz2_job_mutex.
+	 */
+	bool done;
+
+	/**
+	 * Has the next block been added to the index?  This is only
+	 * used by the stream.
+	 */
+	bool indexed;
+
+	/**
+	 * The position of the block in the archive [bits].
+	 */
+	goffset bit;
+
+	/**
+	 * The position of the magic which ends the block [bits].
+	 */
+	goffset end;
+
+	/**
+	 * The number of magic matches which have been skipped.
+	 */
+	unsigned false_matches;
+
+	/**
+	 * The position of the next block in the archive [bits], or -1
+	 * if this is the last one.
+	 */
+	goffset next_bit;
+
+	/**
+	 * The synthetic bzip2 stream which contains the block.  It is
+	 * freed by the worker.
+	 */
+	GByteArray *input;
+
+	/**
+	 * The decompressed block.
+	 */
+	GByteArray *output;
+
+	GError *error;
+};
+
+/**
+ * Decompresses blocks for all streams.  If it could not be created,
+ * blocks are decompressed in the stream's thread.
+ */
+static GThreadPool *bz2_pool;
+
+/**
+ * The maximum number of blocks per stream which are queued in
+ * #bz2_pool.
+ */
+static unsigned bz2_read_ahead;
+
+static GMutex *bz2_job_mutex;
+
+/**
+ * Signalled when a job is done.
+ */
+static GCond *bz2_job_cond;
+
 struct bz2_archive_file {
 	struct archive_file base;
 
 	struct refcount ref;
 
 	char *name;
+	char *path;
 	bool reset;
-	struct input_stream *istream;
+
+	struct bz2_index *index;
 };
 
 struct bz2_input_stream {
@@ -53,11 +262,46 @@ struct bz2_input_stream {
 
 	struct bz2_archive_file *archive;
 
-	bool eof;
+	/**
+	 * The archive file.
+	 */
+	struct input_stream *istream;
 
-	bz_stream bzstream;
+	bool eof;
 
-	char buffer[5000];
+	/**
+	 * The number of the current block in the index.
+	 */
+	unsigned block;
+
+	/**
+	 * The jobs for the current block and the following ones.
+	 */
+	GQueue *jobs;
+
+	/**
+	 * The number of blocks which are decompressed in advance.
+	 * This grows while the stream is read sequentially, up to
+	 * #bz2_read_ahead, and is reset by seeking.
+	 */
+	unsigned window;
+
+	/**
+	 * The position of the block after the last job [bits], or -1
+	 * if there are no more blocks.
+	 */
+	goffset next_bit;
+
+	/**
+	 * The read position within the output of the current block.
+	 */
+	size_t position;
+
+	/**
+	 * The number of decompressed bytes which have to be
+	 * discarded before reaching the stream offset (after a seek).
+	 */
+	goffset skip;
 };
 
 static const struct input_plugin bz2_inputplugin;
@@ -68,36 +312,452 @@ bz2_quark(void)
 	return g_quark_from_static_string("bz2");
 }
 
-/* single archive handling allocation helpers */
+/* the block index */
+
+static struct bz2_index *
+bz2_index_new(time_t mtime, goffset archive_size)
+{
+	struct bz2_index *index = g_new(struct bz2_index, 1);
+
+	index->refs = 1;
+	index->mtime = mtime;
+	index->archive_size = archive_size;
+	index->blocks = g_array_new(false, false, sizeof(struct bz2_block));
+	index->size = -1;
+
+	return index;
+}
+
+/**
+ * Caller must lock #bz2_mutex.
+ */
+static void
+bz2_index_unref(gpointer data)
+{
+	struct bz2_index *index = data;
+
+	assert(index->refs > 0);
+
+	if (--index->refs > 0)
+		return;
+
+	g_array_free(index->blocks, true);
+	g_free(index);
+}
+
+static void
+bz2_index_append(struct bz2_index *index, goffset bit, goffset offset)
+{
+	struct bz2_block block = {
+		.bit = bit,
+		.offset = offset,
+	};
+
+	g_array_append_val(index->blocks, block);
+}
+
+/**
+ * Finds the block which contains the specified uncompressed offset,
+ * or the last known block if the offset is beyond the index.  The
+ * index must not be empty.  Caller must lock #bz2_mutex.
+ */
+static unsigned
+bz2_index_find(const struct bz2_index *index, goffset offset)
+{
+	unsigned a = 0, b = index->blocks->len;
+
+	assert(b > 0);
+
+	while (b - a > 1) {
+		unsigned i = (a + b) / 2;
+
+		if (g_array_index(index->blocks, struct bz2_block,
+				  i).offset <= offset)
+			a = i;
+		else
+			b = i;
+	}
+
+	return a;
+}
+
+/**
+ * Returns a new reference to the index for the archive, and creates
+ * an empty one if it is not known yet or if the file has been
+ * modified.
+ */
+static struct bz2_index *
+bz2_index_get(const char *path, const struct stat *st)
+{
+	struct bz2_index *index;
+
+	g_mutex_lock(bz2_mutex);
+
+	index = g_hash_table_lookup(bz2_indexes, path);
+	if (index == NULL || index->mtime != st->st_mtime ||
+	    index->archive_size != (goffset)st->st_size) {
+		index = bz2_index_new(st->st_mtime, st->st_size);
+		g_hash_table_insert(bz2_indexes, g_strdup(path), index);
+	}
+
+	++index->refs;
+
+	g_mutex_unlock(bz2_mutex);
+
+	return index;
+}
+
+static void
+bz2_index_load(FILE *fp)
+{
+	GString *buffer = g_string_sized_new(1024);
+	struct bz2_index *index = NULL;
+	char *line, *path = NULL, *endptr;
+	gint64 a, b;
+
+	while ((line = read_text_line(fp, buffer)) != NULL) {
+		if (g_str_has_prefix(line, "archive: ")) {
+			if (index != NULL)
+				break;
+
+			path = g_strdup(line + 9);
+			index = bz2_index_new(0, -1);
+		} else if (index == NULL)
+			break;
+		else if (g_str_has_prefix(line, "mtime: "))
+			index->mtime = (time_t)g_ascii_strtoll(line + 7,
+							       NULL, 10);
+		else if (g_str_has_prefix(line, "archive_size: "))
+			index->archive_size = g_ascii_strtoll(line + 14,
+							      NULL, 10);
+		else if (g_str_has_prefix(line, "block: ")) {
+			a = g_ascii_strtoll(line + 7, &endptr, 10);
+			b = g_ascii_strtoll(endptr, &endptr, 10);
+			if (*endptr != 0)
+				break;
+
+			bz2_index_append(index, a, b);
+		} else if (g_str_has_prefix(line, "size: ") &&
+			   index->blocks->len > 0) {
+			index->size = g_ascii_strtoll(line + 6, NULL, 10);
+			g_hash_table_insert(bz2_indexes, path, index);
+			path = NULL;
+			index = NULL;
+		} else
+			break;
+	}
+
+	if (line != NULL)
+		g_warning("Malformed line in %s: %s", bz2_index_path, line);
+
+	if (index != NULL)
+		/* incomplete entry */
+		bz2_index_unref(index);
+
+	g_free(path);
+	g_string_free(buffer, true);
+}
+
+static void
+bz2_index_save_entry(gpointer key, gpointer value, gpointer user_data)
+{
+	const char *path = key;
+	const struct bz2_index *index = value;
+	FILE *fp = user_data;
+	struct stat st;
+
+	if (index->size < 0 || strchr(path, '\n') != NULL ||
+	    /* forget archives which have been deleted or modified */
+	    stat(path, &st) < 0 || st.st_mtime != index->mtime ||
+	    (goffset)st.st_size != index->archive_size)
+		return;
+
+	fprintf(fp, "archive: %s\n", path);
+	fprintf(fp, "mtime: %lld\n", (long long)index->mtime);
+	fprintf(fp, "archive_size: %lld\n", (long long)index->archive_size);
+
+	for (unsigned i = 0; i < index->blocks->len; ++i) {
+		const struct bz2_block *block =
+			&g_array_index(index->blocks, struct bz2_block, i);
+		fprintf(fp, "block: %lld %lld\n",
+			(long long)block->bit, (long long)block->offset);
+	}
+
+	fprintf(fp, "size: %lld\n", (long long)index->size);
+}
 
 static bool
-bz2_alloc(struct bz2_input_stream *data, GError **error_r)
+bz2_index_save(void)
 {
-	int ret;
+	char *tmp = g_strconcat(bz2_index_path, ".tmp", NULL);
+	FILE *fp = fopen(tmp, "w");
+	bool success = true;
 
-	data->bzstream.bzalloc = NULL;
-	data->bzstream.bzfree  = NULL;
-	data->bzstream.opaque  = NULL;
+	if (fp == NULL) {
+		g_warning("Failed to create %s: %s", tmp, g_strerror(errno));
+		g_free(tmp);
+		return false;
+	}
 
-	data->bzstream.next_in = (void *) data->buffer;
-	data->bzstream.avail_in = 0;
+	g_hash_table_foreach(bz2_indexes, bz2_index_save_entry, fp);
 
-	ret = BZ2_bzDecompressInit(&data->bzstream, 0, 0);
-	if (ret != BZ_OK) {
-		g_free(data);
+	if (ferror(fp) || fclose(fp) != 0 || rename(tmp, bz2_index_path) < 0) {
+		g_warning("Failed to write %s: %s",
+			  bz2_index_path, g_strerror(errno));
+		unlink(tmp);
+		success = false;
+	}
+
+	g_free(tmp);
+	return success;
+}
+
+/**
+ * Saves the index file if an index has been completed since it was
+ * saved last time.
+ */
+static void
+bz2_index_save_modified(void)
+{
+	g_mutex_lock(bz2_mutex);
+
+	if (bz2_index_path != NULL && bz2_index_modified &&
+	    bz2_index_save())
+		bz2_index_modified = false;
+
+	g_mutex_unlock(bz2_mutex);
+}
 
+/* the worker pool */
+
+/**
+ * Caller must lock #bz2_job_mutex.
+ */
+static void
+bz2_job_unref(struct bz2_job *job)
+{
+	assert(job->refs > 0);
+
+	if (--job->refs > 0)
+		return;
+
+	if (job->input != NULL)
+		g_byte_array_free(job->input, true);
+	if (job->output != NULL)
+		g_byte_array_free(job->output, true);
+	if (job->error != NULL)
+		g_error_free(job->error);
+	g_free(job);
+}
+
+/**
+ * Decompresses the synthetic stream of a job.
+ */
+static GByteArray *
+bz2_decompress(GByteArray *input, GError **error_r)
+{
+	GByteArray *output;
+	bz_stream bzstream;
+	size_t position = 0;
+	int ret;
+
+	memset(&bzstream, 0, sizeof(bzstream));
+	ret = BZ2_bzDecompressInit(&bzstream, 0, 0);
+	if (ret != BZ_OK) {
 		g_set_error(error_r, bz2_quark(), ret,
 			    "BZ2_bzDecompressInit() has failed");
+		return NULL;
+	}
+
+	bzstream.next_in = (char *)input->data;
+	bzstream.avail_in = input->len;
+
+	/* most blocks are not larger than 900 kB, but run-length
+	   encoded data may be */
+	output = g_byte_array_new();
+	g_byte_array_set_size(output, 1024 * 1024);
+
+	while (true) {
+		if (position == output->len)
+			g_byte_array_set_size(output, output->len * 2);
+
+		bzstream.next_out = (char *)output->data + position;
+		bzstream.avail_out = output->len - position;
+
+		ret = BZ2_bzDecompress(&bzstream);
+		position = output->len - bzstream.avail_out;
+
+		if (ret == BZ_STREAM_END)
+			break;
+
+		if (ret != BZ_OK) {
+			g_set_error(error_r, bz2_quark(), ret,
+				    "BZ2_bzDecompress() has failed");
+			break;
+		}
+
+		if (bzstream.avail_out > 0 && bzstream.avail_in == 0) {
+			g_set_error(error_r, bz2_quark(), 0,
+				    "Unexpected end of bzip2 block");
+			break;
+		}
+	}
+
+	BZ2_bzDecompressEnd(&bzstream);
+
+	if (ret != BZ_STREAM_END) {
+		g_byte_array_free(output, true);
+		return NULL;
+	}
+
+	g_byte_array_set_size(output, position);
+	return output;
+}
+
+static void
+bz2_job_run(gpointer data, G_GNUC_UNUSED gpointer user_data)
+{
+	struct bz2_job *job = data;
+	GByteArray *output = NULL;
+	GError *error = NULL;
+	bool cancelled;
+
+	g_mutex_lock(bz2_job_mutex);
+	cancelled = job->refs == 1;
+	g_mutex_unlock(bz2_job_mutex);
+
+	if (!cancelled)
+		output = bz2_decompress(job->input, &error);
+
+	g_mutex_lock(bz2_job_mutex);
+
+	g_byte_array_free(job->input, true);
+	job->input = NULL;
+	job->output = output;
+	job->error = error;
+	job->done = true;
+	g_cond_broadcast(bz2_job_cond);
+
+	bz2_job_unref(job);
+
+	g_mutex_unlock(bz2_job_mutex);
+}
+
+static void
+bz2_job_submit(struct bz2_job *job)
+{
+	/* the reference for the worker */
+	++job->refs;
+
+	if (bz2_pool != NULL)
+		g_thread_pool_push(bz2_pool, job, NULL);
+	else
+		bz2_job_run(job, NULL);
+}
+
+/**
+ * Waits until the job is done.
+ *
+ * @return false if decompression has failed
+ */
+static bool
+bz2_job_wait(const struct bz2_job *job, GError **error_r)
+{
+	g_mutex_lock(bz2_job_mutex);
+	while (!job->done)
+		g_cond_wait(bz2_job_cond, bz2_job_mutex);
+	g_mutex_unlock(bz2_job_mutex);
+
+	if (job->error != NULL) {
+		/* copy it, because the stream reports it again on the
+		   next read */
+		g_propagate_error(error_r, g_error_copy(job->error));
 		return false;
 	}
 
 	return true;
 }
 
+/**
+ * Releases the jobs of a stream.  Workers skip the jobs which have
+ * not been started yet.
+ */
 static void
-bz2_destroy(struct bz2_input_stream *data)
+bz2_cancel(struct bz2_input_stream *bis)
 {
-	BZ2_bzDecompressEnd(&data->bzstream);
+	struct bz2_job *job;
+
+	g_mutex_lock(bz2_job_mutex);
+	while ((job = g_queue_pop_head(bis->jobs)) != NULL)
+		bz2_job_unref(job);
+	g_mutex_unlock(bz2_job_mutex);
+}
+
+/* global initialization */
+
+static bool
+bz2_init(void)
+{
+	const char *db_path = config_get_path(CONF_DB_FILE);
+	GError *error = NULL;
+	FILE *fp;
+	long n;
+
+	bz2_indexes = g_hash_table_new_full(g_str_hash, g_str_equal,
+					    g_free, bz2_index_unref);
+	bz2_mutex = g_mutex_new();
+	bz2_index_modified = false;
+
+	bz2_job_mutex = g_mutex_new();
+	bz2_job_cond = g_cond_new();
+
+	/* one worker per CPU; the stream's thread only copies the
+	   decompressed data */
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	n = n < 1 ? 1 : (n > BZ2_MAX_THREADS ? BZ2_MAX_THREADS : n);
+	bz2_read_ahead = n + 1;
+
+	bz2_pool = g_thread_pool_new(bz2_job_run, NULL, n, false, &error);
+	if (bz2_pool == NULL) {
+		g_warning("Failed to create the bzip2 worker pool: %s",
+			  error->message);
+		g_error_free(error);
+	}
+
+	if (db_path == NULL)
+		return true;
+
+	bz2_index_path = g_strconcat(db_path, ".bz2_index", NULL);
+
+	fp = fopen(bz2_index_path, "r");
+	if (fp != NULL) {
+		bz2_index_load(fp);
+		fclose(fp);
+	}
+
+	return true;
+}
+
+static void
+bz2_finish(void)
+{
+	if (bz2_pool != NULL) {
+		/* wait for the workers, which free the remaining
+		   jobs */
+		g_thread_pool_free(bz2_pool, false, true);
+		bz2_pool = NULL;
+	}
+
+	g_cond_free(bz2_job_cond);
+	g_mutex_free(bz2_job_mutex);
+
+	bz2_index_save_modified();
+
+	g_free(bz2_index_path);
+	bz2_index_path = NULL;
+
+	g_hash_table_destroy(bz2_indexes);
+	g_mutex_free(bz2_mutex);
 }
 
 /* archive open && listing routine */
@@ -106,18 +766,22 @@ static struct archive_file *
 bz2_open(const char *pathname, GError **error_r)
 {
 	struct bz2_archive_file *context;
+	struct stat st;
 	int len;
 
+	if (stat(pathname, &st) < 0) {
+		g_set_error(error_r, bz2_quark(), errno,
+			    "Failed to open %s: %s",
+			    pathname, g_strerror(errno));
+		return NULL;
+	}
+
 	context = g_malloc(sizeof(*context));
 	archive_file_init(&context->base, &bz2_archive_plugin);
 	refcount_init(&context->ref);
 
-	//open archive
-	context->istream = input_stream_open(pathname, error_r);
-	if (context->istream == NULL) {
-		g_free(context);
-		return NULL;
-	}
+	context->path = g_strdup(pathname);
+	context->index = bz2_index_get(pathname, &st);
 
 	context->name = g_path_get_basename(pathname);
 
@@ -130,10 +794,57 @@ bz2_open(const char *pathname, GError **error_r)
 	return &context->base;
 }
 
+static struct input_stream *
+bz2_open_stream(struct archive_file *file, const char *path, GError **error_r);
+
+/**
+ * Decompresses the whole archive, to complete its block index.
+ */
+static void
+bz2_complete_index(struct bz2_archive_file *context)
+{
+	GError *error = NULL;
+	struct input_stream *is;
+	char buffer[16384];
+
+	is = bz2_open_stream(&context->base, context->name, &error);
+	if (is == NULL) {
+		g_warning("%s", error->message);
+		g_error_free(error);
+		return;
+	}
+
+	while (input_stream_read(is, buffer, sizeof(buffer), &error) > 0) {}
+
+	if (error != NULL) {
+		g_warning("%s: %s", context->path, error->message);
+		g_error_free(error);
+	}
+
+	input_stream_close(is);
+}
+
 static void
 bz2_scan_reset(struct archive_file *file)
 {
 	struct bz2_archive_file *context = (struct bz2_archive_file *) file;
+	bool complete;
+
+	/* this is called by the database update: build the index
+	   now, so seeking during playback is fast */
+	g_mutex_lock(bz2_mutex);
+	complete = context->index->size >= 0;
+	g_mutex_unlock(bz2_mutex);
+
+	if (!complete) {
+		bz2_complete_index(context);
+
+		/* save it now: the archive listing cache skips this
+		   archive in later updates, so the index would not be
+		   built again if MPD is killed */
+		bz2_index_save_modified();
+	}
+
 	context->reset = true;
 }
 
@@ -159,34 +870,399 @@ bz2_close(struct archive_file *file)
 	if (!refcount_dec(&context->ref))
 		return;
 
-	g_free(context->name);
+	g_mutex_lock(bz2_mutex);
+	bz2_index_unref(context->index);
+	g_mutex_unlock(bz2_mutex);
 
-	input_stream_close(context->istream);
+	g_free(context->name);
+	g_free(context->path);
 	g_free(context);
 }
 
 /* single archive handling */
 
+/**
+ * Reads exactly the specified number of bytes from the archive.
+ */
+static bool
+bz2_read_at(struct bz2_input_stream *bis, goffset offset,
+	    void *buffer, size_t length, GError **error_r)
+{
+	GError *error = NULL;
+
+	if (!input_stream_seek(bis->istream, offset, SEEK_SET, error_r))
+		return false;
+
+	while (length > 0) {
+		size_t nbytes = input_stream_read(bis->istream, buffer,
+						  length, &error);
+		if (nbytes == 0) {
+			if (error != NULL)
+				g_propagate_error(error_r, error);
+			else
+				g_set_error(error_r, bz2_quark(), 0,
+					    "Unexpected end of file");
+			return false;
+		}
+
+		buffer = (char *)buffer + nbytes;
+		length -= nbytes;
+	}
+
+	return true;
+}
+
+/**
+ * Checks for a stream header followed by a block at the specified
+ * position.
+ *
+ * @return the position of the block magic [bits], or -1 if there is
+ * no block
+ */
+static goffset
+bz2_find_stream(struct bz2_input_stream *bis, goffset offset)
+{
+	unsigned char buffer[BZ2_HEADER_SIZE + BZ2_MAGIC_CRC_SIZE];
+	guint64 magic = 0;
+
+	if (offset + (goffset)sizeof(buffer) > bis->archive->index->archive_size ||
+	    !bz2_read_at(bis, offset, buffer, sizeof(buffer), NULL) ||
+	    memcmp(buffer, "BZh", 3) != 0 ||
+	    buffer[3] < '1' || buffer[3] > '9')
+		return -1;
+
+	for (unsigned i = 0; i < 6; ++i)
+		magic = (magic << 8) | buffer[BZ2_HEADER_SIZE + i];
+
+	return magic == BZ2_BLOCK_MAGIC
+		? (offset + BZ2_HEADER_SIZE) * 8
+		: -1;
+}
+
+/**
+ * Initializes an empty index: checks the header of the first stream.
+ */
+static bool
+bz2_index_init(struct bz2_input_stream *bis, GError **error_r)
+{
+	struct bz2_index *index = bis->archive->index;
+	goffset bit;
+	bool empty;
+
+	g_mutex_lock(bz2_mutex);
+	empty = index->blocks->len == 0 && index->size < 0;
+	g_mutex_unlock(bz2_mutex);
+
+	if (!empty)
+		return true;
+
+	bit = bz2_find_stream(bis, 0);
+	if (bit < 0) {
+		g_set_error(error_r, bz2_quark(), 0,
+			    "Not a bzip2 file: %s", bis->archive->path);
+		return false;
+	}
+
+	g_mutex_lock(bz2_mutex);
+	if (index->blocks->len == 0)
+		bz2_index_append(index, bit, 0);
+	g_mutex_unlock(bz2_mutex);
+
+	return true;
+}
+
+/**
+ * Loads the block which begins at the specified position from the
+ * archive, and converts it to a single-block bzip2 stream.
+ *
+ * @param after the block ends at the first magic after this position
+ * [bits]; this is the position of the block itself, unless an
+ * earlier match has turned out to be false
+ */
+static struct bz2_job *
+bz2_load_block(struct bz2_input_stream *bis, goffset bit, goffset after,
+	       GError **error_r)
+{
+	static const unsigned char eos_magic[6] = {
+		0x17, 0x72, 0x45, 0x38, 0x50, 0x90,
+	};
+	GByteArray *buffer = g_byte_array_new();
+	struct bz2_job *job;
+	GError *error = NULL;
+	goffset position = bit / 8 * 8, end = -1, next, nbits, nbytes;
+	guint64 reg = 0;
+	unsigned shift = bit % 8;
+	unsigned char *p, trailer[BZ2_MAGIC_CRC_SIZE];
+	bool end_of_stream = false;
+
+	/* read until the next block magic or end-of-stream magic */
+
+	g_byte_array_set_size(buffer, BZ2_HEADER_SIZE);
+
+	if (!input_stream_seek(bis->istream, bit / 8, SEEK_SET, error_r)) {
+		g_byte_array_free(buffer, true);
+		return NULL;
+	}
+
+	do {
+		size_t old_length = buffer->len, nbytes;
+
+		g_byte_array_set_size(buffer, old_length + BZ2_READ_SIZE);
+		nbytes = input_stream_read(bis->istream,
+					   buffer->data + old_length,
+					   BZ2_READ_SIZE, &error);
+		g_byte_array_set_size(buffer, old_length + nbytes);
+
+		if (nbytes == 0) {
+			if (error != NULL) {
+				g_propagate_error(error_r, error);
+				g_byte_array_free(buffer, true);
+				return NULL;
+			}
+
+			/* truncated file: let libbz2 report the error */
+			end = position;
+			end_of_stream = true;
+			break;
+		}
+
+		for (size_t i = old_length; i < buffer->len && end < 0; ++i) {
+			for (int j = 7; j >= 0; --j) {
+				reg = (reg << 1) | ((buffer->data[i] >> j) & 1);
+				++position;
+
+				if (position - 48 > after &&
+				    ((reg & BZ2_MAGIC_MASK) == BZ2_BLOCK_MAGIC ||
+				     (reg & BZ2_MAGIC_MASK) == BZ2_EOS_MAGIC)) {
+					end = position - 48;
+					end_of_stream =
+						(reg & BZ2_MAGIC_MASK) ==
+						BZ2_EOS_MAGIC;
+					break;
+				}
+			}
+		}
+	} while (end < 0);
+
+	nbits = end - bit;
+	if (nbits < BZ2_MAGIC_CRC_SIZE * 8) {
+		g_set_error(error_r, bz2_quark(), 0,
+			    "Corrupt bzip2 block in %s", bis->archive->path);
+		g_byte_array_free(buffer, true);
+		return NULL;
+	}
+
+	/* shift the block to a byte boundary */
+
+	p = buffer->data + BZ2_HEADER_SIZE;
+	nbytes = (nbits + 7) / 8;
+
+	if (shift > 0) {
+		size_t length = buffer->len - BZ2_HEADER_SIZE;
+
+		for (goffset i = 0; i < nbytes; ++i) {
+			unsigned next = (size_t)i + 1 < length ? p[i + 1] : 0;
+			p[i] = (p[i] << shift) | (next >> (8 - shift));
+		}
+	}
+
+	/* append the end-of-stream magic; the combined CRC of a
+	   stream with only one block is the CRC of the block */
+
+	memcpy(trailer, eos_magic, sizeof(eos_magic));
+	memcpy(trailer + sizeof(eos_magic), p + sizeof(eos_magic), 4);
+
+	g_byte_array_set_size(buffer, BZ2_HEADER_SIZE +
+			      (nbits + sizeof(trailer) * 8 + 7) / 8);
+	p = buffer->data + BZ2_HEADER_SIZE;
+
+	if (nbits % 8 != 0)
+		p[nbytes - 1] &= 0xff << (8 - nbits % 8);
+	memset(p + nbytes, 0, buffer->len - BZ2_HEADER_SIZE - nbytes);
+
+	for (unsigned i = 0; i < sizeof(trailer) * 8; ++i) {
+		if ((trailer[i / 8] >> (7 - i % 8)) & 1) {
+			goffset j = nbits + i;
+			p[j / 8] |= 0x80 >> (j % 8);
+		}
+	}
+
+	/* the maximum block size, which works for all blocks */
+	memcpy(buffer->data, "BZh9", BZ2_HEADER_SIZE);
+
+	/* find the next block */
+
+	if (!end_of_stream)
+		next = end;
+	else if (end / 8 < bis->archive->index->archive_size)
+		/* is there another stream after this one (e.g. created
+		   by pbzip2)? */
+		next = bz2_find_stream(bis, (end + BZ2_MAGIC_CRC_SIZE * 8
+					     + 7) / 8);
+	else
+		next = -1;
+
+	job = g_new(struct bz2_job, 1);
+	job->refs = 1;
+	job->done = false;
+	job->indexed = false;
+	job->bit = bit;
+	job->end = end;
+	job->false_matches = 0;
+	job->next_bit = next;
+	job->input = buffer;
+	job->output = NULL;
+	job->error = NULL;
+
+	return job;
+}
+
+/**
+ * Loads blocks and submits them to the worker pool, until the read
+ * ahead window is full.
+ */
+static bool
+bz2_fill(struct bz2_input_stream *bis, GError **error_r)
+{
+	while (g_queue_get_length(bis->jobs) < bis->window &&
+	       bis->next_bit >= 0) {
+		GError *error = NULL;
+		struct bz2_job *job = bz2_load_block(bis, bis->next_bit,
+						     bis->next_bit, &error);
+		if (job == NULL) {
+			if (g_queue_is_empty(bis->jobs)) {
+				g_propagate_error(error_r, error);
+				return false;
+			}
+
+			/* try again when this block is needed */
+			g_error_free(error);
+			break;
+		}
+
+		bis->next_bit = job->next_bit;
+		g_queue_push_tail(bis->jobs, job);
+		bz2_job_submit(job);
+	}
+
+	return true;
+}
+
+/**
+ * Decompressing the current block has failed.  The 48 bit magic may
+ * occur by chance in compressed data, and then the block has been
+ * cut short: load it again, up to the next magic.  The following
+ * jobs began at the false match, so they are discarded.
+ *
+ * @return false if the block cannot be extended
+ */
+static bool
+bz2_retry(struct bz2_input_stream *bis)
+{
+	struct bz2_job *job = g_queue_peek_head(bis->jobs);
+	goffset bit = job->bit, end = job->end;
+	unsigned false_matches = job->false_matches + 1;
+
+	if (false_matches > BZ2_MAX_FALSE_MATCHES ||
+	    end >= bis->archive->index->archive_size * 8)
+		return false;
+
+	job = bz2_load_block(bis, bit, end, NULL);
+	if (job == NULL)
+		return false;
+
+	job->false_matches = false_matches;
+
+	g_debug("%s: block at bit %lld extended to bit %lld",
+		bis->archive->path, (long long)bit, (long long)job->end);
+
+	bz2_cancel(bis);
+
+	bis->next_bit = job->next_bit;
+	g_queue_push_tail(bis->jobs, job);
+	bz2_job_submit(job);
+	return true;
+}
+
+/**
+ * The current block has been decompressed.  Adds the next block to
+ * the index.
+ */
+static void
+bz2_block_end(struct bz2_input_stream *bis, struct bz2_job *job)
+{
+	struct bz2_index *index = bis->archive->index;
+
+	assert(job->done);
+	assert(job->output != NULL);
+
+	job->indexed = true;
+
+	g_mutex_lock(bz2_mutex);
+
+	if (bis->block + 1 == index->blocks->len && index->size < 0) {
+		goffset offset = g_array_index(index->blocks,
+					       struct bz2_block,
+					       bis->block).offset
+			+ job->output->len;
+
+		if (job->next_bit >= 0)
+			bz2_index_append(index, job->next_bit, offset);
+		else {
+			index->size = offset;
+			bz2_index_modified = true;
+
+			g_debug("%s: %u blocks, %lld bytes",
+				bis->archive->path,
+				index->blocks->len, (long long)offset);
+		}
+	}
+
+	if (bis->base.size < 0)
+		bis->base.size = index->size;
+
+	g_mutex_unlock(bz2_mutex);
+}
+
 static struct input_stream *
 bz2_open_stream(struct archive_file *file, const char *path, GError **error_r)
 {
 	struct bz2_archive_file *context = (struct bz2_archive_file *) file;
-	struct bz2_input_stream *bis = g_new(struct bz2_input_stream, 1);
+	struct bz2_input_stream *bis;
+	struct input_stream *istream;
+
+	istream = input_stream_open(context->path, error_r);
+	if (istream == NULL)
+		return NULL;
 
+	bis = g_new(struct bz2_input_stream, 1);
 	input_stream_init(&bis->base, &bz2_inputplugin, path);
 
 	bis->archive = context;
-
-	bis->base.ready = true;
-	bis->base.seekable = false;
-
-	if (!bz2_alloc(bis, error_r)) {
+	bis->istream = istream;
+	bis->eof = false;
+	bis->block = 0;
+	bis->jobs = g_queue_new();
+	bis->window = 1;
+	bis->position = 0;
+	bis->skip = 0;
+
+	if (!bz2_index_init(bis, error_r)) {
+		g_queue_free(bis->jobs);
+		input_stream_close(istream);
 		input_stream_deinit(&bis->base);
 		g_free(bis);
 		return NULL;
 	}
 
-	bis->eof = false;
+	g_mutex_lock(bz2_mutex);
+	bis->base.size = context->index->size;
+	bis->next_bit = g_array_index(context->index->blocks,
+				      struct bz2_block, 0).bit;
+	g_mutex_unlock(bz2_mutex);
+
+	bis->base.ready = true;
+	bis->base.seekable = true;
 
 	refcount_inc(&context->ref);
 
@@ -198,7 +1274,9 @@ bz2_is_close(struct input_stream *is)
 {
 	struct bz2_input_stream *bis = (struct bz2_input_stream *)is;
 
-	bz2_destroy(bis);
+	bz2_cancel(bis);
+	g_queue_free(bis->jobs);
+	input_stream_close(bis->istream);
 
 	bz2_close(&bis->archive->base);
 
@@ -206,66 +1284,78 @@ bz2_is_close(struct input_stream *is)
 	g_free(bis);
 }
 
-static bool
-bz2_fillbuffer(struct bz2_input_stream *bis, GError **error_r)
-{
-	size_t count;
-	bz_stream *bzstream;
-
-	bzstream = &bis->bzstream;
-
-	if (bzstream->avail_in > 0)
-		return true;
-
-	count = input_stream_read(bis->archive->istream,
-				  bis->buffer, sizeof(bis->buffer),
-				  error_r);
-	if (count == 0)
-		return false;
-
-	bzstream->next_in = bis->buffer;
-	bzstream->avail_in = count;
-	return true;
-}
-
 static size_t
 bz2_is_read(struct input_stream *is, void *ptr, size_t length,
 	    GError **error_r)
 {
 	struct bz2_input_stream *bis = (struct bz2_input_stream *)is;
-	bz_stream *bzstream;
-	int bz_result;
-	size_t nbytes = 0;
+	struct bz2_job *job;
+	GError *error = NULL;
+	size_t nbytes;
 
-	if (bis->eof)
-		return 0;
-
-	bzstream = &bis->bzstream;
-	bzstream->next_out = ptr;
-	bzstream->avail_out = length;
-
-	do {
-		if (!bz2_fillbuffer(bis, error_r))
+	while (!bis->eof) {
+		if (!bz2_fill(bis, error_r))
 			return 0;
 
-		bz_result = BZ2_bzDecompress(bzstream);
-
-		if (bz_result == BZ_STREAM_END) {
+		job = g_queue_peek_head(bis->jobs);
+		if (job == NULL) {
+			/* after the last block */
 			bis->eof = true;
 			break;
 		}
 
-		if (bz_result != BZ_OK) {
-			g_set_error(error_r, bz2_quark(), bz_result,
-				    "BZ2_bzDecompress() has failed");
-			return 0;
+		if (!bz2_job_wait(job, &error)) {
+			if (!bz2_retry(bis)) {
+				g_propagate_error(error_r, error);
+				return 0;
+			}
+
+			g_error_free(error);
+			error = NULL;
+			continue;
+		}
+
+		if (!job->indexed)
+			bz2_block_end(bis, job);
+
+		nbytes = job->output->len - bis->position;
+		if (nbytes == 0) {
+			/* advance to the next block, and decompress
+			   more blocks in advance, because the stream
+			   is read sequentially */
+			g_mutex_lock(bz2_job_mutex);
+			bz2_job_unref(g_queue_pop_head(bis->jobs));
+			g_mutex_unlock(bz2_job_mutex);
+
+			++bis->block;
+			bis->position = 0;
+
+			if (bis->window < bz2_read_ahead)
+				++bis->window;
+			continue;
+		}
+
+		if (bis->skip > 0) {
+			/* after a seek, discard the data before the
+			   offset */
+			if ((goffset)nbytes > bis->skip)
+				nbytes = (size_t)bis->skip;
+
+			bis->position += nbytes;
+			bis->skip -= nbytes;
+			continue;
 		}
-	} while (bzstream->avail_out == length);
 
-	nbytes = length - bzstream->avail_out;
-	is->offset += nbytes;
+		if (nbytes > length)
+			nbytes = length;
 
-	return nbytes;
+		memcpy(ptr, job->output->data + bis->position, nbytes);
+		bis->position += nbytes;
+		is->offset += nbytes;
+		return nbytes;
+	}
+
+	return 0;
 }
 
 static bool
@@ -276,6 +1366,73 @@ bz2_is_eof(struct input_stream *is)
 	return bis->eof;
 }
 
+static bool
+bz2_is_seek(struct input_stream *is, goffset offset, int whence,
+	    GError **error_r)
+{
+	struct bz2_input_stream *bis = (struct bz2_input_stream *)is;
+	struct bz2_index *index = bis->archive->index;
+	struct bz2_block block;
+	unsigned i;
+
+	if (whence == SEEK_CUR)
+		offset += is->offset;
+	else if (whence == SEEK_END) {
+		if (is->size < 0) {
+			g_set_error(error_r, bz2_quark(), 0,
+				    "Size is unknown");
+			return false;
+		}
+
+		offset += is->size;
+	}
+
+	if (offset < 0) {
+		g_set_error(error_r, bz2_quark(), 0, "Invalid offset");
+		return false;
+	}
+
+	g_mutex_lock(bz2_mutex);
+	i = bz2_index_find(index, offset);
+	block = g_array_index(index->blocks, struct bz2_block, i);
+	g_mutex_unlock(bz2_mutex);
+
+	if (i < bis->block) {
+		bz2_cancel(bis);
+		bis->block = i;
+		bis->next_bit = block.bit;
+		bis->window = 1;
+	} else {
+		struct bz2_job *job;
+
+		/* keep the jobs for the new block and the following
+		   ones, unless they began at a false magic match */
+		g_mutex_lock(bz2_job_mutex);
+		while (bis->block < i && !g_queue_is_empty(bis->jobs)) {
+			bz2_job_unref(g_queue_pop_head(bis->jobs));
+			++bis->block;
+		}
+		g_mutex_unlock(bz2_job_mutex);
+
+		job = g_queue_peek_head(bis->jobs);
+		if (job != NULL && job->bit != block.bit)
+			bz2_cancel(bis);
+
+		if (bis->block < i || g_queue_is_empty(bis->jobs)) {
+			bis->block = i;
+			bis->next_bit = block.bit;
+			bis->window = 1;
+		}
+	}
+
+	bis->position = 0;
+	bis->skip = offset - block.offset;
+	bis->eof = false;
+
+	is->offset = offset;
+	return true;
+}
+
 /* exported structures */
 
 static const char *const bz2_extensions[] = {
@@ -287,10 +1444,13 @@ static const struct input_plugin bz2_inputplugin = {
 	.close = bz2_is_close,
 	.read = bz2_is_read,
 	.eof = bz2_is_eof,
+	.seek = bz2_is_seek,
 };
 
 const struct archive_plugin bz2_archive_plugin = {
 	.name = "bz2",
+	.init = bz2_init,
+	.finish = bz2_finish,
 	.open = bz2_open,
 	.scan_reset = bz2_scan_reset,
 	.scan_next = bz2_scan_next,
@@ -298,4 +1458,3 @@ const struct archive_plugin bz2_archive_plugin = {
 	.close = bz2_close,
 	.suffixes = bz2_extensions
 };
-
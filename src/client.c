@@ -39,3 +39,8 @@ void client_set_permission(struct client *client, unsigned permission)
 {
 	client->permission = permission;
 }
+
+guint64 client_get_bytes_written(const struct client *client)
+{
+	return client->bytes_written;
+}
@@ -45,6 +45,12 @@ unsigned client_get_permission(const struct client *client);
 
 void client_set_permission(struct client *client, unsigned permission);
 
+/**
+ * Returns the total number of bytes which were written to this
+ * client.
+ */
+guint64 client_get_bytes_written(const struct client *client);
+
 /**
  * Write a C string to the client.
  */
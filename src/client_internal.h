@@ -58,6 +58,9 @@ struct client {
 	char send_buf[4096];
 	size_t send_buf_used;	/* bytes used this instance */
 
+	/** the total number of bytes which were sent to this client */
+	guint64 bytes_written;
+
 	/** is this client waiting for an "idle" response? */
 	bool idle_waiting;
 
@@ -110,6 +110,7 @@ void client_new(int fd, const struct sockaddr *sa, size_t sa_length, int uid)
 	client->num = next_client_num++;
 
 	client->send_buf_used = 0;
+	client->bytes_written = 0;
 
 	(void)write(fd, GREETING, sizeof(GREETING) - 1);
 
@@ -217,6 +217,8 @@ static void client_write(struct client *client, const char *buffer, size_t bufle
 	if (client_is_expired(client))
 		return;
 
+	client->bytes_written += buflen;
+
 	while (buflen > 0 && !client_is_expired(client)) {
 		size_t copylen;
 
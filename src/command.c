@@ -1553,6 +1553,10 @@ static enum command_return
 handle_not_commands(struct client *client,
 		    G_GNUC_UNUSED int argc, G_GNUC_UNUSED char *argv[]);
 
+static enum command_return
+handle_commandstats(struct client *client,
+		    G_GNUC_UNUSED int argc, G_GNUC_UNUSED char *argv[]);
+
 static enum command_return
 handle_playlistclear(struct client *client, G_GNUC_UNUSED int argc, char *argv[])
 {
@@ -1831,6 +1835,7 @@ static const struct command commands[] = {
 	{ "clearerror", PERMISSION_CONTROL, 0, 0, handle_clearerror },
 	{ "close", PERMISSION_NONE, -1, -1, handle_close },
 	{ "commands", PERMISSION_NONE, 0, 0, handle_commands },
+	{ "commandstats", PERMISSION_READ, 0, 0, handle_commandstats },
 	{ "consume", PERMISSION_CONTROL, 1, 1, handle_consume },
 	{ "count", PERMISSION_READ, 2, -1, handle_count },
 	{ "crossfade", PERMISSION_CONTROL, 1, 1, handle_crossfade },
@@ -1907,6 +1912,103 @@ static const struct command commands[] = {
 
 static const unsigned num_commands = sizeof(commands) / sizeof(commands[0]);
 
+/**
+ * Statistics about one command, reported by "commandstats".
+ */
+struct command_stats {
+	/** how often was this command invoked? */
+	unsigned long calls;
+
+	/** the total time spent in the handler [s] */
+	double total_time;
+
+	/** the longest time spent in one invocation [s] */
+	double max_time;
+
+	/** the number of bytes the handler has sent to clients */
+	guint64 bytes;
+};
+
+/**
+ * The statistics for each element of #commands, with the same index.
+ */
+static struct command_stats command_stats[G_N_ELEMENTS(commands)];
+
+/**
+ * The timer which measures the duration of command handlers.
+ */
+static GTimer *command_timer;
+
+enum {
+	/**
+	 * The number of slots in #command_hash.  This must be a
+	 * power of two.
+	 */
+	COMMAND_HASH_SIZE = 1024,
+
+	/**
+	 * Try this many seeds in command_init() for a collision-free
+	 * #command_hash.
+	 */
+	COMMAND_HASH_MAX_SEEDS = 4096,
+};
+
+/**
+ * A hash table for looking up commands by name.  It is built by
+ * command_init(), which searches a #command_hash_seed that makes it
+ * free of collisions, so a lookup usually needs only one string
+ * comparison.  Linear probing is used as a fallback.
+ */
+static const struct command *command_hash[COMMAND_HASH_SIZE];
+
+static unsigned command_hash_seed;
+
+/**
+ * A seeded FNV-1a hash of the command name.
+ */
+static unsigned
+command_hash_string(const char *name, unsigned seed)
+{
+	unsigned hash = 2166136261u ^ (seed * 16777619u);
+
+	for (; *name != 0; ++name) {
+		hash ^= (unsigned char)*name;
+		hash *= 16777619u;
+	}
+
+	return hash & (COMMAND_HASH_SIZE - 1);
+}
+
+/**
+ * Fills #command_hash, using the specified seed.
+ *
+ * @param probe if false, then the function fails on the first
+ * collision; if true, then collisions are resolved with linear
+ * probing
+ * @return false on collision (only if #probe is false)
+ */
+static bool
+command_hash_build(unsigned seed, bool probe)
+{
+	memset(command_hash, 0, sizeof(command_hash));
+	command_hash_seed = seed;
+
+	for (unsigned i = 0; i < num_commands; ++i) {
+		unsigned h = command_hash_string(commands[i].cmd, seed);
+
+		while (command_hash[h] != NULL) {
+			if (!probe)
+				return false;
+
+			h = (h + 1) & (COMMAND_HASH_SIZE - 1);
+		}
+
+		command_hash[h] = &commands[i];
+	}
+
+	return true;
+}
+
 static bool
 command_available(G_GNUC_UNUSED const struct command *cmd)
 {
@@ -1954,41 +2056,96 @@ handle_not_commands(struct client *client,
 	return COMMAND_RETURN_OK;
 }
 
+static enum command_return
+handle_commandstats(struct client *client,
+		    G_GNUC_UNUSED int argc, G_GNUC_UNUSED char *argv[])
+{
+	for (unsigned i = 0; i < num_commands; ++i) {
+		const struct command_stats *stats = &command_stats[i];
+
+		if (stats->calls == 0)
+			continue;
+
+		client_printf(client,
+			      "command: %s\n"
+			      "calls: %lu\n"
+			      "time: %f\n"
+			      "max_time: %f\n"
+			      "bytes: %" G_GUINT64_FORMAT "\n",
+			      commands[i].cmd, stats->calls,
+			      stats->total_time, stats->max_time,
+			      stats->bytes);
+	}
+
+	return COMMAND_RETURN_OK;
+}
+
 void command_init(void)
 {
+	unsigned seed;
+
 #ifndef NDEBUG
 	/* ensure that the command list is sorted */
 	for (unsigned i = 0; i < num_commands - 1; ++i)
 		assert(strcmp(commands[i].cmd, commands[i + 1].cmd) < 0);
 #endif
+
+	for (seed = 0; seed < COMMAND_HASH_MAX_SEEDS; ++seed)
+		if (command_hash_build(seed, false))
+			break;
+
+	if (seed == COMMAND_HASH_MAX_SEEDS)
+		command_hash_build(0, true);
+
+	command_timer = g_timer_new();
 }
 
 void command_finish(void)
 {
+	g_timer_destroy(command_timer);
 }
 
 static const struct command *
 command_lookup(const char *name)
 {
-	unsigned a = 0, b = num_commands, i;
-	int cmp;
+	unsigned h = command_hash_string(name, command_hash_seed);
+	const struct command *cmd;
 
-	/* binary search */
-	do {
-		i = (a + b) / 2;
+	while ((cmd = command_hash[h]) != NULL) {
+		if (strcmp(name, cmd->cmd) == 0)
+			return cmd;
 
-		cmp = strcmp(name, commands[i].cmd);
-		if (cmp == 0)
-			return &commands[i];
-		else if (cmp < 0)
-			b = i;
-		else if (cmp > 0)
-			a = i + 1;
-	} while (a < b);
+		h = (h + 1) & (COMMAND_HASH_SIZE - 1);
+	}
 
 	return NULL;
 }
 
+/**
+ * Invokes the command handler, and updates its #command_stats.
+ */
+static enum command_return
+command_invoke(const struct command *cmd, struct client *client,
+	       int argc, char *argv[])
+{
+	struct command_stats *stats = &command_stats[cmd - commands];
+	guint64 bytes = client_get_bytes_written(client);
+	double start = g_timer_elapsed(command_timer, NULL), duration;
+	enum command_return ret;
+
+	ret = cmd->handler(client, argc, argv);
+
+	duration = g_timer_elapsed(command_timer, NULL) - start;
+
+	++stats->calls;
+	stats->total_time += duration;
+	if (duration > stats->max_time)
+		stats->max_time = duration;
+	stats->bytes += client_get_bytes_written(client) - bytes;
+
+	return ret;
+}
+
 static bool
 command_check_request(const struct command *cmd, struct client *client,
 		      unsigned permission, int argc, char *argv[])
@@ -2117,7 +2274,7 @@ command_process(struct client *client, unsigned num, char *line)
 	cmd = command_checked_lookup(client, client_get_permission(client),
 				     argc, argv);
 	if (cmd)
-		ret = cmd->handler(client, argc, argv);
+		ret = command_invoke(cmd, client, argc, argv);
 
 	current_command = NULL;
 	command_list_num = 0;
@@ -94,6 +94,10 @@ static struct config_entry config_entries[] = {
 	{ .name = CONF_GAPLESS_MP3_PLAYBACK, false, false },
 	{ .name = CONF_PLAYLIST_PLUGIN, true, true },
 	{ .name = CONF_AUTO_UPDATE, false, false },
+	{ .name = CONF_INPUT_CACHE_DIR, false, false },
+	{ .name = CONF_INPUT_CACHE_SIZE, false, false },
+	{ .name = CONF_INPUT_BUFFER_SIZE, false, false },
+	{ .name = CONF_INPUT_REWIND_BUFFER, false, false },
 	{ .name = "filter", true, true },
 };
 
@@ -135,7 +139,7 @@ config_new_param(const char *value, int line)
 	return ret;
 }
 
-static void
+void
 config_param_free(struct config_param *param)
 {
 	g_free(param->value);
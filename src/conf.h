@@ -70,6 +70,10 @@
 #define CONF_GAPLESS_MP3_PLAYBACK	"gapless_mp3_playback"
 #define CONF_PLAYLIST_PLUGIN "playlist_plugin"
 #define CONF_AUTO_UPDATE		"auto_update"
+#define CONF_INPUT_CACHE_DIR "input_cache_directory"
+#define CONF_INPUT_CACHE_SIZE "input_cache_size"
+#define CONF_INPUT_BUFFER_SIZE "input_buffer_size"
+#define CONF_INPUT_REWIND_BUFFER "input_rewind_buffer"
 
 #define DEFAULT_PLAYLIST_MAX_LENGTH (1024*16)
 #define DEFAULT_PLAYLIST_SAVE_ABSOLUTE_PATHS false
@@ -198,6 +202,9 @@ config_get_block_bool(const struct config_param *param, const char *name,
 struct config_param *
 config_new_param(const char *value, int line);
 
+void
+config_param_free(struct config_param *param);
+
 bool
 config_add_block_param(struct config_param * param, const char *name,
 		       const char *value, int line, GError **error_r);
@@ -181,6 +181,8 @@ mp3_fill_buffer(struct mp3_data *data)
 {
 	size_t remaining, length;
 	unsigned char *dest;
+	const void *p;
+	size_t peek_length;
 
 	if (data->stream.next_frame != NULL) {
 		remaining = data->stream.bufend - data->stream.next_frame;
@@ -194,6 +196,21 @@ mp3_fill_buffer(struct mp3_data *data)
 		dest = data->input_buffer;
 	}
 
+	if (remaining == 0 &&
+	    (p = input_stream_peek(data->input_stream,
+				   &peek_length)) != NULL) {
+		/* the stream is in memory (e.g. a mapped file): let
+		   libmad parse it there, without copying it; the
+		   window is valid until the next peek, which is
+		   called only after libmad is done with it */
+		input_stream_consume(data->input_stream, peek_length);
+
+		mad_stream_buffer(&data->stream, p, peek_length);
+		(data->stream).error = 0;
+
+		return true;
+	}
+
 	/* we've exhausted the read buffer, so give up!, these potential
 	 * mp3 frames are way too big, and thus unlikely to be mp3 frames */
 	if (length == 0)
@@ -181,6 +181,9 @@ size_t decoder_read(struct decoder *decoder,
 			return 0;
 		}
 
+		if (decoder != NULL && is->offset > decoder->max_offset)
+			decoder->max_offset = is->offset;
+
 		if (nbytes > 0 || input_stream_eof(is))
 			return nbytes;
 
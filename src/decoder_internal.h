@@ -24,6 +24,8 @@
 #include "pcm_convert.h"
 #include "replay_gain_info.h"
 
+#include <glib.h>
+
 struct input_stream;
 
 struct decoder {
@@ -54,6 +56,13 @@ struct decoder {
 	/** the chunk currently being written to */
 	struct music_chunk *chunk;
 
+	/**
+	 * The highest stream offset reached by decoder_read().  This
+	 * is used to measure how much of the stream a plugin reads
+	 * before rejecting it.
+	 */
+	goffset max_offset;
+
 	struct replay_gain_info replay_gain_info;
 
 	/**
@@ -107,6 +107,16 @@ enum {
 /** which plugins have been initialized successfully? */
 bool decoder_plugins_enabled[num_decoder_plugins];
 
+/**
+ * How much data did each plugin read from streams before accepting
+ * or rejecting them?  Only the decoder thread writes this.
+ */
+static struct decoder_probe_stats {
+	unsigned accepted, rejected;
+
+	guint64 rejected_bytes, max_rejected_bytes;
+} decoder_probe_stats[num_decoder_plugins];
+
 static unsigned
 decoder_plugin_index(const struct decoder_plugin *plugin)
 {
@@ -204,6 +214,23 @@ decoder_plugin_config(const char *plugin_name)
 	return NULL;
 }
 
+void
+decoder_plugin_record_probe(const struct decoder_plugin *plugin,
+			    bool success, guint64 consumed)
+{
+	struct decoder_probe_stats *stats =
+		&decoder_probe_stats[decoder_plugin_index(plugin)];
+
+	if (success)
+		++stats->accepted;
+	else {
+		++stats->rejected;
+		stats->rejected_bytes += consumed;
+		if (consumed > stats->max_rejected_bytes)
+			stats->max_rejected_bytes = consumed;
+	}
+}
+
 void decoder_plugin_init_all(void)
 {
 	for (unsigned i = 0; decoder_plugins[i] != NULL; ++i) {
@@ -225,6 +252,17 @@ void decoder_plugin_deinit_all(void)
 	for (unsigned i = 0; decoder_plugins[i] != NULL; ++i) {
 		const struct decoder_plugin *plugin = decoder_plugins[i];
 
+		const struct decoder_probe_stats *stats =
+			&decoder_probe_stats[i];
+
+		if (stats->rejected > 0)
+			g_debug("%s accepted %u streams, rejected %u after "
+				"reading %llu bytes on average, at most %llu",
+				plugin->name, stats->accepted, stats->rejected,
+				(unsigned long long)(stats->rejected_bytes /
+						     stats->rejected),
+				(unsigned long long)stats->max_rejected_bytes);
+
 		if (decoder_plugins_enabled[i])
 			decoder_plugin_finish(plugin);
 	}
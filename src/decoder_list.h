@@ -20,6 +20,8 @@
 #ifndef MPD_DECODER_LIST_H
 #define MPD_DECODER_LIST_H
 
+#include <glib.h>
+
 #include <stdbool.h>
 
 struct decoder_plugin;
@@ -46,6 +48,18 @@ decoder_plugin_from_mime_type(const char *mimeType, unsigned int next);
 const struct decoder_plugin *
 decoder_plugin_from_name(const char *name);
 
+/**
+ * Records the result of an attempt to decode a stream with the
+ * plugin.  The statistics are logged by decoder_plugin_deinit_all().
+ *
+ * @param success true if the plugin has accepted the stream
+ * @param consumed the number of bytes which were read from the
+ * stream (only used if the plugin has rejected it)
+ */
+void
+decoder_plugin_record_probe(const struct decoder_plugin *plugin,
+			    bool success, guint64 consumed);
+
 /* this is where we "load" all the "plugins" ;-) */
 void decoder_plugin_init_all(void);
 
@@ -52,16 +52,190 @@ decoder_lock_get_command(struct decoder_control *dc)
 	return command;
 }
 
+/**
+ * An input_stream_open() call which runs in a separate thread, because
+ * it may block for a long time (DNS lookup, TCP connect).  Protected
+ * by the decoder_control mutex.
+ */
+struct decoder_open {
+	struct decoder_control *dc;
+
+	GThread *thread;
+
+	char *uri;
+
+	/**
+	 * Has input_stream_open() returned?  Then #is and #error are
+	 * set.
+	 */
+	bool done;
+
+	/**
+	 * Has the decoder thread stopped waiting?  Then the object is
+	 * in #decoder_abandoned_opens.
+	 */
+	bool abandoned;
+
+	struct input_stream *is;
+
+	GError *error;
+};
+
+/**
+ * Cancelled decoder_open objects whose threads have not been joined
+ * yet.  The decoder thread joins them before it exits, because they
+ * use the decoder_control object and the input plugins.  Only used
+ * by the decoder thread.
+ */
+static GSList *decoder_abandoned_opens;
+
+static void
+decoder_open_free(struct decoder_open *o)
+{
+	if (o->is != NULL)
+		input_stream_close(o->is);
+	if (o->error != NULL)
+		g_error_free(o->error);
+	g_free(o->uri);
+	g_free(o);
+}
+
+static gpointer
+decoder_open_thread(gpointer data)
+{
+	struct decoder_open *o = data;
+	struct decoder_control *dc = o->dc;
+	GError *error = NULL;
+	struct input_stream *is;
+
+	is = input_stream_open(o->uri, &error);
+
+	decoder_lock(dc);
+
+	o->is = is;
+	o->error = error;
+	o->done = true;
+
+	if (!o->abandoned)
+		decoder_signal(dc);
+
+	decoder_unlock(dc);
+
+	return NULL;
+}
+
+/**
+ * Joins the threads of cancelled decoder_open objects, and frees
+ * them (closing the streams they have opened).
+ *
+ * @param wait if false, only the threads which have finished are
+ * joined; if true, this function waits for all of them
+ */
+static void
+decoder_open_reap(struct decoder_control *dc, bool wait)
+{
+	GSList *i = decoder_abandoned_opens;
+
+	while (i != NULL) {
+		struct decoder_open *o = i->data;
+		GSList *next = g_slist_next(i);
+		bool done;
+
+		decoder_lock(dc);
+		done = o->done;
+		decoder_unlock(dc);
+
+		if (done || wait) {
+			g_thread_join(o->thread);
+			decoder_open_free(o);
+
+			decoder_abandoned_opens =
+				g_slist_delete_link(decoder_abandoned_opens,
+						    i);
+		}
+
+		i = next;
+	}
+}
+
+/**
+ * Calls input_stream_open() in a new thread, and waits until it
+ * returns or a decoder STOP command is received.  In the latter
+ * case, the thread is abandoned; decoder_open_reap() closes the
+ * stream after it has been opened.
+ *
+ * Unlock the decoder before calling this function.
+ *
+ * @return the stream, or NULL on error or if the operation was
+ * cancelled
+ */
+static struct input_stream *
+decoder_input_stream_open_async(struct decoder_control *dc, const char *uri,
+				GError **error_r)
+{
+	struct decoder_open *o = g_new(struct decoder_open, 1);
+	struct input_stream *is;
+	GError *error = NULL;
+
+	decoder_open_reap(dc, false);
+
+	o->dc = dc;
+	o->uri = g_strdup(uri);
+	o->done = false;
+	o->abandoned = false;
+	o->is = NULL;
+	o->error = NULL;
+
+	o->thread = g_thread_create(decoder_open_thread, o, true, &error);
+	if (o->thread == NULL) {
+		g_warning("Failed to spawn thread: %s", error->message);
+		g_error_free(error);
+
+		decoder_open_free(o);
+		return input_stream_open(uri, error_r);
+	}
+
+	decoder_lock(dc);
+
+	while (!o->done && dc->command != DECODE_COMMAND_STOP)
+		decoder_wait(dc);
+
+	if (!o->done) {
+		o->abandoned = true;
+		decoder_unlock(dc);
+
+		g_debug("cancelled opening %s", uri);
+		decoder_abandoned_opens =
+			g_slist_prepend(decoder_abandoned_opens, o);
+		return NULL;
+	}
+
+	decoder_unlock(dc);
+
+	g_thread_join(o->thread);
+
+	is = o->is;
+	o->is = NULL;
+	if (o->error != NULL) {
+		g_propagate_error(error_r, o->error);
+		o->error = NULL;
+	}
+
+	decoder_open_free(o);
+	return is;
+}
+
 /**
  * Opens the input stream with input_stream_open(), and waits until
  * the stream gets ready.  If a decoder STOP command is received
  * during that, it cancels the operation (but does not close the
- * stream).
+ * stream once it has been opened).
  *
  * Unlock the decoder before calling this function.
  *
  * @return an input_stream on success or if #DECODE_COMMAND_STOP is
- * received, NULL on error
+ * received after the stream has been opened, NULL on error or if
+ * the open call was cancelled
  */
 static struct input_stream *
 decoder_input_stream_open(struct decoder_control *dc, const char *uri)
@@ -69,7 +243,11 @@ decoder_input_stream_open(struct decoder_control *dc, const char *uri)
 	GError *error = NULL;
 	struct input_stream *is;
 
-	is = input_stream_open(uri, &error);
+	/* only remote resources are opened in a separate thread;
+	   local files don't block for long */
+	is = uri_has_scheme(uri)
+		? decoder_input_stream_open_async(dc, uri, &error)
+		: input_stream_open(uri, &error);
 	if (is == NULL) {
 		if (error != NULL) {
 			g_warning("%s", error->message);
@@ -103,6 +281,8 @@ decoder_stream_decode(const struct decoder_plugin *plugin,
 		      struct decoder *decoder,
 		      struct input_stream *input_stream)
 {
+	bool success;
+
 	assert(plugin != NULL);
 	assert(plugin->stream_decode != NULL);
 	assert(decoder != NULL);
@@ -119,6 +299,7 @@ decoder_stream_decode(const struct decoder_plugin *plugin,
 
 	/* rewind the stream, so each plugin gets a fresh start */
 	input_stream_seek(input_stream, 0, SEEK_SET, NULL);
+	decoder->max_offset = 0;
 
 	decoder_plugin_stream_decode(plugin, decoder, input_stream);
 
@@ -127,7 +308,18 @@ decoder_stream_decode(const struct decoder_plugin *plugin,
 	assert(decoder->dc->state == DECODE_STATE_START ||
 	       decoder->dc->state == DECODE_STATE_DECODE);
 
-	return decoder->dc->state != DECODE_STATE_START;
+	success = decoder->dc->state != DECODE_STATE_START;
+
+	/* remember how much data the plugin has read: this is what
+	   the rewind buffer must hold for the plugins tried after
+	   this one */
+	if (input_stream->offset > decoder->max_offset)
+		decoder->max_offset = input_stream->offset;
+	if (decoder->dc->command != DECODE_COMMAND_STOP)
+		decoder_plugin_record_probe(plugin, success,
+					    decoder->max_offset);
+
+	return success;
 }
 
 static bool
@@ -269,7 +461,8 @@ decoder_run_stream(struct decoder *decoder, const char *uri)
 	input_stream = decoder_input_stream_open(dc, uri);
 	if (input_stream == NULL) {
 		decoder_lock(dc);
-		return false;
+		/* being cancelled is not an error */
+		return dc->command == DECODE_COMMAND_STOP;
 	}
 
 	decoder_lock(dc);
@@ -324,8 +517,15 @@ decoder_run_file(struct decoder *decoder, const char *path_fs)
 			bool success;
 
 			input_stream = decoder_input_stream_open(dc, path_fs);
-			if (input_stream == NULL)
+			if (input_stream == NULL) {
+				decoder_lock(dc);
+				if (dc->command == DECODE_COMMAND_STOP)
+					/* cancelled */
+					return true;
+				decoder_unlock(dc);
+
 				continue;
+			}
 
 			decoder_lock(dc);
 
@@ -363,6 +563,7 @@ decoder_run_song(struct decoder_control *dc,
 	decoder.stream_tag = NULL;
 	decoder.decoder_tag = NULL;
 	decoder.chunk = NULL;
+	decoder.max_offset = 0;
 
 	dc->state = DECODE_STATE_START;
 	dc->command = DECODE_COMMAND_NONE;
@@ -463,6 +664,10 @@ decoder_task(gpointer arg)
 
 	decoder_unlock(dc);
 
+	/* wait for cancelled input_stream_open() calls, before the
+	   decoder_control object and the input plugins go away */
+	decoder_open_reap(dc, true);
+
 	return NULL;
 }
 
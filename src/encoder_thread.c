@@ -0,0 +1,455 @@
+/*
+ * Copyright (C) 2003-2010 The Music Player Daemon Project
+ * http://www.musicpd.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "config.h"
+#include "encoder_thread.h"
+#include "encoder_plugin.h"
+#include "audio_format.h"
+#include "page.h"
+#include "tag.h"
+
+#include <assert.h>
+
+#undef G_LOG_DOMAIN
+#define G_LOG_DOMAIN "encoder"
+
+/**
+ * An item in encoder_thread.queue: either a PCM chunk or a tag.
+ */
+struct encoder_thread_item {
+	struct page *pcm;
+
+	struct tag *tag;
+
+	/**
+	 * The value of encoder_thread.timer when this item was
+	 * queued [s].
+	 */
+	double time;
+};
+
+struct encoder_thread {
+	struct encoder *encoder;
+
+	const struct encoder_thread_handler *handler;
+	void *ctx;
+
+	/**
+	 * The maximum value of #queue_size.
+	 */
+	size_t max_queue_size;
+
+	/**
+	 * The number of PCM bytes per second passed to the encoder.
+	 */
+	double time_to_size;
+
+	/**
+	 * This mutex protects all attributes below.
+	 */
+	GMutex *mutex;
+
+	/**
+	 * Signalled when an item has been added to or removed from
+	 * #queue, when the worker thread has become idle, and when
+	 * #error has been set.
+	 */
+	GCond *cond;
+
+	GThread *thread;
+
+	/**
+	 * The queue of PCM chunks and tags which have not been passed
+	 * to the encoder yet.
+	 */
+	GQueue *queue;
+
+	/**
+	 * The total size of the PCM chunks in #queue.
+	 */
+	size_t queue_size;
+
+	/**
+	 * Is the worker thread processing an item right now?
+	 */
+	bool busy;
+
+	/**
+	 * Set by encoder_thread_cancel(): the worker thread shall
+	 * invoke encoder_thread_handler.cancel().
+	 */
+	bool cancel;
+
+	/**
+	 * Set by encoder_thread_free(): the worker thread shall exit.
+	 */
+	bool quit;
+
+	/**
+	 * If the encoder or the handler has failed, then the error is
+	 * stored here, and reported by the next
+	 * encoder_thread_write() call.
+	 */
+	GError *error;
+
+	/**
+	 * Measures queueing latencies.
+	 */
+	GTimer *timer;
+
+	unsigned chunks;
+	double total_latency, max_latency;
+
+	unsigned waits;
+	double wait_time;
+};
+
+static void
+encoder_thread_item_free(struct encoder_thread_item *item)
+{
+	if (item->pcm != NULL)
+		page_unref(item->pcm);
+	if (item->tag != NULL)
+		tag_free(item->tag);
+	g_free(item);
+}
+
+static void
+encoder_thread_item_free_callback(gpointer data,
+				  G_GNUC_UNUSED gpointer user_data)
+{
+	encoder_thread_item_free(data);
+}
+
+static bool
+encoder_thread_process(struct encoder_thread *et,
+		       const struct encoder_thread_item *item,
+		       GError **error_r)
+{
+	if (item->tag != NULL)
+		return et->handler->tag == NULL ||
+			et->handler->tag(et->ctx, item->tag, error_r);
+
+	return encoder_write(et->encoder, item->pcm->data, item->pcm->size,
+			     error_r) &&
+		et->handler->encoded(et->ctx, item->pcm->size, error_r);
+}
+
+static gpointer
+encoder_thread_run(gpointer data)
+{
+	struct encoder_thread *et = data;
+
+	g_mutex_lock(et->mutex);
+
+	while (!et->quit) {
+		struct encoder_thread_item *item;
+		GError *error = NULL;
+		bool success;
+
+		if (et->cancel) {
+			et->cancel = false;
+
+			if (et->handler->cancel != NULL) {
+				et->busy = true;
+				g_mutex_unlock(et->mutex);
+
+				et->handler->cancel(et->ctx);
+
+				g_mutex_lock(et->mutex);
+				et->busy = false;
+				g_cond_broadcast(et->cond);
+			}
+
+			continue;
+		}
+
+		item = g_queue_pop_head(et->queue);
+		if (item == NULL) {
+			g_cond_wait(et->cond, et->mutex);
+			continue;
+		}
+
+		if (item->pcm != NULL)
+			et->queue_size -= item->pcm->size;
+
+		/* wake up encoder_thread_write(), which may be
+		   waiting for room in the queue */
+		g_cond_broadcast(et->cond);
+
+		if (et->error != NULL) {
+			/* discard everything after an error */
+			encoder_thread_item_free(item);
+			continue;
+		}
+
+		et->busy = true;
+		g_mutex_unlock(et->mutex);
+
+		success = encoder_thread_process(et, item, &error);
+
+		g_mutex_lock(et->mutex);
+		et->busy = false;
+
+		if (success && item->pcm != NULL) {
+			double latency = g_timer_elapsed(et->timer, NULL) -
+				item->time;
+
+			++et->chunks;
+			et->total_latency += latency;
+			if (latency > et->max_latency)
+				et->max_latency = latency;
+		}
+
+		if (!success) {
+			g_warning("encoder failed: %s", error->message);
+			et->error = error;
+		}
+
+		g_cond_broadcast(et->cond);
+		encoder_thread_item_free(item);
+	}
+
+	g_mutex_unlock(et->mutex);
+
+	return NULL;
+}
+
+struct encoder_thread *
+encoder_thread_new(struct encoder *encoder,
+		   const struct audio_format *audio_format, size_t queue_size,
+		   const struct encoder_thread_handler *handler, void *ctx,
+		   GError **error_r)
+{
+	struct encoder_thread *et = g_new(struct encoder_thread, 1);
+
+	assert(handler != NULL);
+	assert(handler->encoded != NULL);
+	assert(queue_size > 0);
+
+	et->encoder = encoder;
+	et->handler = handler;
+	et->ctx = ctx;
+	et->max_queue_size = queue_size;
+	et->time_to_size = audio_format_time_to_size(audio_format);
+
+	et->mutex = g_mutex_new();
+	et->cond = g_cond_new();
+	et->queue = g_queue_new();
+	et->queue_size = 0;
+	et->busy = false;
+	et->cancel = false;
+	et->quit = false;
+	et->error = NULL;
+
+	et->timer = g_timer_new();
+	et->chunks = 0;
+	et->total_latency = et->max_latency = 0;
+	et->waits = 0;
+	et->wait_time = 0;
+
+	et->thread = g_thread_create(encoder_thread_run, et, true, error_r);
+	if (et->thread == NULL) {
+		g_timer_destroy(et->timer);
+		g_queue_free(et->queue);
+		g_cond_free(et->cond);
+		g_mutex_free(et->mutex);
+		g_free(et);
+		return NULL;
+	}
+
+	return et;
+}
+
+void
+encoder_thread_free(struct encoder_thread *et)
+{
+	struct encoder_thread_stats stats;
+
+	g_mutex_lock(et->mutex);
+	et->quit = true;
+	g_cond_broadcast(et->cond);
+	g_mutex_unlock(et->mutex);
+
+	g_thread_join(et->thread);
+
+	encoder_thread_get_stats(et, &stats);
+	g_debug("%u chunks encoded, latency avg=%.1fms max=%.1fms, "
+		"waited %u times (%.1fms)",
+		stats.chunks, stats.average_latency * 1000,
+		stats.max_latency * 1000, stats.waits,
+		stats.wait_time * 1000);
+
+	g_queue_foreach(et->queue, encoder_thread_item_free_callback, NULL);
+	g_queue_free(et->queue);
+
+	if (et->error != NULL)
+		g_error_free(et->error);
+
+	g_timer_destroy(et->timer);
+	g_cond_free(et->cond);
+	g_mutex_free(et->mutex);
+	g_free(et);
+}
+
+/**
+ * Appends an item to the queue.  The caller must hold the mutex.
+ */
+static void
+encoder_thread_push(struct encoder_thread *et,
+		    struct encoder_thread_item *item)
+{
+	item->time = g_timer_elapsed(et->timer, NULL);
+
+	g_queue_push_tail(et->queue, item);
+	if (item->pcm != NULL)
+		et->queue_size += item->pcm->size;
+
+	g_cond_broadcast(et->cond);
+}
+
+bool
+encoder_thread_write_page(struct encoder_thread *et, struct page *pcm,
+			  GError **error_r)
+{
+	struct encoder_thread_item *item;
+
+	g_mutex_lock(et->mutex);
+
+	if (et->error == NULL && et->queue_size >= et->max_queue_size) {
+		/* backpressure: wait until the worker thread has
+		   caught up */
+		double start = g_timer_elapsed(et->timer, NULL);
+
+		do {
+			g_cond_wait(et->cond, et->mutex);
+		} while (et->error == NULL &&
+			 et->queue_size >= et->max_queue_size);
+
+		++et->waits;
+		et->wait_time += g_timer_elapsed(et->timer, NULL) - start;
+	}
+
+	if (et->error != NULL) {
+		g_propagate_error(error_r, g_error_copy(et->error));
+		g_mutex_unlock(et->mutex);
+		return false;
+	}
+
+	item = g_new(struct encoder_thread_item, 1);
+	page_ref(pcm);
+	item->pcm = pcm;
+	item->tag = NULL;
+	encoder_thread_push(et, item);
+
+	g_mutex_unlock(et->mutex);
+	return true;
+}
+
+bool
+encoder_thread_write(struct encoder_thread *et,
+		     const void *data, size_t length, GError **error_r)
+{
+	struct page *pcm = page_new_copy(data, length);
+	bool success;
+
+	success = encoder_thread_write_page(et, pcm, error_r);
+	page_unref(pcm);
+	return success;
+}
+
+void
+encoder_thread_tag(struct encoder_thread *et, const struct tag *tag)
+{
+	struct encoder_thread_item *item =
+		g_new(struct encoder_thread_item, 1);
+
+	item->pcm = NULL;
+	item->tag = tag_dup(tag);
+
+	g_mutex_lock(et->mutex);
+	encoder_thread_push(et, item);
+	g_mutex_unlock(et->mutex);
+}
+
+void
+encoder_thread_cancel(struct encoder_thread *et)
+{
+	unsigned n;
+
+	g_mutex_lock(et->mutex);
+
+	/* discard all PCM chunks, but keep the tags in order */
+	n = g_queue_get_length(et->queue);
+	while (n-- > 0) {
+		struct encoder_thread_item *item =
+			g_queue_pop_head(et->queue);
+
+		if (item->tag != NULL)
+			g_queue_push_tail(et->queue, item);
+		else
+			encoder_thread_item_free(item);
+	}
+
+	et->queue_size = 0;
+
+	et->cancel = true;
+	g_cond_broadcast(et->cond);
+
+	g_mutex_unlock(et->mutex);
+}
+
+bool
+encoder_thread_drain(struct encoder_thread *et, GError **error_r)
+{
+	g_mutex_lock(et->mutex);
+
+	while (et->error == NULL &&
+	       (et->busy || et->cancel ||
+		!g_queue_is_empty(et->queue)))
+		g_cond_wait(et->cond, et->mutex);
+
+	if (et->error != NULL) {
+		g_propagate_error(error_r, g_error_copy(et->error));
+		g_mutex_unlock(et->mutex);
+		return false;
+	}
+
+	g_mutex_unlock(et->mutex);
+	return true;
+}
+
+void
+encoder_thread_get_stats(struct encoder_thread *et,
+			 struct encoder_thread_stats *stats)
+{
+	g_mutex_lock(et->mutex);
+
+	stats->chunks = et->chunks;
+	stats->queued = et->queue_size;
+	stats->queued_time = et->queue_size / et->time_to_size;
+	stats->average_latency = et->chunks > 0
+		? et->total_latency / et->chunks
+		: 0;
+	stats->max_latency = et->max_latency;
+	stats->waits = et->waits;
+	stats->wait_time = et->wait_time;
+
+	g_mutex_unlock(et->mutex);
+}
@@ -0,0 +1,164 @@
+/*
+ * Copyright (C) 2003-2010 The Music Player Daemon Project
+ * http://www.musicpd.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/** \file
+ *
+ * Runs an encoder in a worker thread, fed by a bounded queue of PCM
+ * chunks and tags.  This keeps encoder (and sink) latency spikes away
+ * from the output thread, which would otherwise stop consuming the
+ * music pipe.
+ */
+
+#ifndef MPD_ENCODER_THREAD_H
+#define MPD_ENCODER_THREAD_H
+
+#include <glib.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct encoder;
+struct audio_format;
+struct page;
+struct tag;
+
+/**
+ * Callbacks which consume the encoder's output.  They are invoked in
+ * the worker thread, in stream order.  A callback which returns
+ * false must set the #GError.
+ */
+struct encoder_thread_handler {
+	/**
+	 * PCM data has been passed to the encoder.  The handler reads
+	 * the encoded data with encoder_read().
+	 *
+	 * @param length the number of PCM bytes which were encoded
+	 */
+	bool (*encoded)(void *ctx, size_t length, GError **error_r);
+
+	/**
+	 * A tag has been queued with encoder_thread_tag().  The
+	 * handler decides how to send it (e.g. flush the encoder and
+	 * call encoder_tag()).  Optional.
+	 */
+	bool (*tag)(void *ctx, const struct tag *tag, GError **error_r);
+
+	/**
+	 * The queued PCM data has been discarded by
+	 * encoder_thread_cancel().  Optional.
+	 */
+	void (*cancel)(void *ctx);
+};
+
+struct encoder_thread_stats {
+	/**
+	 * The number of PCM chunks which were encoded.
+	 */
+	unsigned chunks;
+
+	/**
+	 * The number of PCM bytes currently queued, and the duration
+	 * of that data [s].
+	 */
+	size_t queued;
+	double queued_time;
+
+	/**
+	 * The time between queueing a chunk and the handler being
+	 * finished with it [s].
+	 */
+	double average_latency, max_latency;
+
+	/**
+	 * How often the producer had to wait for room in the queue,
+	 * and for how long in total [s].
+	 */
+	unsigned waits;
+	double wait_time;
+};
+
+/**
+ * Starts a new worker thread for an encoder which has already been
+ * opened.  The encoder must not be used by the caller until the
+ * worker thread is freed.
+ *
+ * @param audio_format the input audio format of the encoder, used
+ * for latency accounting
+ * @param queue_size the maximum number of PCM bytes in the queue;
+ * encoder_thread_write() blocks while it is exceeded
+ * @return the new object, or NULL on error
+ */
+struct encoder_thread *
+encoder_thread_new(struct encoder *encoder,
+		   const struct audio_format *audio_format, size_t queue_size,
+		   const struct encoder_thread_handler *handler, void *ctx,
+		   GError **error_r);
+
+/**
+ * Stops the worker thread and discards all queued data.  Does not
+ * close the encoder.
+ */
+void
+encoder_thread_free(struct encoder_thread *et);
+
+/**
+ * Queues a PCM chunk.  Blocks while the queue is full.
+ *
+ * @param pcm the PCM data; the encoder thread adds its own reference
+ * @return false if the encoder or the handler has failed before
+ */
+bool
+encoder_thread_write_page(struct encoder_thread *et, struct page *pcm,
+			  GError **error_r);
+
+/**
+ * Copies a PCM chunk, and queues it.  Blocks while the queue is full.
+ *
+ * @return false if the encoder or the handler has failed before
+ */
+bool
+encoder_thread_write(struct encoder_thread *et,
+		     const void *data, size_t length, GError **error_r);
+
+/**
+ * Queues a tag, which will be passed to
+ * encoder_thread_handler.tag().
+ */
+void
+encoder_thread_tag(struct encoder_thread *et, const struct tag *tag);
+
+/**
+ * Discards all queued PCM data.  Tags are kept.
+ */
+void
+encoder_thread_cancel(struct encoder_thread *et);
+
+/**
+ * Waits until the worker thread has processed all queued data.
+ *
+ * @return false if the encoder or the handler has failed
+ */
+bool
+encoder_thread_drain(struct encoder_thread *et, GError **error_r);
+
+void
+encoder_thread_get_stats(struct encoder_thread *et,
+			 struct encoder_thread_stats *stats);
+
+#endif
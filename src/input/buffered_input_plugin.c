@@ -0,0 +1,425 @@
+/*
+ * Copyright (C) 2003-2010 The Music Player Daemon Project
+ * http://www.musicpd.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "config.h"
+#include "input/buffered_input_plugin.h"
+#include "input_plugin.h"
+#include "conf.h"
+
+#include <glib.h>
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#undef G_LOG_DOMAIN
+#define G_LOG_DOMAIN "input_buffered"
+
+/**
+ * The default buffer size [kB].
+ */
+#define DEFAULT_INPUT_BUFFER_SIZE 64
+
+/**
+ * The buffer size [bytes], 0 disables this plugin.
+ */
+static size_t buffered_size = DEFAULT_INPUT_BUFFER_SIZE * 1024;
+
+struct input_buffered {
+	struct input_stream base;
+
+	struct input_stream *input;
+
+	/**
+	 * The buffer.  It contains the data before the offset of the
+	 * underlying stream; the range between #head and #tail has not
+	 * been consumed yet.
+	 */
+	unsigned char *data;
+
+	/**
+	 * The read position within the buffer.  This corresponds to
+	 * base.offset.
+	 */
+	size_t head;
+
+	/**
+	 * The end of the valid data within the buffer.  This
+	 * corresponds to the offset of the underlying stream.
+	 */
+	size_t tail;
+
+	/**
+	 * An error which occurred while filling the buffer for
+	 * input_buffered_peek(), or after a part of a read request had
+	 * been served.  It is returned by the next read call.
+	 */
+	GError *postponed_error;
+
+	/**
+	 * Statistics: the number of read and peek calls, the number
+	 * of reads on the underlying stream which filled the buffer,
+	 * and the number of large reads which bypassed the buffer.
+	 */
+	unsigned reads, fills, direct;
+};
+
+static inline GQuark
+buffered_quark(void)
+{
+	return g_quark_from_static_string("input_buffered");
+}
+
+static inline size_t
+input_buffered_available(const struct input_buffered *b)
+{
+	assert(b->head <= b->tail);
+
+	return b->tail - b->head;
+}
+
+/**
+ * Copy public attributes from the underlying input stream.  This
+ * function is called when a method of the underlying stream has
+ * returned, which may have modified these attributes.
+ */
+static void
+input_buffered_copy_attributes(struct input_buffered *b)
+{
+	struct input_stream *dest = &b->base;
+	const struct input_stream *src = b->input;
+
+	dest->ready = src->ready;
+	dest->seekable = src->seekable;
+	dest->size = src->size;
+	dest->offset = src->offset - input_buffered_available(b);
+
+	if (dest->mime == NULL && src->mime != NULL)
+		/* this is set only once, and the duplicated pointer
+		   is freed by input_stream_close() */
+		dest->mime = g_strdup(src->mime);
+}
+
+/**
+ * Replaces the (empty) buffer with new data from the underlying
+ * stream.
+ *
+ * @return false if nothing was read (end of file, error, or no data
+ * available yet)
+ */
+static bool
+input_buffered_fill(struct input_buffered *b, GError **error_r)
+{
+	size_t nbytes;
+
+	assert(input_buffered_available(b) == 0);
+
+	b->head = b->tail = 0;
+
+	nbytes = input_stream_read(b->input, b->data, buffered_size, error_r);
+	b->tail = nbytes;
+	++b->fills;
+
+	input_buffered_copy_attributes(b);
+	return nbytes > 0;
+}
+
+static void
+input_buffered_close(struct input_stream *is)
+{
+	struct input_buffered *b = (struct input_buffered *)is;
+
+	g_debug("%u reads, %u buffer fills, %u direct reads",
+		b->reads, b->fills, b->direct);
+
+	input_stream_close(b->input);
+
+	if (b->postponed_error != NULL)
+		g_error_free(b->postponed_error);
+
+	g_free(b->data);
+	input_stream_deinit(&b->base);
+	g_free(b);
+}
+
+static struct tag *
+input_buffered_tag(struct input_stream *is)
+{
+	struct input_buffered *b = (struct input_buffered *)is;
+
+	return input_stream_tag(b->input);
+}
+
+static int
+input_buffered_buffer(struct input_stream *is, GError **error_r)
+{
+	struct input_buffered *b = (struct input_buffered *)is;
+
+	int ret = input_stream_buffer(b->input, error_r);
+	input_buffered_copy_attributes(b);
+
+	return ret;
+}
+
+/**
+ * Reads from the underlying stream after the buffer has been
+ * exhausted.  Large requests bypass the buffer, to avoid copying the
+ * data twice.
+ */
+static size_t
+input_buffered_read_input(struct input_buffered *b, void *ptr, size_t size,
+			  GError **error_r)
+{
+	const void *p;
+	size_t length;
+
+	assert(input_buffered_available(b) == 0);
+
+	p = input_stream_peek(b->input, &length);
+	if (p != NULL) {
+		/* the underlying stream is in memory (e.g. a mapped
+		   file): copy directly from there */
+		if (size > length)
+			size = length;
+
+		memcpy(ptr, p, size);
+		b->head = b->tail = 0;
+		input_stream_consume(b->input, size);
+
+		input_buffered_copy_attributes(b);
+		return size;
+	}
+
+	if (size >= buffered_size / 2) {
+		size_t nbytes;
+
+		b->head = b->tail = 0;
+		nbytes = input_stream_read(b->input, ptr, size, error_r);
+		++b->direct;
+
+		input_buffered_copy_attributes(b);
+		return nbytes;
+	}
+
+	if (!input_buffered_fill(b, error_r))
+		return 0;
+
+	if (size > b->tail)
+		size = b->tail;
+
+	memcpy(ptr, b->data, size);
+	b->head = size;
+	b->base.offset += size;
+	return size;
+}
+
+static size_t
+input_buffered_read(struct input_stream *is, void *ptr, size_t size,
+		    GError **error_r)
+{
+	struct input_buffered *b = (struct input_buffered *)is;
+	size_t nbytes = input_buffered_available(b), nbytes2;
+	GError *error = NULL;
+
+	++b->reads;
+
+	if (nbytes == 0) {
+		if (b->postponed_error != NULL) {
+			g_propagate_error(error_r, b->postponed_error);
+			b->postponed_error = NULL;
+			return 0;
+		}
+
+		return input_buffered_read_input(b, ptr, size, error_r);
+	}
+
+	if (nbytes > size)
+		nbytes = size;
+
+	memcpy(ptr, b->data + b->head, nbytes);
+	b->head += nbytes;
+	is->offset += nbytes;
+
+	if (nbytes == size)
+		return nbytes;
+
+	/* the buffer has been exhausted: try to complete the request,
+	   because many decoders don't expect short reads from local
+	   files */
+
+	nbytes2 = input_buffered_read_input(b, (unsigned char *)ptr + nbytes,
+					    size - nbytes, &error);
+	if (error != NULL)
+		/* report the error after the caller has processed the
+		   data it got */
+		b->postponed_error = error;
+
+	return nbytes + nbytes2;
+}
+
+static const void *
+input_buffered_peek(struct input_stream *is, size_t *length_r)
+{
+	struct input_buffered *b = (struct input_buffered *)is;
+	const void *p;
+
+	++b->reads;
+
+	if (input_buffered_available(b) == 0) {
+		GError *error = NULL;
+
+		p = input_stream_peek(b->input, length_r);
+		if (p != NULL)
+			/* the underlying stream is in memory already */
+			return p;
+
+		if (b->postponed_error != NULL ||
+		    !input_buffered_fill(b, &error)) {
+			/* let the caller find out with
+			   input_stream_read() */
+			if (error != NULL)
+				b->postponed_error = error;
+			return NULL;
+		}
+	}
+
+	*length_r = input_buffered_available(b);
+	return b->data + b->head;
+}
+
+static void
+input_buffered_consume(struct input_stream *is, size_t length)
+{
+	struct input_buffered *b = (struct input_buffered *)is;
+
+	if (input_buffered_available(b) == 0) {
+		/* input_buffered_peek() has returned the underlying
+		   stream's data */
+		input_stream_consume(b->input, length);
+		input_buffered_copy_attributes(b);
+		return;
+	}
+
+	assert(length <= input_buffered_available(b));
+
+	b->head += length;
+	is->offset += length;
+}
+
+static bool
+input_buffered_eof(struct input_stream *is)
+{
+	struct input_buffered *b = (struct input_buffered *)is;
+
+	return input_buffered_available(b) == 0 &&
+		b->postponed_error == NULL &&
+		input_stream_eof(b->input);
+}
+
+static bool
+input_buffered_seek(struct input_stream *is, goffset offset, int whence,
+		    GError **error_r)
+{
+	struct input_buffered *b = (struct input_buffered *)is;
+	bool success;
+
+	if (b->postponed_error != NULL) {
+		g_error_free(b->postponed_error);
+		b->postponed_error = NULL;
+	}
+
+	if (whence == SEEK_CUR) {
+		offset += is->offset;
+		whence = SEEK_SET;
+	}
+
+	if (whence == SEEK_SET && offset <= b->input->offset &&
+	    offset >= b->input->offset - (goffset)b->tail) {
+		/* buffered seek: the buffer contains the data
+		   between the new offset and the offset of the
+		   underlying stream */
+		b->head = b->tail - (size_t)(b->input->offset - offset);
+		is->offset = offset;
+		return true;
+	}
+
+	b->head = b->tail = 0;
+	success = input_stream_seek(b->input, offset, whence, error_r);
+	input_buffered_copy_attributes(b);
+
+	return success;
+}
+
+static const struct input_plugin buffered_input_plugin = {
+	.close = input_buffered_close,
+	.tag = input_buffered_tag,
+	.buffer = input_buffered_buffer,
+	.read = input_buffered_read,
+	.eof = input_buffered_eof,
+	.seek = input_buffered_seek,
+	.peek = input_buffered_peek,
+	.consume = input_buffered_consume,
+};
+
+struct input_stream *
+input_buffered_open(struct input_stream *is)
+{
+	struct input_buffered *b;
+
+	assert(is != NULL);
+
+	if (buffered_size == 0)
+		return is;
+
+	b = g_new(struct input_buffered, 1);
+	input_stream_init(&b->base, &buffered_input_plugin, is->uri);
+	b->input = is;
+	b->data = g_malloc(buffered_size);
+	b->head = b->tail = 0;
+	b->postponed_error = NULL;
+	b->reads = b->fills = b->direct = 0;
+
+	input_buffered_copy_attributes(b);
+
+	return &b->base;
+}
+
+bool
+input_buffered_global_init(GError **error_r)
+{
+	const struct config_param *param =
+		config_get_param(CONF_INPUT_BUFFER_SIZE);
+	char *endptr;
+	long value;
+
+	if (param == NULL)
+		return true;
+
+	value = strtol(param->value, &endptr, 10);
+	if (*endptr != 0 || value < 0) {
+		g_set_error(error_r, buffered_quark(), 0,
+			    "input buffer size \"%s\" is not a valid number, "
+			    "line %i", param->value, param->line);
+		return false;
+	}
+
+	buffered_size = (size_t)value * 1024;
+	return true;
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2003-2010 The Music Player Daemon Project
+ * http://www.musicpd.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/** \file
+ *
+ * A wrapper for an input_stream object which reads the underlying
+ * stream in large blocks, and serves small reads from memory.  It
+ * implements the "peek" and "consume" methods for all streams, so
+ * decoders can parse the data in place.  If the underlying stream is
+ * in memory already (its peek() method returns data), the wrapper
+ * uses that instead of its own buffer.
+ */
+
+#ifndef MPD_INPUT_BUFFERED_H
+#define MPD_INPUT_BUFFERED_H
+
+#include "check.h"
+
+#include <glib.h>
+
+#include <stdbool.h>
+
+struct input_stream;
+
+/**
+ * Reads the "input_buffer_size" setting.
+ */
+bool
+input_buffered_global_init(GError **error_r);
+
+/**
+ * Wraps the stream.  Returns the stream unmodified if buffering is
+ * disabled.
+ */
+struct input_stream *
+input_buffered_open(struct input_stream *is);
+
+#endif
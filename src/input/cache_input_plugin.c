@@ -0,0 +1,1060 @@
+/*
+ * Copyright (C) 2003-2010 The Music Player Daemon Project
+ * http://www.musicpd.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#include "config.h"
+#include "input/cache_input_plugin.h"
+#include "input_plugin.h"
+#include "conf.h"
+#include "uri.h"
+#include "fd_util.h"
+
+#include <glib.h>
+
+#include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#undef G_LOG_DOMAIN
+#define G_LOG_DOMAIN "input_cache"
+
+/**
+ * The default value of "input_cache_size" [kB].
+ */
+#define DEFAULT_INPUT_CACHE_SIZE (64 * 1024)
+
+/**
+ * A range of bytes of a resource which is in the cache file.
+ */
+struct cache_range {
+	goffset start, end;
+};
+
+/**
+ * A resource in the cache.  Its data is stored in the file
+ * "NAME.data", which is sparse as long as the resource is not
+ * cached completely.  The rest of this struct is stored in
+ * "NAME.meta".
+ */
+struct cache_entry {
+	char *uri;
+
+	/**
+	 * The base name of the files, derived from the URI.
+	 */
+	char name[17];
+
+	/**
+	 * The size of the resource.
+	 */
+	goffset size;
+
+	char *mime;
+
+	/**
+	 * The validators of the cached version of the resource (see
+	 * input_stream.etag).  At least one of them is set.
+	 */
+	char *etag, *last_modified;
+
+	/**
+	 * A sorted list of disjoint #cache_range objects.
+	 */
+	GSList *ranges;
+
+	/**
+	 * The number of bytes in #ranges.
+	 */
+	goffset used;
+
+	/**
+	 * The time of the last use, for choosing the least recently
+	 * used entry.
+	 */
+	time_t atime;
+
+	/**
+	 * The number of input streams using this entry.  An entry
+	 * which is in use is never deleted.
+	 */
+	unsigned refcount;
+
+	/**
+	 * The data file, open while the entry is in use.
+	 */
+	int fd;
+
+	/**
+	 * Have the ranges been modified since the ".meta" file was
+	 * written?
+	 */
+	bool dirty;
+
+	/**
+	 * Has the resource been modified while the entry was in use?
+	 * Then it is deleted when the last reference is released.
+	 */
+	bool stale;
+};
+
+struct input_cache {
+	struct input_stream base;
+
+	/**
+	 * The underlying stream.  NULL if the resource was cached
+	 * completely, and everything is read from the cache file.
+	 */
+	struct input_stream *input;
+
+	/**
+	 * The cache entry.  NULL until the underlying stream becomes
+	 * ready, and if the resource can't be cached; in that case,
+	 * all method calls are passed to the underlying stream.
+	 */
+	struct cache_entry *entry;
+
+	/**
+	 * Has input_cache_check() decided whether to cache this
+	 * stream?
+	 */
+	bool checked;
+
+	/**
+	 * Don't write to the cache file anymore, because a write has
+	 * failed.
+	 */
+	bool readonly;
+
+	/** statistics: the number of bytes read from the cache and
+	    from the underlying stream */
+	guint64 hits, misses;
+};
+
+/**
+ * The cache directory, or NULL if the cache is disabled.
+ */
+static const char *cache_directory;
+
+/**
+ * The configured maximum size of the cache [bytes].
+ */
+static goffset cache_max_size;
+
+/**
+ * The number of bytes in all entries.
+ */
+static goffset cache_size;
+
+/**
+ * Maps URIs to #cache_entry objects.
+ */
+static GHashTable *cache_entries;
+
+/**
+ * Protects #cache_entries, #cache_size and the attributes of all
+ * entries, except for the file contents.
+ */
+static GMutex *cache_mutex;
+
+static inline GQuark
+cache_quark(void)
+{
+	return g_quark_from_static_string("input_cache");
+}
+
+/**
+ * A 64 bit FNV-1a hash, used for the file names.
+ */
+static guint64
+cache_hash(const char *p)
+{
+	guint64 hash = G_GINT64_CONSTANT(14695981039346656037U);
+
+	while (*p != 0) {
+		hash ^= (unsigned char)*p++;
+		hash *= G_GINT64_CONSTANT(1099511628211U);
+	}
+
+	return hash;
+}
+
+static struct cache_entry *
+cache_entry_new(const char *uri, goffset size, const char *mime,
+		const char *etag, const char *last_modified)
+{
+	struct cache_entry *e = g_new0(struct cache_entry, 1);
+
+	e->uri = g_strdup(uri);
+	g_snprintf(e->name, sizeof(e->name), "%016llx",
+		   (unsigned long long)cache_hash(uri));
+	e->size = size;
+	e->mime = g_strdup(mime);
+	e->etag = g_strdup(etag);
+	e->last_modified = g_strdup(last_modified);
+	e->fd = -1;
+
+	return e;
+}
+
+static void
+cache_range_free_callback(gpointer data, G_GNUC_UNUSED gpointer user_data)
+{
+	g_free(data);
+}
+
+static void
+cache_entry_free(struct cache_entry *e)
+{
+	assert(e->refcount == 0);
+	assert(e->fd < 0);
+
+	g_slist_foreach(e->ranges, cache_range_free_callback, NULL);
+	g_slist_free(e->ranges);
+
+	g_free(e->mime);
+	g_free(e->etag);
+	g_free(e->last_modified);
+	g_free(e->uri);
+	g_free(e);
+}
+
+static char *
+cache_entry_path(const struct cache_entry *e, const char *suffix)
+{
+	char *base = g_strconcat(e->name, suffix, NULL);
+	char *path = g_build_filename(cache_directory, base, NULL);
+
+	g_free(base);
+	return path;
+}
+
+/**
+ * Removes the entry from the cache, deletes its files, and frees it.
+ * Caller must lock #cache_mutex.
+ */
+static void
+cache_entry_delete(struct cache_entry *e)
+{
+	char *path;
+
+	g_hash_table_remove(cache_entries, e->uri);
+	cache_size -= e->used;
+
+	path = cache_entry_path(e, ".meta");
+	unlink(path);
+	g_free(path);
+
+	path = cache_entry_path(e, ".data");
+	unlink(path);
+	g_free(path);
+
+	cache_entry_free(e);
+}
+
+/**
+ * Returns the number of bytes which are cached, starting at the
+ * specified offset.
+ */
+static goffset
+cache_entry_available(const struct cache_entry *e, goffset offset)
+{
+	for (const GSList *i = e->ranges; i != NULL; i = i->next) {
+		const struct cache_range *r = i->data;
+
+		if (offset < r->start)
+			break;
+
+		if (offset < r->end)
+			return r->end - offset;
+	}
+
+	return 0;
+}
+
+/**
+ * Returns the number of bytes which are not cached, starting at the
+ * specified offset (which must not be cached).
+ */
+static goffset
+cache_entry_missing(const struct cache_entry *e, goffset offset)
+{
+	for (const GSList *i = e->ranges; i != NULL; i = i->next) {
+		const struct cache_range *r = i->data;
+
+		if (offset < r->start)
+			return r->start - offset;
+	}
+
+	return e->size - offset;
+}
+
+/**
+ * Marks a range as cached, and merges it with adjacent ranges.
+ * Caller must lock #cache_mutex.
+ */
+static void
+cache_entry_add(struct cache_entry *e, goffset start, goffset end)
+{
+	GSList **p = &e->ranges;
+	struct cache_range *r;
+	goffset old = 0;
+
+	assert(start < end);
+
+	/* skip the ranges before the new one */
+	while (*p != NULL && ((struct cache_range *)(*p)->data)->end < start)
+		p = &(*p)->next;
+
+	/* merge all ranges which overlap or touch the new one */
+	while (*p != NULL && (r = (*p)->data)->start <= end) {
+		if (r->start < start)
+			start = r->start;
+		if (r->end > end)
+			end = r->end;
+
+		old += r->end - r->start;
+		g_free(r);
+		*p = g_slist_delete_link(*p, *p);
+	}
+
+	r = g_new(struct cache_range, 1);
+	r->start = start;
+	r->end = end;
+	*p = g_slist_prepend(*p, r);
+
+	e->used += (end - start) - old;
+	cache_size += (end - start) - old;
+	e->dirty = true;
+}
+
+/**
+ * Does the entry contain the same version of the resource which is
+ * delivered by the specified stream?  The entity tags are compared if
+ * the server sends one, the modification times otherwise.
+ */
+static bool
+cache_entry_matches(const struct cache_entry *e,
+		    const struct input_stream *is)
+{
+	if (e->size != is->size)
+		return false;
+
+	if (is->etag != NULL)
+		return e->etag != NULL && strcmp(e->etag, is->etag) == 0;
+
+	return is->last_modified != NULL && e->last_modified != NULL &&
+		strcmp(e->last_modified, is->last_modified) == 0;
+}
+
+static bool
+cache_entry_is_complete(const struct cache_entry *e)
+{
+	const struct cache_range *r;
+
+	if (e->ranges == NULL || e->ranges->next != NULL)
+		return false;
+
+	r = e->ranges->data;
+	return r->start == 0 && r->end == e->size;
+}
+
+/**
+ * Writes the ".meta" file.  Caller must lock #cache_mutex.
+ */
+static void
+cache_entry_save(struct cache_entry *e)
+{
+	char *path = cache_entry_path(e, ".meta");
+	char *tmp = g_strconcat(path, ".tmp", NULL);
+	FILE *file;
+
+	file = fopen(tmp, "w");
+	if (file == NULL) {
+		g_warning("Failed to create %s: %s", tmp, g_strerror(errno));
+		goto out;
+	}
+
+	fprintf(file, "uri: %s\n", e->uri);
+	fprintf(file, "size: %lld\n", (long long)e->size);
+	fprintf(file, "atime: %ld\n", (long)e->atime);
+	if (e->mime != NULL)
+		fprintf(file, "mime: %s\n", e->mime);
+	if (e->etag != NULL)
+		fprintf(file, "etag: %s\n", e->etag);
+	if (e->last_modified != NULL)
+		fprintf(file, "last_modified: %s\n", e->last_modified);
+
+	for (const GSList *i = e->ranges; i != NULL; i = i->next) {
+		const struct cache_range *r = i->data;
+
+		fprintf(file, "range: %lld %lld\n",
+			(long long)r->start, (long long)r->end);
+	}
+
+	if (fclose(file) != 0 || rename(tmp, path) < 0) {
+		g_warning("Failed to write %s: %s", path, g_strerror(errno));
+		unlink(tmp);
+	} else
+		e->dirty = false;
+
+out:
+	g_free(tmp);
+	g_free(path);
+}
+
+/**
+ * Parses a ".meta" file.
+ *
+ * @return the new entry, or NULL if the file is malformed
+ */
+static struct cache_entry *
+cache_entry_load(const char *path)
+{
+	char *contents, **lines;
+	const char *uri = NULL, *mime = NULL;
+	const char *etag = NULL, *last_modified = NULL;
+	goffset size = -1;
+	time_t atime = 0;
+	struct cache_entry *e;
+	struct stat st;
+	char *data_path;
+
+	if (!g_file_get_contents(path, &contents, NULL, NULL))
+		return NULL;
+
+	lines = g_strsplit(contents, "\n", 0);
+	g_free(contents);
+
+	for (char **line = lines; *line != NULL; ++line) {
+		if (g_str_has_prefix(*line, "uri: "))
+			uri = *line + 5;
+		else if (g_str_has_prefix(*line, "size: "))
+			size = g_ascii_strtoll(*line + 6, NULL, 10);
+		else if (g_str_has_prefix(*line, "atime: "))
+			atime = (time_t)g_ascii_strtoll(*line + 7, NULL, 10);
+		else if (g_str_has_prefix(*line, "mime: "))
+			mime = *line + 6;
+		else if (g_str_has_prefix(*line, "etag: "))
+			etag = *line + 6;
+		else if (g_str_has_prefix(*line, "last_modified: "))
+			last_modified = *line + 15;
+	}
+
+	if (uri == NULL || size <= 0 ||
+	    (etag == NULL && last_modified == NULL)) {
+		/* without a validator, the entry can't be used */
+		g_strfreev(lines);
+		return NULL;
+	}
+
+	e = cache_entry_new(uri, size, mime, etag, last_modified);
+	e->atime = atime;
+
+	for (char **line = lines; *line != NULL; ++line) {
+		char *endptr;
+		goffset start, end;
+
+		if (!g_str_has_prefix(*line, "range: "))
+			continue;
+
+		start = g_ascii_strtoll(*line + 7, &endptr, 10);
+		end = g_ascii_strtoll(endptr, NULL, 10);
+		if (start >= 0 && start < end && end <= size)
+			cache_entry_add(e, start, end);
+	}
+
+	g_strfreev(lines);
+
+	/* the ranges must be backed by the data file */
+	data_path = cache_entry_path(e, ".data");
+	if (e->ranges == NULL || stat(data_path, &st) < 0 ||
+	    st.st_size < ((struct cache_range *)
+			  g_slist_last(e->ranges)->data)->end) {
+		g_free(data_path);
+		cache_size -= e->used;
+		cache_entry_free(e);
+		return NULL;
+	}
+
+	g_free(data_path);
+	e->dirty = false;
+	return e;
+}
+
+/**
+ * Loads the ".meta" files from the cache directory, and deletes
+ * everything else.
+ */
+static bool
+cache_load(GError **error_r)
+{
+	GDir *dir;
+	const char *name;
+
+	dir = g_dir_open(cache_directory, 0, error_r);
+	if (dir == NULL)
+		return false;
+
+	while ((name = g_dir_read_name(dir)) != NULL) {
+		char *path = g_build_filename(cache_directory, name, NULL);
+
+		if (g_str_has_suffix(name, ".meta")) {
+			struct cache_entry *e = cache_entry_load(path);
+
+			if (e != NULL &&
+			    strncmp(name, e->name, sizeof(e->name) - 1) == 0 &&
+			    g_hash_table_lookup(cache_entries, e->uri) == NULL)
+				g_hash_table_insert(cache_entries, e->uri, e);
+			else {
+				char *data_path;
+
+				if (e != NULL) {
+					cache_size -= e->used;
+					cache_entry_free(e);
+				}
+
+				path[strlen(path) - 5] = 0;
+				data_path = g_strconcat(path, ".data", NULL);
+				unlink(data_path);
+				g_free(data_path);
+
+				strcat(path, ".meta");
+				unlink(path);
+			}
+		} else if (g_str_has_suffix(name, ".data")) {
+			/* delete orphaned data files */
+			char *meta_path;
+
+			path[strlen(path) - 5] = 0;
+			meta_path = g_strconcat(path, ".meta", NULL);
+			if (!g_file_test(meta_path, G_FILE_TEST_EXISTS)) {
+				strcat(path, ".data");
+				unlink(path);
+			}
+
+			g_free(meta_path);
+		} else if (g_str_has_suffix(name, ".meta.tmp"))
+			unlink(path);
+
+		g_free(path);
+	}
+
+	g_dir_close(dir);
+	return true;
+}
+
+static void
+cache_find_lru(G_GNUC_UNUSED gpointer key, gpointer value, gpointer user_data)
+{
+	struct cache_entry *e = value, **lru_r = user_data;
+
+	if (e->refcount == 0 && (*lru_r == NULL || e->atime < (*lru_r)->atime))
+		*lru_r = e;
+}
+
+/**
+ * Deletes the least recently used entries until the specified
+ * number of bytes fits into the cache.  Caller must lock
+ * #cache_mutex.
+ *
+ * @return false if there is not enough room, because the remaining
+ * entries are in use
+ */
+static bool
+cache_make_room(goffset length)
+{
+	while (cache_size + length > cache_max_size) {
+		struct cache_entry *lru = NULL;
+
+		g_hash_table_foreach(cache_entries, cache_find_lru, &lru);
+		if (lru == NULL)
+			return false;
+
+		g_debug("deleting %s", lru->uri);
+		cache_entry_delete(lru);
+	}
+
+	return true;
+}
+
+/**
+ * Acquires a reference to the entry, and opens its data file.
+ * Caller must lock #cache_mutex.
+ */
+static bool
+cache_entry_ref(struct cache_entry *e)
+{
+	if (e->fd < 0) {
+		char *path = cache_entry_path(e, ".data");
+
+		e->fd = open_cloexec(path, O_RDWR|O_CREAT, 0600);
+		if (e->fd < 0) {
+			g_warning("Failed to open %s: %s",
+				  path, g_strerror(errno));
+			g_free(path);
+			return false;
+		}
+
+		g_free(path);
+	}
+
+	++e->refcount;
+	e->atime = time(NULL);
+	return true;
+}
+
+/**
+ * Finds or creates the entry for a resource, and acquires a
+ * reference to it.  An existing entry is only used if its validators
+ * match the stream's response headers.
+ *
+ * @param input the underlying stream, which must be ready
+ * @return the entry, or NULL if the resource can't be cached now
+ */
+static struct cache_entry *
+cache_acquire(const char *uri, const struct input_stream *input)
+{
+	struct cache_entry *e;
+
+	g_mutex_lock(cache_mutex);
+
+	e = g_hash_table_lookup(cache_entries, uri);
+	if (e != NULL && (e->stale || !cache_entry_matches(e, input))) {
+		/* the resource has been modified */
+		g_debug("%s has been modified", uri);
+
+		if (e->refcount > 0) {
+			e->stale = true;
+			g_mutex_unlock(cache_mutex);
+			return NULL;
+		}
+
+		cache_entry_delete(e);
+		e = NULL;
+	}
+
+	if (e == NULL) {
+		e = cache_entry_new(uri, input->size, input->mime,
+				    input->etag, input->last_modified);
+		g_hash_table_insert(cache_entries, e->uri, e);
+	}
+
+	if (!cache_entry_ref(e)) {
+		if (e->refcount == 0 && e->used == 0)
+			cache_entry_delete(e);
+		e = NULL;
+	}
+
+	g_mutex_unlock(cache_mutex);
+	return e;
+}
+
+static void
+cache_release(struct cache_entry *e)
+{
+	g_mutex_lock(cache_mutex);
+
+	assert(e->refcount > 0);
+
+	if (--e->refcount == 0) {
+		close(e->fd);
+		e->fd = -1;
+
+		if (e->stale)
+			cache_entry_delete(e);
+		else if (e->dirty)
+			cache_entry_save(e);
+	}
+
+	g_mutex_unlock(cache_mutex);
+}
+
+/**
+ * Copy public attributes from the underlying input stream, as long
+ * as the cache is not used.
+ */
+static void
+copy_attributes(struct input_cache *c)
+{
+	struct input_stream *dest = &c->base;
+	const struct input_stream *src = c->input;
+
+	dest->ready = src->ready;
+	dest->seekable = src->seekable;
+	dest->size = src->size;
+	dest->offset = src->offset;
+
+	if (dest->mime == NULL && src->mime != NULL)
+		dest->mime = g_strdup(src->mime);
+}
+
+/**
+ * Decides whether the stream shall be cached, as soon as the
+ * underlying stream becomes ready.  If the resource is cached
+ * completely, the underlying stream is closed: its response headers
+ * have confirmed that the resource has not been modified, and
+ * everything else is read from the cache.
+ */
+static void
+input_cache_check(struct input_cache *c)
+{
+	struct input_stream *input = c->input;
+	bool complete;
+
+	if (c->entry != NULL)
+		return;
+
+	copy_attributes(c);
+
+	if (c->checked || !input->ready)
+		return;
+
+	c->checked = true;
+
+	if (!input->seekable || input->size <= 0)
+		/* live streams can't be cached */
+		return;
+
+	if (input->etag == NULL && input->last_modified == NULL)
+		/* modifications can't be detected */
+		return;
+
+	c->entry = cache_acquire(c->base.uri, input);
+	if (c->entry == NULL)
+		return;
+
+	g_mutex_lock(cache_mutex);
+	complete = cache_entry_is_complete(c->entry);
+	g_mutex_unlock(cache_mutex);
+
+	if (complete) {
+		input_stream_close(input);
+		c->input = NULL;
+	}
+}
+
+static void
+input_cache_close(struct input_stream *is)
+{
+	struct input_cache *c = (struct input_cache *)is;
+
+	if (c->entry != NULL) {
+		g_debug("%s: %llu bytes from the cache, %llu bytes fetched",
+			is->uri, (unsigned long long)c->hits,
+			(unsigned long long)c->misses);
+
+		cache_release(c->entry);
+	}
+
+	if (c->input != NULL)
+		input_stream_close(c->input);
+
+	input_stream_deinit(&c->base);
+	g_free(c);
+}
+
+static struct tag *
+input_cache_tag(struct input_stream *is)
+{
+	struct input_cache *c = (struct input_cache *)is;
+
+	return c->input != NULL ? input_stream_tag(c->input) : NULL;
+}
+
+static int
+input_cache_buffer(struct input_stream *is, GError **error_r)
+{
+	struct input_cache *c = (struct input_cache *)is;
+	int ret;
+
+	if (c->input == NULL)
+		return 0;
+
+	ret = input_stream_buffer(c->input, error_r);
+	input_cache_check(c);
+
+	return ret;
+}
+
+/**
+ * Copies data which was read from the underlying stream to the
+ * cache file.
+ */
+static void
+input_cache_store(struct input_cache *c, const void *data, size_t length)
+{
+	struct cache_entry *e = c->entry;
+	goffset offset = c->base.offset;
+	ssize_t nbytes;
+	bool success;
+
+	if (c->readonly)
+		return;
+
+	g_mutex_lock(cache_mutex);
+	success = cache_make_room(length);
+	g_mutex_unlock(cache_mutex);
+
+	if (!success)
+		return;
+
+	nbytes = pwrite(e->fd, data, length, offset);
+	if (nbytes <= 0) {
+		g_warning("Failed to write to the cache: %s",
+			  g_strerror(errno));
+		c->readonly = true;
+		return;
+	}
+
+	g_mutex_lock(cache_mutex);
+	cache_entry_add(e, offset, offset + nbytes);
+	g_mutex_unlock(cache_mutex);
+}
+
+static size_t
+input_cache_read(struct input_stream *is, void *ptr, size_t size,
+		 GError **error_r)
+{
+	struct input_cache *c = (struct input_cache *)is;
+	goffset available;
+	size_t nbytes;
+
+	if (c->input != NULL)
+		input_cache_check(c);
+
+	if (c->entry == NULL) {
+		/* pass method call to underlying stream */
+		nbytes = input_stream_read(c->input, ptr, size, error_r);
+		copy_attributes(c);
+		return nbytes;
+	}
+
+	g_mutex_lock(cache_mutex);
+	available = cache_entry_available(c->entry, is->offset);
+	if (available == 0 && is->offset < c->entry->size)
+		available = -cache_entry_missing(c->entry, is->offset);
+	g_mutex_unlock(cache_mutex);
+
+	if (available > 0) {
+		ssize_t n;
+
+		if ((goffset)size > available)
+			size = (size_t)available;
+
+		n = pread(c->entry->fd, ptr, size, is->offset);
+		if (n <= 0) {
+			g_set_error(error_r, cache_quark(), errno,
+				    "Failed to read from the cache: %s",
+				    n < 0 ? g_strerror(errno) : "short file");
+			return 0;
+		}
+
+		is->offset += n;
+		c->hits += n;
+		return n;
+	}
+
+	if (available == 0 || c->input == NULL)
+		/* end of file */
+		return 0;
+
+	/* fetch the missing data from the underlying stream, but
+	   don't fetch what's already cached after the gap */
+
+	if ((goffset)size > -available)
+		size = (size_t)-available;
+
+	if (c->input->offset != is->offset &&
+	    !input_stream_seek(c->input, is->offset, SEEK_SET, error_r)) {
+		if (error_r != NULL && *error_r == NULL)
+			g_set_error(error_r, cache_quark(), 0,
+				    "Failed to seek");
+		return 0;
+	}
+
+	nbytes = input_stream_read(c->input, ptr, size, error_r);
+
+	if (nbytes > 0 && !cache_entry_matches(c->entry, c->input)) {
+		/* the new request has delivered another version of
+		   the resource; don't splice it with the cached
+		   data */
+		g_mutex_lock(cache_mutex);
+		c->entry->stale = true;
+		g_mutex_unlock(cache_mutex);
+
+		g_set_error(error_r, cache_quark(), 0,
+			    "%s has been modified", is->uri);
+		return 0;
+	}
+
+	if (nbytes > 0) {
+		input_cache_store(c, ptr, nbytes);
+		is->offset += nbytes;
+		c->misses += nbytes;
+	}
+
+	return nbytes;
+}
+
+static bool
+input_cache_eof(struct input_stream *is)
+{
+	struct input_cache *c = (struct input_cache *)is;
+
+	if (c->entry != NULL)
+		return is->offset >= c->entry->size;
+
+	return input_stream_eof(c->input);
+}
+
+static bool
+input_cache_seek(struct input_stream *is, goffset offset, int whence,
+		 GError **error_r)
+{
+	struct input_cache *c = (struct input_cache *)is;
+
+	if (c->entry == NULL) {
+		/* pass method call to underlying stream */
+		bool success = input_stream_seek(c->input, offset, whence,
+						 error_r);
+		input_cache_check(c);
+		return success;
+	}
+
+	/* the underlying stream is seeked lazily, when
+	   input_cache_read() needs data which is not cached */
+
+	switch (whence) {
+	case SEEK_SET:
+		break;
+
+	case SEEK_CUR:
+		offset += is->offset;
+		break;
+
+	case SEEK_END:
+		offset += is->size;
+		break;
+
+	default:
+		return false;
+	}
+
+	if (offset < 0 || offset > is->size)
+		return false;
+
+	is->offset = offset;
+	return true;
+}
+
+static const struct input_plugin cache_input_plugin = {
+	.close = input_cache_close,
+	.tag = input_cache_tag,
+	.buffer = input_cache_buffer,
+	.read = input_cache_read,
+	.eof = input_cache_eof,
+	.seek = input_cache_seek,
+};
+
+struct input_stream *
+input_cache_open(struct input_stream *is)
+{
+	struct input_cache *c;
+
+	assert(is != NULL);
+
+	if (cache_directory == NULL || is->uri == NULL ||
+	    !uri_has_scheme(is->uri))
+		return is;
+
+	c = g_new0(struct input_cache, 1);
+	input_stream_init(&c->base, &cache_input_plugin, is->uri);
+	c->input = is;
+
+	input_cache_check(c);
+
+	return &c->base;
+}
+
+bool
+input_cache_global_init(GError **error_r)
+{
+	cache_directory = config_get_path(CONF_INPUT_CACHE_DIR);
+	if (cache_directory == NULL)
+		return true;
+
+	cache_max_size = (goffset)config_get_positive(CONF_INPUT_CACHE_SIZE,
+						      DEFAULT_INPUT_CACHE_SIZE)
+		* 1024;
+
+	if (g_mkdir_with_parents(cache_directory, 0700) < 0) {
+		g_set_error(error_r, cache_quark(), errno,
+			    "Failed to create %s: %s",
+			    cache_directory, g_strerror(errno));
+		cache_directory = NULL;
+		return false;
+	}
+
+	cache_entries = g_hash_table_new(g_str_hash, g_str_equal);
+	cache_mutex = g_mutex_new();
+	cache_size = 0;
+
+	if (!cache_load(error_r)) {
+		input_cache_global_finish();
+		return false;
+	}
+
+	cache_make_room(0);
+
+	g_debug("%u resources, %lld bytes",
+		g_hash_table_size(cache_entries), (long long)cache_size);
+
+	return true;
+}
+
+static gboolean
+cache_free_callback(G_GNUC_UNUSED gpointer key, gpointer value,
+		    G_GNUC_UNUSED gpointer user_data)
+{
+	struct cache_entry *e = value;
+
+	if (e->dirty)
+		cache_entry_save(e);
+
+	cache_entry_free(e);
+	return true;
+}
+
+void
+input_cache_global_finish(void)
+{
+	if (cache_directory == NULL)
+		return;
+
+	g_hash_table_foreach_remove(cache_entries, cache_free_callback, NULL);
+	g_hash_table_destroy(cache_entries);
+	g_mutex_free(cache_mutex);
+
+	cache_directory = NULL;
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2003-2010 The Music Player Daemon Project
+ * http://www.musicpd.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+/** \file
+ *
+ * A wrapper for remote input_stream objects which stores the data
+ * in a directory on the local disk.  The cache remembers which byte
+ * ranges of a resource have been fetched; reads and seeks within
+ * these ranges are served from the cache file.
+ *
+ * The entity tag or the modification time in the response headers
+ * of the underlying stream decide whether a cached resource is still
+ * valid.  If it is cached completely, the connection is closed right
+ * after that check.
+ *
+ * Only seekable resources with a known size and at least one of
+ * these validators are cached.  The least
+ * recently used resources are deleted when the configured size is
+ * exceeded.
+ */
+
+#ifndef MPD_INPUT_CACHE_H
+#define MPD_INPUT_CACHE_H
+
+#include "check.h"
+
+#include <glib.h>
+
+#include <stdbool.h>
+
+struct input_stream;
+
+/**
+ * Loads the cache index.  The cache is disabled if
+ * "input_cache_directory" is not configured.
+ */
+bool
+input_cache_global_init(GError **error_r);
+
+void
+input_cache_global_finish(void);
+
+/**
+ * Wraps an input stream which was just opened.
+ *
+ * @return the wrapper, or the stream itself if it is not a
+ * candidate for the cache
+ */
+struct input_stream *
+input_cache_open(struct input_stream *is);
+
+#endif
@@ -23,6 +23,8 @@
 #include "conf.h"
 #include "tag.h"
 #include "icy_metadata.h"
+#include "fifo_buffer.h"
+#include "fd_util.h"
 #include "glib_compat.h"
 
 #include <assert.h>
@@ -34,6 +36,7 @@
 #endif
 
 #include <string.h>
+#include <unistd.h>
 #include <errno.h>
 
 #include <curl/curl.h>
@@ -42,18 +45,41 @@
 #undef G_LOG_DOMAIN
 #define G_LOG_DOMAIN "input_curl"
 
-/**
- * Buffers created by input_curl_writefunction().
- */
-struct buffer {
-	/** size of the payload */
-	size_t size;
-
-	/** how much has been consumed yet? */
-	size_t consumed;
-
-	/** the payload */
-	unsigned char data[sizeof(long)];
+enum {
+	/**
+	 * Do not buffer more than this number of bytes per stream.
+	 * When the buffer is full, the transfer is paused.
+	 */
+	CURL_MAX_BUFFERED = 512 * 1024,
+
+	/**
+	 * Resume a paused transfer when the buffer has been drained
+	 * to this number of bytes.  The difference to
+	 * #CURL_MAX_BUFFERED must be larger than CURL_MAX_WRITE_SIZE,
+	 * because libcurl delivers the rejected chunk again.
+	 */
+	CURL_RESUME_AT = 384 * 1024,
+
+	/**
+	 * How long does input_curl_read() wait for data before it
+	 * returns to the caller [ms]?
+	 */
+	CURL_READ_TIMEOUT = 1000,
+
+	/**
+	 * A forward seek beyond the buffer discards up to this
+	 * number of bytes from the running transfer, instead of
+	 * aborting it and sending a new request.  Aborting a
+	 * transfer closes its connection, and the new request has to
+	 * open another one.
+	 */
+	CURL_MAX_SKIP = 256 * 1024,
+
+	/**
+	 * The number of idle connections kept in the connection
+	 * cache of #curl_multi.
+	 */
+	CURL_MAX_CONNECTS = 8,
 };
 
 struct input_curl {
@@ -64,20 +90,80 @@ struct input_curl {
 	char *url, *range;
 	struct curl_slist *request_headers;
 
-	/** the curl handles */
+	/**
+	 * The "easy" handle.  While it is registered with the I/O
+	 * thread (#active), only the I/O thread may use it.
+	 */
 	CURL *easy;
-	CURLM *multi;
-
-	/** list of buffers, where input_curl_writefunction() appends
-	    to, and input_curl_read() reads from them */
-	GQueue *buffers;
 
-	/** has something been added to the buffers list? */
+	/**
+	 * Signalled by the I/O thread when data has arrived, the
+	 * transfer is finished, or a request from
+	 * input_curl_schedule() has been handled.
+	 */
+	GCond *cond;
+
+	/*
+	 * All of the following attributes are protected by
+	 * #curl_mutex.
+	 */
+
+	/**
+	 * Shall the I/O thread add the "easy" handle to its "multi"
+	 * handle?
+	 */
+	bool started;
+
+	/**
+	 * Is the "easy" handle currently registered with the "multi"
+	 * handle?
+	 */
+	bool active;
+
+	/**
+	 * Is this stream in #curl_pending?
+	 */
+	bool scheduled;
+
+	/**
+	 * Has input_curl_writefunction() paused the transfer because
+	 * the buffer was full?
+	 */
+	bool paused;
+
+	/** the data which was received, but not read yet */
+	struct fifo_buffer *buffer;
+
+	/** the offset of the first byte of the current response */
+	goffset request_offset;
+
+	/**
+	 * The number of bytes which input_curl_writefunction() shall
+	 * discard, because the reader has seeked forward beyond the
+	 * buffer.  If this is non-zero, the buffer is empty.
+	 */
+	goffset skip;
+
+	/** has something been added to the buffer? */
 	bool buffered;
 
 	/** did libcurl tell us the we're at the end of the response body? */
 	bool eof;
 
+	/**
+	 * An error which occurred in the I/O thread.  It is reported
+	 * after all buffered data has been read.
+	 */
+	GError *postponed_error;
+
+	/**
+	 * Attributes received by the I/O thread.  They are copied to
+	 * #base by input_curl_copy_attributes().
+	 */
+	bool ready, seekable;
+	goffset size;
+	char *mime, *etag, *last_modified;
+
 	/** error message provided by libcurl */
 	char error[CURL_ERROR_SIZE];
 
@@ -90,6 +176,14 @@ struct input_curl {
 	/** the tag object ready to be requested via
 	    input_stream_tag() */
 	struct tag *tag;
+
+	/** statistics, logged when the stream is closed */
+	guint64 received;
+	unsigned pauses, waits;
+
+	/** the number of requests, and the number of new connections
+	    they needed */
+	unsigned requests, connects;
 };
 
 /** libcurl should accept "ICY 200 OK" */
@@ -99,15 +193,351 @@ static struct curl_slist *http_200_aliases;
 static const char *proxy, *proxy_user, *proxy_password;
 static unsigned proxy_port;
 
+/**
+ * The I/O thread, which performs the transfers of all streams.
+ */
+static GThread *curl_thread;
+
+/**
+ * The "multi" handle, owned by the I/O thread.
+ */
+static CURLM *curl_multi;
+
+/**
+ * Protects the I/O thread state and all streams.
+ */
+static GMutex *curl_mutex;
+
+/**
+ * Wakes up the I/O thread from select().  On Windows, this is a pair
+ * of connected sockets, because winsock's select() accepts only
+ * sockets.
+ */
+static int curl_wake_pipe[2];
+
+/**
+ * Streams which need attention by the I/O thread.  See
+ * input_curl_schedule().
+ */
+static GSList *curl_pending;
+
+/**
+ * Shall the I/O thread quit?
+ */
+static bool curl_quit;
+
 static inline GQuark
 curl_quark(void)
 {
 	return g_quark_from_static_string("curl");
 }
 
+#ifdef WIN32
+
+/**
+ * Creates a pair of connected loopback TCP sockets, to be used
+ * instead of a pipe.
+ */
+static int
+curl_socketpair(int fds[2])
+{
+	struct sockaddr_in address;
+	int length = sizeof(address);
+	SOCKET listener, a, b;
+	u_long nonblock = 1;
+
+	listener = socket(AF_INET, SOCK_STREAM, 0);
+	if (listener == INVALID_SOCKET)
+		return -1;
+
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = 0;
+
+	if (bind(listener, (struct sockaddr *)&address,
+		 sizeof(address)) != 0 ||
+	    getsockname(listener, (struct sockaddr *)&address,
+			&length) != 0 ||
+	    listen(listener, 1) != 0) {
+		closesocket(listener);
+		return -1;
+	}
+
+	a = socket(AF_INET, SOCK_STREAM, 0);
+	if (a == INVALID_SOCKET) {
+		closesocket(listener);
+		return -1;
+	}
+
+	if (connect(a, (struct sockaddr *)&address, sizeof(address)) != 0) {
+		closesocket(a);
+		closesocket(listener);
+		return -1;
+	}
+
+	b = accept(listener, NULL, NULL);
+	closesocket(listener);
+	if (b == INVALID_SOCKET) {
+		closesocket(a);
+		return -1;
+	}
+
+	ioctlsocket(a, FIONBIO, &nonblock);
+	ioctlsocket(b, FIONBIO, &nonblock);
+
+	fds[0] = (int)b;
+	fds[1] = (int)a;
+	return 0;
+}
+
+#endif
+
+static int
+input_curl_wake_open(void)
+{
+#ifdef WIN32
+	return curl_socketpair(curl_wake_pipe);
+#else
+	return pipe_cloexec_nonblock(curl_wake_pipe);
+#endif
+}
+
+static void
+input_curl_wake_close(void)
+{
+#ifdef WIN32
+	closesocket(curl_wake_pipe[0]);
+	closesocket(curl_wake_pipe[1]);
+#else
+	close(curl_wake_pipe[0]);
+	close(curl_wake_pipe[1]);
+#endif
+}
+
+static void
+input_curl_wake(void)
+{
+	static const char dummy = 0;
+	G_GNUC_UNUSED ssize_t nbytes;
+
+#ifdef WIN32
+	nbytes = send(curl_wake_pipe[1], &dummy, 1, 0);
+#else
+	nbytes = write(curl_wake_pipe[1], &dummy, 1);
+#endif
+}
+
+/**
+ * Asks the I/O thread to compare the stream's state with what was
+ * requested, and to call the necessary libcurl functions.  Caller
+ * must lock #curl_mutex.
+ */
+static void
+input_curl_schedule(struct input_curl *c)
+{
+	if (c->scheduled)
+		return;
+
+	c->scheduled = true;
+	curl_pending = g_slist_append(curl_pending, c);
+	input_curl_wake();
+}
+
+/**
+ * Returns the number of bytes in the buffer.  Caller must lock
+ * #curl_mutex.
+ */
+static size_t
+input_curl_buffered(const struct input_curl *c)
+{
+	size_t length;
+
+	return fifo_buffer_read(c->buffer, &length) != NULL ? length : 0;
+}
+
+/**
+ * Handles a stream from #curl_pending.  Called in the I/O thread
+ * with #curl_mutex locked, which is released temporarily while
+ * libcurl is called, because libcurl may invoke our callbacks.
+ */
+static void
+input_curl_update(struct input_curl *c)
+{
+	CURLMcode mcode;
+
+	if (c->started && !c->active) {
+		g_mutex_unlock(curl_mutex);
+		mcode = curl_multi_add_handle(curl_multi, c->easy);
+		g_mutex_lock(curl_mutex);
+
+		if (mcode == CURLM_OK)
+			c->active = true;
+		else {
+			c->postponed_error =
+				g_error_new(curl_quark(), mcode,
+					    "curl_multi_add_handle() failed: %s",
+					    curl_multi_strerror(mcode));
+			c->eof = true;
+			c->ready = true;
+		}
+	} else if (!c->started && c->active) {
+		long connects = 0;
+
+		g_mutex_unlock(curl_mutex);
+		curl_multi_remove_handle(curl_multi, c->easy);
+		curl_easy_getinfo(c->easy, CURLINFO_NUM_CONNECTS, &connects);
+		g_mutex_lock(curl_mutex);
+
+		++c->requests;
+		c->connects += connects;
+		c->active = false;
+		c->paused = false;
+	} else if (c->active && c->paused &&
+		   input_curl_buffered(c) <= CURL_RESUME_AT) {
+		c->paused = false;
+
+		g_mutex_unlock(curl_mutex);
+		curl_easy_pause(c->easy, CURLPAUSE_CONT);
+		g_mutex_lock(curl_mutex);
+	}
+
+	g_cond_broadcast(c->cond);
+}
+
+/**
+ * Wait for the libcurl sockets or for the wake pipe.
+ */
+static void
+input_curl_select(void)
+{
+	fd_set rfds, wfds, efds;
+	int max_fd, ret;
+	long timeout_ms;
+	struct timeval timeout;
+	CURLMcode mcode;
+
+	FD_ZERO(&rfds);
+	FD_ZERO(&wfds);
+	FD_ZERO(&efds);
+
+	mcode = curl_multi_fdset(curl_multi, &rfds, &wfds, &efds, &max_fd);
+	if (mcode != CURLM_OK) {
+		g_warning("curl_multi_fdset() failed: %s\n",
+			  curl_multi_strerror(mcode));
+		max_fd = -1;
+	}
+
+	FD_SET(curl_wake_pipe[0], &rfds);
+	if (curl_wake_pipe[0] > max_fd)
+		max_fd = curl_wake_pipe[0];
+
+	/* libcurl may need to be called before its sockets become
+	   ready (connect timeouts, DNS resolver threads) */
+	if (curl_multi_timeout(curl_multi, &timeout_ms) != CURLM_OK ||
+	    timeout_ms < 0 || timeout_ms > 1000)
+		timeout_ms = 1000;
+
+	timeout.tv_sec = timeout_ms / 1000;
+	timeout.tv_usec = (timeout_ms % 1000) * 1000;
+
+	ret = select(max_fd + 1, &rfds, &wfds, &efds, &timeout);
+	if (ret < 0 && errno != EINTR)
+		g_warning("select() failed: %s\n", g_strerror(errno));
+
+	if (ret > 0 && FD_ISSET(curl_wake_pipe[0], &rfds)) {
+		char buffer[256];
+		G_GNUC_UNUSED ssize_t nbytes;
+
+#ifdef WIN32
+		nbytes = recv(curl_wake_pipe[0], buffer, sizeof(buffer), 0);
+#else
+		nbytes = read(curl_wake_pipe[0], buffer, sizeof(buffer));
+#endif
+	}
+}
+
+/**
+ * Find out which transfers are finished.  Called in the I/O thread.
+ */
+static void
+input_curl_info_read(void)
+{
+	CURLMsg *msg;
+	int msgs_in_queue;
+
+	while ((msg = curl_multi_info_read(curl_multi,
+					   &msgs_in_queue)) != NULL) {
+		struct input_curl *c;
+
+		if (msg->msg != CURLMSG_DONE)
+			continue;
+
+		curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &c);
+
+		g_mutex_lock(curl_mutex);
+
+		c->eof = true;
+		c->ready = true;
+
+		if (msg->data.result != CURLE_OK && c->postponed_error == NULL)
+			c->postponed_error =
+				g_error_new(curl_quark(), msg->data.result,
+					    "curl failed: %s", c->error);
+
+		g_cond_broadcast(c->cond);
+		g_mutex_unlock(curl_mutex);
+	}
+}
+
+static void
+input_curl_perform(void)
+{
+	CURLMcode mcode;
+	int running_handles;
+
+	do {
+		mcode = curl_multi_perform(curl_multi, &running_handles);
+	} while (mcode == CURLM_CALL_MULTI_PERFORM);
+
+	if (mcode != CURLM_OK)
+		g_warning("curl_multi_perform() failed: %s\n",
+			  curl_multi_strerror(mcode));
+
+	input_curl_info_read();
+}
+
+static gpointer
+input_curl_thread(G_GNUC_UNUSED gpointer data)
+{
+	g_mutex_lock(curl_mutex);
+
+	while (!curl_quit) {
+		while (curl_pending != NULL) {
+			struct input_curl *c = curl_pending->data;
+
+			curl_pending = g_slist_delete_link(curl_pending,
+							   curl_pending);
+			c->scheduled = false;
+
+			input_curl_update(c);
+		}
+
+		g_mutex_unlock(curl_mutex);
+
+		input_curl_select();
+		input_curl_perform();
+
+		g_mutex_lock(curl_mutex);
+	}
+
+	g_mutex_unlock(curl_mutex);
+
+	return NULL;
+}
+
 static bool
-input_curl_init(const struct config_param *param,
-		G_GNUC_UNUSED GError **error_r)
+input_curl_init(const struct config_param *param, GError **error_r)
 {
 	CURLcode code = curl_global_init(CURL_GLOBAL_ALL);
 	if (code != CURLE_OK) {
@@ -133,36 +563,107 @@ input_curl_init(const struct config_param *param,
 						   "");
 	}
 
+	/* all streams share this "multi" handle, and with it, its DNS
+	   cache and its cache of idle keep-alive connections; the
+	   next request to the same server (the next song, or a seek)
+	   doesn't need to connect again */
+	curl_multi = curl_multi_init();
+	if (curl_multi == NULL) {
+		g_set_error(error_r, curl_quark(), 0,
+			    "curl_multi_init() failed");
+		goto fail;
+	}
+
+	curl_multi_setopt(curl_multi, CURLMOPT_MAXCONNECTS,
+			  (long)CURL_MAX_CONNECTS);
+
+	if (input_curl_wake_open() < 0) {
+		g_set_error(error_r, g_quark_from_static_string("errno"),
+			    errno, "Failed to create pipe: %s",
+			    g_strerror(errno));
+		goto fail_multi;
+	}
+
+	curl_mutex = g_mutex_new();
+	curl_quit = false;
+
+	curl_thread = g_thread_create(input_curl_thread, NULL, true, error_r);
+	if (curl_thread == NULL)
+		goto fail_pipe;
+
 	return true;
+
+fail_pipe:
+	g_mutex_free(curl_mutex);
+	input_curl_wake_close();
+fail_multi:
+	curl_multi_cleanup(curl_multi);
+fail:
+	curl_slist_free_all(http_200_aliases);
+	http_200_aliases = NULL;
+	curl_global_cleanup();
+	return false;
 }
 
 static void
 input_curl_finish(void)
 {
+	g_mutex_lock(curl_mutex);
+	assert(curl_pending == NULL);
+	curl_quit = true;
+	input_curl_wake();
+	g_mutex_unlock(curl_mutex);
+
+	g_thread_join(curl_thread);
+
+	g_mutex_free(curl_mutex);
+	input_curl_wake_close();
+
+	curl_multi_cleanup(curl_multi);
+
 	curl_slist_free_all(http_200_aliases);
 
 	curl_global_cleanup();
 }
 
+/**
+ * Lets the I/O thread start the transfer on the current "easy"
+ * handle.
+ */
 static void
-buffer_free_callback(gpointer data, G_GNUC_UNUSED gpointer user_data)
+input_curl_start(struct input_curl *c)
 {
-	struct buffer *buffer = data;
+	g_mutex_lock(curl_mutex);
+	c->started = true;
+	input_curl_schedule(c);
+	g_mutex_unlock(curl_mutex);
+}
 
-	assert(buffer->consumed <= buffer->size);
+/**
+ * Removes the "easy" handle from the I/O thread, and waits until the
+ * I/O thread has forgotten about this stream.  Caller must lock
+ * #curl_mutex.
+ */
+static void
+input_curl_stop(struct input_curl *c)
+{
+	c->started = false;
+	input_curl_schedule(c);
 
-	g_free(data);
+	while (c->active || c->scheduled)
+		g_cond_wait(c->cond, curl_mutex);
 }
 
 /**
  * Frees the current "libcurl easy" handle, and everything associated
- * with it.
+ * with it.  It must not be registered with the I/O thread.
  */
 static void
 input_curl_easy_free(struct input_curl *c)
 {
+	assert(!c->active);
+
 	if (c->easy != NULL) {
-		curl_multi_remove_handle(c->multi, c->easy);
 		curl_easy_cleanup(c->easy);
 		c->easy = NULL;
 	}
@@ -173,8 +674,14 @@ input_curl_easy_free(struct input_curl *c)
 	g_free(c->range);
 	c->range = NULL;
 
-	g_queue_foreach(c->buffers, buffer_free_callback, NULL);
-	g_queue_clear(c->buffers);
+	fifo_buffer_clear(c->buffer);
+	c->buffered = false;
+	c->skip = 0;
+
+	if (c->postponed_error != NULL) {
+		g_error_free(c->postponed_error);
+		c->postponed_error = NULL;
+	}
 }
 
 /**
@@ -183,178 +690,159 @@ input_curl_easy_free(struct input_curl *c)
 static void
 input_curl_free(struct input_curl *c)
 {
+	if (c->easy != NULL) {
+		g_mutex_lock(curl_mutex);
+		input_curl_stop(c);
+		g_mutex_unlock(curl_mutex);
+	}
+
+	g_debug("%s: received %llu bytes, paused %u times, "
+		"reader waited %u times, %u requests, %u new connections",
+		c->url, (unsigned long long)c->received, c->pauses, c->waits,
+		c->requests, c->connects);
+
 	if (c->tag != NULL)
 		tag_free(c->tag);
 	g_free(c->meta_name);
 
 	input_curl_easy_free(c);
 
-	if (c->multi != NULL)
-		curl_multi_cleanup(c->multi);
-
-	g_queue_free(c->buffers);
+	fifo_buffer_free(c->buffer);
+	g_cond_free(c->cond);
 
+	g_free(c->mime);
+	g_free(c->etag);
+	g_free(c->last_modified);
 	g_free(c->url);
 	input_stream_deinit(&c->base);
 	g_free(c);
 }
 
-static struct tag *
-input_curl_tag(struct input_stream *is)
-{
-	struct input_curl *c = (struct input_curl *)is;
-	struct tag *tag = c->tag;
-
-	c->tag = NULL;
-	return tag;
-}
-
-static bool
-input_curl_multi_info_read(struct input_curl *c, GError **error_r)
+/**
+ * Copies the attributes received by the I/O thread to the public
+ * input_stream struct.  Caller must lock #curl_mutex.
+ */
+static void
+input_curl_copy_attributes(struct input_curl *c)
 {
-	CURLMsg *msg;
-	int msgs_in_queue;
+	c->base.ready = c->ready;
+	c->base.seekable = c->seekable;
+	c->base.size = c->size;
 
-	while ((msg = curl_multi_info_read(c->multi,
-					   &msgs_in_queue)) != NULL) {
-		if (msg->msg == CURLMSG_DONE) {
-			c->eof = true;
-			c->base.ready = true;
+	if (c->mime != NULL) {
+		g_free(c->base.mime);
+		c->base.mime = c->mime;
+		c->mime = NULL;
+	}
 
-			if (msg->data.result != CURLE_OK) {
-				g_set_error(error_r, curl_quark(),
-					    msg->data.result,
-					    "curl failed: %s", c->error);
-				return false;
-			}
-		}
+	if (c->etag != NULL) {
+		g_free(c->base.etag);
+		c->base.etag = c->etag;
+		c->etag = NULL;
 	}
 
-	return true;
+	if (c->last_modified != NULL) {
+		g_free(c->base.last_modified);
+		c->base.last_modified = c->last_modified;
+		c->last_modified = NULL;
+	}
 }
 
 /**
- * Wait for the libcurl socket.
+ * Reports the error which occurred in the I/O thread.  Caller must
+ * lock #curl_mutex.
  *
- * @return -1 on error, 0 if no data is available yet, 1 if data is
- * available
+ * @return false if there was an error
  */
-static int
-input_curl_select(struct input_curl *c, GError **error_r)
+static bool
+input_curl_check_error(struct input_curl *c, GError **error_r)
 {
-	fd_set rfds, wfds, efds;
-	int max_fd, ret;
-	CURLMcode mcode;
-	/* XXX hard coded timeout value.. */
-	struct timeval timeout = {
-		.tv_sec = 1,
-		.tv_usec = 0,
-	};
-
-	assert(!c->eof);
-
-	FD_ZERO(&rfds);
-	FD_ZERO(&wfds);
-	FD_ZERO(&efds);
-
-	mcode = curl_multi_fdset(c->multi, &rfds, &wfds, &efds, &max_fd);
-	if (mcode != CURLM_OK) {
-		g_set_error(error_r, curl_quark(), mcode,
-			    "curl_multi_fdset() failed: %s",
-			    curl_multi_strerror(mcode));
-		return -1;
-	}
-
-	assert(max_fd >= 0);
+	if (c->postponed_error == NULL)
+		return true;
 
-	ret = select(max_fd + 1, &rfds, &wfds, &efds, &timeout);
-	if (ret < 0)
-		g_set_error(error_r, g_quark_from_static_string("errno"),
-			    errno,
-			    "select() failed: %s\n", g_strerror(errno));
+	g_propagate_error(error_r, c->postponed_error);
+	c->postponed_error = NULL;
+	return false;
+}
 
-	return ret;
+/**
+ * Resumes the transfer if it was paused and the reader has drained
+ * enough of the buffer.  Caller must lock #curl_mutex.
+ */
+static void
+input_curl_resume(struct input_curl *c)
+{
+	if (c->paused && input_curl_buffered(c) <= CURL_RESUME_AT)
+		input_curl_schedule(c);
 }
 
-static bool
-fill_buffer(struct input_stream *is, GError **error_r)
+static struct tag *
+input_curl_tag(struct input_stream *is)
 {
 	struct input_curl *c = (struct input_curl *)is;
-	CURLMcode mcode = CURLM_CALL_MULTI_PERFORM;
-
-	while (!c->eof && g_queue_is_empty(c->buffers)) {
-		int running_handles;
-		bool bret;
-
-		if (mcode != CURLM_CALL_MULTI_PERFORM) {
-			/* if we're still here, there is no input yet
-			   - wait for input */
-			int ret = input_curl_select(c, error_r);
-			if (ret <= 0)
-				/* no data yet or error */
-				return false;
-		}
-
-		mcode = curl_multi_perform(c->multi, &running_handles);
-		if (mcode != CURLM_OK && mcode != CURLM_CALL_MULTI_PERFORM) {
-			g_set_error(error_r, curl_quark(), mcode,
-				    "curl_multi_perform() failed: %s",
-				    curl_multi_strerror(mcode));
-			c->eof = true;
-			is->ready = true;
-			return false;
-		}
+	struct tag *tag;
 
-		bret = input_curl_multi_info_read(c, error_r);
-		if (!bret)
-			return false;
-	}
+	g_mutex_lock(curl_mutex);
+	tag = c->tag;
+	c->tag = NULL;
+	g_mutex_unlock(curl_mutex);
 
-	return !g_queue_is_empty(c->buffers);
+	return tag;
 }
 
 /**
- * Mark a part of the buffer object as consumed.
+ * Waits until the I/O thread has received data, or until the
+ * transfer is finished.  Caller must lock #curl_mutex.
+ *
+ * @return true if there is data in the buffer
  */
-static struct buffer *
-consume_buffer(struct buffer *buffer, size_t length)
+static bool
+input_curl_wait(struct input_curl *c, unsigned timeout_ms)
 {
-	assert(buffer != NULL);
-	assert(buffer->consumed < buffer->size);
+	GTimeVal end;
+
+	if (!fifo_buffer_is_empty(c->buffer))
+		return true;
 
-	buffer->consumed += length;
-	if (buffer->consumed < buffer->size)
-		return buffer;
+	if (c->eof)
+		return false;
 
-	assert(buffer->consumed == buffer->size);
+	++c->waits;
 
-	g_free(buffer);
+	g_get_current_time(&end);
+	g_time_val_add(&end, timeout_ms * 1000);
 
-	return NULL;
+	while (fifo_buffer_is_empty(c->buffer) && !c->eof)
+		if (!g_cond_timed_wait(c->cond, curl_mutex, &end))
+			break;
+
+	return !fifo_buffer_is_empty(c->buffer);
 }
 
 static size_t
-read_from_buffer(struct icy_metadata *icy_metadata, GQueue *buffers,
+read_from_buffer(struct icy_metadata *icy_metadata,
+		 struct fifo_buffer *buffer,
 		 void *dest0, size_t length)
 {
-	struct buffer *buffer = g_queue_pop_head(buffers);
+	const uint8_t *src;
+	size_t available;
 	uint8_t *dest = dest0;
 	size_t nbytes = 0;
 
-	assert(buffer->size > 0);
-	assert(buffer->consumed < buffer->size);
+	src = fifo_buffer_read(buffer, &available);
+	assert(src != NULL);
 
-	if (length > buffer->size - buffer->consumed)
-		length = buffer->size - buffer->consumed;
+	if (length > available)
+		length = available;
 
 	while (true) {
 		size_t chunk;
 
 		chunk = icy_data(icy_metadata, length);
 		if (chunk > 0) {
-			memcpy(dest, buffer->data + buffer->consumed,
-			       chunk);
-			buffer = consume_buffer(buffer, chunk);
+			memcpy(dest, src, chunk);
+			fifo_buffer_consume(buffer, chunk);
+			src += chunk;
 
 			nbytes += chunk;
 			dest += chunk;
@@ -362,27 +850,20 @@ read_from_buffer(struct icy_metadata *icy_metadata, GQueue *buffers,
 
 			if (length == 0)
 				break;
-
-			assert(buffer != NULL);
 		}
 
-		chunk = icy_meta(icy_metadata, buffer->data + buffer->consumed,
-				 length);
+		chunk = icy_meta(icy_metadata, src, length);
 		if (chunk > 0) {
-			buffer = consume_buffer(buffer, chunk);
+			fifo_buffer_consume(buffer, chunk);
+			src += chunk;
 
 			length -= chunk;
 
 			if (length == 0)
 				break;
-
-			assert(buffer != NULL);
 		}
 	}
 
-	if (buffer != NULL)
-		g_queue_push_head(buffers, buffer);
-
 	return nbytes;
 }
 
@@ -408,21 +889,25 @@ input_curl_read(struct input_stream *is, void *ptr, size_t size,
 		GError **error_r)
 {
 	struct input_curl *c = (struct input_curl *)is;
-	bool success;
 	size_t nbytes = 0;
 	char *dest = ptr;
 
+	g_mutex_lock(curl_mutex);
+
 	do {
-		/* fill the buffer */
+		/* wait for the I/O thread; this does not block as
+		   long as there is data in the buffer */
 
-		success = fill_buffer(is, error_r);
-		if (!success)
-			return 0;
+		if (!input_curl_wait(c, CURL_READ_TIMEOUT)) {
+			input_curl_check_error(c, error_r);
+			break;
+		}
 
 		/* send buffer contents */
 
-		while (size > 0 && !g_queue_is_empty(c->buffers)) {
-			size_t copy = read_from_buffer(&c->icy_metadata, c->buffers,
+		while (size > 0 && !fifo_buffer_is_empty(c->buffer)) {
+			size_t copy = read_from_buffer(&c->icy_metadata,
+						       c->buffer,
 						       dest + nbytes, size);
 
 			nbytes += copy;
@@ -430,9 +915,14 @@ input_curl_read(struct input_stream *is, void *ptr, size_t size,
 		}
 	} while (nbytes == 0);
 
+	input_curl_resume(c);
+
 	if (icy_defined(&c->icy_metadata))
 		copy_icy_tag(c);
 
+	input_curl_copy_attributes(c);
+	g_mutex_unlock(curl_mutex);
+
 	is->offset += (goffset)nbytes;
 
 	return nbytes;
@@ -450,46 +940,47 @@ static bool
 input_curl_eof(G_GNUC_UNUSED struct input_stream *is)
 {
 	struct input_curl *c = (struct input_curl *)is;
+	bool eof;
+
+	g_mutex_lock(curl_mutex);
+	eof = c->eof && fifo_buffer_is_empty(c->buffer);
+	g_mutex_unlock(curl_mutex);
 
-	return c->eof && g_queue_is_empty(c->buffers);
+	return eof;
 }
 
 static int
 input_curl_buffer(struct input_stream *is, GError **error_r)
 {
 	struct input_curl *c = (struct input_curl *)is;
-	CURLMcode mcode;
-	int running_handles;
-	bool ret;
+	int ret;
 
-	c->buffered = false;
+	g_mutex_lock(curl_mutex);
 
-	if (!is->ready && !c->eof)
+	if (!c->ready && !c->eof) {
 		/* not ready yet means the caller is waiting in a busy
-		   loop; relax that by calling select() on the
-		   socket */
-		if (input_curl_select(c, error_r) < 0)
-			return -1;
+		   loop; relax that by waiting for the I/O thread */
+		GTimeVal end;
 
-	do {
-		mcode = curl_multi_perform(c->multi, &running_handles);
-	} while (mcode == CURLM_CALL_MULTI_PERFORM &&
-		 g_queue_is_empty(c->buffers));
-
-	if (mcode != CURLM_OK && mcode != CURLM_CALL_MULTI_PERFORM) {
-		g_set_error(error_r, curl_quark(), mcode,
-			    "curl_multi_perform() failed: %s",
-			    curl_multi_strerror(mcode));
-		c->eof = true;
-		is->ready = true;
-		return -1;
+		g_get_current_time(&end);
+		g_time_val_add(&end, 100 * 1000);
+
+		while (!c->ready && !c->eof)
+			if (!g_cond_timed_wait(c->cond, curl_mutex, &end))
+				break;
 	}
 
-	ret = input_curl_multi_info_read(c, error_r);
-	if (!ret)
-		return -1;
+	ret = c->buffered;
+	c->buffered = false;
+
+	if (fifo_buffer_is_empty(c->buffer) &&
+	    !input_curl_check_error(c, error_r))
+		ret = -1;
 
-	return c->buffered;
+	input_curl_copy_attributes(c);
+	g_mutex_unlock(curl_mutex);
+
+	return ret;
 }
 
 /** called by curl when new data is available */
@@ -522,23 +1013,31 @@ input_curl_headerfunction(void *ptr, size_t size, size_t nmemb, void *stream)
 	while (end > value && g_ascii_isspace(end[-1]))
 		--end;
 
+	g_mutex_lock(curl_mutex);
+
 	if (g_ascii_strcasecmp(name, "accept-ranges") == 0) {
 		/* a stream with icy-metadata is not seekable */
 		if (!icy_defined(&c->icy_metadata))
-			c->base.seekable = true;
+			c->seekable = true;
 	} else if (g_ascii_strcasecmp(name, "content-length") == 0) {
 		char buffer[64];
 
-		if ((size_t)(end - header) >= sizeof(buffer))
-			return size;
-
-		memcpy(buffer, value, end - value);
-		buffer[end - value] = 0;
+		if ((size_t)(end - header) < sizeof(buffer)) {
+			memcpy(buffer, value, end - value);
+			buffer[end - value] = 0;
 
-		c->base.size = c->base.offset + g_ascii_strtoull(buffer, NULL, 10);
+			c->size = c->request_offset +
+				g_ascii_strtoull(buffer, NULL, 10);
+		}
 	} else if (g_ascii_strcasecmp(name, "content-type") == 0) {
-		g_free(c->base.mime);
-		c->base.mime = g_strndup(value, end - value);
+		g_free(c->mime);
+		c->mime = g_strndup(value, end - value);
+	} else if (g_ascii_strcasecmp(name, "etag") == 0) {
+		g_free(c->etag);
+		c->etag = g_strndup(value, end - value);
+	} else if (g_ascii_strcasecmp(name, "last-modified") == 0) {
+		g_free(c->last_modified);
+		c->last_modified = g_strndup(value, end - value);
 	} else if (g_ascii_strcasecmp(name, "icy-name") == 0 ||
 		   g_ascii_strcasecmp(name, "ice-name") == 0 ||
 		   g_ascii_strcasecmp(name, "x-audiocast-name") == 0) {
@@ -554,25 +1053,26 @@ input_curl_headerfunction(void *ptr, size_t size, size_t nmemb, void *stream)
 		char buffer[64];
 		size_t icy_metaint;
 
-		if ((size_t)(end - header) >= sizeof(buffer) ||
-		    icy_defined(&c->icy_metadata))
-			return size;
-
-		memcpy(buffer, value, end - value);
-		buffer[end - value] = 0;
+		if ((size_t)(end - header) < sizeof(buffer) &&
+		    !icy_defined(&c->icy_metadata)) {
+			memcpy(buffer, value, end - value);
+			buffer[end - value] = 0;
 
-		icy_metaint = g_ascii_strtoull(buffer, NULL, 10);
-		g_debug("icy-metaint=%zu", icy_metaint);
+			icy_metaint = g_ascii_strtoull(buffer, NULL, 10);
+			g_debug("icy-metaint=%zu", icy_metaint);
 
-		if (icy_metaint > 0) {
-			icy_start(&c->icy_metadata, icy_metaint);
+			if (icy_metaint > 0) {
+				icy_start(&c->icy_metadata, icy_metaint);
 
-			/* a stream with icy-metadata is not
-			   seekable */
-			c->base.seekable = false;
+				/* a stream with icy-metadata is not
+				   seekable */
+				c->seekable = false;
+			}
 		}
 	}
 
+	g_mutex_unlock(curl_mutex);
+
 	return size;
 }
 
@@ -581,20 +1081,49 @@ static size_t
 input_curl_writefunction(void *ptr, size_t size, size_t nmemb, void *stream)
 {
 	struct input_curl *c = (struct input_curl *)stream;
-	struct buffer *buffer;
+	void *dest;
+	size_t max_length, skip = 0;
 
 	size *= nmemb;
 	if (size == 0)
 		return 0;
 
-	buffer = g_malloc(sizeof(*buffer) - sizeof(buffer->data) + size);
-	buffer->size = size;
-	buffer->consumed = 0;
-	memcpy(buffer->data, ptr, size);
-	g_queue_push_tail(c->buffers, buffer);
+	g_mutex_lock(curl_mutex);
+
+	if (c->skip > 0) {
+		/* discard the data which the reader has seeked
+		   over */
+		skip = c->skip < (goffset)size ? (size_t)c->skip : size;
+		c->skip -= skip;
+		c->received += skip;
+
+		if (skip == size) {
+			g_mutex_unlock(curl_mutex);
+			return size;
+		}
+	}
+
+	dest = fifo_buffer_write(c->buffer, &max_length);
+	if (dest == NULL || max_length < size - skip) {
+		assert(skip == 0);
+
+		/* the buffer is full; libcurl will deliver this chunk
+		   again after input_curl_resume() */
+		c->paused = true;
+		++c->pauses;
+		g_mutex_unlock(curl_mutex);
+		return CURL_WRITEFUNC_PAUSE;
+	}
+
+	memcpy(dest, (const char *)ptr + skip, size - skip);
+	fifo_buffer_append(c->buffer, size - skip);
+	c->received += size - skip;
 
 	c->buffered = true;
-	c->base.ready = true;
+	c->ready = true;
+
+	g_cond_broadcast(c->cond);
+	g_mutex_unlock(curl_mutex);
 
 	return size;
 }
@@ -603,9 +1132,9 @@ static bool
 input_curl_easy_init(struct input_curl *c, GError **error_r)
 {
 	CURLcode code;
-	CURLMcode mcode;
 
 	c->eof = false;
+	c->paused = false;
 
 	c->easy = curl_easy_init();
 	if (c->easy == NULL) {
@@ -614,14 +1143,7 @@ input_curl_easy_init(struct input_curl *c, GError **error_r)
 		return false;
 	}
 
-	mcode = curl_multi_add_handle(c->multi, c->easy);
-	if (mcode != CURLM_OK) {
-		g_set_error(error_r, curl_quark(), mcode,
-			    "curl_multi_add_handle() failed: %s",
-			    curl_multi_strerror(mcode));
-		return false;
-	}
-
+	curl_easy_setopt(c->easy, CURLOPT_PRIVATE, c);
 	curl_easy_setopt(c->easy, CURLOPT_USERAGENT,
 			 "Music Player Daemon " VERSION);
 	curl_easy_setopt(c->easy, CURLOPT_HEADERFUNCTION,
@@ -665,38 +1187,6 @@ input_curl_easy_init(struct input_curl *c, GError **error_r)
 	return true;
 }
 
-void
-input_curl_reinit(struct input_stream *is)
-{
-	struct input_curl *c = (struct input_curl *)is;
-
-	assert(c->base.plugin == &input_plugin_curl);
-	assert(c->easy != NULL);
-
-	curl_easy_setopt(c->easy, CURLOPT_WRITEHEADER, is);
-	curl_easy_setopt(c->easy, CURLOPT_WRITEDATA, is);
-}
-
-static bool
-input_curl_send_request(struct input_curl *c, GError **error_r)
-{
-	CURLMcode mcode;
-	int running_handles;
-
-	do {
-		mcode = curl_multi_perform(c->multi, &running_handles);
-	} while (mcode == CURLM_CALL_MULTI_PERFORM);
-
-	if (mcode != CURLM_OK) {
-		g_set_error(error_r, curl_quark(), mcode,
-			    "curl_multi_perform() failed: %s",
-			    curl_multi_strerror(mcode));
-		return false;
-	}
-
-	return true;
-}
-
 static bool
 input_curl_seek(struct input_stream *is, goffset offset, int whence,
 		GError **error_r)
@@ -740,28 +1230,40 @@ input_curl_seek(struct input_stream *is, goffset offset, int whence,
 
 	/* check if we can fast-forward the buffer */
 
-	while (offset > is->offset && !g_queue_is_empty(c->buffers)) {
-		struct buffer *buffer;
-		size_t length;
+	g_mutex_lock(curl_mutex);
 
-		buffer = (struct buffer *)g_queue_pop_head(c->buffers);
+	if (offset > is->offset) {
+		size_t length = input_curl_buffered(c);
 
-		length = buffer->size - buffer->consumed;
 		if (offset - is->offset < (goffset)length)
 			length = offset - is->offset;
 
-		buffer = consume_buffer(buffer, length);
-		if (buffer != NULL)
-			g_queue_push_head(c->buffers, buffer);
-
+		fifo_buffer_consume(c->buffer, length);
 		is->offset += length;
+
+		/* if the rest is not far away, skip it in the
+		   running transfer, and keep its connection */
+		if (offset > is->offset && c->started && !c->eof &&
+		    offset - is->offset <= CURL_MAX_SKIP) {
+			c->skip += offset - is->offset;
+			is->offset = offset;
+		}
+
+		input_curl_resume(c);
 	}
 
-	if (offset == is->offset)
+	if (offset == is->offset) {
+		g_mutex_unlock(curl_mutex);
 		return true;
+	}
 
 	/* close the old connection and open a new one */
 
+	if (c->easy != NULL)
+		input_curl_stop(c);
+
+	g_mutex_unlock(curl_mutex);
+
 	input_curl_easy_free(c);
 
 	is->offset = offset;
@@ -779,16 +1281,14 @@ input_curl_seek(struct input_stream *is, goffset offset, int whence,
 
 	/* send the "Range" header */
 
+	c->request_offset = is->offset;
 	if (is->offset > 0) {
 		c->range = g_strdup_printf("%lld-", (long long)is->offset);
 		curl_easy_setopt(c->easy, CURLOPT_RANGE, c->range);
 	}
 
-	ret = input_curl_send_request(c, error_r);
-	if (!ret)
-		return false;
-
-	return input_curl_multi_info_read(c, error_r);
+	input_curl_start(c);
+	return true;
 }
 
 static struct input_stream *
@@ -804,15 +1304,9 @@ input_curl_open(const char *url, GError **error_r)
 	input_stream_init(&c->base, &input_plugin_curl, url);
 
 	c->url = g_strdup(url);
-	c->buffers = g_queue_new();
-
-	c->multi = curl_multi_init();
-	if (c->multi == NULL) {
-		g_set_error(error_r, curl_quark(), 0,
-			    "curl_multi_init() failed");
-		input_curl_free(c);
-		return NULL;
-	}
+	c->cond = g_cond_new();
+	c->buffer = fifo_buffer_new(CURL_MAX_BUFFERED);
+	c->size = -1;
 
 	icy_clear(&c->icy_metadata);
 	c->tag = NULL;
@@ -823,17 +1317,7 @@ input_curl_open(const char *url, GError **error_r)
 		return NULL;
 	}
 
-	ret = input_curl_send_request(c, error_r);
-	if (!ret) {
-		input_curl_free(c);
-		return NULL;
-	}
-
-	ret = input_curl_multi_info_read(c, error_r);
-	if (!ret) {
-		input_curl_free(c);
-		return NULL;
-	}
+	input_curl_start(c);
 
 	return &c->base;
 }
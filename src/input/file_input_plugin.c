@@ -20,6 +20,7 @@
 #include "config.h" /* must be first for large file support */
 #include "input/file_input_plugin.h"
 #include "input_plugin.h"
+#include "conf.h"
 #include "fd_util.h"
 
 #include <sys/stat.h>
@@ -27,15 +28,63 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <assert.h>
 #include <glib.h>
 
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
+
 #undef G_LOG_DOMAIN
 #define G_LOG_DOMAIN "input_file"
 
+#ifdef HAVE_MMAP
+enum {
+	/**
+	 * How far ahead of the current offset shall the kernel read
+	 * the mapped file?
+	 */
+	FILE_READ_AHEAD = 1024 * 1024,
+
+	/**
+	 * The maximum amount of mapped data which is handed out at a
+	 * time.  Before each window, fstat() checks that the file
+	 * still has its original size.
+	 */
+	FILE_MAP_WINDOW = 64 * 1024,
+};
+
+/**
+ * Map files into memory instead of calling read()?  Configured with
+ * the "mmap" setting.
+ */
+static bool file_use_mmap;
+#endif
+
 struct file_input_stream {
 	struct input_stream base;
 
 	int fd;
+
+#ifdef HAVE_MMAP
+	/**
+	 * The file mapped into memory, or NULL if read() is used.
+	 */
+	const unsigned char *map;
+
+	/**
+	 * The end of the region which the kernel was asked to read
+	 * ahead with MADV_WILLNEED.
+	 */
+	goffset advised;
+
+	/**
+	 * The end of the window which may be accessed without
+	 * checking the file size again.  Accessing a mapped page
+	 * beyond the end of a truncated file raises SIGBUS.
+	 */
+	goffset verified;
+#endif
 };
 
 static inline GQuark
@@ -44,6 +93,134 @@ file_quark(void)
 	return g_quark_from_static_string("file");
 }
 
+static bool
+input_file_init(const struct config_param *param,
+		G_GNUC_UNUSED GError **error_r)
+{
+#ifdef HAVE_MMAP
+	file_use_mmap = config_get_block_bool(param, "mmap", false);
+#else
+	(void)param;
+#endif
+
+	return true;
+}
+
+#ifdef HAVE_MMAP
+
+/**
+ * Asks the kernel to read the next part of the mapped file, before
+ * the decoder needs it.
+ */
+static void
+input_file_advise(struct file_input_stream *fis)
+{
+#ifdef HAVE_MADVISE
+	goffset offset = fis->base.offset, start, end;
+
+	if (offset + FILE_READ_AHEAD / 2 <= fis->advised)
+		/* enough has been advised already */
+		return;
+
+	start = offset > fis->advised ? offset : fis->advised;
+	start &= ~(goffset)(sysconf(_SC_PAGESIZE) - 1);
+
+	end = offset + FILE_READ_AHEAD;
+	if (end > fis->base.size)
+		end = fis->base.size;
+
+	if (end > start)
+		madvise((void *)(fis->map + start), (size_t)(end - start),
+			MADV_WILLNEED);
+
+	fis->advised = end;
+#else
+	(void)fis;
+#endif
+}
+
+/**
+ * Maps the file into memory.  On failure, the stream falls back to
+ * read().
+ */
+static void
+input_file_map(struct file_input_stream *fis)
+{
+	goffset size = fis->base.size;
+	void *p;
+
+	if (size <= 0 || (goffset)(size_t)size != size)
+		/* empty, or too large for the address space */
+		return;
+
+	p = mmap(NULL, (size_t)size, PROT_READ, MAP_SHARED, fis->fd, 0);
+	if (p == MAP_FAILED) {
+		g_debug("mmap(\"%s\") failed: %s",
+			fis->base.uri, g_strerror(errno));
+		return;
+	}
+
+#ifdef HAVE_MADVISE
+	madvise(p, (size_t)size, MADV_SEQUENTIAL);
+#endif
+
+	fis->map = p;
+	fis->advised = 0;
+	fis->verified = 0;
+	input_file_advise(fis);
+}
+
+/**
+ * Unmaps the file, and lets the stream use read() from now on.
+ */
+static void
+input_file_unmap(struct file_input_stream *fis)
+{
+	munmap((void *)fis->map, (size_t)fis->base.size);
+	fis->map = NULL;
+
+	lseek(fis->fd, (off_t)fis->base.offset, SEEK_SET);
+}
+
+/**
+ * Returns the number of mapped bytes at the current offset which
+ * may be accessed, at most the specified length and
+ * #FILE_MAP_WINDOW.  When this exceeds the window which was checked
+ * last time, the file size is checked again.  If the file has been
+ * truncated, or if it is still being written, the file is unmapped,
+ * and 0 is returned; the caller must fall back to read() then.
+ */
+static size_t
+input_file_map_window(struct file_input_stream *fis, size_t length)
+{
+	goffset offset = fis->base.offset;
+	struct stat st;
+
+	if ((goffset)length > fis->base.size - offset)
+		length = (size_t)(fis->base.size - offset);
+	if (length > FILE_MAP_WINDOW)
+		length = FILE_MAP_WINDOW;
+
+	if (offset + (goffset)length <= fis->verified)
+		return length;
+
+	if (fstat(fis->fd, &st) < 0 || st.st_size != fis->base.size) {
+		g_debug("\"%s\" has been modified, not using mmap() anymore",
+			fis->base.uri);
+
+		input_file_unmap(fis);
+
+		if (fstat(fis->fd, &st) == 0)
+			fis->base.size = st.st_size;
+		return 0;
+	}
+
+	fis->verified = offset + FILE_MAP_WINDOW;
+	return length;
+}
+
+#endif
+
 static struct input_stream *
 input_file_open(const char *filename, GError **error_r)
 {
@@ -92,6 +269,12 @@ input_file_open(const char *filename, GError **error_r)
 
 	fis->fd = fd;
 
+#ifdef HAVE_MMAP
+	fis->map = NULL;
+	if (file_use_mmap)
+		input_file_map(fis);
+#endif
+
 	return &fis->base;
 }
 
@@ -101,6 +284,38 @@ input_file_seek(struct input_stream *is, goffset offset, int whence,
 {
 	struct file_input_stream *fis = (struct file_input_stream *)is;
 
+#ifdef HAVE_MMAP
+	if (fis->map != NULL) {
+		switch (whence) {
+		case SEEK_SET:
+			break;
+
+		case SEEK_CUR:
+			offset += is->offset;
+			break;
+
+		case SEEK_END:
+			offset += is->size;
+			break;
+
+		default:
+			offset = -1;
+		}
+
+		if (offset < 0 || offset > is->size) {
+			g_set_error(error_r, file_quark(), EINVAL,
+				    "Failed to seek: %s", g_strerror(EINVAL));
+			return false;
+		}
+
+		is->offset = offset;
+		fis->advised = offset;
+		fis->verified = offset;
+		input_file_advise(fis);
+		return true;
+	}
+#endif
+
 	offset = (goffset)lseek(fis->fd, (off_t)offset, whence);
 	if (offset < 0) {
 		g_set_error(error_r, file_quark(), errno,
@@ -119,6 +334,20 @@ input_file_read(struct input_stream *is, void *ptr, size_t size,
 	struct file_input_stream *fis = (struct file_input_stream *)is;
 	ssize_t nbytes;
 
+#ifdef HAVE_MMAP
+	if (fis->map != NULL) {
+		size_t length = input_file_map_window(fis, size);
+		if (fis->map != NULL) {
+			memcpy(ptr, fis->map + is->offset, length);
+			is->offset += length;
+			input_file_advise(fis);
+			return length;
+		}
+
+		/* the file has been unmapped; use read() */
+	}
+#endif
+
 	nbytes = read(fis->fd, ptr, size);
 	if (nbytes < 0) {
 		g_set_error(error_r, file_quark(), errno,
@@ -135,6 +364,11 @@ input_file_close(struct input_stream *is)
 {
 	struct file_input_stream *fis = (struct file_input_stream *)is;
 
+#ifdef HAVE_MMAP
+	if (fis->map != NULL)
+		munmap((void *)fis->map, (size_t)is->size);
+#endif
+
 	close(fis->fd);
 	input_stream_deinit(&fis->base);
 	g_free(fis);
@@ -146,11 +380,47 @@ input_file_eof(struct input_stream *is)
 	return is->offset >= is->size;
 }
 
+#ifdef HAVE_MMAP
+
+static const void *
+input_file_peek(struct input_stream *is, size_t *length_r)
+{
+	struct file_input_stream *fis = (struct file_input_stream *)is;
+
+	if (fis->map == NULL || is->offset >= is->size)
+		return NULL;
+
+	*length_r = input_file_map_window(fis, (size_t)(is->size - is->offset));
+	if (*length_r == 0)
+		return NULL;
+
+	return fis->map + is->offset;
+}
+
+static void
+input_file_consume(struct input_stream *is, size_t length)
+{
+	struct file_input_stream *fis = (struct file_input_stream *)is;
+
+	assert(fis->map != NULL);
+	assert(is->offset + (goffset)length <= fis->verified);
+
+	is->offset += length;
+	input_file_advise(fis);
+}
+
+#endif
+
 const struct input_plugin input_plugin_file = {
 	.name = "file",
+	.init = input_file_init,
 	.open = input_file_open,
 	.close = input_file_close,
 	.read = input_file_read,
 	.eof = input_file_eof,
 	.seek = input_file_seek,
+#ifdef HAVE_MMAP
+	.peek = input_file_peek,
+	.consume = input_file_consume,
+#endif
 };
@@ -19,18 +19,56 @@
 
 #include "config.h"
 #include "input/rewind_input_plugin.h"
-#include "input/curl_input_plugin.h"
 #include "input_plugin.h"
 #include "tag.h"
+#include "conf.h"
 
 #include <glib.h>
 
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #undef G_LOG_DOMAIN
 #define G_LOG_DOMAIN "input_rewind"
 
+/**
+ * The default maximum buffer size [kB].
+ */
+#define DEFAULT_INPUT_REWIND_BUFFER 256
+
+enum {
+	/**
+	 * The size of a new buffer; it is doubled each time it
+	 * becomes full, up to #rewind_max_size.
+	 */
+	REWIND_BUFFER_MIN_SIZE = 16 * 1024,
+
+	/**
+	 * The maximum number of unused buffers in #rewind_pool.
+	 */
+	REWIND_POOL_MAX = 4,
+};
+
+/**
+ * The maximum buffer size [bytes], 0 disables this plugin.
+ */
+static size_t rewind_max_size = DEFAULT_INPUT_REWIND_BUFFER * 1024;
+
+struct rewind_buffer {
+	char *data;
+	size_t size;
+};
+
+/**
+ * Buffers of closed streams, which are reused by new streams.
+ * Protected by #rewind_pool_mutex.
+ */
+static GSList *rewind_pool;
+
+static GMutex *rewind_pool_mutex;
+
 struct input_rewind {
 	struct input_stream base;
 
@@ -48,16 +86,145 @@ struct input_rewind {
 	size_t tail;
 
 	/**
-	 * The size of this buffer is the maximum number of bytes
-	 * which can be rewinded cheaply without passing the "seek"
-	 * call to CURL.
+	 * This buffer contains the data which can be rewinded
+	 * cheaply without passing the "seek" call to CURL.  It is
+	 * obtained from the pool when the first data arrives, and
+	 * grows on demand up to #rewind_max_size.
 	 *
 	 * The origin of this buffer is always the beginning of the
 	 * stream (offset 0).
 	 */
-	char buffer[64 * 1024];
+	struct rewind_buffer *buffer;
 };
 
+static inline GQuark
+rewind_quark(void)
+{
+	return g_quark_from_static_string("input_rewind");
+}
+
+/**
+ * Obtains a buffer of at least the specified size, preferably from
+ * the pool.
+ */
+static struct rewind_buffer *
+rewind_buffer_get(size_t size)
+{
+	struct rewind_buffer *buffer = NULL;
+
+	g_mutex_lock(rewind_pool_mutex);
+
+	for (GSList *i = rewind_pool; i != NULL; i = g_slist_next(i)) {
+		struct rewind_buffer *b = i->data;
+
+		if (b->size >= size) {
+			rewind_pool = g_slist_delete_link(rewind_pool, i);
+			buffer = b;
+			break;
+		}
+	}
+
+	g_mutex_unlock(rewind_pool_mutex);
+
+	if (buffer == NULL) {
+		buffer = g_new(struct rewind_buffer, 1);
+		buffer->data = g_malloc(size);
+		buffer->size = size;
+	}
+
+	return buffer;
+}
+
+static void
+rewind_buffer_free(struct rewind_buffer *buffer)
+{
+	g_free(buffer->data);
+	g_free(buffer);
+}
+
+/**
+ * Returns a buffer to the pool.  If the pool is full, its smallest
+ * buffer is freed.
+ */
+static void
+rewind_buffer_put(struct rewind_buffer *buffer)
+{
+	struct rewind_buffer *smallest = buffer;
+
+	g_mutex_lock(rewind_pool_mutex);
+
+	rewind_pool = g_slist_prepend(rewind_pool, buffer);
+
+	if (g_slist_length(rewind_pool) > REWIND_POOL_MAX) {
+		for (GSList *i = rewind_pool; i != NULL; i = g_slist_next(i)) {
+			struct rewind_buffer *b = i->data;
+
+			if (b->size < smallest->size)
+				smallest = b;
+		}
+
+		rewind_pool = g_slist_remove(rewind_pool, smallest);
+	} else
+		smallest = NULL;
+
+	g_mutex_unlock(rewind_pool_mutex);
+
+	if (smallest != NULL)
+		rewind_buffer_free(smallest);
+}
+
+/**
+ * Disables buffering (after the stream has left the buffered
+ * range), and returns the buffer to the pool.
+ */
+static void
+input_rewind_release(struct input_rewind *r)
+{
+	r->tail = 0;
+
+	if (r->buffer != NULL) {
+		rewind_buffer_put(r->buffer);
+		r->buffer = NULL;
+	}
+}
+
+/**
+ * Makes room for the specified number of bytes at the end of the
+ * buffer.
+ *
+ * @return false if that would exceed the maximum buffer size
+ */
+static bool
+input_rewind_grow(struct input_rewind *r, size_t length)
+{
+	size_t needed = r->tail + length, size;
+	struct rewind_buffer *buffer;
+
+	if (r->buffer != NULL && needed <= r->buffer->size)
+		return true;
+
+	if (needed > rewind_max_size)
+		return false;
+
+	size = r->buffer != NULL
+		? r->buffer->size * 2
+		: REWIND_BUFFER_MIN_SIZE;
+	while (size < needed)
+		size *= 2;
+	if (size > rewind_max_size)
+		size = rewind_max_size;
+
+	buffer = rewind_buffer_get(size);
+
+	if (r->buffer != NULL) {
+		memcpy(buffer->data, r->buffer->data, r->tail);
+		rewind_buffer_put(r->buffer);
+	}
+
+	r->buffer = buffer;
+	return true;
+}
+
 /**
  * Are we currently reading from the buffer, and does the buffer
  * contain more data for the next read operation?
@@ -98,6 +265,11 @@ input_rewind_close(struct input_stream *is)
 
 	input_stream_close(r->input);
 
+	if (r->buffer != NULL)
+		g_debug("%lu bytes buffered", (unsigned long)r->tail);
+
+	input_rewind_release(r);
+
 	input_stream_deinit(&r->base);
 	g_free(r);
 }
@@ -137,7 +309,7 @@ input_rewind_read(struct input_stream *is, void *ptr, size_t size,
 		if (size > r->tail - r->head)
 			size = r->tail - r->head;
 
-		memcpy(ptr, r->buffer + r->head, size);
+		memcpy(ptr, r->buffer->data + r->head, size);
 		r->head += size;
 		is->offset += size;
 
@@ -147,16 +319,17 @@ input_rewind_read(struct input_stream *is, void *ptr, size_t size,
 
 		size_t nbytes = input_stream_read(r->input, ptr, size, error_r);
 
-		if (r->input->offset > (goffset)sizeof(r->buffer))
-			/* disable buffering */
-			r->tail = 0;
-		else if (r->tail == (size_t)is->offset) {
+		if (r->tail == (size_t)is->offset && nbytes > 0) {
 			/* append to buffer */
 
-			memcpy(r->buffer + r->tail, ptr, nbytes);
-			r->tail += nbytes;
+			if (input_rewind_grow(r, nbytes)) {
+				memcpy(r->buffer->data + r->tail, ptr, nbytes);
+				r->tail += nbytes;
 
-			assert(r->tail == (size_t)r->input->offset);
+				assert(r->tail == (size_t)r->input->offset);
+			} else
+				/* disable buffering */
+				input_rewind_release(r);
 		}
 
 		copy_attributes(r);
@@ -199,7 +372,7 @@ input_rewind_seek(struct input_stream *is, goffset offset, int whence,
 
 		/* disable the buffer, because r->input has left the
 		   buffered range now */
-		r->tail = 0;
+		input_rewind_release(r);
 
 		return success;
 	}
@@ -222,7 +395,7 @@ input_rewind_open(struct input_stream *is)
 	assert(is != NULL);
 	assert(is->offset == 0);
 
-	if (is->seekable)
+	if (is->seekable || rewind_max_size == 0)
 		/* seekable resources don't need this plugin */
 		return is;
 
@@ -230,6 +403,42 @@ input_rewind_open(struct input_stream *is)
 	input_stream_init(&c->base, &rewind_input_plugin, is->uri);
 	c->tail = 0;
 	c->input = is;
+	c->buffer = NULL;
 
 	return &c->base;
 }
+
+bool
+input_rewind_global_init(GError **error_r)
+{
+	const struct config_param *param =
+		config_get_param(CONF_INPUT_REWIND_BUFFER);
+	char *endptr;
+	long value;
+
+	rewind_pool_mutex = g_mutex_new();
+
+	if (param == NULL)
+		return true;
+
+	value = strtol(param->value, &endptr, 10);
+	if (*endptr != 0 || value < 0) {
+		g_set_error(error_r, rewind_quark(), 0,
+			    "rewind buffer size \"%s\" is not a valid number, "
+			    "line %i", param->value, param->line);
+		return false;
+	}
+
+	rewind_max_size = (size_t)value * 1024;
+	return true;
+}
+
+void
+input_rewind_global_finish(void)
+{
+	g_slist_foreach(rewind_pool, (GFunc)rewind_buffer_free, NULL);
+	g_slist_free(rewind_pool);
+	rewind_pool = NULL;
+
+	g_mutex_free(rewind_pool_mutex);
+}
@@ -21,7 +21,9 @@
  *
  * A wrapper for an input_stream object which allows cheap buffered
  * rewinding.  This is useful while detecting the stream codec (let
- * each decoder plugin peek a portion from the stream).
+ * each decoder plugin peek a portion from the stream).  The buffer
+ * grows on demand, up to the size configured with
+ * "input_rewind_buffer"; buffers of closed streams are pooled.
  */
 
 #ifndef MPD_INPUT_REWIND_H
@@ -29,8 +31,24 @@
 
 #include "check.h"
 
+#include <glib.h>
+
+#include <stdbool.h>
+
 struct input_stream;
 
+/**
+ * Reads the "input_rewind_buffer" setting.
+ */
+bool
+input_rewind_global_init(GError **error_r);
+
+/**
+ * Frees the buffer pool.
+ */
+void
+input_rewind_global_finish(void);
+
 struct input_stream *
 input_rewind_open(struct input_stream *is);
 
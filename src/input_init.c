@@ -21,6 +21,9 @@
 #include "input_init.h"
 #include "input_plugin.h"
 #include "input_registry.h"
+#include "input/cache_input_plugin.h"
+#include "input/buffered_input_plugin.h"
+#include "input/rewind_input_plugin.h"
 #include "conf.h"
 #include "glib_compat.h"
 
@@ -88,11 +91,16 @@ input_stream_global_init(GError **error_r)
 		}
 	}
 
-	return true;
+	return input_buffered_global_init(error_r) &&
+		input_rewind_global_init(error_r) &&
+		input_cache_global_init(error_r);
 }
 
 void input_stream_global_finish(void)
 {
+	input_cache_global_finish();
+	input_rewind_global_finish();
+
 	for (unsigned i = 0; input_plugins[i] != NULL; ++i)
 		if (input_plugins_enabled[i] &&
 		    input_plugins[i]->finish != NULL)
@@ -58,6 +58,22 @@ struct input_plugin {
 	bool (*eof)(struct input_stream *is);
 	bool (*seek)(struct input_stream *is, goffset offset, int whence,
 		     GError **error_r);
+
+	/**
+	 * Returns a pointer to the data at the current offset,
+	 * without copying it.  Optional; if implemented, consume()
+	 * must be implemented, too.
+	 *
+	 * @param length_r the number of bytes at the returned pointer
+	 * @return the data, or NULL if the stream can't provide it
+	 * this way (e.g. at the end of the stream)
+	 */
+	const void *(*peek)(struct input_stream *is, size_t *length_r);
+
+	/**
+	 * Advances the offset after peek().
+	 */
+	void (*consume)(struct input_stream *is, size_t length);
 };
 
 #endif
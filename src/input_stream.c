@@ -22,6 +22,8 @@
 #include "input_registry.h"
 #include "input_plugin.h"
 #include "input/rewind_input_plugin.h"
+#include "input/cache_input_plugin.h"
+#include "input/buffered_input_plugin.h"
 
 #include <glib.h>
 #include <assert.h>
@@ -36,12 +38,12 @@ struct input_stream *
 input_stream_open(const char *url, GError **error_r)
 {
 	GError *error = NULL;
+	struct input_stream *is;
 
 	assert(error_r == NULL || *error_r == NULL);
 
 	for (unsigned i = 0; input_plugins[i] != NULL; ++i) {
 		const struct input_plugin *plugin = input_plugins[i];
-		struct input_stream *is;
 
 		if (!input_plugins_enabled[i])
 			continue;
@@ -53,8 +55,12 @@ input_stream_open(const char *url, GError **error_r)
 			assert(is->plugin->read != NULL);
 			assert(is->plugin->eof != NULL);
 			assert(!is->seekable || is->plugin->seek != NULL);
+			assert(is->plugin->peek == NULL ||
+			       is->plugin->consume != NULL);
 
+			is = input_cache_open(is);
 			is = input_rewind_open(is);
+			is = input_buffered_open(is);
 
 			return is;
 		} else if (error != NULL) {
@@ -97,6 +103,25 @@ input_stream_read(struct input_stream *is, void *ptr, size_t size,
 	return is->plugin->read(is, ptr, size, error_r);
 }
 
+const void *
+input_stream_peek(struct input_stream *is, size_t *length_r)
+{
+	assert(length_r != NULL);
+
+	if (is->plugin->peek == NULL)
+		return NULL;
+
+	return is->plugin->peek(is, length_r);
+}
+
+void
+input_stream_consume(struct input_stream *is, size_t length)
+{
+	assert(is->plugin->consume != NULL);
+
+	is->plugin->consume(is, length);
+}
+
 void input_stream_close(struct input_stream *is)
 {
 	is->plugin->close(is);
@@ -69,6 +69,14 @@ struct input_stream {
 	 * the MIME content type of the resource, or NULL if unknown
 	 */
 	char *mime;
+
+	/**
+	 * The entity tag and the modification time of the resource
+	 * (the HTTP "ETag" and "Last-Modified" response headers), or
+	 * NULL if unknown.  They allow detecting whether the resource
+	 * has been modified.
+	 */
+	char *etag, *last_modified;
 };
 
 static inline void
@@ -82,6 +90,8 @@ input_stream_init(struct input_stream *is, const struct input_plugin *plugin,
 	is->size = -1;
 	is->offset = 0;
 	is->mime = NULL;
+	is->etag = NULL;
+	is->last_modified = NULL;
 }
 
 static inline void
@@ -89,6 +99,8 @@ input_stream_deinit(struct input_stream *is)
 {
 	g_free(is->uri);
 	g_free(is->mime);
+	g_free(is->etag);
+	g_free(is->last_modified);
 }
 
 /**
@@ -155,4 +167,34 @@ size_t
 input_stream_read(struct input_stream *is, void *ptr, size_t size,
 		  GError **error_r);
 
+/**
+ * Returns a pointer to the data at the current offset, without
+ * copying it.  Unlike input_stream_read(), this does not advance the
+ * offset; call input_stream_consume() after the data has been used.
+ * The pointer remains valid until the next call to
+ * input_stream_read(), input_stream_peek() or input_stream_seek().
+ *
+ * Streams opened with input_stream_open() support this method
+ * unless buffering was disabled with "input_buffer_size".  For
+ * streams which are not in memory, it may block until the buffer
+ * has been filled.
+ *
+ * @param length_r the number of bytes at the returned pointer
+ * @return the data, or NULL if the stream doesn't support this or
+ * if no data is available (end of file, error, not ready); the
+ * caller should fall back to input_stream_read() then
+ */
+const void *
+input_stream_peek(struct input_stream *is, size_t *length_r);
+
+/**
+ * Marks data returned by input_stream_peek() as consumed, and
+ * advances the offset.
+ *
+ * @param length the number of bytes, not more than the length
+ * returned by input_stream_peek()
+ */
+void
+input_stream_consume(struct input_stream *is, size_t length);
+
 #endif
@@ -24,6 +24,8 @@
 #include <glib.h>
 #include <alsa/asoundlib.h>
 
+#include <string.h>
+
 #undef G_LOG_DOMAIN
 #define G_LOG_DOMAIN "alsa"
 
@@ -76,10 +78,40 @@ struct alsa_data {
 	 */
 	snd_pcm_uframes_t period_frames;
 
+	/**
+	 * The size of the hardware buffer, in number of frames.
+	 */
+	snd_pcm_uframes_t buffer_frames;
+
+	/**
+	 * The configured start threshold, in number of frames.  The
+	 * mmap path starts the PCM itself, because
+	 * snd_pcm_mmap_commit() ignores this setting.
+	 */
+	snd_pcm_uframes_t start_threshold;
+
 	/**
 	 * The number of frames written in the current period.
 	 */
 	snd_pcm_uframes_t period_position;
+
+	/* statistics of the mmap path */
+
+	/**
+	 * How often did alsa_play() wait for the device?
+	 */
+	unsigned waits;
+
+	/**
+	 * The lowest and the highest delay (snd_pcm_delay()) measured
+	 * at period boundaries, in frames.
+	 */
+	snd_pcm_sframes_t min_delay, max_delay;
+
+	/**
+	 * The sample rate, for converting the delay to time.
+	 */
+	unsigned sample_rate;
 };
 
 /**
@@ -489,6 +521,8 @@ configure_hw:
 		(unsigned)alsa_buffer_size, (unsigned)alsa_period_size);
 
 	ad->period_frames = alsa_period_size;
+	ad->buffer_frames = alsa_buffer_size;
+	ad->start_threshold = alsa_buffer_size - alsa_period_size;
 	ad->period_position = 0;
 
 	return true;
@@ -523,6 +557,10 @@ alsa_open(void *data, struct audio_format *audio_format, GError **error)
 	}
 
 	ad->frame_size = audio_format_frame_size(audio_format);
+	ad->sample_rate = audio_format->sample_rate;
+	ad->waits = 0;
+	ad->min_delay = G_MAXLONG;
+	ad->max_delay = 0;
 
 	return true;
 }
@@ -613,9 +651,139 @@ alsa_close(void *data)
 {
 	struct alsa_data *ad = data;
 
+	if (ad->use_mmap && ad->min_delay <= ad->max_delay)
+		g_debug("waited %u times, delay min=%.1fms max=%.1fms",
+			ad->waits,
+			ad->min_delay * 1000.0 / ad->sample_rate,
+			ad->max_delay * 1000.0 / ad->sample_rate);
+
 	snd_pcm_close(ad->pcm);
 }
 
+/**
+ * Measures the hardware delay, i.e. the time until a frame written
+ * now will be played.
+ */
+static void
+alsa_measure_delay(struct alsa_data *ad)
+{
+	snd_pcm_sframes_t delay;
+
+	if (snd_pcm_delay(ad->pcm, &delay) < 0)
+		return;
+
+	if (delay < ad->min_delay)
+		ad->min_delay = delay;
+	if (delay > ad->max_delay)
+		ad->max_delay = delay;
+}
+
+/**
+ * Returns the number of frames which may be written now.  At the
+ * beginning of a period, it waits until there is room for the whole
+ * period, so the device wakes us up only once per period (see
+ * avail_min).
+ *
+ * @return the number of frames, or a negative error code
+ */
+static snd_pcm_sframes_t
+alsa_mmap_avail(struct alsa_data *ad)
+{
+	while (true) {
+		snd_pcm_sframes_t avail = snd_pcm_avail_update(ad->pcm);
+		int err;
+
+		if (avail < 0)
+			return avail;
+
+		if ((snd_pcm_uframes_t)avail >= ad->period_frames ||
+		    (ad->period_position > 0 && avail > 0))
+			return avail;
+
+		++ad->waits;
+		err = snd_pcm_wait(ad->pcm, 1000);
+		if (err < 0)
+			return err;
+	}
+}
+
+/**
+ * Starts the PCM when the buffer has been filled up to the start
+ * threshold.  Unlike snd_pcm_writei(), snd_pcm_mmap_commit() doesn't
+ * do that by itself.
+ *
+ * @return 0 on success, or a negative error code
+ */
+static int
+alsa_mmap_start(struct alsa_data *ad)
+{
+	snd_pcm_sframes_t avail;
+
+	if (snd_pcm_state(ad->pcm) != SND_PCM_STATE_PREPARED)
+		return 0;
+
+	avail = snd_pcm_avail_update(ad->pcm);
+	if (avail < 0)
+		return avail;
+
+	if (ad->buffer_frames - (snd_pcm_uframes_t)avail <
+	    ad->start_threshold)
+		return 0;
+
+	return snd_pcm_start(ad->pcm);
+}
+
+/**
+ * Copies the chunk directly into the memory mapped ring buffer of the
+ * device.  Each call writes up to the end of the current period, so
+ * commits are period aligned.
+ *
+ * @return the number of frames which were written, or a negative
+ * error code
+ */
+static snd_pcm_sframes_t
+alsa_play_mmap(struct alsa_data *ad, const void *chunk,
+	       snd_pcm_uframes_t nframes)
+{
+	const snd_pcm_channel_area_t *areas;
+	snd_pcm_uframes_t offset, frames;
+	snd_pcm_sframes_t avail, committed;
+	int err;
+
+	avail = alsa_mmap_avail(ad);
+	if (avail < 0)
+		return avail;
+
+	frames = ad->period_frames - ad->period_position;
+	if (frames > nframes)
+		frames = nframes;
+	if (frames > (snd_pcm_uframes_t)avail)
+		frames = avail;
+
+	err = snd_pcm_mmap_begin(ad->pcm, &areas, &offset, &frames);
+	if (err < 0)
+		return err;
+
+	/* interleaved access: all channels are in areas[0] */
+	memcpy((char *)areas[0].addr +
+	       (areas[0].first + offset * areas[0].step) / 8,
+	       chunk, frames * ad->frame_size);
+
+	committed = snd_pcm_mmap_commit(ad->pcm, offset, frames);
+	if (committed < 0)
+		return committed;
+
+	err = alsa_mmap_start(ad);
+	if (err < 0)
+		return err;
+
+	if (committed > 0 &&
+	    ad->period_position + committed >= ad->period_frames)
+		alsa_measure_delay(ad);
+
+	return committed;
+}
+
 static size_t
 alsa_play(void *data, const void *chunk, size_t size, GError **error)
 {
@@ -623,6 +791,26 @@ alsa_play(void *data, const void *chunk, size_t size, GError **error)
 
 	size /= ad->frame_size;
 
+	if (ad->use_mmap) {
+		while (true) {
+			snd_pcm_sframes_t ret =
+				alsa_play_mmap(ad, chunk, size);
+			if (ret > 0) {
+				ad->period_position =
+					(ad->period_position + ret)
+					% ad->period_frames;
+				return ret * ad->frame_size;
+			}
+
+			if (ret < 0 && ret != -EAGAIN && ret != -EINTR &&
+			    alsa_recover(ad, ret) < 0) {
+				g_set_error(error, alsa_output_quark(), -ret,
+					    "%s", snd_strerror(-ret));
+				return 0;
+			}
+		}
+	}
+
 	while (true) {
 		snd_pcm_sframes_t ret = ad->writei(ad->pcm, chunk, size);
 		if (ret > 0) {
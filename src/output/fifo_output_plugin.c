@@ -31,18 +31,42 @@
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
+#include <poll.h>
 
 #undef G_LOG_DOMAIN
 #define G_LOG_DOMAIN "fifo"
 
 #define FIFO_BUFFER_SIZE 65536 /* pipe capacity on Linux >= 2.6.11 */
 
+/**
+ * What shall be done when the FIFO is full because the reader is too
+ * slow?
+ */
+enum fifo_drop_policy {
+	/**
+	 * Discard the data in the FIFO which was not read yet.
+	 */
+	FIFO_DROP_OLDEST,
+
+	/**
+	 * Discard the new data.
+	 */
+	FIFO_DROP_NEWEST,
+
+	/**
+	 * Wait for the reader.
+	 */
+	FIFO_DROP_NONE,
+};
+
 struct fifo_data {
 	char *path;
 	int input;
 	int output;
 	bool created;
 	Timer *timer;
+
+	enum fifo_drop_policy drop_policy;
 };
 
 /**
@@ -175,6 +199,21 @@ fifo_open(struct fifo_data *fd, GError **error)
 	return true;
 }
 
+static bool
+fifo_parse_drop_policy(const char *value, enum fifo_drop_policy *policy_r)
+{
+	if (strcmp(value, "oldest") == 0)
+		*policy_r = FIFO_DROP_OLDEST;
+	else if (strcmp(value, "newest") == 0)
+		*policy_r = FIFO_DROP_NEWEST;
+	else if (strcmp(value, "none") == 0)
+		*policy_r = FIFO_DROP_NONE;
+	else
+		return false;
+
+	return true;
+}
+
 static void *
 fifo_output_init(G_GNUC_UNUSED const struct audio_format *audio_format,
 		 const struct config_param *param,
@@ -182,6 +221,8 @@ fifo_output_init(G_GNUC_UNUSED const struct audio_format *audio_format,
 {
 	struct fifo_data *fd;
 	char *value, *path;
+	const char *drop_policy;
+	enum fifo_drop_policy policy;
 
 	value = config_dup_block_string(param, "path", NULL);
 	if (value == NULL) {
@@ -198,8 +239,17 @@ fifo_output_init(G_GNUC_UNUSED const struct audio_format *audio_format,
 		return NULL;
 	}
 
+	drop_policy = config_get_block_string(param, "drop_policy", "oldest");
+	if (!fifo_parse_drop_policy(drop_policy, &policy)) {
+		g_set_error(error, fifo_output_quark(), 0,
+			    "No such drop policy: %s", drop_policy);
+		g_free(path);
+		return NULL;
+	}
+
 	fd = fifo_data_new();
 	fd->path = path;
+	fd->drop_policy = policy;
 
 	if (!fifo_open(fd, error)) {
 		fifo_data_free(fd);
@@ -255,6 +305,29 @@ fifo_output_cancel(void *data)
 	}
 }
 
+/**
+ * Waits until the reader has made room in the FIFO.
+ */
+static bool
+fifo_wait(struct fifo_data *fd, GError **error)
+{
+	struct pollfd pfd = {
+		.fd = fd->output,
+		.events = POLLOUT,
+	};
+
+	while (poll(&pfd, 1, -1) < 0) {
+		if (errno != EINTR) {
+			g_set_error(error, fifo_output_quark(), errno,
+				    "Failed to poll FIFO %s: %s",
+				    fd->path, g_strerror(errno));
+			return false;
+		}
+	}
+
+	return true;
+}
+
 static size_t
 fifo_output_play(void *data, const void *chunk, size_t size,
 		 GError **error)
@@ -277,9 +350,26 @@ fifo_output_play(void *data, const void *chunk, size_t size,
 		if (bytes < 0) {
 			switch (errno) {
 			case EAGAIN:
-				/* The pipe is full, so empty it */
-				fifo_output_cancel(fd);
-				continue;
+				switch (fd->drop_policy) {
+				case FIFO_DROP_OLDEST:
+					/* The pipe is full, so empty it */
+					fifo_output_cancel(fd);
+					continue;
+
+				case FIFO_DROP_NEWEST:
+					/* keep the data which is already
+					   in the pipe, and discard this
+					   chunk */
+					return size;
+
+				case FIFO_DROP_NONE:
+					if (!fifo_wait(fd, error))
+						return 0;
+					continue;
+				}
+
+				break;
+
 			case EINTR:
 				continue;
 			}
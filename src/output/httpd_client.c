@@ -20,6 +20,9 @@
 #include "config.h"
 #include "httpd_client.h"
 #include "httpd_internal.h"
+#include "httpd_thread.h"
+#include "httpd_mount.h"
+#include "httpd_ring.h"
 #include "fifo_buffer.h"
 #include "page.h"
 #include "icy_server.h"
@@ -28,6 +31,19 @@
 #include <stdbool.h>
 #include <assert.h>
 #include <string.h>
+#include <errno.h>
+
+#ifndef G_OS_WIN32
+#include <sys/uio.h>
+#endif
+
+enum {
+	/**
+	 * The maximum number of #iovec structs passed to one writev()
+	 * call.
+	 */
+	HTTPD_CLIENT_MAX_IOV = 16,
+};
 
 struct httpd_client {
 	/**
@@ -35,11 +51,31 @@ struct httpd_client {
 	 */
 	struct httpd_output *httpd;
 
+	/**
+	 * The I/O thread which serves this client.  All event
+	 * sources are attached to its main context.
+	 */
+	struct httpd_thread *thread;
+
+	/**
+	 * The mount point which was requested by the client.  This is
+	 * set when the request line has been received.
+	 */
+	struct httpd_mount *mount;
+
 	/**
 	 * The TCP socket.
 	 */
 	GIOChannel *channel;
 
+#ifdef G_OS_WIN32
+	/**
+	 * The socket of #channel, which GLib doesn't return on
+	 * Windows.
+	 */
+	int fd;
+#endif
+
 	/**
 	 * The GLib main loop source id for reading from the socket,
 	 * and to detect errors.
@@ -48,8 +84,8 @@ struct httpd_client {
 
 	/**
 	 * The GLib main loop source id for writing to the socket.  If
-	 * 0, then there is no event source currently (because there
-	 * are no queued pages).
+	 * 0, then there is no event source currently (because the
+	 * client has caught up with the ring buffer).
 	 */
 	guint write_source_id;
 
@@ -74,67 +110,85 @@ struct httpd_client {
 	} state;
 
 	/**
-	 * A queue of #page objects to be sent to the client.
+	 * The encoder header which is sent to the client before the
+	 * stream data.  NULL if it has been sent already.
 	 */
-	GQueue *pages;
+	struct page *header;
 
 	/**
-	 * The #page which is currently being sent to the client.
+	 * The amount of bytes which were already sent from #header.
 	 */
-	struct page *current_page;
+	size_t header_position;
 
 	/**
-	 * The amount of bytes which were already sent from
-	 * #current_page.
+	 * The position of the next byte in the ring buffer (see
+	 * httpd_client_ring()) which will be sent to this client.
 	 */
-	size_t current_position;
+	unsigned position;
 
 	/* ICY */
 
 	/**
-	 * Do we support sending Icy-Metadata to the client?  This is
-	 * disabled if the httpd audio output uses encoder tags.
-	 */
-	bool metadata_supported;
-
-	/**
-	 * If we should sent icy metadata.
+	 * If we should sent icy metadata.  The client reads
+	 * httpd_mount.icy_ring then, which contains the metadata
+	 * blocks already.
 	 */
 	bool metadata_requested;
 
 	/**
-	 * If the current metadata was already sent to the client.
+	 * The position of the next metadata block in
+	 * httpd_mount.icy_ring.  Only valid if #metadata_requested is
+	 * true.
 	 */
-	bool metadata_sent;
+	unsigned metadata_position;
 
 	/**
-	 * The amount of streaming data between each metadata block
+	 * The current metadata at the time the client has connected.
+	 * It replaces the first empty metadata block, so the client
+	 * doesn't have to wait for the next song to see a title.
+	 * NULL if it has been sent or dropped already.
 	 */
-	guint metaint;
+	struct page *first_metadata;
+};
 
-	/**
-	 * The metadata as #page which is currently being sent to the client.
-	 */
-	struct page *metadata;
+static gboolean
+httpd_client_out_event(GIOChannel *source,
+		       G_GNUC_UNUSED GIOCondition condition, gpointer data);
 
-	/*
-	 * The amount of bytes which were already sent from the metadata.
-	 */
-	size_t metadata_current_position;
+/**
+ * Creates a watch on the socket, and attaches it to the main context
+ * of the I/O thread.
+ *
+ * @return the event source id
+ */
+static guint
+httpd_client_add_watch(struct httpd_client *client, GIOCondition condition,
+		       GIOFunc function)
+{
+	GSource *source = g_io_create_watch(client->channel, condition);
+	guint id;
 
-	/**
-	 * The amount of streaming data sent to the client
-	 * since the last icy information was sent.
-	 */
-	guint metadata_fill;
-};
+	g_source_set_callback(source, (GSourceFunc)function, client, NULL);
+	id = g_source_attach(source, client->thread->context);
+	g_source_unref(source);
+
+	return id;
+}
 
+/**
+ * Removes an event source which was created by
+ * httpd_client_add_watch().  g_source_remove() cannot be used,
+ * because it works only on the default main context.
+ */
 static void
-httpd_client_unref_page(gpointer data, G_GNUC_UNUSED gpointer user_data)
+httpd_client_remove_watch(struct httpd_client *client, guint id)
 {
-	struct page *page = data;
+	GSource *source =
+		g_main_context_find_source_by_id(client->thread->context, id);
 
-	page_unref(page);
+	assert(source != NULL);
+
+	g_source_destroy(source);
 }
 
 void
@@ -142,20 +196,18 @@ httpd_client_free(struct httpd_client *client)
 {
 	if (client->state == RESPONSE) {
 		if (client->write_source_id != 0)
-			g_source_remove(client->write_source_id);
-
-		if (client->current_page != NULL)
-			page_unref(client->current_page);
+			httpd_client_remove_watch(client,
+						  client->write_source_id);
 
-		g_queue_foreach(client->pages, httpd_client_unref_page, NULL);
-		g_queue_free(client->pages);
+		if (client->header != NULL)
+			page_unref(client->header);
 	} else
 		fifo_buffer_free(client->input);
 
-	if (client->metadata)
-		page_unref (client->metadata);
+	if (client->first_metadata != NULL)
+		page_unref(client->first_metadata);
 
-	g_source_remove(client->read_source_id);
+	httpd_client_remove_watch(client, client->read_source_id);
 	g_io_channel_unref(client->channel);
 	g_free(client);
 }
@@ -166,22 +218,79 @@ httpd_client_free(struct httpd_client *client)
 static void
 httpd_client_close(struct httpd_client *client)
 {
-	httpd_output_remove_client(client->httpd, client);
+	httpd_thread_remove_client(client->thread, client);
 	httpd_client_free(client);
 }
 
+/**
+ * Returns the ring buffer which this client reads: the plain stream,
+ * or the stream with ICY metadata blocks.
+ */
+static inline const struct httpd_ring *
+httpd_client_ring(const struct httpd_client *client)
+{
+	return client->metadata_requested
+		? &client->mount->icy_ring
+		: &client->mount->ring;
+}
+
+/**
+ * Returns the position in the ring buffer where a new client starts:
+ * the burst position published by the output thread, or the head
+ * (the beginning of the current ICY block) if that is not usable
+ * anymore.
+ */
+static unsigned
+httpd_client_start_position(const struct httpd_client *client)
+{
+	const struct httpd_mount *mount = client->mount;
+	const struct httpd_ring *ring = httpd_client_ring(client);
+	unsigned position, fallback;
+
+	if (client->metadata_requested) {
+		position = (unsigned)
+			g_atomic_int_get(&mount->icy_burst_position);
+		fallback = (unsigned)
+			g_atomic_int_get(&mount->icy_block_position);
+	} else {
+		position = (unsigned)
+			g_atomic_int_get(&mount->burst_position);
+		fallback = httpd_ring_head(ring);
+	}
+
+	if (!httpd_ring_valid(ring, position) ||
+	    httpd_ring_available(ring, position) > client->httpd->max_lag)
+		position = fallback;
+
+	return position;
+}
+
 /**
  * Switch the client to the "RESPONSE" state.
  */
 static void
 httpd_client_begin_response(struct httpd_client *client)
 {
+	struct page *header;
+
 	client->state = RESPONSE;
 	client->write_source_id = 0;
-	client->pages = g_queue_new();
-	client->current_page = NULL;
+	client->header = NULL;
+	client->position = httpd_client_start_position(client);
+
+	if (client->metadata_requested) {
+		/* the client starts at the beginning of a block */
+		client->metadata_position =
+			client->position + client->mount->metaint;
+		client->first_metadata =
+			httpd_mount_get_icy_metadata(client->mount);
+	}
 
-	httpd_output_send_header(client->httpd, client);
+	header = httpd_mount_get_header(client->mount);
+	if (header != NULL) {
+		httpd_client_send_header(client, header);
+		page_unref(header);
+	}
 }
 
 /**
@@ -193,13 +302,22 @@ httpd_client_handle_line(struct httpd_client *client, const char *line)
 	assert(client->state != RESPONSE);
 
 	if (client->state == REQUEST) {
+		const char *path;
+		char *p;
+
 		if (strncmp(line, "GET /", 5) != 0) {
 			/* only GET is supported */
 			g_warning("malformed request line from client");
 			return false;
 		}
 
-		line = strchr(line + 5, ' ');
+		path = line + 4;
+		line = strchr(path, ' ');
+
+		p = line != NULL ? g_strndup(path, line - path) : g_strdup(path);
+		client->mount = httpd_output_find_mount(client->httpd, p);
+		g_free(p);
+
 		if (line == NULL || strncmp(line + 1, "HTTP/", 5) != 0) {
 			/* HTTP/0.9 without request headers */
 			httpd_client_begin_response(client);
@@ -219,7 +337,7 @@ httpd_client_handle_line(struct httpd_client *client, const char *line)
 		if (g_ascii_strncasecmp(line, "Icy-MetaData: 1", 15) == 0) {
 			/* Send icy metadata */
 			client->metadata_requested =
-				client->metadata_supported;
+				client->mount->metadata_supported;
 			return true;
 		}
 
@@ -278,15 +396,15 @@ httpd_client_send_response(struct httpd_client *client)
 			   "Pragma: no-cache\r\n"
 			   "Cache-Control: no-cache, no-store\r\n"
 			   "\r\n",
-			   client->httpd->content_type);
+			   client->mount->content_type);
 	} else {
 		gchar *metadata_header;
 
 		metadata_header = icy_server_metadata_header("Add config information here!", /* TODO */
 							     "Add config information here!", /* TODO */
 							     "Add config information here!", /* TODO */
-							     client->httpd->content_type,
-							     client->metaint);
+							     client->mount->content_type,
+							     client->mount->metaint);
 
 		g_strlcpy(buffer, metadata_header, sizeof(buffer));
 
@@ -408,10 +526,10 @@ httpd_client_in_event(G_GNUC_UNUSED GIOChannel *source, GIOCondition condition,
 		      gpointer data)
 {
 	struct httpd_client *client = data;
-	struct httpd_output *httpd = client->httpd;
+	struct httpd_thread *thread = client->thread;
 	bool ret;
 
-	g_mutex_lock(httpd->mutex);
+	g_mutex_lock(thread->mutex);
 
 	if (condition == G_IO_IN && httpd_client_read(client)) {
 		ret = true;
@@ -420,22 +538,24 @@ httpd_client_in_event(G_GNUC_UNUSED GIOChannel *source, GIOCondition condition,
 		ret = false;
 	}
 
-	g_mutex_unlock(httpd->mutex);
+	g_mutex_unlock(thread->mutex);
 
 	return ret;
 }
 
 struct httpd_client *
-httpd_client_new(struct httpd_output *httpd, int fd, bool metadata_supported)
+httpd_client_new(struct httpd_thread *thread, int fd)
 {
 	struct httpd_client *client = g_new(struct httpd_client, 1);
 
-	client->httpd = httpd;
+	client->httpd = thread->httpd;
+	client->thread = thread;
 
 #ifndef G_OS_WIN32
 	client->channel = g_io_channel_unix_new(fd);
 #else
 	client->channel = g_io_channel_win32_new_socket(fd);
+	client->fd = fd;
 #endif
 
 	/* GLib is responsible for closing the file descriptor */
@@ -445,267 +565,472 @@ httpd_client_new(struct httpd_output *httpd, int fd, bool metadata_supported)
 	/* we prefer to do buffering */
 	g_io_channel_set_buffered(client->channel, false);
 
-	client->read_source_id = g_io_add_watch(client->channel,
-						G_IO_IN|G_IO_ERR|G_IO_HUP,
-						httpd_client_in_event, client);
+	client->read_source_id =
+		httpd_client_add_watch(client, G_IO_IN|G_IO_ERR|G_IO_HUP,
+				       httpd_client_in_event);
 
 	client->input = fifo_buffer_new(4096);
 	client->state = REQUEST;
 
-	client->metadata_supported = metadata_supported;
+	client->mount = NULL;
 	client->metadata_requested = false;
-	client->metadata_sent = true;
-	client->metaint = 8192; /*TODO: just a std value */
-	client->metadata = NULL;
-	client->metadata_current_position = 0;
-	client->metadata_fill = 0;
+	client->metadata_position = 0;
+	client->first_metadata = NULL;
 
 	return client;
 }
 
-static void
-httpd_client_add_page_size(gpointer data, gpointer user_data)
+/**
+ * Is there anything which has not been sent to the client yet?
+ */
+static bool
+httpd_client_has_data(const struct httpd_client *client)
 {
-	struct page *page = data;
-	size_t *size = user_data;
+	assert(client->state == RESPONSE);
 
-	*size += page->size;
+	return client->header != NULL ||
+		httpd_ring_available(httpd_client_ring(client),
+				     client->position) > 0;
 }
 
-size_t
-httpd_client_queue_size(const struct httpd_client *client)
+/**
+ * Registers the G_IO_OUT event source, unless it exists already.
+ */
+static void
+httpd_client_schedule_write(struct httpd_client *client)
 {
-	size_t size = 0;
+	if (client->write_source_id == 0)
+		client->write_source_id =
+			httpd_client_add_watch(client, G_IO_OUT,
+					       httpd_client_out_event);
+}
 
-	if (client->state != RESPONSE)
-		return 0;
+/**
+ * Reads one byte from the ring buffer.
+ *
+ * @return false if the byte has not been published yet
+ */
+static bool
+httpd_client_peek_byte(const struct httpd_ring *ring, unsigned position,
+		       unsigned char *value_r)
+{
+	struct iovec iov[2];
 
-	g_queue_foreach(client->pages, httpd_client_add_page_size, &size);
-	return size;
+	if (httpd_ring_available(ring, position) == 0)
+		return false;
+
+	httpd_ring_iovec(ring, position, 1, iov);
+	*value_r = *(const unsigned char *)iov[0].iov_base;
+	return true;
 }
 
-void
-httpd_client_cancel(struct httpd_client *client)
+/**
+ * Returns the position of the metadata block which follows the one at
+ * the specified position.
+ *
+ * @param length the length byte of the metadata block
+ */
+static inline unsigned
+httpd_client_next_metadata(const struct httpd_client *client,
+			   unsigned position, unsigned char length)
 {
-	if (client->state != RESPONSE)
-		return;
+	return position + 1 + length * 16 + client->mount->metaint;
+}
 
-	g_queue_foreach(client->pages, httpd_client_unref_page, NULL);
-	g_queue_clear(client->pages);
+/**
+ * Moves the client to the most recent data, discarding everything
+ * in between.  ICY clients keep their offset within the metadata
+ * interval, so the client's metadata framing stays intact; this is
+ * not possible while the client is in a metadata block, or if the
+ * current block hasn't come far enough yet.
+ *
+ * @return true if the client has been moved
+ */
+static bool
+httpd_client_skip(struct httpd_client *client)
+{
+	const struct httpd_mount *mount = client->mount;
+	const struct httpd_ring *ring = httpd_client_ring(client);
+	unsigned block, remaining, position;
 
-	if (client->write_source_id != 0 && client->current_page == NULL) {
-		g_source_remove(client->write_source_id);
-		client->write_source_id = 0;
+	if (!client->metadata_requested) {
+		client->position = httpd_ring_head(ring);
+		return true;
 	}
-}
 
-static GIOStatus
-write_page_to_channel(GIOChannel *channel,
-		      const struct page *page, size_t position,
-		      gsize *bytes_written_r, GError **error)
-{
-	assert(channel != NULL);
-	assert(page != NULL);
-	assert(position < page->size);
-
-	return g_io_channel_write_chars(channel,
-					(const gchar*)page->data + position,
-					page->size - position,
-					bytes_written_r, error);
+	/* the number of stream bytes until the next metadata
+	   block */
+	remaining = client->metadata_position - client->position;
+	if (remaining == 0 || remaining > mount->metaint)
+		return false;
+
+	block = (unsigned)g_atomic_int_get(&mount->icy_block_position);
+	position = block + mount->metaint - remaining;
+	if (httpd_ring_available(ring, block) < position - block)
+		return false;
+
+	client->position = position;
+	client->metadata_position = block + mount->metaint;
+	return true;
 }
 
-static GIOStatus
-write_n_bytes_to_channel(GIOChannel *channel, const struct page *page,
-			 size_t position, gint n,
-			 gsize *bytes_written_r, GError **error)
+/**
+ * Applies the lag policy of the httpd output if this client has
+ * fallen too far behind.
+ *
+ * @return false if the client has been closed
+ */
+static bool
+httpd_client_check_lag(struct httpd_client *client)
 {
-	GIOStatus status;
+	struct httpd_output *httpd = client->httpd;
+	const struct httpd_ring *ring = httpd_client_ring(client);
+	unsigned lag;
 
-	assert(channel != NULL);
-	assert(page != NULL);
-	assert(position < page->size);
+	lag = httpd_ring_valid(ring, client->position)
+		? httpd_ring_available(ring, client->position)
+		: G_MAXUINT;
+	if (lag <= httpd->max_lag)
+		return true;
 
-	if (n == -1) {
-		status =  write_page_to_channel (channel, page, position,
-						 bytes_written_r, error);
-	} else {
-		status = g_io_channel_write_chars(channel,
-						  (const gchar*)page->data + position,
-						  n, bytes_written_r, error);
+	if (httpd->lag_policy == HTTPD_LAG_SKIP) {
+		if (httpd_client_skip(client)) {
+			g_debug("client is too slow, skipping data");
+			return true;
+		}
+
+		if (lag != G_MAXUINT)
+			/* try again later */
+			return true;
 	}
 
-	return status;
+	g_debug("client is too slow, disconnecting");
+	httpd_client_close(client);
+	return false;
+}
+
+void
+httpd_client_cancel(struct httpd_client *client)
+{
+	if (client->state != RESPONSE)
+		return;
+
+	httpd_client_skip(client);
 }
 
-static gint
-bytes_left_till_metadata (struct httpd_client *client)
+bool
+httpd_client_wake(struct httpd_client *client)
 {
-	assert(client != NULL);
+	if (client->state != RESPONSE)
+		/* the client is still writing the HTTP request */
+		return true;
 
-	if (client->metadata_requested &&
-	    client->current_page->size - client->current_position
-	    > client->metaint - client->metadata_fill)
-		return client->metaint - client->metadata_fill;
+	if (!httpd_client_check_lag(client))
+		return false;
+
+	if (httpd_client_has_data(client))
+		httpd_client_schedule_write(client);
 
-	return -1;
+	return true;
 }
 
-static gboolean
-httpd_client_out_event(GIOChannel *source,
-		       G_GNUC_UNUSED GIOCondition condition, gpointer data)
+/**
+ * The kind of data described by one #iovec in
+ * httpd_client_out_event().
+ */
+enum httpd_client_segment {
+	SEGMENT_HEADER,
+	SEGMENT_DATA,
+};
+
+/**
+ * Sends the current metadata to a new ICY client: when it reaches its
+ * first metadata block and that block is empty, the block is skipped
+ * and #first_metadata is sent instead.
+ */
+static void
+httpd_client_inject_metadata(struct httpd_client *client)
 {
-	struct httpd_client *client = data;
-	struct httpd_output *httpd = client->httpd;
-	GError *error = NULL;
-	GIOStatus status;
-	gsize bytes_written;
-	gint bytes_to_write;
+	const struct httpd_ring *ring = httpd_client_ring(client);
+	unsigned char length;
+
+	if (client->first_metadata == NULL ||
+	    client->position != client->metadata_position ||
+	    client->header != NULL ||
+	    !httpd_client_peek_byte(ring, client->position, &length) ||
+	    !httpd_ring_valid(ring, client->position))
+		return;
 
-	g_mutex_lock(httpd->mutex);
+	if (length == 0) {
+		client->header = client->first_metadata;
+		client->header_position = 0;
 
-	assert(condition == G_IO_OUT);
-	assert(client->state == RESPONSE);
+		client->position += 1;
+		client->metadata_position =
+			client->position + client->mount->metaint;
+	} else
+		/* the metadata has changed meanwhile, and the new
+		   block is in the ring buffer already */
+		page_unref(client->first_metadata);
 
-	if (client->write_source_id == 0) {
-		/* another thread has removed the event source while
-		   this thread was waiting for httpd->mutex */
-		g_mutex_unlock(httpd->mutex);
-		return false;
-	}
+	client->first_metadata = NULL;
+}
 
-	if (client->current_page == NULL) {
-		client->current_page = g_queue_pop_head(client->pages);
-		client->current_position = 0;
+/**
+ * Fills the #iovec array with the data which is pending for this
+ * client: the encoder header (or the first metadata block), and the
+ * stream data from the ring buffer.
+ *
+ * @param metadata_positions receives the value of
+ * httpd_client.metadata_position after the respective #iovec has
+ * been sent
+ * @return the number of #iovec structs
+ */
+static unsigned
+httpd_client_fill_iovec(const struct httpd_client *client,
+			struct iovec *iov, enum httpd_client_segment *segments,
+			unsigned *metadata_positions)
+{
+	const struct httpd_ring *ring = httpd_client_ring(client);
+	unsigned n = 0, position = client->position;
+	unsigned available = httpd_ring_available(ring, position);
+	unsigned metadata_position = client->metadata_position;
+
+	if (client->header != NULL) {
+		iov[n].iov_base = client->header->data +
+			client->header_position;
+		iov[n].iov_len = client->header->size -
+			client->header_position;
+		metadata_positions[n] = metadata_position;
+		segments[n++] = SEGMENT_HEADER;
 	}
 
-	bytes_to_write = bytes_left_till_metadata(client);
+	/* reserve space for two ring buffer spans per iteration */
+	while (available > 0 && n + 2 <= HTTPD_CLIENT_MAX_IOV) {
+		unsigned length = available, i;
+
+		if (client->metadata_requested) {
+			if (position == metadata_position) {
+				unsigned char block_length;
+
+				if (client->first_metadata != NULL)
+					/* wait for
+					   httpd_client_inject_metadata() */
+					break;
+
+				/* the metadata block is in the ring
+				   buffer; send it together with the
+				   following stream data */
+				httpd_client_peek_byte(ring, position,
+						       &block_length);
+				metadata_position =
+					httpd_client_next_metadata(client,
+								   position,
+								   block_length);
+			}
 
-	if (bytes_to_write == 0) {
-		gint metadata_to_write;
+			if (length > metadata_position - position)
+				length = metadata_position - position;
+		}
 
-		metadata_to_write = client->metadata_current_position;
+		i = httpd_ring_iovec(ring, position, length, iov + n);
+		while (i-- > 0) {
+			metadata_positions[n] = metadata_position;
+			segments[n++] = SEGMENT_DATA;
+		}
 
-		if (!client->metadata_sent) {
-			status = write_page_to_channel(source,
-						       client->metadata,
-						       metadata_to_write,
-						       &bytes_written, &error);
+		position += length;
+		available -= length;
+	}
 
-			client->metadata_current_position += bytes_written;
+	return n;
+}
 
-			if (client->metadata->size
-			    - client->metadata_current_position == 0) {
-				client->metadata_fill = 0;
-				client->metadata_current_position = 0;
-				client->metadata_sent = true;
+/**
+ * Updates the client's state after data has been sent.
+ *
+ * @param nbytes the number of bytes which were sent from the #iovec
+ * array which was filled by httpd_client_fill_iovec()
+ */
+static void
+httpd_client_consume(struct httpd_client *client,
+		     const struct iovec *iov,
+		     const enum httpd_client_segment *segments,
+		     const unsigned *metadata_positions,
+		     size_t nbytes)
+{
+	for (unsigned i = 0; nbytes > 0; ++i) {
+		size_t length = iov[i].iov_len;
+
+		if (length > nbytes)
+			length = nbytes;
+		nbytes -= length;
+
+		switch (segments[i]) {
+		case SEGMENT_HEADER:
+			client->header_position += length;
+			if (client->header_position == client->header->size) {
+				page_unref(client->header);
+				client->header = NULL;
 			}
-		} else {
-			struct page *empty_meta;
-			guchar empty_data = 0;
 
-			empty_meta = page_new_copy(&empty_data, 1);
+			break;
 
-			status = write_page_to_channel(source,
-						       empty_meta,
-						       metadata_to_write,
-						       &bytes_written, &error);
+		case SEGMENT_DATA:
+			client->position += length;
+			client->metadata_position = metadata_positions[i];
+			break;
+		}
+	}
+}
 
-			client->metadata_current_position += bytes_written;
+/**
+ * Checks whether the ring buffer data starting at the specified
+ * position is still intact, and closes the client if the producer
+ * has overwritten it.
+ *
+ * @return false if the client has been closed
+ */
+static bool
+httpd_client_check_overrun(struct httpd_client *client, unsigned start)
+{
+	if (httpd_ring_valid(httpd_client_ring(client), start))
+		return true;
 
-			if (empty_meta->size
-			    - client->metadata_current_position == 0) {
-				client->metadata_fill = 0;
-				client->metadata_current_position = 0;
-			}
+	g_debug("client is too slow, disconnecting");
+	httpd_client_close(client);
+	return false;
+}
+
+/**
+ * Sends the data described by the #iovec array.  Windows has no
+ * writev(), so the segments are sent one after another there.
+ *
+ * @return the number of bytes which were sent, or -1 on error (with
+ * errno set)
+ */
+static ssize_t
+httpd_client_writev(const struct httpd_client *client,
+		    const struct iovec *iov, unsigned n)
+{
+#ifndef G_OS_WIN32
+	return writev(g_io_channel_unix_get_fd(client->channel), iov, n);
+#else
+	ssize_t total = 0;
+
+	for (unsigned i = 0; i < n; ++i) {
+		int nbytes = send(client->fd, iov[i].iov_base,
+				  (int)iov[i].iov_len, 0);
+		if (nbytes < 0) {
+			if (total > 0)
+				break;
+
+			errno = WSAGetLastError() == WSAEWOULDBLOCK
+				? EAGAIN : EIO;
+			return -1;
 		}
 
-		bytes_written = 0;
-	} else {
-		status = write_n_bytes_to_channel(source, client->current_page,
-						  client->current_position, bytes_to_write,
-						  &bytes_written, &error);
+		total += nbytes;
+		if ((size_t)nbytes < iov[i].iov_len)
+			break;
 	}
 
-	switch (status) {
-	case G_IO_STATUS_NORMAL:
-		client->current_position += bytes_written;
-		assert(client->current_position <= client->current_page->size);
-
-		if (client->metadata_requested)
-			client->metadata_fill += bytes_written;
+	return total;
+#endif
+}
 
-		if (client->current_position >= client->current_page->size) {
-			page_unref(client->current_page);
-			client->current_page = NULL;
+static gboolean
+httpd_client_out_event(G_GNUC_UNUSED GIOChannel *source,
+		       G_GNUC_UNUSED GIOCondition condition, gpointer data)
+{
+	struct httpd_client *client = data;
+	struct iovec iov[HTTPD_CLIENT_MAX_IOV];
+	enum httpd_client_segment segments[HTTPD_CLIENT_MAX_IOV];
+	unsigned metadata_positions[HTTPD_CLIENT_MAX_IOV];
+	unsigned n, start;
+	ssize_t nbytes;
 
-			if (g_queue_is_empty(client->pages)) {
-				/* all pages are sent: remove the
-				   event source */
-				client->write_source_id = 0;
+	g_mutex_lock(client->thread->mutex);
 
-				g_mutex_unlock(httpd->mutex);
-				return false;
-			}
-		}
+	assert(condition == G_IO_OUT);
+	assert(client->state == RESPONSE);
 
-		g_mutex_unlock(httpd->mutex);
-		return true;
+	if (client->write_source_id == 0) {
+		/* another thread has removed the event source while
+		   this thread was waiting for the mutex */
+		g_mutex_unlock(client->thread->mutex);
+		return false;
+	}
 
-	case G_IO_STATUS_AGAIN:
-		g_mutex_unlock(httpd->mutex);
-		return true;
+	if (!httpd_client_check_lag(client)) {
+		g_mutex_unlock(client->thread->mutex);
+		return false;
+	}
 
-	case G_IO_STATUS_EOF:
-		/* client has disconnected */
+	httpd_client_inject_metadata(client);
 
-		httpd_client_close(client);
-		g_mutex_unlock(httpd->mutex);
+	start = client->position;
+	n = httpd_client_fill_iovec(client, iov, segments,
+				    metadata_positions);
+	if (n == 0) {
+		/* the client has caught up: remove the event source
+		   until the httpd output publishes more data */
+		client->write_source_id = 0;
+		g_mutex_unlock(client->thread->mutex);
 		return false;
+	}
 
-	case G_IO_STATUS_ERROR:
-		/* I/O error */
+	/* the producer may have overwritten the data (and the ICY
+	   metadata lengths which were peeked) after the lag check;
+	   don't send anything which is not intact anymore */
+	if (!httpd_client_check_overrun(client, start)) {
+		g_mutex_unlock(client->thread->mutex);
+		return false;
+	}
 
-		g_warning("failed to write to client: %s", error->message);
-		g_error_free(error);
+	nbytes = httpd_client_writev(client, iov, n);
+	if (nbytes < 0) {
+		if (errno == EAGAIN || errno == EINTR) {
+			g_mutex_unlock(client->thread->mutex);
+			return true;
+		}
 
+		g_warning("failed to write to client: %s", g_strerror(errno));
 		httpd_client_close(client);
-		g_mutex_unlock(httpd->mutex);
+		g_mutex_unlock(client->thread->mutex);
 		return false;
 	}
 
-	/* unreachable */
-	httpd_client_close(client);
-	g_mutex_unlock(httpd->mutex);
-	return false;
-}
+	/* check again: if the producer has overwritten the data
+	   while the kernel was copying it, the client has received a
+	   corrupt stream (or torn ICY framing), and cannot continue */
+	if (!httpd_client_check_overrun(client, start)) {
+		g_mutex_unlock(client->thread->mutex);
+		return false;
+	}
 
-void
-httpd_client_send(struct httpd_client *client, struct page *page)
-{
-	if (client->state != RESPONSE)
-		/* the client is still writing the HTTP request */
-		return;
+	httpd_client_consume(client, iov, segments, metadata_positions,
+			     nbytes);
 
-	page_ref(page);
-	g_queue_push_tail(client->pages, page);
+	if (!httpd_client_has_data(client)) {
+		client->write_source_id = 0;
+		g_mutex_unlock(client->thread->mutex);
+		return false;
+	}
 
-	if (client->write_source_id == 0)
-		client->write_source_id =
-			g_io_add_watch(client->channel, G_IO_OUT,
-				       httpd_client_out_event, client);
+	g_mutex_unlock(client->thread->mutex);
+	return true;
 }
 
 void
-httpd_client_send_metadata(struct httpd_client *client, struct page *page)
+httpd_client_send_header(struct httpd_client *client, struct page *page)
 {
-	if (client->metadata) {
-		page_unref(client->metadata);
-		client->metadata = NULL;
-	}
-
-	g_return_if_fail (page);
+	assert(client->state == RESPONSE);
+	assert(client->header == NULL);
 
 	page_ref(page);
-	client->metadata = page;
-	client->metadata_sent = false;
+	client->header = page;
+	client->header_position = 0;
+
+	httpd_client_schedule_write(client);
 }
@@ -25,47 +25,45 @@
 #include <stdbool.h>
 
 struct httpd_client;
-struct httpd_output;
+struct httpd_thread;
 struct page;
 
 /**
  * Creates a new #httpd_client object
  *
- * @param httpd the HTTP output device
+ * @param thread the I/O thread which serves this client
  * @param fd the socket file descriptor
  */
 struct httpd_client *
-httpd_client_new(struct httpd_output *httpd, int fd, bool metadata_supported);
+httpd_client_new(struct httpd_thread *thread, int fd);
 
 /**
  * Frees memory and resources allocated by the #httpd_client object.
- * This does not remove it from the #httpd_output object.
+ * This does not remove it from the #httpd_thread object.
  */
 void
 httpd_client_free(struct httpd_client *client);
 
 /**
- * Returns the total size of this client's page queue.
- */
-size_t
-httpd_client_queue_size(const struct httpd_client *client);
-
-/**
- * Clears the page queue.
+ * Skips all data which is still pending in the ring buffer.
  */
 void
 httpd_client_cancel(struct httpd_client *client);
 
 /**
- * Appends a page to the client's queue.
+ * Notifies the client that new data has been published in the ring
+ * buffer.  This applies the lag policy, and registers the write
+ * event source if necessary.
+ *
+ * @return false if the client has been closed (and freed)
  */
-void
-httpd_client_send(struct httpd_client *client, struct page *page);
+bool
+httpd_client_wake(struct httpd_client *client);
 
 /**
- * Sends the passed metadata.
+ * Sends the encoder header page before the stream data.
  */
 void
-httpd_client_send_metadata(struct httpd_client *client, struct page *page);
+httpd_client_send_header(struct httpd_client *client, struct page *page);
 
 #endif
@@ -26,6 +26,7 @@
 #define MPD_OUTPUT_HTTPD_INTERNAL_H
 
 #include "timer.h"
+#include "httpd_thread.h"
 
 #include <glib.h>
 
@@ -38,6 +39,24 @@
 #include <stdbool.h>
 
 struct httpd_client;
+struct httpd_mount;
+
+/**
+ * What happens to a client which has fallen behind by more than
+ * httpd_output.max_lag bytes?
+ */
+enum httpd_lag_policy {
+	/**
+	 * Skip the pending data, and continue with the most recent
+	 * data.
+	 */
+	HTTPD_LAG_SKIP,
+
+	/**
+	 * Disconnect the client.
+	 */
+	HTTPD_LAG_DISCONNECT,
+};
 
 struct httpd_output {
 	/**
@@ -47,14 +66,16 @@ struct httpd_output {
 	bool open;
 
 	/**
-	 * The configured encoder plugin.
+	 * The mount points, each with its own encoder.  The first
+	 * one is the default mount, configured in the main block of
+	 * the audio output.
 	 */
-	struct encoder *encoder;
+	struct httpd_mount **mounts;
 
 	/**
-	 * The MIME type produced by the #encoder.
+	 * The number of elements in #mounts.
 	 */
-	const char *content_type;
+	unsigned num_mounts;
 
 	/**
 	 * The configured address of the listener socket.
@@ -67,8 +88,10 @@ struct httpd_output {
 	socklen_t address_size;
 
 	/**
-	 * This mutex protects the listener socket and the client
-	 * list.
+	 * This mutex protects the listener socket, #open and the
+	 * list of threads.  When it is held
+	 * together with a httpd_thread.mutex, it must be locked
+	 * first.
 	 */
 	GMutex *mutex;
 
@@ -89,47 +112,51 @@ struct httpd_output {
 	guint source_id;
 
 	/**
-	 * The header page, which is sent to every client on connect.
+	 * The I/O threads which serve the clients.  They exist only
+	 * while the output is open.
 	 */
-	struct page *header;
+	struct httpd_thread *threads;
 
 	/**
-	 * The metadata, which is sent to every client.
+	 * The configured number of I/O threads.
 	 */
-	struct page *metadata;
+	unsigned num_threads;
 
 	/**
-	 * A linked list containing all clients which are currently
-	 * connected.
+	 * The maximum number of bytes a client may fall behind the
+	 * head of httpd_mount.ring.
 	 */
-	GList *clients;
+	unsigned max_lag;
 
 	/**
-	 * A temporary buffer for the httpd_output_read_page()
-	 * function.
+	 * What happens to clients which exceed #max_lag?
 	 */
-	char buffer[32768];
+	enum httpd_lag_policy lag_policy;
 
 	/**
-	 * The maximum and current number of clients connected 
-	 * at the same time.
+	 * The configured duration of encoded data which is sent to a
+	 * new client right after it has connected [s].  0 disables
+	 * this "burst on connect".
 	 */
-	guint clients_max, clients_cnt;
-};
+	unsigned burst;
 
-/**
- * Removes a client from the httpd_output.clients linked list.
- */
-void
-httpd_output_remove_client(struct httpd_output *httpd,
-			   struct httpd_client *client);
+	/**
+	 * The maximum number of clients connected at the same time.
+	 */
+	guint clients_max;
+
+	/**
+	 * The current number of clients of all threads.  Modified
+	 * with atomic operations.
+	 */
+	volatile gint clients_cnt;
+};
 
 /**
- * Sends the encoder header to the client.  This is called right after
- * the response headers have been sent.
+ * Looks up the mount point for the specified request path.  Returns
+ * the default mount if no mount was configured with this path.
  */
-void
-httpd_output_send_header(struct httpd_output *httpd,
-			 struct httpd_client *client);
+struct httpd_mount *
+httpd_output_find_mount(struct httpd_output *httpd, const char *path);
 
 #endif
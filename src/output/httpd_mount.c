@@ -0,0 +1,575 @@
+/*
+ * Copyright (C) 2003-2010 The Music Player Daemon Project
+ * http://www.musicpd.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#include "config.h"
+#include "httpd_mount.h"
+#include "httpd_internal.h"
+#include "httpd_thread.h"
+#include "encoder_thread.h"
+#include "encoder_plugin.h"
+#include "encoder_list.h"
+#include "audio_format.h"
+#include "conf.h"
+#include "page.h"
+#include "icy_server.h"
+#include "tag.h"
+
+#include <assert.h>
+
+#undef G_LOG_DOMAIN
+#define G_LOG_DOMAIN "httpd_output"
+
+enum {
+	/**
+	 * The size of the ring buffer which holds the encoded
+	 * stream.
+	 */
+	HTTPD_RING_SIZE = 1024 * 1024,
+
+	/**
+	 * The capacity of httpd_sync_list.points.
+	 */
+	HTTPD_MAX_SYNC_POINTS = 1024,
+
+	/**
+	 * The number of stream bytes between two ICY metadata
+	 * blocks.
+	 */
+	HTTPD_ICY_METAINT = 8192,
+
+	/**
+	 * The maximum amount of PCM data queued for the encoder.
+	 * httpd_mount_play() blocks while it is exceeded.
+	 */
+	HTTPD_MOUNT_QUEUE_SIZE = 256 * 1024,
+};
+
+static inline GQuark
+httpd_mount_quark(void)
+{
+	return g_quark_from_static_string("httpd_output");
+}
+
+static void
+httpd_sync_list_init(struct httpd_sync_list *list, bool enabled)
+{
+	list->points = enabled
+		? g_new(struct httpd_sync_point, HTTPD_MAX_SYNC_POINTS)
+		: NULL;
+	list->start = 0;
+	list->count = 0;
+}
+
+/**
+ * Remembers a position where new clients may start.
+ */
+static void
+httpd_sync_list_add(struct httpd_sync_list *list,
+		    unsigned position, double time)
+{
+	struct httpd_sync_point *sp;
+
+	if (list->points == NULL)
+		return;
+
+	if (list->count == HTTPD_MAX_SYNC_POINTS) {
+		/* full: drop the oldest one */
+		list->start = (list->start + 1) % HTTPD_MAX_SYNC_POINTS;
+		--list->count;
+	}
+
+	sp = &list->points[(list->start + list->count) %
+			   HTTPD_MAX_SYNC_POINTS];
+	sp->position = position;
+	sp->time = time;
+	++list->count;
+}
+
+/**
+ * Removes sync points which are too old for a burst, and returns the
+ * oldest remaining one.
+ *
+ * @param head the current head of the ring buffer
+ * @param fallback the position to be returned if there is no
+ * suitable sync point
+ */
+static unsigned
+httpd_sync_list_update(struct httpd_sync_list *list,
+		       const struct httpd_output *httpd, double time,
+		       unsigned head, unsigned fallback)
+{
+	while (list->count > 0) {
+		const struct httpd_sync_point *sp =
+			&list->points[list->start];
+
+		/* don't send more than half of the allowed lag, or
+		   the new client would be "too slow" right away */
+		if (sp->time + httpd->burst >= time &&
+		    head - sp->position <= httpd->max_lag / 2)
+			return sp->position;
+
+		list->start = (list->start + 1) % HTTPD_MAX_SYNC_POINTS;
+		--list->count;
+	}
+
+	return fallback;
+}
+
+struct httpd_mount *
+httpd_mount_new(struct httpd_output *httpd, const char *path,
+		const struct config_param *param, GError **error_r)
+{
+	struct httpd_mount *mount;
+	const char *encoder_name;
+	const struct encoder_plugin *encoder_plugin;
+
+	encoder_name = config_get_block_string(param, "encoder", "vorbis");
+	encoder_plugin = encoder_plugin_get(encoder_name);
+	if (encoder_plugin == NULL) {
+		g_set_error(error_r, httpd_mount_quark(), 0,
+			    "No such encoder: %s", encoder_name);
+		return NULL;
+	}
+
+	mount = g_new(struct httpd_mount, 1);
+	mount->httpd = httpd;
+
+	mount->encoder = encoder_init(encoder_plugin, param, error_r);
+	if (mount->encoder == NULL) {
+		g_free(mount);
+		return NULL;
+	}
+
+	mount->path = g_strdup(path);
+
+	/* determine content type */
+	mount->content_type = encoder_get_mime_type(mount->encoder);
+	if (mount->content_type == NULL)
+		mount->content_type = "application/octet-stream";
+
+	mount->metadata_supported = encoder_plugin->tag == NULL;
+
+	mount->mutex = g_mutex_new();
+	mount->header = NULL;
+
+	httpd_ring_init(&mount->ring, HTTPD_RING_SIZE);
+	httpd_sync_list_init(&mount->sync, httpd->burst > 0);
+
+	mount->metaint = HTTPD_ICY_METAINT;
+	mount->icy_pending = NULL;
+	mount->icy_metadata = NULL;
+
+	if (mount->metadata_supported) {
+		/* room for the same amount of stream data, plus the
+		   metadata blocks */
+		httpd_ring_init(&mount->icy_ring, HTTPD_RING_SIZE * 2);
+		httpd_sync_list_init(&mount->icy_sync, httpd->burst > 0);
+	}
+
+	return mount;
+}
+
+void
+httpd_mount_free(struct httpd_mount *mount)
+{
+	encoder_finish(mount->encoder);
+	g_free(mount->path);
+	g_mutex_free(mount->mutex);
+	httpd_ring_deinit(&mount->ring);
+	g_free(mount->sync.points);
+
+	if (mount->metadata_supported) {
+		httpd_ring_deinit(&mount->icy_ring);
+		g_free(mount->icy_sync.points);
+	}
+
+	if (mount->icy_pending != NULL)
+		page_unref(mount->icy_pending);
+	if (mount->icy_metadata != NULL)
+		page_unref(mount->icy_metadata);
+
+	g_free(mount);
+}
+
+/**
+ * Reads data from the encoder (as much as available) and returns it
+ * as a new #page object.
+ */
+static struct page *
+httpd_mount_read_page(struct httpd_mount *mount)
+{
+	size_t size = 0, nbytes;
+
+	do {
+		nbytes = encoder_read(mount->encoder, mount->buffer + size,
+				      sizeof(mount->buffer) - size);
+		if (nbytes == 0)
+			break;
+
+		size += nbytes;
+	} while (size < sizeof(mount->buffer));
+
+	if (size == 0)
+		return NULL;
+
+	return page_new_copy(mount->buffer, size);
+}
+
+bool
+httpd_mount_open(struct httpd_mount *mount, struct audio_format *audio_format,
+		 GError **error_r)
+{
+	if (!encoder_open(mount->encoder, audio_format, error_r))
+		return false;
+
+	/* we have to remember the encoder header, i.e. the first
+	   bytes of encoder output after opening it, because it has to
+	   be sent to every new client */
+	mount->header = httpd_mount_read_page(mount);
+	return true;
+}
+
+void
+httpd_mount_close(struct httpd_mount *mount)
+{
+	if (mount->header != NULL) {
+		page_unref(mount->header);
+		mount->header = NULL;
+	}
+
+	encoder_close(mount->encoder);
+}
+
+/**
+ * Appends stream data to #icy_ring, and inserts a metadata block
+ * after each #metaint bytes.
+ */
+static void
+httpd_mount_icy_write(struct httpd_mount *mount,
+		      const void *data, size_t size)
+{
+	static const unsigned char empty_metadata = 0;
+	const unsigned char *p = data;
+
+	while (size > 0) {
+		size_t length = mount->metaint - mount->icy_fill;
+		unsigned position;
+
+		if (length > size)
+			length = size;
+
+		httpd_ring_write(&mount->icy_ring, p, length);
+		mount->icy_fill += length;
+		p += length;
+		size -= length;
+
+		if (mount->icy_fill < mount->metaint)
+			break;
+
+		/* end of the block: the metadata block follows, or
+		   an empty one if the metadata has not changed */
+
+		if (mount->icy_pending != NULL) {
+			httpd_ring_write(&mount->icy_ring,
+					 mount->icy_pending->data,
+					 mount->icy_pending->size);
+			page_unref(mount->icy_pending);
+			mount->icy_pending = NULL;
+		} else
+			httpd_ring_write(&mount->icy_ring,
+					 &empty_metadata, 1);
+
+		mount->icy_fill = 0;
+
+		position = httpd_ring_head(&mount->icy_ring);
+		g_atomic_int_set(&mount->icy_block_position, (gint)position);
+		httpd_sync_list_add(&mount->icy_sync, position, mount->time);
+	}
+}
+
+/**
+ * Publishes data in the ring buffer(s), and wakes up the clients.
+ */
+static void
+httpd_mount_broadcast(struct httpd_mount *mount,
+		      const void *data, size_t size)
+{
+	struct httpd_output *httpd = mount->httpd;
+
+	httpd_ring_write(&mount->ring, data, size);
+	if (mount->metadata_supported)
+		httpd_mount_icy_write(mount, data, size);
+
+	for (unsigned i = 0; i < httpd->num_threads; ++i)
+		httpd_thread_wake(&httpd->threads[i]);
+}
+
+/**
+ * Removes sync points which are too old for a burst, and publishes
+ * the oldest remaining one to the clients.  Without burst-on-connect,
+ * new clients start at the head of the ring buffer (or at the
+ * beginning of the current ICY block).
+ */
+static void
+httpd_mount_update_burst(struct httpd_mount *mount)
+{
+	const struct httpd_output *httpd = mount->httpd;
+	unsigned head = httpd_ring_head(&mount->ring), position;
+
+	position = httpd_sync_list_update(&mount->sync, httpd, mount->time,
+					  head, head);
+	g_atomic_int_set(&mount->burst_position, (gint)position);
+
+	if (mount->metadata_supported) {
+		unsigned block = (unsigned)
+			g_atomic_int_get(&mount->icy_block_position);
+
+		position = httpd_sync_list_update(&mount->icy_sync, httpd,
+						  mount->time,
+						  httpd_ring_head(&mount->icy_ring),
+						  block);
+		g_atomic_int_set(&mount->icy_burst_position, (gint)position);
+	}
+}
+
+/**
+ * Forgets all sync points, e.g. because the encoder has started a new
+ * stream.  New clients will start at the current head.
+ */
+static void
+httpd_mount_clear_burst(struct httpd_mount *mount)
+{
+	mount->sync.count = 0;
+	if (mount->metadata_supported)
+		mount->icy_sync.count = 0;
+
+	httpd_mount_update_burst(mount);
+}
+
+/**
+ * Broadcasts data from the encoder to all clients.
+ */
+static void
+httpd_mount_encoder_to_clients(struct httpd_mount *mount)
+{
+	unsigned start = httpd_ring_head(&mount->ring);
+	size_t nbytes;
+	bool published = false;
+
+	while ((nbytes = encoder_read(mount->encoder, mount->buffer,
+				      sizeof(mount->buffer))) > 0) {
+		httpd_mount_broadcast(mount, mount->buffer, nbytes);
+		published = true;
+	}
+
+	if (published) {
+		/* the encoder has been drained completely before, so
+		   this batch begins at a frame (or Ogg page)
+		   boundary */
+		httpd_sync_list_add(&mount->sync, start, mount->time);
+		httpd_mount_update_burst(mount);
+	}
+}
+
+/**
+ * Converts a tag to an ICY metadata block, which is inserted into
+ * #icy_ring at the end of the current block.
+ */
+static void
+httpd_mount_icy_tag(struct httpd_mount *mount, const struct tag *tag)
+{
+	struct page *page =
+		icy_server_metadata_page(tag, TAG_ALBUM,
+					 TAG_ARTIST, TAG_TITLE,
+					 TAG_NUM_OF_ITEM_TYPES);
+	if (page == NULL)
+		return;
+
+	if (mount->icy_pending != NULL)
+		page_unref(mount->icy_pending);
+	page_ref(page);
+	mount->icy_pending = page;
+
+	g_mutex_lock(mount->mutex);
+	if (mount->icy_metadata != NULL)
+		page_unref(mount->icy_metadata);
+	mount->icy_metadata = page;
+	g_mutex_unlock(mount->mutex);
+}
+
+/**
+ * Passes a tag to the encoder, which starts a new stream with a new
+ * header.  If the encoder doesn't support tags, ICY metadata is used
+ * instead.
+ */
+static bool
+httpd_mount_encode_tag(void *ctx, const struct tag *tag, GError **error_r)
+{
+	struct httpd_mount *mount = ctx;
+	struct page *page;
+
+	if (mount->metadata_supported) {
+		httpd_mount_icy_tag(mount, tag);
+		return true;
+	}
+
+	/* flush the current stream, and end it */
+
+	if (!encoder_flush(mount->encoder, error_r))
+		return false;
+
+	httpd_mount_encoder_to_clients(mount);
+
+	/* send the tag to the encoder - which starts a new stream
+	   now */
+
+	if (!encoder_tag(mount->encoder, tag, error_r))
+		return false;
+
+	/* the first page generated by the encoder will now be used as
+	   the new "header" page, which is sent to all new clients */
+
+	page = httpd_mount_read_page(mount);
+	if (page != NULL) {
+		g_mutex_lock(mount->mutex);
+		if (mount->header != NULL)
+			page_unref(mount->header);
+		mount->header = page;
+		g_mutex_unlock(mount->mutex);
+
+		httpd_mount_broadcast(mount, page->data, page->size);
+
+		/* new clients must not get data of the old stream
+		   after the new header */
+		httpd_mount_clear_burst(mount);
+	}
+
+	return true;
+}
+
+static bool
+httpd_mount_encoded(void *ctx, size_t length, G_GNUC_UNUSED GError **error_r)
+{
+	struct httpd_mount *mount = ctx;
+
+	httpd_mount_encoder_to_clients(mount);
+
+	mount->time += length / mount->time_to_size;
+	return true;
+}
+
+static void
+httpd_mount_cancelled(void *ctx)
+{
+	struct httpd_mount *mount = ctx;
+
+	/* don't send the cancelled data to new clients */
+	httpd_mount_clear_burst(mount);
+}
+
+static const struct encoder_thread_handler httpd_mount_handler = {
+	.encoded = httpd_mount_encoded,
+	.tag = httpd_mount_encode_tag,
+	.cancel = httpd_mount_cancelled,
+};
+
+bool
+httpd_mount_start(struct httpd_mount *mount,
+		  const struct audio_format *audio_format, GError **error_r)
+{
+	mount->time_to_size = audio_format_time_to_size(audio_format);
+	mount->time = 0;
+	mount->sync.start = 0;
+	mount->sync.count = 0;
+	mount->burst_position = (gint)httpd_ring_head(&mount->ring);
+
+	if (mount->metadata_supported) {
+		if (mount->icy_pending != NULL) {
+			page_unref(mount->icy_pending);
+			mount->icy_pending = NULL;
+		}
+
+		mount->icy_fill = 0;
+		mount->icy_sync.start = 0;
+		mount->icy_sync.count = 0;
+		mount->icy_block_position = mount->icy_burst_position =
+			(gint)httpd_ring_head(&mount->icy_ring);
+	}
+
+	mount->thread = encoder_thread_new(mount->encoder, audio_format,
+					   HTTPD_MOUNT_QUEUE_SIZE,
+					   &httpd_mount_handler, mount,
+					   error_r);
+	return mount->thread != NULL;
+}
+
+void
+httpd_mount_stop(struct httpd_mount *mount)
+{
+	encoder_thread_free(mount->thread);
+	mount->thread = NULL;
+}
+
+bool
+httpd_mount_play(struct httpd_mount *mount, struct page *pcm,
+		 GError **error_r)
+{
+	return encoder_thread_write_page(mount->thread, pcm, error_r);
+}
+
+void
+httpd_mount_tag(struct httpd_mount *mount, const struct tag *tag)
+{
+	encoder_thread_tag(mount->thread, tag);
+}
+
+void
+httpd_mount_cancel(struct httpd_mount *mount)
+{
+	encoder_thread_cancel(mount->thread);
+}
+
+struct page *
+httpd_mount_get_header(struct httpd_mount *mount)
+{
+	struct page *header;
+
+	g_mutex_lock(mount->mutex);
+	header = mount->header;
+	if (header != NULL)
+		page_ref(header);
+	g_mutex_unlock(mount->mutex);
+
+	return header;
+}
+
+struct page *
+httpd_mount_get_icy_metadata(struct httpd_mount *mount)
+{
+	struct page *metadata;
+
+	g_mutex_lock(mount->mutex);
+	metadata = mount->icy_metadata;
+	if (metadata != NULL)
+		page_ref(metadata);
+	g_mutex_unlock(mount->mutex);
+
+	return metadata;
+}
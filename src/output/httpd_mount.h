@@ -0,0 +1,281 @@
+/*
+ * Copyright (C) 2003-2010 The Music Player Daemon Project
+ * http://www.musicpd.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+/** \file
+ *
+ * A mount point of the "httpd" audio output plugin.  Each mount point
+ * has its own encoder, which runs in an #encoder_thread, and its own
+ * ring buffer.  All mount points are fed with the same PCM data.
+ *
+ * If the encoder does not support tags, the mount point maintains a
+ * second ring buffer with the same stream, interleaved with ICY
+ * metadata blocks.  Clients which have requested ICY metadata read
+ * from that one, without any per-client metadata bookkeeping.
+ */
+
+#ifndef MPD_OUTPUT_HTTPD_MOUNT_H
+#define MPD_OUTPUT_HTTPD_MOUNT_H
+
+#include "httpd_ring.h"
+
+#include <glib.h>
+
+#include <stdbool.h>
+
+struct httpd_output;
+struct config_param;
+struct audio_format;
+struct page;
+struct tag;
+
+/**
+ * A position in a ring buffer where a new client may start receiving
+ * the stream, i.e. a codec frame or Ogg page boundary, or the
+ * beginning of an ICY data block.
+ */
+struct httpd_sync_point {
+	unsigned position;
+
+	/**
+	 * The stream time at this position [s].
+	 */
+	double time;
+};
+
+/**
+ * A circular array of recent sync points, oldest first.  Only the
+ * worker thread accesses it.
+ */
+struct httpd_sync_list {
+	/**
+	 * NULL if burst-on-connect is disabled.
+	 */
+	struct httpd_sync_point *points;
+
+	/**
+	 * The index of the oldest element of #points, and the number
+	 * of elements.
+	 */
+	unsigned start, count;
+};
+
+struct httpd_mount {
+	struct httpd_output *httpd;
+
+	/**
+	 * The request path of this mount point, e.g. "/128.mp3".
+	 * NULL for the default mount point, which serves all
+	 * requests that don't match any other mount point.
+	 */
+	char *path;
+
+	/**
+	 * The configured encoder plugin.
+	 */
+	struct encoder *encoder;
+
+	/**
+	 * The MIME type produced by the #encoder.
+	 */
+	const char *content_type;
+
+	/**
+	 * Do we support sending Icy-Metadata to clients?  This is
+	 * disabled if the encoder supports tags.
+	 */
+	bool metadata_supported;
+
+	/**
+	 * This mutex protects #header.  It is never held while
+	 * locking another mutex.
+	 */
+	GMutex *mutex;
+
+	/**
+	 * The worker thread which runs the encoder.  It exists only
+	 * while the mount point is started.
+	 */
+	struct encoder_thread *thread;
+
+	/**
+	 * The header page, which is sent to every client on connect.
+	 */
+	struct page *header;
+
+	/**
+	 * The encoded stream, shared by all clients of this mount
+	 * point.  Each client has its own read position.
+	 */
+	struct httpd_ring ring;
+
+	/**
+	 * The position in #ring where new clients start (see
+	 * httpd_output.burst).  Written by the worker thread with
+	 * atomic operations.
+	 */
+	volatile gint burst_position;
+
+	/**
+	 * The stream interleaved with ICY metadata blocks.  Only
+	 * initialized if #metadata_supported is true.
+	 */
+	struct httpd_ring icy_ring;
+
+	/**
+	 * The number of stream bytes between two metadata blocks in
+	 * #icy_ring.
+	 */
+	unsigned metaint;
+
+	/**
+	 * The number of stream bytes in the current (incomplete)
+	 * block of #icy_ring.  Only the worker thread accesses it.
+	 */
+	unsigned icy_fill;
+
+	/**
+	 * The metadata block which will be written to #icy_ring at
+	 * the end of the current block, or NULL if the metadata has
+	 * not changed.  Only the worker thread accesses it.
+	 */
+	struct page *icy_pending;
+
+	/**
+	 * The most recent metadata block, sent to new clients.
+	 * Protected by #mutex.
+	 */
+	struct page *icy_metadata;
+
+	/**
+	 * The position in #icy_ring where the most recent block
+	 * begins.  Written by the worker thread with atomic
+	 * operations.
+	 */
+	volatile gint icy_block_position;
+
+	/**
+	 * Like #burst_position, but in #icy_ring.
+	 */
+	volatile gint icy_burst_position;
+
+	/**
+	 * The number of PCM bytes per second passed to the encoder.
+	 */
+	double time_to_size;
+
+	/**
+	 * The duration of the audio passed to the encoder since the
+	 * mount point was started [s].
+	 */
+	double time;
+
+	/**
+	 * Recent sync points in #ring and in #icy_ring.
+	 */
+	struct httpd_sync_list sync, icy_sync;
+
+	/**
+	 * A temporary buffer for reading from the encoder.
+	 */
+	char buffer[32768];
+};
+
+/**
+ * Creates a new mount point, and initializes its encoder.
+ *
+ * @param path the request path, or NULL for the default mount point
+ * @param param the configuration of the encoder
+ */
+struct httpd_mount *
+httpd_mount_new(struct httpd_output *httpd, const char *path,
+		const struct config_param *param, GError **error_r);
+
+void
+httpd_mount_free(struct httpd_mount *mount);
+
+/**
+ * Opens the encoder, and reads its header.
+ *
+ * @param audio_format the input audio format; the encoder may modify
+ * it
+ */
+bool
+httpd_mount_open(struct httpd_mount *mount, struct audio_format *audio_format,
+		 GError **error_r);
+
+/**
+ * Closes the encoder.  The worker thread must not be running.
+ */
+void
+httpd_mount_close(struct httpd_mount *mount);
+
+/**
+ * Starts the worker thread.  The mount point must be open, and the
+ * I/O threads of the httpd output must be running.
+ */
+bool
+httpd_mount_start(struct httpd_mount *mount,
+		  const struct audio_format *audio_format, GError **error_r);
+
+/**
+ * Stops the worker thread, and discards all queued data.
+ */
+void
+httpd_mount_stop(struct httpd_mount *mount);
+
+/**
+ * Queues a PCM chunk for the encoder.  Blocks while the queue is
+ * full.
+ *
+ * @param pcm the PCM data; the mount point adds its own reference
+ * @return false if the encoder has failed
+ */
+bool
+httpd_mount_play(struct httpd_mount *mount, struct page *pcm,
+		 GError **error_r);
+
+/**
+ * Queues a tag.  It is passed to the encoder if it supports tags;
+ * otherwise, it is converted to an ICY metadata block.
+ */
+void
+httpd_mount_tag(struct httpd_mount *mount, const struct tag *tag);
+
+/**
+ * Discards all queued data, and the burst data.
+ */
+void
+httpd_mount_cancel(struct httpd_mount *mount);
+
+/**
+ * Returns a new reference to the current header page, or NULL if
+ * there is none.  Locks the mutex.
+ */
+struct page *
+httpd_mount_get_header(struct httpd_mount *mount);
+
+/**
+ * Returns a new reference to the most recent ICY metadata block, or
+ * NULL if there is none.  Locks the mutex.
+ */
+struct page *
+httpd_mount_get_icy_metadata(struct httpd_mount *mount);
+
+#endif
@@ -20,12 +20,12 @@
 #include "config.h"
 #include "httpd_internal.h"
 #include "httpd_client.h"
+#include "httpd_mount.h"
 #include "output_api.h"
-#include "encoder_plugin.h"
-#include "encoder_list.h"
+#include "audio_format.h"
+#include "conf.h"
 #include "socket_util.h"
 #include "page.h"
-#include "icy_server.h"
 #include "fd_util.h"
 
 #include <assert.h>
@@ -40,10 +40,26 @@
 #endif
 #include <unistd.h>
 #include <errno.h>
+#include <string.h>
 
 #undef G_LOG_DOMAIN
 #define G_LOG_DOMAIN "httpd_output"
 
+enum {
+	/**
+	 * The maximum number of bytes a client may fall behind.
+	 * This must be well below the size of httpd_mount.ring, so
+	 * clients which are being served don't get overwritten.
+	 */
+	HTTPD_MAX_LAG = 256 * 1024,
+
+	/**
+	 * How often does httpd_output_open() reopen the encoders if
+	 * one of them modifies the audio format?
+	 */
+	HTTPD_FORMAT_ATTEMPTS = 3,
+};
+
 /**
  * The quark used for GError.domain.
  */
@@ -99,30 +115,148 @@ httpd_output_unbind(struct httpd_output *httpd)
 	g_mutex_unlock(httpd->mutex);
 }
 
+static void
+httpd_output_add_mount(struct httpd_output *httpd, struct httpd_mount *mount)
+{
+	httpd->mounts = g_renew(struct httpd_mount *, httpd->mounts,
+				httpd->num_mounts + 1);
+	httpd->mounts[httpd->num_mounts++] = mount;
+}
+
+static void
+httpd_output_free_mounts(struct httpd_output *httpd)
+{
+	for (unsigned i = 0; i < httpd->num_mounts; ++i)
+		httpd_mount_free(httpd->mounts[i]);
+	g_free(httpd->mounts);
+}
+
+/**
+ * Parses one mount point definition of the form "PATH NAME=VALUE
+ * ...", where the NAME=VALUE pairs configure the encoder, and adds
+ * the mount point to the httpd output.
+ */
+static bool
+httpd_output_parse_mount(struct httpd_output *httpd, const char *spec,
+			 int line, GError **error_r)
+{
+	char **words = g_strsplit_set(spec, " \t", 0);
+	struct config_param *param;
+	struct httpd_mount *mount;
+	const char *path = NULL;
+
+	param = config_new_param(NULL, line);
+
+	for (char **p = words; *p != NULL; ++p) {
+		char *word = *p, *eq;
+
+		if (*word == 0)
+			continue;
+
+		if (path == NULL) {
+			if (*word != '/') {
+				g_set_error(error_r, httpd_output_quark(), 0,
+					    "Malformed mount path: %s", word);
+				break;
+			}
+
+			path = word;
+			continue;
+		}
+
+		eq = strchr(word, '=');
+		if (eq == NULL) {
+			g_set_error(error_r, httpd_output_quark(), 0,
+				    "Malformed mount option: %s", word);
+			path = NULL;
+			break;
+		}
+
+		*eq = 0;
+		if (!config_add_block_param(param, word, eq + 1, line,
+					    error_r)) {
+			path = NULL;
+			break;
+		}
+	}
+
+	mount = path != NULL
+		? httpd_mount_new(httpd, path, param, error_r)
+		: NULL;
+
+	config_param_free(param);
+	g_strfreev(words);
+
+	if (mount == NULL)
+		return false;
+
+	httpd_output_add_mount(httpd, mount);
+	return true;
+}
+
+/**
+ * Parses the "mount" setting: a list of mount point definitions,
+ * separated by semicolons.
+ */
+static bool
+httpd_output_parse_mounts(struct httpd_output *httpd, const char *value,
+			  int line, GError **error_r)
+{
+	char **specs = g_strsplit(value, ";", 0);
+	bool success = true;
+
+	for (char **p = specs; *p != NULL && success; ++p) {
+		g_strstrip(*p);
+		if (**p != 0)
+			success = httpd_output_parse_mount(httpd, *p, line,
+							   error_r);
+	}
+
+	g_strfreev(specs);
+	return success;
+}
+
 static void *
 httpd_output_init(G_GNUC_UNUSED const struct audio_format *audio_format,
 		  const struct config_param *param,
 		  GError **error)
 {
 	struct httpd_output *httpd = g_new(struct httpd_output, 1);
-	const char *encoder_name;
-	const struct encoder_plugin *encoder_plugin;
+	const char *lag_policy, *mounts;
+	struct httpd_mount *mount;
 	guint port;
 	struct sockaddr_in *sin;
 
+	httpd->mounts = NULL;
+	httpd->num_mounts = 0;
+
 	/* read configuration */
 
 	port = config_get_block_unsigned(param, "port", 8000);
 
-	encoder_name = config_get_block_string(param, "encoder", "vorbis");
-	encoder_plugin = encoder_plugin_get(encoder_name);
-	if (encoder_plugin == NULL) {
+	httpd->clients_max = config_get_block_unsigned(param,"max_clients", 0);
+
+	lag_policy = config_get_block_string(param, "lag_policy", "skip");
+	if (strcmp(lag_policy, "skip") == 0)
+		httpd->lag_policy = HTTPD_LAG_SKIP;
+	else if (strcmp(lag_policy, "disconnect") == 0)
+		httpd->lag_policy = HTTPD_LAG_DISCONNECT;
+	else {
 		g_set_error(error, httpd_output_quark(), 0,
-			    "No such encoder: %s", encoder_name);
-		return NULL;
+			    "No such lag policy: %s", lag_policy);
+		goto error;
 	}
 
-	httpd->clients_max = config_get_block_unsigned(param,"max_clients", 0);
+	httpd->max_lag = HTTPD_MAX_LAG;
+
+	httpd->burst = config_get_block_unsigned(param, "burst", 0);
+
+	httpd->num_threads = config_get_block_unsigned(param, "threads", 1);
+	if (httpd->num_threads == 0) {
+		g_set_error(error, httpd_output_quark(), 0,
+			    "Invalid number of threads");
+		goto error;
+	}
 
 	/* initialize listen address */
 
@@ -133,24 +267,30 @@ httpd_output_init(G_GNUC_UNUSED const struct audio_format *audio_format,
 	sin->sin_addr.s_addr = INADDR_ANY;
 	httpd->address_size = sizeof(*sin);
 
-	/* initialize metadata */
-	httpd->metadata = NULL;
+	/* initialize the default mount point, which uses the
+	   encoder settings of the main block */
 
-	/* initialize encoder */
+	mount = httpd_mount_new(httpd, NULL, param, error);
+	if (mount == NULL)
+		goto error;
 
-	httpd->encoder = encoder_init(encoder_plugin, param, error);
-	if (httpd->encoder == NULL)
-		return NULL;
+	httpd_output_add_mount(httpd, mount);
 
-	/* determine content type */
-	httpd->content_type = encoder_get_mime_type(httpd->encoder);
-	if (httpd->content_type == NULL) {
-		httpd->content_type = "application/octet-stream";
-	}
+	/* additional mount points */
+
+	mounts = config_get_block_string(param, "mount", NULL);
+	if (mounts != NULL &&
+	    !httpd_output_parse_mounts(httpd, mounts, param->line, error))
+		goto error;
 
 	httpd->mutex = g_mutex_new();
 
 	return httpd;
+
+error:
+	httpd_output_free_mounts(httpd);
+	g_free(httpd);
+	return NULL;
 }
 
 static void
@@ -158,31 +298,86 @@ httpd_output_finish(void *data)
 {
 	struct httpd_output *httpd = data;
 
-	if (httpd->metadata)
-		page_unref(httpd->metadata);
-
-	encoder_finish(httpd->encoder);
+	httpd_output_free_mounts(httpd);
 	g_mutex_free(httpd->mutex);
 	g_free(httpd);
 }
 
 /**
- * Creates a new #httpd_client object and adds it into the
- * httpd_output.clients linked list.
+ * Returns the I/O thread which serves the least number of clients.
+ * The caller must hold httpd->mutex.
+ */
+static struct httpd_thread *
+httpd_output_pick_thread(struct httpd_output *httpd)
+{
+	struct httpd_thread *best = NULL;
+	unsigned best_clients = 0;
+
+	for (unsigned i = 0; i < httpd->num_threads; ++i) {
+		struct httpd_thread *thread = &httpd->threads[i];
+		unsigned num_clients;
+
+		g_mutex_lock(thread->mutex);
+		num_clients = thread->num_clients;
+		g_mutex_unlock(thread->mutex);
+
+		if (best == NULL || num_clients < best_clients) {
+			best = thread;
+			best_clients = num_clients;
+		}
+	}
+
+	return best;
+}
+
+/**
+ * Creates a new #httpd_client object and adds it to one of the I/O
+ * threads.  The caller must hold httpd->mutex.
  */
 static void
 httpd_client_add(struct httpd_output *httpd, int fd)
 {
-	struct httpd_client *client =
-		httpd_client_new(httpd, fd,
-				 httpd->encoder->plugin->tag == NULL);
+	struct httpd_thread *thread = httpd_output_pick_thread(httpd);
+
+	g_mutex_lock(thread->mutex);
+	httpd_thread_add_client(thread, fd);
+	g_mutex_unlock(thread->mutex);
+}
+
+struct httpd_mount *
+httpd_output_find_mount(struct httpd_output *httpd, const char *path)
+{
+	/* ignore the query string */
+	size_t length = strcspn(path, "?");
 
-	httpd->clients = g_list_prepend(httpd->clients, client);
-	httpd->clients_cnt++;
+	for (unsigned i = 1; i < httpd->num_mounts; ++i) {
+		struct httpd_mount *mount = httpd->mounts[i];
 
-	/* pass metadata to client */
-	if (httpd->metadata)
-		httpd_client_send_metadata(client, httpd->metadata);
+		if (strlen(mount->path) == length &&
+		    memcmp(mount->path, path, length) == 0)
+			return mount;
+	}
+
+	return httpd->mounts[0];
+}
+
+/**
+ * Invokes a function for each client of all I/O threads.  The caller
+ * must hold httpd->mutex, and the output must be open.
+ */
+static void
+httpd_output_foreach_client(struct httpd_output *httpd,
+			    GFunc func, gpointer user_data)
+{
+	assert(httpd->open);
+
+	for (unsigned i = 0; i < httpd->num_threads; ++i) {
+		struct httpd_thread *thread = &httpd->threads[i];
+
+		g_mutex_lock(thread->mutex);
+		g_list_foreach(thread->clients, func, user_data);
+		g_mutex_unlock(thread->mutex);
+	}
 }
 
 static gboolean
@@ -206,7 +401,8 @@ httpd_listen_in_event(G_GNUC_UNUSED GIOChannel *source,
 		/* can we allow additional client */
 		if (httpd->open &&
 		    (httpd->clients_max == 0 ||
-		     httpd->clients_cnt < httpd->clients_max))
+		     (guint)g_atomic_int_get(&httpd->clients_cnt)
+		     < httpd->clients_max))
 			httpd_client_add(httpd, fd);
 		else
 			close(fd);
@@ -219,62 +415,71 @@ httpd_listen_in_event(G_GNUC_UNUSED GIOChannel *source,
 	return true;
 }
 
-/**
- * Reads data from the encoder (as much as available) and returns it
- * as a new #page object.
- */
-static struct page *
-httpd_output_read_page(struct httpd_output *httpd)
+static bool
+httpd_output_enable(void *data, GError **error_r)
 {
-	size_t size = 0, nbytes;
-
-	do {
-		nbytes = encoder_read(httpd->encoder, httpd->buffer + size,
-				      sizeof(httpd->buffer) - size);
-		if (nbytes == 0)
-			break;
-
-		size += nbytes;
-	} while (size < sizeof(httpd->buffer));
-
-	if (size == 0)
-		return NULL;
+	struct httpd_output *httpd = data;
 
-	return page_new_copy(httpd->buffer, size);
+	return httpd_output_bind(httpd, error_r);
 }
 
-static bool
-httpd_output_encoder_open(struct httpd_output *httpd,
-			  struct audio_format *audio_format,
-			  GError **error)
+static void
+httpd_output_disable(void *data)
 {
-	bool success;
-
-	success = encoder_open(httpd->encoder, audio_format, error);
-	if (!success)
-		return false;
+	struct httpd_output *httpd = data;
 
-	/* we have to remember the encoder header, i.e. the first
-	   bytes of encoder output after opening it, because it has to
-	   be sent to every new client */
-	httpd->header = httpd_output_read_page(httpd);
-	return true;
+	httpd_output_unbind(httpd);
 }
 
+/**
+ * Opens the encoders of all mount points.  They all get the same PCM
+ * data, so they must agree on one audio format: if an encoder
+ * modifies it, the others are reopened with the new format.
+ */
 static bool
-httpd_output_enable(void *data, GError **error_r)
+httpd_output_open_mounts(struct httpd_output *httpd,
+			 struct audio_format *audio_format, GError **error_r)
 {
-	struct httpd_output *httpd = data;
+	for (unsigned attempt = 0; attempt < HTTPD_FORMAT_ATTEMPTS;
+	     ++attempt) {
+		bool changed = false;
+		unsigned i;
+
+		for (i = 0; i < httpd->num_mounts && !changed; ++i) {
+			struct audio_format af = *audio_format;
+
+			if (!httpd_mount_open(httpd->mounts[i], &af,
+					      error_r)) {
+				while (i-- > 0)
+					httpd_mount_close(httpd->mounts[i]);
+				return false;
+			}
+
+			if (!audio_format_equals(&af, audio_format)) {
+				*audio_format = af;
+
+				/* the first encoder may choose freely */
+				changed = i > 0;
+			}
+		}
 
-	return httpd_output_bind(httpd, error_r);
+		if (!changed)
+			return true;
+
+		while (i-- > 0)
+			httpd_mount_close(httpd->mounts[i]);
+	}
+
+	g_set_error(error_r, httpd_output_quark(), 0,
+		    "The encoders cannot agree on an audio format");
+	return false;
 }
 
 static void
-httpd_output_disable(void *data)
+httpd_output_close_mounts(struct httpd_output *httpd)
 {
-	struct httpd_output *httpd = data;
-
-	httpd_output_unbind(httpd);
+	for (unsigned i = 0; i < httpd->num_mounts; ++i)
+		httpd_mount_close(httpd->mounts[i]);
 }
 
 static bool
@@ -283,12 +488,13 @@ httpd_output_open(void *data, struct audio_format *audio_format,
 {
 	struct httpd_output *httpd = data;
 	bool success;
+	unsigned i;
 
 	g_mutex_lock(httpd->mutex);
 
-	/* open the encoder */
+	/* open the encoders */
 
-	success = httpd_output_encoder_open(httpd, audio_format, error);
+	success = httpd_output_open_mounts(httpd, audio_format, error);
 	if (!success) {
 		g_source_remove(httpd->source_id);
 		close(httpd->fd);
@@ -296,10 +502,43 @@ httpd_output_open(void *data, struct audio_format *audio_format,
 		return false;
 	}
 
-	/* initialize other attributes */
+	/* start the I/O threads */
 
-	httpd->clients = NULL;
 	httpd->clients_cnt = 0;
+	httpd->threads = g_new(struct httpd_thread, httpd->num_threads);
+
+	for (i = 0; i < httpd->num_threads; ++i) {
+		success = httpd_thread_start(&httpd->threads[i], httpd,
+					     error);
+		if (!success) {
+			while (i-- > 0)
+				httpd_thread_stop(&httpd->threads[i]);
+			g_free(httpd->threads);
+			httpd_output_close_mounts(httpd);
+			g_mutex_unlock(httpd->mutex);
+			return false;
+		}
+	}
+
+	/* start the encoder threads */
+
+	for (i = 0; i < httpd->num_mounts; ++i) {
+		success = httpd_mount_start(httpd->mounts[i], audio_format,
+					    error);
+		if (!success) {
+			while (i-- > 0)
+				httpd_mount_stop(httpd->mounts[i]);
+			for (i = 0; i < httpd->num_threads; ++i)
+				httpd_thread_stop(&httpd->threads[i]);
+			g_free(httpd->threads);
+			httpd_output_close_mounts(httpd);
+			g_mutex_unlock(httpd->mutex);
+			return false;
+		}
+	}
+
+	/* initialize other attributes */
+
 	httpd->timer = timer_new(audio_format);
 
 	httpd->open = true;
@@ -308,14 +547,6 @@ httpd_output_open(void *data, struct audio_format *audio_format,
 	return true;
 }
 
-static void
-httpd_client_delete(gpointer data, G_GNUC_UNUSED gpointer user_data)
-{
-	struct httpd_client *client = data;
-
-	httpd_client_free(client);
-}
-
 static void httpd_output_close(void *data)
 {
 	struct httpd_output *httpd = data;
@@ -326,117 +557,38 @@ static void httpd_output_close(void *data)
 
 	timer_free(httpd->timer);
 
-	g_list_foreach(httpd->clients, httpd_client_delete, NULL);
-	g_list_free(httpd->clients);
-
-	if (httpd->header != NULL)
-		page_unref(httpd->header);
-
-	encoder_close(httpd->encoder);
-
-	g_mutex_unlock(httpd->mutex);
-}
-
-void
-httpd_output_remove_client(struct httpd_output *httpd,
-			   struct httpd_client *client)
-{
-	assert(httpd != NULL);
-	assert(client != NULL);
-
-	httpd->clients = g_list_remove(httpd->clients, client);
-	httpd->clients_cnt--;
-}
-
-void
-httpd_output_send_header(struct httpd_output *httpd,
-			 struct httpd_client *client)
-{
-	if (httpd->header != NULL)
-		httpd_client_send(client, httpd->header);
-}
-
-static void
-httpd_client_check_queue(gpointer data, G_GNUC_UNUSED gpointer user_data)
-{
-	struct httpd_client *client = data;
-
-	if (httpd_client_queue_size(client) > 256 * 1024) {
-		g_debug("client is too slow, flushing its queue");
-		httpd_client_cancel(client);
-	}
-}
-
-static void
-httpd_client_send_page(gpointer data, gpointer user_data)
-{
-	struct httpd_client *client = data;
-	struct page *page = user_data;
-
-	httpd_client_send(client, page);
-}
+	/* the encoder threads publish data to the I/O threads, so
+	   stop them first */
+	for (unsigned i = 0; i < httpd->num_mounts; ++i)
+		httpd_mount_stop(httpd->mounts[i]);
 
-/**
- * Broadcasts a page struct to all clients.
- */
-static void
-httpd_output_broadcast_page(struct httpd_output *httpd, struct page *page)
-{
-	assert(page != NULL);
+	for (unsigned i = 0; i < httpd->num_threads; ++i)
+		httpd_thread_stop(&httpd->threads[i]);
+	g_free(httpd->threads);
 
-	g_mutex_lock(httpd->mutex);
-	g_list_foreach(httpd->clients, httpd_client_send_page, page);
-	g_mutex_unlock(httpd->mutex);
-}
-
-/**
- * Broadcasts data from the encoder to all clients.
- */
-static void
-httpd_output_encoder_to_clients(struct httpd_output *httpd)
-{
-	struct page *page;
+	httpd_output_close_mounts(httpd);
 
-	g_mutex_lock(httpd->mutex);
-	g_list_foreach(httpd->clients, httpd_client_check_queue, NULL);
 	g_mutex_unlock(httpd->mutex);
-
-	while ((page = httpd_output_read_page(httpd)) != NULL) {
-		httpd_output_broadcast_page(httpd, page);
-		page_unref(page);
-	}
-}
-
-static bool
-httpd_output_encode_and_play(struct httpd_output *httpd,
-			     const void *chunk, size_t size, GError **error)
-{
-	bool success;
-
-	success = encoder_write(httpd->encoder, chunk, size, error);
-	if (!success)
-		return false;
-
-	httpd_output_encoder_to_clients(httpd);
-
-	return true;
 }
 
 static size_t
 httpd_output_play(void *data, const void *chunk, size_t size, GError **error)
 {
 	struct httpd_output *httpd = data;
-	bool has_clients;
 
-	g_mutex_lock(httpd->mutex);
-	has_clients = httpd->clients != NULL;
-	g_mutex_unlock(httpd->mutex);
+	/* with burst-on-connect, always encode, so new clients can
+	   get the recent data */
+	if (httpd->burst > 0 || g_atomic_int_get(&httpd->clients_cnt) > 0) {
+		/* all encoder threads share one copy of the chunk */
+		struct page *pcm = page_new_copy(chunk, size);
+		bool success = true;
 
-	if (has_clients) {
-		bool success;
+		for (unsigned i = 0; i < httpd->num_mounts && success; ++i)
+			success = httpd_mount_play(httpd->mounts[i], pcm,
+						   error);
+
+		page_unref(pcm);
 
-		success = httpd_output_encode_and_play(httpd, chunk, size,
-						       error);
 		if (!success)
 			return 0;
 	}
@@ -450,15 +602,6 @@ httpd_output_play(void *data, const void *chunk, size_t size, GError **error)
 	return size;
 }
 
-static void
-httpd_send_metadata(gpointer data, gpointer user_data)
-{
-	struct httpd_client *client = data;
-	struct page *icy_metadata = user_data;
-
-	httpd_client_send_metadata(client, icy_metadata);
-}
-
 static void
 httpd_output_tag(void *data, const struct tag *tag)
 {
@@ -466,48 +609,11 @@ httpd_output_tag(void *data, const struct tag *tag)
 
 	assert(tag != NULL);
 
-	if (httpd->encoder->plugin->tag != NULL) {
-		/* embed encoder tags */
-		struct page *page;
-
-		/* flush the current stream, and end it */
-
-		encoder_flush(httpd->encoder, NULL);
-		httpd_output_encoder_to_clients(httpd);
-
-		/* send the tag to the encoder - which starts a new
-		   stream now */
-
-		encoder_tag(httpd->encoder, tag, NULL);
-
-		/* the first page generated by the encoder will now be
-		   used as the new "header" page, which is sent to all
-		   new clients */
-
-		page = httpd_output_read_page(httpd);
-		if (page != NULL) {
-			if (httpd->header != NULL)
-				page_unref(httpd->header);
-			httpd->header = page;
-			httpd_output_broadcast_page(httpd, page);
-		}
-	} else {
-		/* use Icy-Metadata */
-
-		if (httpd->metadata != NULL)
-			page_unref (httpd->metadata);
-
-		httpd->metadata =
-			icy_server_metadata_page(tag, TAG_ALBUM,
-						 TAG_ARTIST, TAG_TITLE,
-						 TAG_NUM_OF_ITEM_TYPES);
-		if (httpd->metadata != NULL) {
-			g_mutex_lock(httpd->mutex);
-			g_list_foreach(httpd->clients,
-				       httpd_send_metadata, httpd->metadata);
-			g_mutex_unlock(httpd->mutex);
-		}
-	}
+	/* each mount point either embeds the tag in the encoded
+	   stream (which starts a new stream), or converts it to
+	   Icy-Metadata */
+	for (unsigned i = 0; i < httpd->num_mounts; ++i)
+		httpd_mount_tag(httpd->mounts[i], tag);
 }
 
 static void
@@ -524,7 +630,18 @@ httpd_output_cancel(void *data)
 	struct httpd_output *httpd = data;
 
 	g_mutex_lock(httpd->mutex);
-	g_list_foreach(httpd->clients, httpd_client_cancel_callback, NULL);
+
+	if (httpd->open) {
+		httpd_output_foreach_client(httpd,
+					    httpd_client_cancel_callback,
+					    NULL);
+
+		/* discard the queued PCM data, and don't send the
+		   cancelled data to new clients */
+		for (unsigned i = 0; i < httpd->num_mounts; ++i)
+			httpd_mount_cancel(httpd->mounts[i]);
+	}
+
 	g_mutex_unlock(httpd->mutex);
 }
 
@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2003-2010 The Music Player Daemon Project
+ * http://www.musicpd.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#include "config.h"
+#include "httpd_ring.h"
+
+#include <assert.h>
+#include <string.h>
+
+#ifndef G_OS_WIN32
+#include <sys/uio.h>
+#endif
+
+void
+httpd_ring_init(struct httpd_ring *ring, unsigned size)
+{
+	unsigned n = 1;
+
+	assert(size > 0);
+
+	while (n < size)
+		n <<= 1;
+
+	ring->data = g_malloc(n);
+	ring->size = n;
+	ring->head = 0;
+	ring->tail = 0;
+}
+
+void
+httpd_ring_deinit(struct httpd_ring *ring)
+{
+	g_free(ring->data);
+}
+
+void
+httpd_ring_write(struct httpd_ring *ring, const void *data, size_t length)
+{
+	const unsigned char *src = data;
+	unsigned head = ring->head, offset = head & (ring->size - 1);
+	unsigned tail = ring->tail;
+
+	assert(length <= ring->size);
+
+	if (length == 0)
+		return;
+
+	/* invalidate the data which is going to be overwritten
+	   before touching it */
+	if (head + length - tail > ring->size)
+		g_atomic_int_set(&ring->tail, (gint)(head + length - ring->size));
+
+	if (offset + length > ring->size) {
+		size_t first = ring->size - offset;
+
+		memcpy(ring->data + offset, src, first);
+		memcpy(ring->data, src + first, length - first);
+	} else
+		memcpy(ring->data + offset, src, length);
+
+	g_atomic_int_set(&ring->head, (gint)(head + length));
+}
+
+unsigned
+httpd_ring_iovec(const struct httpd_ring *ring, unsigned position,
+		 unsigned length, struct iovec *iov)
+{
+	unsigned offset = position & (ring->size - 1);
+
+	assert(length <= ring->size);
+
+	if (length == 0)
+		return 0;
+
+	iov[0].iov_base = ring->data + offset;
+
+	if (offset + length > ring->size) {
+		iov[0].iov_len = ring->size - offset;
+		iov[1].iov_base = ring->data;
+		iov[1].iov_len = length - iov[0].iov_len;
+		return 2;
+	}
+
+	iov[0].iov_len = length;
+	return 1;
+}
@@ -0,0 +1,148 @@
+/*
+ * Copyright (C) 2003-2010 The Music Player Daemon Project
+ * http://www.musicpd.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+/** \file
+ *
+ * A ring buffer which is filled by one producer (the audio output
+ * thread), and which is read by any number of consumers (the httpd
+ * clients).  Every consumer keeps its own read cursor; the producer
+ * never waits for consumers, it just overwrites the oldest data.
+ * Publication is lock-free: consumers check with httpd_ring_valid()
+ * whether the data they have read was overwritten meanwhile.
+ *
+ * Positions are 32 bit counters which wrap around; only differences
+ * between positions are meaningful.
+ */
+
+#ifndef MPD_OUTPUT_HTTPD_RING_H
+#define MPD_OUTPUT_HTTPD_RING_H
+
+#include <glib.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef G_OS_WIN32
+/**
+ * Windows has no <sys/uio.h>; this has the members of the POSIX
+ * struct, and httpd_client.c sends each one with send().
+ */
+struct iovec {
+	void *iov_base;
+	size_t iov_len;
+};
+#else
+struct iovec;
+#endif
+
+struct httpd_ring {
+	/**
+	 * The buffer, with #size bytes.
+	 */
+	unsigned char *data;
+
+	/**
+	 * The size of #data.  This is a power of two.
+	 */
+	unsigned size;
+
+	/**
+	 * The position after the last byte which was published.
+	 * Only the producer modifies this attribute.
+	 */
+	volatile gint head;
+
+	/**
+	 * The oldest position which has not been overwritten yet.
+	 * The producer advances it before it overwrites data.
+	 */
+	volatile gint tail;
+};
+
+/**
+ * Allocates the buffer.
+ *
+ * @param size the size of the buffer in bytes; will be rounded up to
+ * the next power of two
+ */
+void
+httpd_ring_init(struct httpd_ring *ring, unsigned size);
+
+void
+httpd_ring_deinit(struct httpd_ring *ring);
+
+/**
+ * Returns the position after the last published byte.  Everything
+ * before it (and not before the tail) can be read by consumers.
+ */
+static inline unsigned
+httpd_ring_head(const struct httpd_ring *ring)
+{
+	return (unsigned)g_atomic_int_get((volatile gint *)&ring->head);
+}
+
+/**
+ * Returns the number of bytes which are available to a consumer at
+ * the specified position.
+ */
+static inline unsigned
+httpd_ring_available(const struct httpd_ring *ring, unsigned position)
+{
+	return httpd_ring_head(ring) - position;
+}
+
+/**
+ * Checks whether the data at the specified position is still in the
+ * buffer, i.e. has not been overwritten by the producer.  Consumers
+ * call this after they have read the data.
+ */
+static inline bool
+httpd_ring_valid(const struct httpd_ring *ring, unsigned position)
+{
+	unsigned tail = g_atomic_int_get((volatile gint *)&ring->tail);
+
+	return (int)(position - tail) >= 0 &&
+		position - tail <= ring->size;
+}
+
+/**
+ * Copies data into the buffer and publishes it.  This may overwrite
+ * the oldest data.  Only the producer thread may call this function.
+ *
+ * @param length the number of bytes; must not be larger than the
+ * buffer
+ */
+void
+httpd_ring_write(struct httpd_ring *ring, const void *data, size_t length);
+
+/**
+ * Describes a range of the buffer with up to two #iovec structs.
+ *
+ * @param position the position of the first byte
+ * @param length the number of bytes (must be available)
+ * @param iov an array of at least two #iovec structs
+ * @return the number of #iovec structs which were filled (0 if the
+ * length is zero)
+ */
+unsigned
+httpd_ring_iovec(const struct httpd_ring *ring, unsigned position,
+		 unsigned length, struct iovec *iov);
+
+#endif
@@ -0,0 +1,173 @@
+/*
+ * Copyright (C) 2003-2010 The Music Player Daemon Project
+ * http://www.musicpd.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#include "config.h"
+#include "httpd_thread.h"
+#include "httpd_internal.h"
+#include "httpd_client.h"
+
+#include <assert.h>
+
+#undef G_LOG_DOMAIN
+#define G_LOG_DOMAIN "httpd_output"
+
+static gpointer
+httpd_thread_run(gpointer data)
+{
+	struct httpd_thread *thread = data;
+
+	g_main_loop_run(thread->loop);
+	return NULL;
+}
+
+/**
+ * Schedules a callback in the thread's main loop.  May be called
+ * from any thread.
+ */
+static void
+httpd_thread_invoke(struct httpd_thread *thread, GSourceFunc function)
+{
+	GSource *source = g_idle_source_new();
+
+	g_source_set_callback(source, function, thread, NULL);
+	g_source_attach(source, thread->context);
+	g_source_unref(source);
+}
+
+bool
+httpd_thread_start(struct httpd_thread *thread, struct httpd_output *httpd,
+		   GError **error_r)
+{
+	thread->httpd = httpd;
+	thread->context = g_main_context_new();
+	thread->loop = g_main_loop_new(thread->context, false);
+	thread->mutex = g_mutex_new();
+	thread->clients = NULL;
+	thread->num_clients = 0;
+	thread->wake_pending = 0;
+
+	thread->thread = g_thread_create(httpd_thread_run, thread, true,
+					 error_r);
+	if (thread->thread == NULL) {
+		g_mutex_free(thread->mutex);
+		g_main_loop_unref(thread->loop);
+		g_main_context_unref(thread->context);
+		return false;
+	}
+
+	return true;
+}
+
+static gboolean
+httpd_thread_quit_callback(gpointer data)
+{
+	struct httpd_thread *thread = data;
+
+	g_main_loop_quit(thread->loop);
+	return false;
+}
+
+static void
+httpd_client_delete(gpointer data, G_GNUC_UNUSED gpointer user_data)
+{
+	struct httpd_client *client = data;
+
+	httpd_client_free(client);
+}
+
+void
+httpd_thread_stop(struct httpd_thread *thread)
+{
+	/* quit from within the thread, because g_main_loop_quit()
+	   may be lost if g_main_loop_run() has not been entered
+	   yet */
+	httpd_thread_invoke(thread, httpd_thread_quit_callback);
+	g_thread_join(thread->thread);
+
+	/* now that the thread has finished, nobody else accesses
+	   the clients */
+
+	g_atomic_int_add(&thread->httpd->clients_cnt,
+			 -(gint)thread->num_clients);
+	g_list_foreach(thread->clients, httpd_client_delete, NULL);
+	g_list_free(thread->clients);
+
+	g_mutex_free(thread->mutex);
+	g_main_loop_unref(thread->loop);
+	g_main_context_unref(thread->context);
+}
+
+struct httpd_client *
+httpd_thread_add_client(struct httpd_thread *thread, int fd)
+{
+	struct httpd_client *client = httpd_client_new(thread, fd);
+
+	thread->clients = g_list_prepend(thread->clients, client);
+	++thread->num_clients;
+	g_atomic_int_inc(&thread->httpd->clients_cnt);
+
+	return client;
+}
+
+void
+httpd_thread_remove_client(struct httpd_thread *thread,
+			   struct httpd_client *client)
+{
+	assert(thread != NULL);
+	assert(client != NULL);
+	assert(thread->num_clients > 0);
+
+	thread->clients = g_list_remove(thread->clients, client);
+	--thread->num_clients;
+	g_atomic_int_add(&thread->httpd->clients_cnt, -1);
+}
+
+/**
+ * Called in the I/O thread after new data has been published in the
+ * ring buffer.  Registers write event sources for all clients which
+ * had caught up.
+ */
+static gboolean
+httpd_thread_wake_callback(gpointer data)
+{
+	struct httpd_thread *thread = data;
+	GList *i, *next;
+
+	g_mutex_lock(thread->mutex);
+
+	g_atomic_int_set(&thread->wake_pending, 0);
+
+	for (i = thread->clients; i != NULL; i = next) {
+		/* the client may remove itself from the list */
+		next = g_list_next(i);
+		httpd_client_wake(i->data);
+	}
+
+	g_mutex_unlock(thread->mutex);
+
+	return false;
+}
+
+void
+httpd_thread_wake(struct httpd_thread *thread)
+{
+	if (g_atomic_int_compare_and_exchange(&thread->wake_pending, 0, 1))
+		httpd_thread_invoke(thread, httpd_thread_wake_callback);
+}
@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2003-2010 The Music Player Daemon Project
+ * http://www.musicpd.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+/** \file
+ *
+ * An I/O thread of the "httpd" audio output plugin.  Each thread runs
+ * its own GLib main loop, and serves a subset of the clients, so the
+ * MPD main thread is not involved in streaming.
+ */
+
+#ifndef MPD_OUTPUT_HTTPD_THREAD_H
+#define MPD_OUTPUT_HTTPD_THREAD_H
+
+#include <glib.h>
+
+#include <stdbool.h>
+
+struct httpd_output;
+struct httpd_client;
+
+struct httpd_thread {
+	/**
+	 * The httpd output object this thread belongs to.
+	 */
+	struct httpd_output *httpd;
+
+	GThread *thread;
+
+	/**
+	 * The main context of this thread.  All event sources of its
+	 * clients are attached to it.
+	 */
+	GMainContext *context;
+
+	GMainLoop *loop;
+
+	/**
+	 * This mutex protects #clients and the state of all clients
+	 * served by this thread.
+	 */
+	GMutex *mutex;
+
+	/**
+	 * A linked list containing all clients which are served by
+	 * this thread.
+	 */
+	GList *clients;
+
+	/**
+	 * The number of elements in #clients.
+	 */
+	unsigned num_clients;
+
+	/**
+	 * Non-zero if httpd_thread_wake() has scheduled a callback
+	 * which has not run yet.  Modified with atomic operations.
+	 */
+	volatile gint wake_pending;
+};
+
+/**
+ * Initializes the thread object and starts the thread.
+ */
+bool
+httpd_thread_start(struct httpd_thread *thread, struct httpd_output *httpd,
+		   GError **error_r);
+
+/**
+ * Stops the thread, frees all of its clients, and frees the
+ * resources of the thread object.  The caller must not hold
+ * httpd_thread.mutex.
+ */
+void
+httpd_thread_stop(struct httpd_thread *thread);
+
+/**
+ * Creates a new client served by this thread.  The caller must hold
+ * httpd_thread.mutex.
+ */
+struct httpd_client *
+httpd_thread_add_client(struct httpd_thread *thread, int fd);
+
+/**
+ * Removes a client from the httpd_thread.clients linked list.  The
+ * caller must hold httpd_thread.mutex.
+ */
+void
+httpd_thread_remove_client(struct httpd_thread *thread,
+			   struct httpd_client *client);
+
+/**
+ * Notifies the thread that new data has been published in the ring
+ * buffer.  This function does not lock the mutex, and may be called
+ * from any thread.
+ */
+void
+httpd_thread_wake(struct httpd_thread *thread);
+
+#endif
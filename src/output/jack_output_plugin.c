@@ -19,6 +19,7 @@
 
 #include "config.h"
 #include "output_api.h"
+#include "fd_util.h"
 
 #include <assert.h>
 
@@ -32,6 +33,7 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <errno.h>
+#include <poll.h>
 
 #undef G_LOG_DOMAIN
 #define G_LOG_DOMAIN "jack"
@@ -77,6 +79,49 @@ struct jack_data {
 	 * silence.
 	 */
 	bool pause;
+
+	/**
+	 * Has mpd_jack_play() written data since the output was
+	 * opened or paused?  Until then, an empty ring buffer is not
+	 * an underrun.
+	 */
+	bool filled;
+
+	/**
+	 * A non-blocking pipe which wakes up mpd_jack_play() while it
+	 * waits for room in the ring buffers.  The "process" callback
+	 * writes one byte to it after consuming data, but only if
+	 * #waiting is set; unlike a mutex and a condition, this
+	 * cannot block the realtime thread.
+	 */
+	int wake_pipe[2];
+
+	/**
+	 * Set by mpd_jack_play() before it waits on #wake_pipe.
+	 */
+	volatile gint waiting;
+
+	/* statistics, updated by the JACK threads with atomic
+	   operations */
+
+	/**
+	 * The number of xruns reported by the JACK server.
+	 */
+	volatile gint xruns;
+
+	/**
+	 * The number of "process" callbacks which had to fill up
+	 * with silence, because MPD was too slow.
+	 */
+	volatile gint underruns;
+
+	/**
+	 * The lowest number of frames which were in the ring buffers
+	 * at the beginning of a "process" callback.  This is the
+	 * headroom which protects against underruns; if it stays
+	 * large, the ring buffers can be made smaller.
+	 */
+	volatile gint min_available;
 };
 
 /**
@@ -108,6 +153,41 @@ mpd_jack_available(const struct jack_data *jd)
 	return min / sample_size;
 }
 
+/**
+ * Wakes up mpd_jack_play() if it is waiting for room in the ring
+ * buffers.  This is safe to call from the realtime thread.
+ */
+static void
+mpd_jack_wake(struct jack_data *jd)
+{
+	static const char dummy = 0;
+
+	if (g_atomic_int_get(&jd->waiting)) {
+		g_atomic_int_set(&jd->waiting, 0);
+
+		/* the pipe is non-blocking; if it is full, the
+		   player will wake up anyway */
+		(void)write(jd->wake_pipe[1], &dummy, sizeof(dummy));
+	}
+}
+
+/**
+ * Updates the statistics in the "process" callback.
+ */
+static void
+mpd_jack_account(struct jack_data *jd, jack_nframes_t available,
+		 jack_nframes_t nframes)
+{
+	if (!jd->filled)
+		return;
+
+	if ((gint)available < g_atomic_int_get(&jd->min_available))
+		g_atomic_int_set(&jd->min_available, (gint)available);
+
+	if (available < nframes)
+		g_atomic_int_inc(&jd->underruns);
+}
+
 static int
 mpd_jack_process(jack_nframes_t nframes, void *arg)
 {
@@ -138,6 +218,7 @@ mpd_jack_process(jack_nframes_t nframes, void *arg)
 	}
 
 	jack_nframes_t available = mpd_jack_available(jd);
+	mpd_jack_account(jd, available, nframes);
 	if (available > nframes)
 		available = nframes;
 
@@ -161,6 +242,17 @@ mpd_jack_process(jack_nframes_t nframes, void *arg)
 			out[f] = 0.0;
 	}
 
+	mpd_jack_wake(jd);
+
+	return 0;
+}
+
+static int
+mpd_jack_xrun(void *arg)
+{
+	struct jack_data *jd = (struct jack_data *) arg;
+
+	g_atomic_int_inc(&jd->xruns);
 	return 0;
 }
 
@@ -169,6 +261,11 @@ mpd_jack_shutdown(void *arg)
 {
 	struct jack_data *jd = (struct jack_data *) arg;
 	jd->shutdown = true;
+
+	/* don't let mpd_jack_play() wait for a callback which will
+	   never come */
+	g_atomic_int_set(&jd->waiting, 1);
+	mpd_jack_wake(jd);
 }
 
 static void
@@ -237,6 +334,7 @@ mpd_jack_connect(struct jack_data *jd, GError **error_r)
 	}
 
 	jack_set_process_callback(jd->client, mpd_jack_process, jd);
+	jack_set_xrun_callback(jd->client, mpd_jack_xrun, jd);
 	jack_on_shutdown(jd->client, mpd_jack_shutdown, jd);
 
 	for (unsigned i = 0; i < jd->num_source_ports; ++i) {
@@ -355,6 +453,14 @@ mpd_jack_init(G_GNUC_UNUSED const struct audio_format *audio_format,
 	jd->ringbuffer_size =
 		config_get_block_unsigned(param, "ringbuffer_size", 32768);
 
+	if (pipe_cloexec_nonblock(jd->wake_pipe) < 0) {
+		g_set_error(error_r, jack_output_quark(), errno,
+			    "Failed to create pipe: %s", g_strerror(errno));
+		return NULL;
+	}
+
+	jd->waiting = 0;
+
 	jack_set_error_function(mpd_jack_error);
 
 #ifdef HAVE_JACK_SET_INFO_FUNCTION
@@ -375,6 +481,9 @@ mpd_jack_finish(void *data)
 	for (unsigned i = 0; i < jd->num_destination_ports; ++i)
 		g_free(jd->destination_ports[i]);
 
+	close(jd->wake_pipe[0]);
+	close(jd->wake_pipe[1]);
+
 	g_free(jd);
 }
 
@@ -562,6 +671,10 @@ mpd_jack_open(void *data, struct audio_format *audio_format, GError **error_r)
 	assert(jd != NULL);
 
 	jd->pause = false;
+	jd->filled = false;
+	jd->xruns = 0;
+	jd->underruns = 0;
+	jd->min_available = G_MAXINT;
 
 	if (jd->client == NULL && !mpd_jack_connect(jd, error_r))
 		return false;
@@ -579,6 +692,17 @@ static void
 mpd_jack_close(G_GNUC_UNUSED void *data)
 {
 	struct jack_data *jd = data;
+	gint min_available = g_atomic_int_get(&jd->min_available);
+
+	if (jd->client != NULL)
+		g_debug("%d xruns, %d underruns, min ring buffer fill "
+			"%.1fms, DSP load %.1f%%",
+			g_atomic_int_get(&jd->xruns),
+			g_atomic_int_get(&jd->underruns),
+			min_available != G_MAXINT
+			? min_available * 1000.0 / jd->audio_format.sample_rate
+			: 0.0,
+			jack_cpu_load(jd->client));
 
 	mpd_jack_stop(jd);
 }
@@ -589,20 +713,18 @@ sample_16_to_jack(int16_t sample)
 	return sample / (jack_default_audio_sample_t)(1 << (16 - 1));
 }
 
+/**
+ * Copies one channel of interleaved 16 bit samples to a JACK buffer.
+ * This is a separate loop for each channel (with a constant stride),
+ * which the compiler can vectorize.
+ */
 static void
-mpd_jack_write_samples_16(struct jack_data *jd, const int16_t *src,
-			  unsigned num_samples)
+mpd_jack_deinterleave_16(jack_default_audio_sample_t *dest,
+			 const int16_t *src, unsigned num_frames,
+			 unsigned channels)
 {
-	jack_default_audio_sample_t sample;
-	unsigned i;
-
-	while (num_samples-- > 0) {
-		for (i = 0; i < jd->audio_format.channels; ++i) {
-			sample = sample_16_to_jack(*src++);
-			jack_ringbuffer_write(jd->ringbuffer[i], (void*)&sample,
-					      sizeof(sample));
-		}
-	}
+	for (unsigned i = 0; i < num_frames; ++i)
+		dest[i] = sample_16_to_jack(src[i * channels]);
 }
 
 static inline jack_default_audio_sample_t
@@ -612,34 +734,34 @@ sample_24_to_jack(int32_t sample)
 }
 
 static void
-mpd_jack_write_samples_24(struct jack_data *jd, const int32_t *src,
-			  unsigned num_samples)
+mpd_jack_deinterleave_24(jack_default_audio_sample_t *dest,
+			 const int32_t *src, unsigned num_frames,
+			 unsigned channels)
 {
-	jack_default_audio_sample_t sample;
-	unsigned i;
-
-	while (num_samples-- > 0) {
-		for (i = 0; i < jd->audio_format.channels; ++i) {
-			sample = sample_24_to_jack(*src++);
-			jack_ringbuffer_write(jd->ringbuffer[i], (void*)&sample,
-					      sizeof(sample));
-		}
-	}
+	for (unsigned i = 0; i < num_frames; ++i)
+		dest[i] = sample_24_to_jack(src[i * channels]);
 }
 
+/**
+ * Copies one channel to the given JACK buffer.
+ *
+ * @param src the first sample of the channel in the interleaved
+ * source buffer
+ */
 static void
-mpd_jack_write_samples(struct jack_data *jd, const void *src,
-		       unsigned num_samples)
+mpd_jack_deinterleave(const struct jack_data *jd,
+		      jack_default_audio_sample_t *dest,
+		      const void *src, unsigned num_frames)
 {
+	const unsigned channels = jd->audio_format.channels;
+
 	switch (jd->audio_format.format) {
 	case SAMPLE_FORMAT_S16:
-		mpd_jack_write_samples_16(jd, (const int16_t*)src,
-					  num_samples);
+		mpd_jack_deinterleave_16(dest, src, num_frames, channels);
 		break;
 
 	case SAMPLE_FORMAT_S24_P32:
-		mpd_jack_write_samples_24(jd, (const int32_t*)src,
-					  num_samples);
+		mpd_jack_deinterleave_24(dest, src, num_frames, channels);
 		break;
 
 	default:
@@ -647,6 +769,69 @@ mpd_jack_write_samples(struct jack_data *jd, const void *src,
 	}
 }
 
+/**
+ * Deinterleaves the samples directly into the ring buffers, one
+ * channel after another.  The caller must have checked that there is
+ * enough room.
+ */
+static void
+mpd_jack_write_samples(struct jack_data *jd, const void *src,
+		       unsigned num_frames)
+{
+	const size_t frame_size = audio_format_frame_size(&jd->audio_format);
+	const size_t src_sample_size =
+		audio_format_sample_size(&jd->audio_format);
+
+	for (unsigned c = 0; c < jd->audio_format.channels; ++c) {
+		const char *p = (const char *)src + c * src_sample_size;
+		jack_ringbuffer_data_t vec[2];
+		unsigned n, remaining = num_frames;
+
+		jack_ringbuffer_get_write_vector(jd->ringbuffer[c], vec);
+
+		for (unsigned i = 0; i < 2 && remaining > 0; ++i) {
+			n = vec[i].len / sample_size;
+			if (n > remaining)
+				n = remaining;
+
+			mpd_jack_deinterleave(jd,
+					      (jack_default_audio_sample_t *)
+					      vec[i].buf,
+					      p, n);
+
+			p += n * frame_size;
+			remaining -= n;
+		}
+
+		assert(remaining == 0);
+
+		jack_ringbuffer_write_advance(jd->ringbuffer[c],
+					      num_frames * sample_size);
+	}
+}
+
+/**
+ * Waits until the "process" callback has consumed data from the ring
+ * buffers (or until the connection has been shut down).
+ */
+static void
+mpd_jack_wait(struct jack_data *jd)
+{
+	struct pollfd pfd = {
+		.fd = jd->wake_pipe[0],
+		.events = POLLIN,
+	};
+	char buffer[64];
+
+	g_atomic_int_set(&jd->waiting, 1);
+
+	/* the "process" callback is invoked periodically, so there
+	   is no lost wakeup; the timeout is only a safety net */
+	poll(&pfd, 1, 500);
+
+	while (read(jd->wake_pipe[0], buffer, sizeof(buffer)) > 0) {}
+}
+
 static size_t
 mpd_jack_play(void *data, const void *chunk, size_t size, GError **error_r)
 {
@@ -675,12 +860,10 @@ mpd_jack_play(void *data, const void *chunk, size_t size, GError **error_r)
 				space = space1;
 		}
 
-		if (space >= frame_size)
+		if (space >= sample_size)
 			break;
 
-		/* XXX do something more intelligent to
-		   synchronize */
-		g_usleep(1000);
+		mpd_jack_wait(jd);
 	}
 
 	space /= sample_size;
@@ -688,6 +871,7 @@ mpd_jack_play(void *data, const void *chunk, size_t size, GError **error_r)
 		size = space;
 
 	mpd_jack_write_samples(jd, chunk, size);
+	jd->filled = true;
 	return size * frame_size;
 }
 
@@ -700,6 +884,7 @@ mpd_jack_pause(void *data)
 		return false;
 
 	jd->pause = true;
+	jd->filled = false;
 
 	/* due to a MPD API limitation, we have to sleep a little bit
 	   here, to avoid hogging the CPU */
@@ -22,6 +22,7 @@
 
 #include <stdio.h>
 #include <errno.h>
+#include <unistd.h>
 
 struct pipe_output {
 	char *cmd;
@@ -92,14 +93,21 @@ static size_t
 pipe_output_play(void *data, const void *chunk, size_t size, GError **error)
 {
 	struct pipe_output *pd = data;
-	size_t ret;
+	ssize_t ret;
 
-	ret = fwrite(chunk, 1, size, pd->fh);
-	if (ret == 0)
+	do {
+		/* bypass stdio buffering, which would only add
+		   another copy */
+		ret = write(fileno(pd->fh), chunk, size);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret <= 0) {
 		g_set_error(error, pipe_output_quark(), errno,
 			    "Write error on pipe: %s", g_strerror(errno));
+		return 0;
+	}
 
-	return ret;
+	return (size_t)ret;
 }
 
 const struct audio_output_plugin pipe_output_plugin = {
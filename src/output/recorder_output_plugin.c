@@ -17,22 +17,27 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+
 #include "config.h"
+#include "recorder_writer.h"
 #include "output_api.h"
 #include "encoder_plugin.h"
 #include "encoder_list.h"
-#include "fd_util.h"
+#include "encoder_thread.h"
 
 #include <assert.h>
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <fcntl.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
-#include <errno.h>
 
 #undef G_LOG_DOMAIN
 #define G_LOG_DOMAIN "recorder"
 
+/**
+ * The maximum amount of PCM data queued for the encoder thread.
+ */
+#define RECORDER_QUEUE_SIZE (256 * 1024)
+
 struct recorder_output {
 	/**
 	 * The configured encoder plugin.
@@ -40,14 +45,80 @@ struct recorder_output {
 	struct encoder *encoder;
 
 	/**
-	 * The destination file name.
+	 * Is the #encoder open?  It is closed and reopened for each
+	 * segment, and may remain closed if that fails.
+	 */
+	bool encoder_open;
+
+	/**
+	 * Runs the encoder and passes the encoded data to the
+	 * #writer.  Exists while the output is open.
+	 */
+	struct encoder_thread *thread;
+
+	/**
+	 * Writes the files in a separate thread, so disk stalls don't
+	 * block the encoder.  Exists while the output is open.
+	 */
+	struct recorder_writer *writer;
+
+	/**
+	 * The destination file name.  It may contain strftime()
+	 * conversions, which are expanded when a file is created.
 	 */
 	const char *path;
 
 	/**
-	 * The destination file descriptor.
+	 * Open files with O_DIRECT?
+	 */
+	bool direct;
+
+	/**
+	 * Start a new file every time the wallclock reaches a
+	 * multiple of this duration [s].  0 disables time based
+	 * segmentation.
+	 */
+	unsigned segment_time;
+
+	/**
+	 * Start a new file when the current one has reached this
+	 * size [bytes].  0 disables size based segmentation.
+	 */
+	guint64 segment_size;
+
+	/**
+	 * The audio format of the encoder input.  It is needed to
+	 * reopen the encoder for each segment.
+	 */
+	struct audio_format audio_format;
+
+	/**
+	 * The expanded #path of the current file, without the
+	 * #sequence suffix.
+	 */
+	char *base_name;
+
+	/**
+	 * The path of the current file.
 	 */
-	int fd;
+	char *file_path;
+
+	/**
+	 * Appended to #base_name if it expands to the same name more
+	 * than once (e.g. if #path does not contain a time stamp).
+	 */
+	unsigned sequence;
+
+	/**
+	 * The number of bytes written to the current file.
+	 */
+	guint64 segment_bytes;
+
+	/**
+	 * When does the current segment end?  Only valid if
+	 * #segment_time is non-zero.
+	 */
+	time_t segment_end;
 
 	/**
 	 * The buffer for encoder_read().
@@ -89,12 +160,21 @@ recorder_output_init(G_GNUC_UNUSED const struct audio_format *audio_format,
 		return NULL;
 	}
 
+	recorder->segment_time =
+		config_get_block_unsigned(param, "segment_time", 0);
+	recorder->segment_size = (guint64)
+		config_get_block_unsigned(param, "segment_size", 0) * 1024;
+	recorder->direct = config_get_block_bool(param, "direct_io", false);
+
 	/* initialize encoder */
 
 	recorder->encoder = encoder_init(encoder_plugin, param, error_r);
 	if (recorder->encoder == NULL)
 		return NULL;
 
+	recorder->base_name = NULL;
+	recorder->file_path = NULL;
+
 	return recorder;
 }
 
@@ -104,9 +184,67 @@ recorder_output_finish(void *data)
 	struct recorder_output *recorder = data;
 
 	encoder_finish(recorder->encoder);
+	g_free(recorder->base_name);
+	g_free(recorder->file_path);
 	g_free(recorder);
 }
 
+/**
+ * Expands the strftime() conversions in the configured path, and
+ * creates the file.
+ */
+static bool
+recorder_output_create_file(struct recorder_output *recorder,
+			    GError **error_r)
+{
+	time_t t = time(NULL);
+#ifndef WIN32
+	struct tm tm;
+#endif
+	const struct tm *tm2;
+	char buffer[4096];
+	char *path;
+	bool success;
+
+#ifdef WIN32
+	tm2 = localtime(&t);
+#else
+	tm2 = localtime_r(&t, &tm);
+#endif
+
+	if (tm2 == NULL || strftime(buffer, sizeof(buffer),
+				    recorder->path, tm2) == 0)
+		g_strlcpy(buffer, recorder->path, sizeof(buffer));
+
+	if (recorder->base_name != NULL &&
+	    strcmp(recorder->base_name, buffer) == 0) {
+		/* don't overwrite the previous segment */
+		path = g_strdup_printf("%s.%u", buffer, ++recorder->sequence);
+	} else {
+		g_free(recorder->base_name);
+		recorder->base_name = g_strdup(buffer);
+		recorder->sequence = 0;
+		path = g_strdup(buffer);
+	}
+
+	success = recorder_writer_open_file(recorder->writer, path, error_r);
+	if (!success) {
+		g_free(path);
+		return false;
+	}
+
+	g_debug("recording to '%s'", path);
+	g_free(recorder->file_path);
+	recorder->file_path = path;
+
+	recorder->segment_bytes = 0;
+	if (recorder->segment_time > 0)
+		recorder->segment_end = (t / recorder->segment_time + 1) *
+			recorder->segment_time;
+
+	return true;
+}
+
 /**
  * Writes pending data from the encoder to the output file.
  */
@@ -114,41 +252,84 @@ static bool
 recorder_output_encoder_to_file(struct recorder_output *recorder,
 			      GError **error_r)
 {
-	size_t size = 0, position, nbytes;
-
-	assert(recorder->fd >= 0);
-
-	/* read from the encoder */
-
-	size = encoder_read(recorder->encoder, recorder->buffer,
-			    sizeof(recorder->buffer));
-	if (size == 0)
-		return true;
-
-	/* write everything into the file */
-
-	position = 0;
-	while (true) {
-		nbytes = write(recorder->fd, recorder->buffer + position,
-			       size - position);
-		if (nbytes > 0) {
-			position += (size_t)nbytes;
-			if (position >= size)
-				return true;
-		} else if (nbytes == 0) {
-			/* shouldn't happen for files */
-			g_set_error(error_r, recorder_output_quark(), 0,
-				    "write() returned 0");
-			return false;
-		} else if (errno != EINTR) {
-			g_set_error(error_r, recorder_output_quark(), 0,
-				    "Failed to write to '%s': %s",
-				    recorder->path, g_strerror(errno));
+	size_t size;
+
+	while ((size = encoder_read(recorder->encoder, recorder->buffer,
+				    sizeof(recorder->buffer))) > 0) {
+		if (!recorder_writer_write(recorder->writer, recorder->buffer,
+					   size, error_r))
 			return false;
-		}
+
+		recorder->segment_bytes += size;
 	}
+
+	return true;
+}
+
+/**
+ * Has the current segment reached its configured duration or size?
+ */
+static bool
+recorder_output_segment_full(const struct recorder_output *recorder)
+{
+	return (recorder->segment_size > 0 &&
+		recorder->segment_bytes >= recorder->segment_size) ||
+		(recorder->segment_time > 0 &&
+		 time(NULL) >= recorder->segment_end);
+}
+
+/**
+ * Finishes the current file, and starts a new one.  The encoder is
+ * reopened, so each file begins with a new stream header.
+ */
+static bool
+recorder_output_next_segment(struct recorder_output *recorder,
+			     GError **error_r)
+{
+	struct audio_format audio_format = recorder->audio_format;
+
+	if (!encoder_flush(recorder->encoder, error_r) ||
+	    !recorder_output_encoder_to_file(recorder, error_r))
+		return false;
+
+	encoder_close(recorder->encoder);
+	recorder->encoder_open = false;
+
+	if (!recorder_output_create_file(recorder, error_r))
+		return false;
+
+	if (!encoder_open(recorder->encoder, &audio_format, error_r))
+		return false;
+
+	recorder->encoder_open = true;
+
+	/* the encoder has already accepted this format when the
+	   output was opened */
+	assert(audio_format_equals(&audio_format, &recorder->audio_format));
+
+	return recorder_output_encoder_to_file(recorder, error_r);
 }
 
+/**
+ * Called in the encoder thread after PCM data has been encoded.
+ */
+static bool
+recorder_output_encoded(void *ctx, G_GNUC_UNUSED size_t length,
+			GError **error_r)
+{
+	struct recorder_output *recorder = ctx;
+
+	if (!recorder_output_encoder_to_file(recorder, error_r))
+		return false;
+
+	return !recorder_output_segment_full(recorder) ||
+		recorder_output_next_segment(recorder, error_r);
+}
+
+static const struct encoder_thread_handler recorder_encoder_handler = {
+	.encoded = recorder_output_encoded,
+};
+
 static bool
 recorder_output_open(void *data, struct audio_format *audio_format,
 		     GError **error_r)
@@ -156,23 +337,37 @@ recorder_output_open(void *data, struct audio_format *audio_format,
 	struct recorder_output *recorder = data;
 	bool success;
 
+	/* open the encoder */
+
+	success = encoder_open(recorder->encoder, audio_format, error_r);
+	if (!success)
+		return false;
+
+	recorder->encoder_open = true;
+	recorder->audio_format = *audio_format;
+
 	/* create the output file */
 
-	recorder->fd = open_cloexec(recorder->path, O_CREAT|O_WRONLY|O_TRUNC,
-				    0666);
-	if (recorder->fd < 0) {
-		g_set_error(error_r, recorder_output_quark(), 0,
-			    "Failed to create '%s': %s",
-			    recorder->path, g_strerror(errno));
+	recorder->writer = recorder_writer_new(recorder->direct, error_r);
+	if (recorder->writer == NULL) {
+		encoder_close(recorder->encoder);
 		return false;
 	}
 
-	/* open the encoder */
+	if (!recorder_output_create_file(recorder, error_r)) {
+		recorder_writer_free(recorder->writer);
+		encoder_close(recorder->encoder);
+		return false;
+	}
 
-	success = encoder_open(recorder->encoder, audio_format, error_r);
-	if (!success) {
-		close(recorder->fd);
-		unlink(recorder->path);
+	recorder->thread = encoder_thread_new(recorder->encoder, audio_format,
+					      RECORDER_QUEUE_SIZE,
+					      &recorder_encoder_handler,
+					      recorder, error_r);
+	if (recorder->thread == NULL) {
+		encoder_close(recorder->encoder);
+		recorder_writer_free(recorder->writer);
+		unlink(recorder->file_path);
 		return false;
 	}
 
@@ -184,16 +379,32 @@ recorder_output_close(void *data)
 {
 	struct recorder_output *recorder = data;
 
-	/* flush the encoder and write the rest to the file */
+	/* wait for the encoder thread to pass all queued data to the
+	   writer */
 
-	if (encoder_flush(recorder->encoder, NULL))
-		recorder_output_encoder_to_file(recorder, NULL);
+	encoder_thread_drain(recorder->thread, NULL);
+	encoder_thread_free(recorder->thread);
 
-	/* now really close everything */
+	/* flush the encoder and write the rest to the file; it may
+	   have been closed already if starting a new segment has
+	   failed */
 
-	encoder_close(recorder->encoder);
+	if (recorder->encoder_open) {
+		if (encoder_flush(recorder->encoder, NULL))
+			recorder_output_encoder_to_file(recorder, NULL);
+
+		/* now really close everything */
+
+		encoder_close(recorder->encoder);
+		recorder->encoder_open = false;
+	}
+
+	recorder_writer_free(recorder->writer);
 
-	close(recorder->fd);
+	g_free(recorder->base_name);
+	recorder->base_name = NULL;
+	g_free(recorder->file_path);
+	recorder->file_path = NULL;
 }
 
 static size_t
@@ -202,8 +413,7 @@ recorder_output_play(void *data, const void *chunk, size_t size,
 {
 	struct recorder_output *recorder = data;
 
-	return encoder_write(recorder->encoder, chunk, size, error_r) &&
-		recorder_output_encoder_to_file(recorder, error_r)
+	return encoder_thread_write(recorder->thread, chunk, size, error_r)
 		? size : 0;
 }
 
@@ -0,0 +1,514 @@
+/*
+ * Copyright (C) 2003-2010 The Music Player Daemon Project
+ * http://www.musicpd.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "config.h" /* must be first for large file support */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* for O_DIRECT */
+#endif
+
+#include "recorder_writer.h"
+#include "fd_util.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#undef G_LOG_DOMAIN
+#define G_LOG_DOMAIN "recorder"
+
+enum {
+	/**
+	 * The size of one buffer.  This is a multiple of
+	 * #RECORDER_BUFFER_ALIGN.
+	 */
+	RECORDER_BUFFER_SIZE = 256 * 1024,
+
+	/**
+	 * The number of buffers.  The producer blocks only when all
+	 * of them are waiting for the disk.
+	 */
+	RECORDER_NUM_BUFFERS = 8,
+
+	/**
+	 * The alignment of buffer addresses, sizes and file offsets
+	 * required by O_DIRECT.
+	 */
+	RECORDER_BUFFER_ALIGN = 4096,
+};
+
+/**
+ * An output file.  It is shared by all buffers which are going to be
+ * written to it.
+ */
+struct recorder_file {
+	char *path;
+
+	int fd;
+
+	/**
+	 * Was the file opened with O_DIRECT?  Cleared by the writer
+	 * thread before it writes the last (unaligned) buffer.
+	 */
+	bool direct;
+};
+
+struct recorder_buffer {
+	struct recorder_file *file;
+
+	/**
+	 * Shall the writer thread close the file after this buffer
+	 * has been written?
+	 */
+	bool close;
+
+	size_t length;
+
+	char *data;
+};
+
+struct recorder_writer {
+	bool direct;
+
+	/**
+	 * The file which is currently being written by the
+	 * producer.  Not protected by #mutex.
+	 */
+	struct recorder_file *file;
+
+	/**
+	 * The buffer which is currently being filled by the
+	 * producer.  Not protected by #mutex.
+	 */
+	struct recorder_buffer *current;
+
+	/**
+	 * This mutex protects all attributes below.
+	 */
+	GMutex *mutex;
+
+	/**
+	 * Signalled when a buffer has been submitted or has been
+	 * written.
+	 */
+	GCond *cond;
+
+	GThread *thread;
+
+	/**
+	 * Buffers which are waiting to be written, oldest first.
+	 */
+	GQueue *full;
+
+	/**
+	 * Buffers which may be filled by the producer.
+	 */
+	GQueue *empty;
+
+	/**
+	 * Set by recorder_writer_free(): the thread shall exit after
+	 * it has written all buffers.
+	 */
+	bool quit;
+
+	/**
+	 * The first write error.  All data after it is discarded.
+	 */
+	GError *error;
+
+	GTimer *timer;
+
+	struct recorder_writer_stats stats;
+
+	double total_latency;
+};
+
+/**
+ * The quark used for GError.domain.
+ */
+static inline GQuark
+recorder_writer_quark(void)
+{
+	return g_quark_from_static_string("recorder_output");
+}
+
+static void
+recorder_file_close(struct recorder_file *file)
+{
+	close(file->fd);
+	g_free(file->path);
+	g_free(file);
+}
+
+/**
+ * Writes one buffer to its file.  Called in the writer thread.
+ */
+static bool
+recorder_writer_write_buffer(struct recorder_writer *w,
+			     struct recorder_buffer *buffer, GError **error_r)
+{
+	struct recorder_file *file = buffer->file;
+	size_t position = 0;
+
+#ifdef O_DIRECT
+	if (file->direct && buffer->length % RECORDER_BUFFER_ALIGN != 0) {
+		/* O_DIRECT requires aligned sizes; this can only be
+		   the tail of the file */
+		int flags = fcntl(file->fd, F_GETFL);
+		if (flags >= 0)
+			fcntl(file->fd, F_SETFL, flags & ~O_DIRECT);
+		file->direct = false;
+	}
+#endif
+
+	while (position < buffer->length) {
+		double start = g_timer_elapsed(w->timer, NULL), latency;
+		ssize_t nbytes;
+
+		nbytes = write(file->fd, buffer->data + position,
+			       buffer->length - position);
+
+		latency = g_timer_elapsed(w->timer, NULL) - start;
+
+		g_mutex_lock(w->mutex);
+		++w->stats.writes;
+		w->total_latency += latency;
+		if (latency > w->stats.max_latency)
+			w->stats.max_latency = latency;
+		if (nbytes > 0)
+			w->stats.bytes += nbytes;
+		g_mutex_unlock(w->mutex);
+
+		if (nbytes > 0) {
+			position += (size_t)nbytes;
+		} else if (nbytes == 0) {
+			/* shouldn't happen for files */
+			g_set_error(error_r, recorder_writer_quark(), 0,
+				    "write() returned 0");
+			return false;
+		} else if (errno != EINTR) {
+			g_set_error(error_r, recorder_writer_quark(), 0,
+				    "Failed to write to '%s': %s",
+				    file->path, g_strerror(errno));
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static gpointer
+recorder_writer_run(gpointer data)
+{
+	struct recorder_writer *w = data;
+
+	g_mutex_lock(w->mutex);
+
+	while (true) {
+		struct recorder_buffer *buffer = g_queue_pop_head(w->full);
+		GError *error = NULL;
+
+		if (buffer == NULL) {
+			if (w->quit)
+				break;
+
+			g_cond_wait(w->cond, w->mutex);
+			continue;
+		}
+
+		if (w->error == NULL) {
+			bool success;
+
+			g_mutex_unlock(w->mutex);
+			success = recorder_writer_write_buffer(w, buffer,
+							       &error);
+			g_mutex_lock(w->mutex);
+
+			if (!success) {
+				g_warning("%s", error->message);
+				w->error = error;
+			}
+		}
+
+		if (buffer->close)
+			recorder_file_close(buffer->file);
+
+		g_queue_push_tail(w->empty, buffer);
+		g_cond_broadcast(w->cond);
+	}
+
+	g_mutex_unlock(w->mutex);
+
+	return NULL;
+}
+
+struct recorder_writer *
+recorder_writer_new(bool direct, GError **error_r)
+{
+	struct recorder_writer *w = g_new(struct recorder_writer, 1);
+
+	w->direct = direct;
+	w->file = NULL;
+	w->current = NULL;
+
+	w->mutex = g_mutex_new();
+	w->cond = g_cond_new();
+	w->full = g_queue_new();
+	w->empty = g_queue_new();
+	w->quit = false;
+	w->error = NULL;
+
+	w->timer = g_timer_new();
+	memset(&w->stats, 0, sizeof(w->stats));
+	w->total_latency = 0;
+
+	for (unsigned i = 0; i < RECORDER_NUM_BUFFERS; ++i) {
+		struct recorder_buffer *buffer =
+			g_new(struct recorder_buffer, 1);
+		void *p;
+
+		if (posix_memalign(&p, RECORDER_BUFFER_ALIGN,
+				   RECORDER_BUFFER_SIZE) != 0)
+			g_error("out of memory");
+
+		buffer->data = p;
+		g_queue_push_tail(w->empty, buffer);
+	}
+
+	w->thread = g_thread_create(recorder_writer_run, w, true, error_r);
+	if (w->thread == NULL) {
+		w->quit = true;
+		recorder_writer_free(w);
+		return NULL;
+	}
+
+	return w;
+}
+
+static void
+recorder_buffer_free(gpointer data, G_GNUC_UNUSED gpointer user_data)
+{
+	struct recorder_buffer *buffer = data;
+
+	free(buffer->data);
+	g_free(buffer);
+}
+
+/**
+ * Passes a buffer to the writer thread.
+ */
+static void
+recorder_writer_submit(struct recorder_writer *w,
+		       struct recorder_buffer *buffer)
+{
+	g_mutex_lock(w->mutex);
+	g_queue_push_tail(w->full, buffer);
+	g_cond_broadcast(w->cond);
+	g_mutex_unlock(w->mutex);
+}
+
+/**
+ * Obtains an empty buffer for the current file.  Waits until the
+ * writer thread has finished one if there is none.
+ */
+static struct recorder_buffer *
+recorder_writer_get_buffer(struct recorder_writer *w)
+{
+	struct recorder_buffer *buffer;
+
+	g_mutex_lock(w->mutex);
+
+	if (g_queue_is_empty(w->empty)) {
+		++w->stats.waits;
+
+		do {
+			g_cond_wait(w->cond, w->mutex);
+		} while (g_queue_is_empty(w->empty));
+	}
+
+	buffer = g_queue_pop_head(w->empty);
+
+	g_mutex_unlock(w->mutex);
+
+	buffer->file = w->file;
+	buffer->close = false;
+	buffer->length = 0;
+	return buffer;
+}
+
+/**
+ * Submits the rest of the current file, and lets the writer thread
+ * close it.
+ */
+static void
+recorder_writer_close_file(struct recorder_writer *w)
+{
+	struct recorder_buffer *buffer;
+
+	if (w->file == NULL)
+		return;
+
+	buffer = w->current != NULL
+		? w->current
+		: recorder_writer_get_buffer(w);
+	w->current = NULL;
+
+	buffer->close = true;
+	recorder_writer_submit(w, buffer);
+
+	w->file = NULL;
+}
+
+void
+recorder_writer_free(struct recorder_writer *w)
+{
+	struct recorder_writer_stats stats;
+
+	recorder_writer_close_file(w);
+
+	if (w->thread != NULL) {
+		g_mutex_lock(w->mutex);
+		w->quit = true;
+		g_cond_broadcast(w->cond);
+		g_mutex_unlock(w->mutex);
+
+		g_thread_join(w->thread);
+
+		recorder_writer_get_stats(w, &stats);
+		g_debug("%u writes, %" G_GUINT64_FORMAT " bytes, "
+			"latency avg=%.1fms max=%.1fms, waited %u times",
+			stats.writes, stats.bytes,
+			stats.average_latency * 1000,
+			stats.max_latency * 1000, stats.waits);
+	}
+
+	assert(g_queue_is_empty(w->full));
+
+	g_queue_foreach(w->empty, recorder_buffer_free, NULL);
+	g_queue_free(w->empty);
+	g_queue_free(w->full);
+
+	if (w->error != NULL)
+		g_error_free(w->error);
+
+	g_timer_destroy(w->timer);
+	g_cond_free(w->cond);
+	g_mutex_free(w->mutex);
+	g_free(w);
+}
+
+bool
+recorder_writer_open_file(struct recorder_writer *w, const char *path,
+			  GError **error_r)
+{
+	struct recorder_file *file;
+	int flags = O_CREAT|O_WRONLY|O_TRUNC, fd;
+	bool direct = false;
+
+#ifdef O_DIRECT
+	if (w->direct) {
+		fd = open_cloexec(path, flags|O_DIRECT, 0666);
+		if (fd >= 0)
+			direct = true;
+		else if (errno == EINVAL)
+			/* the file system does not support O_DIRECT */
+			fd = open_cloexec(path, flags, 0666);
+	} else
+#endif
+		fd = open_cloexec(path, flags, 0666);
+
+	if (fd < 0) {
+		g_set_error(error_r, recorder_writer_quark(), 0,
+			    "Failed to create '%s': %s",
+			    path, g_strerror(errno));
+		return false;
+	}
+
+	recorder_writer_close_file(w);
+
+	file = g_new(struct recorder_file, 1);
+	file->path = g_strdup(path);
+	file->fd = fd;
+	file->direct = direct;
+
+	w->file = file;
+	return true;
+}
+
+bool
+recorder_writer_write(struct recorder_writer *w,
+		      const void *data, size_t length, GError **error_r)
+{
+	const char *p = data;
+
+	assert(w->file != NULL);
+
+	g_mutex_lock(w->mutex);
+	if (w->error != NULL) {
+		g_propagate_error(error_r, g_error_copy(w->error));
+		g_mutex_unlock(w->mutex);
+		return false;
+	}
+	g_mutex_unlock(w->mutex);
+
+	while (length > 0) {
+		struct recorder_buffer *buffer;
+		size_t nbytes;
+
+		if (w->current == NULL)
+			w->current = recorder_writer_get_buffer(w);
+
+		buffer = w->current;
+
+		nbytes = RECORDER_BUFFER_SIZE - buffer->length;
+		if (nbytes > length)
+			nbytes = length;
+
+		memcpy(buffer->data + buffer->length, p, nbytes);
+		buffer->length += nbytes;
+		p += nbytes;
+		length -= nbytes;
+
+		if (buffer->length == RECORDER_BUFFER_SIZE) {
+			w->current = NULL;
+			recorder_writer_submit(w, buffer);
+		}
+	}
+
+	return true;
+}
+
+void
+recorder_writer_get_stats(struct recorder_writer *w,
+			  struct recorder_writer_stats *stats)
+{
+	g_mutex_lock(w->mutex);
+
+	*stats = w->stats;
+	stats->average_latency = w->stats.writes > 0
+		? w->total_latency / w->stats.writes
+		: 0;
+
+	g_mutex_unlock(w->mutex);
+}
@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2003-2010 The Music Player Daemon Project
+ * http://www.musicpd.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/** \file
+ *
+ * Writes files for the "recorder" audio output plugin in a separate
+ * thread.  Data is collected in large aligned buffers, which are
+ * written by the thread, so a busy disk only delays the writer
+ * thread.
+ */
+
+#ifndef MPD_OUTPUT_RECORDER_WRITER_H
+#define MPD_OUTPUT_RECORDER_WRITER_H
+
+#include <glib.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct recorder_writer_stats {
+	/**
+	 * The number of write() calls, and the number of bytes
+	 * written.
+	 */
+	unsigned writes;
+	guint64 bytes;
+
+	/**
+	 * The average and the maximum duration of a write() call
+	 * [s].
+	 */
+	double average_latency, max_latency;
+
+	/**
+	 * How often did the producer have to wait for a free buffer?
+	 */
+	unsigned waits;
+};
+
+/**
+ * Creates a new writer, and starts its thread.
+ *
+ * @param direct open files with O_DIRECT, bypassing the page cache
+ * (if supported by the operating system)
+ */
+struct recorder_writer *
+recorder_writer_new(bool direct, GError **error_r);
+
+/**
+ * Writes all pending data, closes the file, and stops the thread.
+ */
+void
+recorder_writer_free(struct recorder_writer *w);
+
+/**
+ * Creates a new file.  All further data is written to it.  The
+ * previous file is closed by the writer thread after its data has
+ * been written.
+ */
+bool
+recorder_writer_open_file(struct recorder_writer *w, const char *path,
+			  GError **error_r);
+
+/**
+ * Appends data to the current file.  Blocks only if all buffers are
+ * waiting to be written.
+ *
+ * @return false if a previous write has failed
+ */
+bool
+recorder_writer_write(struct recorder_writer *w,
+		      const void *data, size_t length, GError **error_r);
+
+void
+recorder_writer_get_stats(struct recorder_writer *w,
+			  struct recorder_writer_stats *stats);
+
+#endif
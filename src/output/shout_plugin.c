@@ -21,6 +21,7 @@
 #include "output_api.h"
 #include "encoder_plugin.h"
 #include "encoder_list.h"
+#include "encoder_thread.h"
 
 #include <shout/shout.h>
 #include <glib.h>
@@ -34,6 +35,11 @@
 
 #define DEFAULT_CONN_TIMEOUT  2
 
+/**
+ * The maximum amount of PCM data queued for the encoder thread.
+ */
+#define SHOUT_QUEUE_SIZE (256 * 1024)
+
 struct shout_buffer {
 	unsigned char data[32768];
 	size_t len;
@@ -45,6 +51,12 @@ struct shout_data {
 
 	struct encoder *encoder;
 
+	/**
+	 * Runs the encoder and sends the encoded data to the server.
+	 * Exists while the device is open.
+	 */
+	struct encoder_thread *thread;
+
 	float quality;
 	int bitrate;
 
@@ -349,6 +361,26 @@ write_page(struct shout_data *sd, GError **error)
 	return true;
 }
 
+/**
+ * Sends the encoded data to the server.  Called in the encoder
+ * thread.
+ */
+static bool
+shout_encoded(void *ctx, G_GNUC_UNUSED size_t length, GError **error_r)
+{
+	struct shout_data *sd = ctx;
+
+	return write_page(sd, error_r);
+}
+
+static bool
+shout_send_tag(void *ctx, const struct tag *tag, GError **error_r);
+
+static const struct encoder_thread_handler shout_encoder_handler = {
+	.encoded = shout_encoded,
+	.tag = shout_send_tag,
+};
+
 static void close_shout_conn(struct shout_data * sd)
 {
 	sd->buf.len = 0;
@@ -383,16 +415,19 @@ static void my_shout_finish_driver(void *data)
 
 static void my_shout_drop_buffered_audio(void *data)
 {
-	G_GNUC_UNUSED
 	struct shout_data *sd = (struct shout_data *)data;
 
-	/* needs to be implemented for shout */
+	encoder_thread_cancel(sd->thread);
 }
 
 static void my_shout_close_device(void *data)
 {
 	struct shout_data *sd = (struct shout_data *)data;
 
+	/* send everything which is still queued */
+	encoder_thread_drain(sd->thread, NULL);
+	encoder_thread_free(sd->thread);
+
 	close_shout_conn(sd);
 }
 
@@ -430,13 +465,27 @@ my_shout_open_device(void *data, struct audio_format *audio_format,
 
 	sd->buf.len = 0;
 
-	ret = encoder_open(sd->encoder, audio_format, error) &&
-		write_page(sd, error);
+	ret = encoder_open(sd->encoder, audio_format, error);
 	if (!ret) {
 		shout_close(sd->shout_conn);
 		return false;
 	}
 
+	ret = write_page(sd, error);
+	if (ret) {
+		sd->thread = encoder_thread_new(sd->encoder, audio_format,
+						SHOUT_QUEUE_SIZE,
+						&shout_encoder_handler, sd,
+						error);
+		ret = sd->thread != NULL;
+	}
+
+	if (!ret) {
+		encoder_close(sd->encoder);
+		shout_close(sd->shout_conn);
+		return false;
+	}
+
 	return true;
 }
 
@@ -445,8 +494,7 @@ my_shout_play(void *data, const void *chunk, size_t size, GError **error)
 {
 	struct shout_data *sd = (struct shout_data *)data;
 
-	return encoder_write(sd->encoder, chunk, size, error) &&
-		write_page(sd, error)
+	return encoder_thread_write(sd->thread, chunk, size, error)
 		? size
 		: 0;
 }
@@ -492,10 +540,14 @@ shout_tag_to_metadata(const struct tag *tag, char *dest, size_t size)
 	snprintf(dest, size, "%s - %s", title, artist);
 }
 
-static void my_shout_set_tag(void *data,
-			     const struct tag *tag)
+/**
+ * Sends a tag to the server.  Called in the encoder thread, in stream
+ * order.
+ */
+static bool
+shout_send_tag(void *ctx, const struct tag *tag, GError **error_r)
 {
-	struct shout_data *sd = (struct shout_data *)data;
+	struct shout_data *sd = ctx;
 	bool ret;
 	GError *error = NULL;
 
@@ -506,12 +558,12 @@ static void my_shout_set_tag(void *data,
 		if (!ret) {
 			g_warning("%s", error->message);
 			g_error_free(error);
-			return;
+			return true;
 		}
 
-		ret = write_page(sd, NULL);
+		ret = write_page(sd, error_r);
 		if (!ret)
-			return;
+			return false;
 
 		ret = encoder_tag(sd->encoder, tag, &error);
 		if (!ret) {
@@ -531,7 +583,15 @@ static void my_shout_set_tag(void *data,
 		}
 	}
 
-	write_page(sd, NULL);
+	return write_page(sd, error_r);
+}
+
+static void my_shout_set_tag(void *data,
+			     const struct tag *tag)
+{
+	struct shout_data *sd = (struct shout_data *)data;
+
+	encoder_thread_tag(sd->thread, tag);
 }
 
 const struct audio_output_plugin shoutPlugin = {
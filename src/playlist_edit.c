@@ -321,9 +321,52 @@ playlist_delete_id(struct playlist *playlist, unsigned id)
 void
 playlist_delete_song(struct playlist *playlist, const struct song *song)
 {
-	for (int i = queue_length(&playlist->queue) - 1; i >= 0; --i)
-		if (song == queue_get(&playlist->queue, i))
-			playlist_delete(playlist, i);
+	const struct song *queued;
+	unsigned *positions, num_positions;
+	bool modified = false;
+
+	queued = playlist_get_queued_song(playlist);
+
+	/* the current song needs special treatment: playback has to
+	   be stopped or advanced to the next song */
+
+	while (playlist->current >= 0 &&
+	       queue_get_order(&playlist->queue, playlist->current) == song) {
+		playlist_delete_internal(playlist,
+					 queue_order_to_position(&playlist->queue,
+								 playlist->current),
+					 &queued);
+		modified = true;
+	}
+
+	/* delete all other occurrences in one pass */
+
+	num_positions = queue_song_positions(&playlist->queue, song,
+					     &positions);
+	if (num_positions > 0) {
+		if (playlist->current >= 0) {
+			unsigned before_current = 0;
+
+			for (unsigned i = 0; i < num_positions; ++i)
+				if (queue_position_to_order(&playlist->queue,
+							    positions[i]) <
+				    (unsigned)playlist->current)
+					++before_current;
+
+			playlist->current -= before_current;
+		}
+
+		queue_delete_positions(&playlist->queue, positions,
+				       num_positions);
+		modified = true;
+	}
+
+	g_free(positions);
+
+	if (modified) {
+		playlist_increment_version(playlist);
+		playlist_update_queued_song(playlist, queued);
+	}
 
 	pc_song_deleted(song);
 }
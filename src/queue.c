@@ -21,6 +21,8 @@
 #include "queue.h"
 #include "song.h"
 
+#include <stdlib.h>
+
 /**
  * Generate a non-existing id number.
  */
@@ -34,11 +36,276 @@ queue_generate_id(const struct queue *queue)
 
 		if (cur >= queue->max_length * QUEUE_HASH_MULT)
 			cur = 0;
-	} while (queue->id_to_position[cur] != -1);
+	} while (queue->id_to_slot[cur] != -1);
 
 	return cur;
 }
 
+static inline struct queue_item *
+queue_item_by_id(struct queue *queue, unsigned id)
+{
+	assert(queue->id_to_slot[id] >= 0);
+
+	return &queue->items[queue->id_to_slot[id]];
+}
+
+/**
+ * Registers a new queue item in the song_to_ids map.
+ */
+static void
+queue_song_map_add(struct queue *queue, struct queue_item *item)
+{
+	unsigned head = GPOINTER_TO_UINT(g_hash_table_lookup(queue->song_to_ids,
+							     item->song));
+
+	item->song_prev = -1;
+	item->song_next = (int)head - 1;
+
+	if (head > 0)
+		queue_item_by_id(queue, head - 1)->song_prev = item->id;
+
+	g_hash_table_insert(queue->song_to_ids, item->song,
+			    GUINT_TO_POINTER(item->id + 1));
+}
+
+/**
+ * Unregisters a queue item from the song_to_ids map.
+ */
+static void
+queue_song_map_remove(struct queue *queue, const struct queue_item *item)
+{
+	if (item->song_prev >= 0)
+		queue_item_by_id(queue, item->song_prev)->song_next =
+			item->song_next;
+	else if (item->song_next >= 0)
+		g_hash_table_insert(queue->song_to_ids, item->song,
+				    GUINT_TO_POINTER(item->song_next + 1));
+	else
+		g_hash_table_remove(queue->song_to_ids, item->song);
+
+	if (item->song_next >= 0)
+		queue_item_by_id(queue, item->song_next)->song_prev =
+			item->song_prev;
+}
+
+/**
+ * Forget all entries in the change log.  Versions older than
+ * #since can not be answered from the log anymore.
+ */
+static void
+queue_changes_reset(struct queue *queue, uint32_t since)
+{
+	queue->changes_start = 0;
+	queue->changes_count = 0;
+	queue->changes_since = since;
+}
+
+/**
+ * Appends an entry to the change log.  If the ring buffer is full,
+ * the oldest entry is discarded.
+ */
+static void
+queue_changes_add(struct queue *queue, unsigned position)
+{
+	unsigned last;
+
+	if (queue->changes_count > 0) {
+		last = (queue->changes_start + queue->changes_count - 1)
+			% queue->max_length;
+		if (queue->changes[last].version == queue->version &&
+		    queue->changes[last].position == position)
+			/* duplicate */
+			return;
+	}
+
+	if (queue->changes_count == queue->max_length) {
+		/* trim the log; this must not lower #changes_since,
+		   because queue_changes_reset() may have raised it
+		   to disable the log after a version wrap */
+		uint32_t since =
+			queue->changes[queue->changes_start].version + 1;
+		if (since > queue->changes_since)
+			queue->changes_since = since;
+
+		queue->changes_start = (queue->changes_start + 1)
+			% queue->max_length;
+		--queue->changes_count;
+	}
+
+	last = (queue->changes_start + queue->changes_count)
+		% queue->max_length;
+	queue->changes[last] = (struct queue_change){
+		.version = queue->version,
+		.position = position,
+	};
+
+	++queue->changes_count;
+}
+
+/**
+ * Records that all positions starting with the specified one were
+ * shifted in the current version.
+ */
+static void
+queue_shifts_add(struct queue *queue, unsigned position)
+{
+	/* older shifts at or after this position are covered by the
+	   new one */
+	while (queue->num_shifts > 0 &&
+	       queue->shifts[queue->num_shifts - 1].position >= position)
+		--queue->num_shifts;
+
+	if (queue->num_shifts > 0 &&
+	    queue->shifts[queue->num_shifts - 1].version == queue->version)
+		/* an older shift in this version covers more
+		   positions */
+		return;
+
+	assert(queue->num_shifts < queue->max_length);
+
+	queue->shifts[queue->num_shifts++] = (struct queue_shift){
+		.version = queue->version,
+		.position = position,
+	};
+}
+
+unsigned
+queue_shifted_since(const struct queue *queue, uint32_t version)
+{
+	unsigned a = 0, b = queue->num_shifts;
+
+	/* find the oldest shift which is not older than the specified
+	   version; it has the lowest position */
+
+	while (a < b) {
+		unsigned i = (a + b) / 2;
+
+		if (queue->shifts[i].version < version)
+			a = i + 1;
+		else
+			b = i;
+	}
+
+	return a < queue->num_shifts
+		? queue->shifts[a].position
+		: G_MAXUINT;
+}
+
+static inline struct queue_item *
+queue_item(struct queue *queue, unsigned position)
+{
+	assert(position < queue->length);
+
+	return &queue->items[queue_index_to_slot(queue, queue->head,
+						 position)];
+}
+
+/**
+ * Marks the song at the specified position as "modified" in the
+ * current version.
+ */
+static void
+queue_touch(struct queue *queue, unsigned position)
+{
+	queue_item(queue, position)->version = queue->version;
+	queue_changes_add(queue, position);
+}
+
+#ifndef NDEBUG
+/**
+ * Checks whether the #id_to_slot and #id_to_order_slot arrays are
+ * consistent with the #items and #order arrays, for the specified
+ * range of positions and order numbers.  This is only used in
+ * assertions.
+ */
+static bool
+queue_order_consistent(const struct queue *queue,
+		       unsigned start, unsigned end)
+{
+	for (unsigned i = start; i < end; ++i) {
+		unsigned slot = queue_index_to_slot(queue, queue->head, i);
+		unsigned order_slot = queue_index_to_slot(queue,
+							  queue->order_head, i);
+		unsigned id = queue->order[order_slot];
+
+		if (queue->id_to_slot[queue->items[slot].id] != (int)slot ||
+		    id >= queue->max_length * QUEUE_HASH_MULT ||
+		    queue->id_to_slot[id] < 0 ||
+		    queue->id_to_order_slot[id] != order_slot)
+			return false;
+	}
+
+	return true;
+}
+#endif
+
+static int
+queue_position_cmp(const void *a, const void *b)
+{
+	unsigned x = *(const unsigned *)a, y = *(const unsigned *)b;
+
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+bool
+queue_get_changes(const struct queue *queue, uint32_t version,
+		  unsigned **positions_r, unsigned *num_positions_r)
+{
+	unsigned n = 0, *positions, num_positions = 0, first;
+
+	if (version > queue->version || version < queue->changes_since)
+		return false;
+
+	/* all songs after this position have been shifted */
+	first = queue_shifted_since(queue, version);
+	if (first > queue->length)
+		first = queue->length;
+
+	/* count the log entries which are relevant, walking backwards
+	   from the newest one */
+
+	while (n < queue->changes_count &&
+	       queue->changes[(queue->changes_start + queue->changes_count
+			       - 1 - n) % queue->max_length].version >= version)
+		++n;
+
+	if (n >= first)
+		/* a full scan is cheaper */
+		return false;
+
+	positions = g_new(unsigned, n + queue->length - first);
+	for (unsigned i = queue->changes_count - n;
+	     i < queue->changes_count; ++i) {
+		unsigned position = queue->changes[(queue->changes_start + i)
+						   % queue->max_length].position;
+
+		/* the log doesn't record deletions; positions beyond
+		   the end are stale */
+		if (position < first &&
+		    queue_song_newer(queue, position, version))
+			positions[num_positions++] = position;
+	}
+
+	if (num_positions > 1)
+		qsort(positions, num_positions, sizeof(positions[0]),
+		      queue_position_cmp);
+
+	/* eliminate duplicates */
+	n = num_positions;
+	num_positions = 0;
+	for (unsigned i = 0; i < n; ++i)
+		if (num_positions == 0 ||
+		    positions[num_positions - 1] != positions[i])
+			positions[num_positions++] = positions[i];
+
+	for (unsigned i = first; i < queue->length; ++i)
+		positions[num_positions++] = i;
+
+	*positions_r = positions;
+	*num_positions_r = num_positions;
+	return true;
+}
+
 int
 queue_next_order(const struct queue *queue, unsigned order)
 {
@@ -70,9 +337,15 @@ queue_increment_version(struct queue *queue)
 
 	if (queue->version >= max) {
 		for (unsigned i = 0; i < queue->length; i++)
-			queue->items[i].version = 0;
+			queue_item(queue, i)->version = 0;
 
 		queue->version = 1;
+		queue->num_shifts = 0;
+
+		/* songs with version 0 are "newer" than any version,
+		   and they are not in the log: disable it until the
+		   next queue_modify_all() or queue_clear() */
+		queue_changes_reset(queue, G_MAXUINT32);
 	}
 }
 
@@ -83,8 +356,8 @@ queue_modify(struct queue *queue, unsigned order)
 
 	assert(order < queue->length);
 
-	position = queue->order[order];
-	queue->items[position].version = queue->version;
+	position = queue_order_to_position(queue, order);
+	queue_touch(queue, position);
 
 	queue_increment_version(queue);
 }
@@ -93,7 +366,13 @@ void
 queue_modify_all(struct queue *queue)
 {
 	for (unsigned i = 0; i < queue->length; i++)
-		queue->items[i].version = queue->version;
+		queue_item(queue, i)->version = queue->version;
+
+	queue->num_shifts = 0;
+
+	/* logging every song would flood the change log; instead,
+	   older versions will fall back to a full scan */
+	queue_changes_reset(queue, queue->version + 1);
 
 	queue_increment_version(queue);
 }
@@ -102,17 +381,24 @@ unsigned
 queue_append(struct queue *queue, struct song *song)
 {
 	unsigned id = queue_generate_id(queue);
+	unsigned slot, order_slot;
 
 	assert(!queue_is_full(queue));
 
-	queue->items[queue->length] = (struct queue_item){
+	slot = queue_index_to_slot(queue, queue->head, queue->length);
+	queue->items[slot] = (struct queue_item){
 		.song = song,
 		.id = id,
 		.version = queue->version,
 	};
 
-	queue->order[queue->length] = queue->length;
-	queue->id_to_position[id] = queue->length;
+	order_slot = queue_index_to_slot(queue, queue->order_head,
+					 queue->length);
+	queue->order[order_slot] = id;
+	queue->id_to_order_slot[id] = order_slot;
+	queue->id_to_slot[id] = slot;
+	queue_song_map_add(queue, &queue->items[slot]);
+	queue_changes_add(queue, queue->length);
 
 	++queue->length;
 
@@ -122,35 +408,76 @@ queue_append(struct queue *queue, struct song *song)
 void
 queue_swap(struct queue *queue, unsigned position1, unsigned position2)
 {
-	struct queue_item tmp;
-	unsigned id1 = queue->items[position1].id;
-	unsigned id2 = queue->items[position2].id;
+	struct queue_item tmp, *item1, *item2;
+	unsigned id1, id2, order_slot1, order_slot2;
+
+	item1 = queue_item(queue, position1);
+	item2 = queue_item(queue, position2);
+	id1 = item1->id;
+	id2 = item2->id;
+
+	tmp = *item1;
+	*item1 = *item2;
+	*item2 = tmp;
 
-	tmp = queue->items[position1];
-	queue->items[position1] = queue->items[position2];
-	queue->items[position2] = tmp;
+	queue_touch(queue, position1);
+	queue_touch(queue, position2);
 
-	queue->items[position1].version = queue->version;
-	queue->items[position2].version = queue->version;
+	queue->id_to_slot[id1] = item2 - queue->items;
+	queue->id_to_slot[id2] = item1 - queue->items;
 
-	queue->id_to_position[id1] = position2;
-	queue->id_to_position[id2] = position1;
+	/* the order numbers refer to positions, not to songs: swap
+	   them, too */
+
+	order_slot1 = queue->id_to_order_slot[id1];
+	order_slot2 = queue->id_to_order_slot[id2];
+	queue->order[order_slot1] = id2;
+	queue->order[order_slot2] = id1;
+	queue->id_to_order_slot[id1] = order_slot2;
+	queue->id_to_order_slot[id2] = order_slot1;
 }
 
 static void
 queue_move_song_to(struct queue *queue, unsigned from, unsigned to)
 {
-	unsigned from_id = queue->items[from].id;
+	struct queue_item *dest = queue_item(queue, to);
 
-	queue->items[to] = queue->items[from];
-	queue->items[to].version = queue->version;
-	queue->id_to_position[from_id] = to;
+	*dest = *queue_item(queue, from);
+	queue->id_to_slot[dest->id] = dest - queue->items;
+	queue_touch(queue, to);
+}
+
+/**
+ * Resets the order numbers of a (position) range to "normal" order.
+ * This is used after songs have been moved while random mode is
+ * disabled.
+ */
+static void
+queue_order_sync(struct queue *queue, unsigned start, unsigned end)
+{
+	for (unsigned i = start; i < end; ++i) {
+		unsigned id = queue_item(queue, i)->id;
+		unsigned order_slot = queue_index_to_slot(queue,
+							  queue->order_head,
+							  i);
+
+		queue->order[order_slot] = id;
+		queue->id_to_order_slot[id] = order_slot;
+	}
+}
+
+void
+queue_restore_order(struct queue *queue)
+{
+	queue_order_sync(queue, 0, queue->length);
+
+	assert(queue_order_consistent(queue, 0, queue->length));
 }
 
 void
 queue_move(struct queue *queue, unsigned from, unsigned to)
 {
-	struct queue_item item = queue->items[from];
+	struct queue_item item = *queue_item(queue, from);
 
 	/* move songs to one less in from->to */
 
@@ -164,23 +491,20 @@ queue_move(struct queue *queue, unsigned from, unsigned to)
 
 	/* put song at _to_ */
 
-	queue->id_to_position[item.id] = to;
-	queue->items[to] = item;
-	queue->items[to].version = queue->version;
-
-	/* now deal with order */
-
-	if (queue->random) {
-		for (unsigned i = 0; i < queue->length; i++) {
-			if (queue->order[i] > from && queue->order[i] <= to)
-				queue->order[i]--;
-			else if (queue->order[i] < from &&
-				 queue->order[i] >= to)
-				queue->order[i]++;
-			else if (from == queue->order[i])
-				queue->order[i] = to;
-		}
-	}
+	*queue_item(queue, to) = item;
+	queue->id_to_slot[item.id] =
+		queue_index_to_slot(queue, queue->head, to);
+	queue_touch(queue, to);
+
+	/* now deal with order: in random mode, the order numbers
+	   follow the songs they refer to, because #order contains
+	   song ids */
+
+	if (!queue->random)
+		queue_order_sync(queue, MIN(from, to), MAX(from, to) + 1);
+
+	assert(queue_order_consistent(queue, MIN(from, to),
+				      MAX(from, to) + 1));
 }
 
 void
@@ -189,7 +513,7 @@ queue_move_range(struct queue *queue, unsigned start, unsigned end, unsigned to)
 	struct queue_item items[end - start];
 	// Copy the original block [start,end-1]
 	for (unsigned i = start; i < end; i++)
-		items[i - start] = queue->items[i];
+		items[i - start] = *queue_item(queue, i);
 
 	// If to > start, we need to move to-start items to start, starting from end
 	for (unsigned i = end; i < end + to - start; i++)
@@ -204,23 +528,121 @@ queue_move_range(struct queue *queue, unsigned start, unsigned end, unsigned to)
 	// Copy the original block back in, starting at to.
 	for (unsigned i = start; i< end; i++)
 	{
-		queue->id_to_position[items[i-start].id] = to + i - start;
-		queue->items[to + i - start] = items[i-start];
-		queue->items[to + i - start].version = queue->version;
+		*queue_item(queue, to + i - start) = items[i-start];
+		queue->id_to_slot[items[i-start].id] =
+			queue_index_to_slot(queue, queue->head,
+					    to + i - start);
+		queue_touch(queue, to + i - start);
 	}
 
-	if (queue->random) {
-		// Update the positions in the queue.
-		// Note that the ranges for these cases are the same as the ranges of
-		// the loops above.
-		for (unsigned i = 0; i < queue->length; i++) {
-			if (queue->order[i] >= end && queue->order[i] < to + end - start)
-				queue->order[i] -= end - start;
-			else if (queue->order[i] < start &&
-				 queue->order[i] >= to)
-				queue->order[i] += end - start;
-			else if (start <= queue->order[i] && queue->order[i] < end)
-				queue->order[i] += to - start;
+	// In random mode, the order numbers follow the songs.
+	if (!queue->random)
+		queue_order_sync(queue, MIN(start, to),
+				 MAX(end, to + end - start));
+
+	assert(queue_order_consistent(queue, MIN(start, to),
+				      MAX(end, to + end - start)));
+}
+
+/**
+ * Removes entries from the #items ring buffer, shifting the shorter
+ * side of the ring.  The caller is responsible for releasing the
+ * songs and their ids, and for updating #length.
+ */
+static void
+queue_items_remove(struct queue *queue, const unsigned *positions,
+		   unsigned num_positions)
+{
+	unsigned first = positions[0], last = positions[num_positions - 1];
+	unsigned dest, next;
+
+	if (last < queue->length - first) {
+		/* move the songs before the last deleted one towards
+		   the end */
+
+		dest = last;
+		next = num_positions - 1;
+		for (unsigned i = last; i-- > 0;) {
+			if (next > 0 && positions[next - 1] == i) {
+				--next;
+				continue;
+			}
+
+			struct queue_item *item = queue_item(queue, dest--);
+			*item = *queue_item(queue, i);
+			queue->id_to_slot[item->id] = item - queue->items;
+		}
+
+		queue->head = (queue->head + num_positions)
+			% queue->max_length;
+	} else {
+		/* move the songs after the first deleted one towards
+		   the beginning */
+
+		dest = first;
+		next = 0;
+		for (unsigned i = first; i < queue->length; ++i) {
+			if (next < num_positions && positions[next] == i) {
+				++next;
+				continue;
+			}
+
+			struct queue_item *item = queue_item(queue, dest++);
+			*item = *queue_item(queue, i);
+			queue->id_to_slot[item->id] = item - queue->items;
+		}
+	}
+}
+
+/**
+ * Removes entries from the #order ring buffer, shifting the shorter
+ * side of the ring.
+ *
+ * @param orders a sorted array of order numbers
+ */
+static void
+queue_order_remove(struct queue *queue, const unsigned *orders,
+		   unsigned num_orders)
+{
+	unsigned first = orders[0], last = orders[num_orders - 1];
+	unsigned dest, next, slot, id;
+
+	if (last < queue->length - first) {
+		dest = last;
+		next = num_orders - 1;
+		for (unsigned i = last; i-- > 0;) {
+			if (next > 0 && orders[next - 1] == i) {
+				--next;
+				continue;
+			}
+
+			slot = queue_index_to_slot(queue, queue->order_head,
+						   dest--);
+			id = queue->order[queue_index_to_slot(queue,
+							      queue->order_head,
+							      i)];
+			queue->order[slot] = id;
+			queue->id_to_order_slot[id] = slot;
+		}
+
+		queue->order_head = (queue->order_head + num_orders)
+			% queue->max_length;
+	} else {
+		dest = first;
+		next = 0;
+		for (unsigned i = first; i < queue->length; ++i) {
+			if (next < num_orders && orders[next] == i) {
+				++next;
+				continue;
+			}
+
+			slot = queue_index_to_slot(queue, queue->order_head,
+						   dest++);
+			id = queue->order[queue_index_to_slot(queue,
+							      queue->order_head,
+							      i)];
+			queue->order[slot] = id;
+			queue->id_to_order_slot[id] = slot;
 		}
 	}
 }
@@ -228,54 +650,105 @@ queue_move_range(struct queue *queue, unsigned start, unsigned end, unsigned to)
 void
 queue_delete(struct queue *queue, unsigned position)
 {
-	struct song *song;
-	unsigned id, order;
+	queue_delete_positions(queue, &position, 1);
+}
 
-	assert(position < queue->length);
+void
+queue_delete_positions(struct queue *queue, const unsigned *positions,
+		       unsigned num_positions)
+{
+	unsigned order_buffer, *orders;
 
-	song = queue_get(queue, position);
-	if (!song_in_database(song))
-		song_free(song);
+	if (num_positions == 0)
+		return;
 
-	id = queue_position_to_id(queue, position);
-	order = queue_position_to_order(queue, position);
+	assert(positions[num_positions - 1] < queue->length);
 
-	--queue->length;
+	orders = num_positions > 1
+		? g_new(unsigned, num_positions)
+		: &order_buffer;
 
-	/* release the song id */
+	/* release the songs and their ids */
 
-	queue->id_to_position[id] = -1;
+	for (unsigned i = 0; i < num_positions; ++i) {
+		struct queue_item *item = queue_item(queue, positions[i]);
 
-	/* delete song from songs array */
+		assert(i == 0 || positions[i - 1] < positions[i]);
 
-	for (unsigned i = position; i < queue->length; i++)
-		queue_move_song_to(queue, i + 1, i);
+		orders[i] = queue_position_to_order(queue, positions[i]);
+
+		queue_song_map_remove(queue, item);
+		queue->id_to_slot[item->id] = -1;
+
+		if (!song_in_database(item->song))
+			song_free(item->song);
+	}
 
-	/* delete the entry from the order array */
+	if (num_positions > 1)
+		qsort(orders, num_positions, sizeof(orders[0]),
+		      queue_position_cmp);
 
-	for (unsigned i = order; i < queue->length; i++)
-		queue->order[i] = queue->order[i + 1];
+	queue_items_remove(queue, positions, num_positions);
+	queue_order_remove(queue, orders, num_positions);
 
-	/* readjust values in the order array */
+	queue->length -= num_positions;
 
-	for (unsigned i = 0; i < queue->length; i++)
-		if (queue->order[i] > position)
-			--queue->order[i];
+	/* all songs after the first deleted one have a new
+	   position */
+	queue_shifts_add(queue, positions[0]);
+
+	if (orders != &order_buffer)
+		g_free(orders);
+}
+
+unsigned
+queue_song_positions(const struct queue *queue, const struct song *song,
+		     unsigned **positions_r)
+{
+	unsigned head = GPOINTER_TO_UINT(g_hash_table_lookup(queue->song_to_ids,
+							     song));
+	unsigned *positions, num_positions = 0, capacity = 0;
+	int id;
+
+	positions = NULL;
+	for (id = (int)head - 1; id >= 0;
+	     id = queue->items[queue->id_to_slot[id]].song_next) {
+		if (num_positions == capacity) {
+			capacity = capacity * 2 + 4;
+			positions = g_renew(unsigned, positions, capacity);
+		}
+
+		positions[num_positions++] = queue_id_to_position(queue, id);
+	}
+
+	if (num_positions > 1)
+		qsort(positions, num_positions, sizeof(positions[0]),
+		      queue_position_cmp);
+
+	*positions_r = positions;
+	return num_positions;
 }
 
 void
 queue_clear(struct queue *queue)
 {
 	for (unsigned i = 0; i < queue->length; i++) {
-		struct queue_item *item = &queue->items[i];
+		struct queue_item *item = queue_item(queue, i);
 
 		if (!song_in_database(item->song))
 			song_free(item->song);
 
-		queue->id_to_position[item->id] = -1;
+		queue->id_to_slot[item->id] = -1;
 	}
 
 	queue->length = 0;
+	queue->head = 0;
+	queue->order_head = 0;
+	queue->num_shifts = 0;
+
+	g_hash_table_remove_all(queue->song_to_ids);
+
+	queue_changes_reset(queue, 0);
 }
 
 void
@@ -283,6 +756,8 @@ queue_init(struct queue *queue, unsigned max_length)
 {
 	queue->max_length = max_length;
 	queue->length = 0;
+	queue->head = 0;
+	queue->order_head = 0;
 	queue->version = 1;
 	queue->repeat = false;
 	queue->random = false;
@@ -292,11 +767,22 @@ queue_init(struct queue *queue, unsigned max_length)
 	queue->items = g_new(struct queue_item, max_length);
 	queue->order = g_malloc(sizeof(queue->order[0]) *
 				  max_length);
-	queue->id_to_position = g_malloc(sizeof(queue->id_to_position[0]) *
-				       max_length * QUEUE_HASH_MULT);
+	queue->id_to_slot = g_malloc(sizeof(queue->id_to_slot[0]) *
+				     max_length * QUEUE_HASH_MULT);
+	queue->id_to_order_slot =
+		g_malloc(sizeof(queue->id_to_order_slot[0]) *
+			 max_length * QUEUE_HASH_MULT);
 
 	for (unsigned i = 0; i < max_length * QUEUE_HASH_MULT; ++i)
-		queue->id_to_position[i] = -1;
+		queue->id_to_slot[i] = -1;
+
+	queue->shifts = g_new(struct queue_shift, max_length);
+	queue->num_shifts = 0;
+
+	queue->song_to_ids = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	queue->changes = g_new(struct queue_change, max_length);
+	queue_changes_reset(queue, 0);
 
 	queue->rand = g_rand_new();
 }
@@ -308,7 +794,11 @@ queue_finish(struct queue *queue)
 
 	g_free(queue->items);
 	g_free(queue->order);
-	g_free(queue->id_to_position);
+	g_free(queue->id_to_slot);
+	g_free(queue->id_to_order_slot);
+	g_free(queue->shifts);
+	g_free(queue->changes);
+	g_hash_table_destroy(queue->song_to_ids);
 
 	g_rand_free(queue->rand);
 }
@@ -322,6 +812,8 @@ queue_shuffle_order(struct queue *queue)
 		queue_swap_order(queue, i,
 				 g_rand_int_range(queue->rand, i,
 						  queue->length));
+
+	assert(queue_order_consistent(queue, 0, queue->length));
 }
 
 void
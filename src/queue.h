@@ -46,6 +46,33 @@ struct queue_item {
 
 	/** when was this item last changed? */
 	uint32_t version;
+
+	/**
+	 * The ids of the previous and the next item which refers to
+	 * the same song, or -1.  See queue.song_to_ids.
+	 */
+	int song_prev, song_next;
+};
+
+/**
+ * One entry in the queue's change log: the song at #position was
+ * modified in #version.
+ */
+struct queue_change {
+	uint32_t version;
+
+	unsigned position;
+};
+
+/**
+ * All positions equal to or greater than #position were shifted
+ * (i.e. modified) in #version.  This is recorded when songs are
+ * deleted, instead of marking each song after the deleted one.
+ */
+struct queue_shift {
+	uint32_t version;
+
+	unsigned position;
 };
 
 /**
@@ -57,6 +84,12 @@ struct queue_item {
  * - the position in the queue
  * - the unique id (which stays the same, regardless of moves)
  * - the order number (which only differs from "position" in random mode)
+ *
+ * The #items and #order arrays are ring buffers of #max_length
+ * elements.  Removing a song shifts only the shorter side of the
+ * ring, so deleting songs at the beginning or at the end of a large
+ * queue (e.g. in "consume" mode) is cheap.  Deleting in the middle
+ * (e.g. "consume" in random mode) and moving songs are still linear.
  */
 struct queue {
 	/** configured maximum length of the queue */
@@ -68,14 +101,65 @@ struct queue {
 	/** the current version number */
 	uint32_t version;
 
-	/** all songs in "position" order */
+	/** all songs in "position" order; position 0 is at #head */
 	struct queue_item *items;
 
-	/** map order numbers to positions */
+	/** the slot in #items which contains position 0 */
+	unsigned head;
+
+	/**
+	 * Map order numbers to song ids; order number 0 is at
+	 * #order_head.
+	 */
 	unsigned *order;
 
-	/** map song ids to positions */
-	int *id_to_position;
+	/** the slot in #order which contains order number 0 */
+	unsigned order_head;
+
+	/** map song ids to slots in #items */
+	int *id_to_slot;
+
+	/** map song ids to slots in #order (the inverse of #order) */
+	unsigned *id_to_order_slot;
+
+	/**
+	 * A stack of #queue_shift objects in ascending version order.
+	 * Shifts which are covered by a newer one are removed, so the
+	 * positions are ascending, too.  Its capacity is
+	 * #max_length.
+	 */
+	struct queue_shift *shifts;
+
+	/** the number of entries in #shifts */
+	unsigned num_shifts;
+
+	/**
+	 * Map song pointers to the first of all queue items which
+	 * refer to it, as GUINT_TO_POINTER(id + 1).  The other items
+	 * are linked with queue_item.song_next.
+	 */
+	GHashTable *song_to_ids;
+
+	/**
+	 * A ring buffer of modified positions in ascending version
+	 * order.  It allows "plchanges" to skip the songs which have
+	 * not been modified.  Its capacity is #max_length.
+	 */
+	struct queue_change *changes;
+
+	/** the index of the oldest entry in #changes */
+	unsigned changes_start;
+
+	/** the number of entries in #changes */
+	unsigned changes_count;
+
+	/**
+	 * The change log is complete for all versions equal to or
+	 * newer than this one.  Older versions require a full scan of
+	 * the queue.  G_MAXUINT32 disables the log until it is reset
+	 * by queue_modify_all() or queue_clear().
+	 */
+	uint32_t changes_since;
 
 	/** repeat playback when the end of the queue has been
 	    reached? */
@@ -140,45 +224,92 @@ queue_valid_order(const struct queue *queue, unsigned order)
 	return order < queue->length;
 }
 
+/**
+ * Converts an index (position or order number) to a slot in a ring
+ * buffer starting at #head.
+ */
+static inline unsigned
+queue_index_to_slot(const struct queue *queue, unsigned head, unsigned i)
+{
+	unsigned slot = head + i;
+
+	assert(i < queue->max_length);
+
+	if (slot >= queue->max_length)
+		slot -= queue->max_length;
+
+	return slot;
+}
+
+/**
+ * Converts a slot in a ring buffer starting at #head to an index
+ * (position or order number).
+ */
+static inline unsigned
+queue_slot_to_index(const struct queue *queue, unsigned head, unsigned slot)
+{
+	assert(slot < queue->max_length);
+
+	return slot >= head
+		? slot - head
+		: slot + queue->max_length - head;
+}
+
+static inline const struct queue_item *
+queue_item_at(const struct queue *queue, unsigned position)
+{
+	assert(position < queue->length);
+
+	return &queue->items[queue_index_to_slot(queue, queue->head,
+						 position)];
+}
+
 static inline int
 queue_id_to_position(const struct queue *queue, unsigned id)
 {
+	int slot;
+
 	if (id >= queue->max_length * QUEUE_HASH_MULT)
 		return -1;
 
-	assert(queue->id_to_position[id] >= -1);
-	assert(queue->id_to_position[id] < (int)queue->length);
+	slot = queue->id_to_slot[id];
+	if (slot < 0)
+		return -1;
 
-	return queue->id_to_position[id];
+	assert(queue_slot_to_index(queue, queue->head, slot) < queue->length);
+
+	return queue_slot_to_index(queue, queue->head, slot);
 }
 
 static inline int
 queue_position_to_id(const struct queue *queue, unsigned position)
 {
-	assert(position < queue->length);
-
-	return queue->items[position].id;
+	return queue_item_at(queue, position)->id;
 }
 
 static inline unsigned
 queue_order_to_position(const struct queue *queue, unsigned order)
 {
+	unsigned id;
+
 	assert(order < queue->length);
 
-	return queue->order[order];
+	id = queue->order[queue_index_to_slot(queue, queue->order_head,
+					      order)];
+	assert(queue->id_to_slot[id] >= 0);
+
+	return queue_slot_to_index(queue, queue->head, queue->id_to_slot[id]);
 }
 
 static inline unsigned
 queue_position_to_order(const struct queue *queue, unsigned position)
 {
-	assert(position < queue->length);
+	unsigned id = queue_item_at(queue, position)->id;
 
-	for (unsigned i = 0;; ++i) {
-		assert(i < queue->length);
+	assert(queue->order[queue->id_to_order_slot[id]] == id);
 
-		if (queue->order[i] == position)
-			return i;
-	}
+	return queue_slot_to_index(queue, queue->order_head,
+				   queue->id_to_order_slot[id]);
 }
 
 /**
@@ -187,9 +318,7 @@ queue_position_to_order(const struct queue *queue, unsigned position)
 static inline struct song *
 queue_get(const struct queue *queue, unsigned position)
 {
-	assert(position < queue->length);
-
-	return queue->items[position].song;
+	return queue_item_at(queue, position)->song;
 }
 
 /**
@@ -201,6 +330,13 @@ queue_get_order(const struct queue *queue, unsigned order)
 	return queue_get(queue, queue_order_to_position(queue, order));
 }
 
+/**
+ * Returns the lowest position which was shifted in the specified
+ * version or later, or G_MAXUINT if there is none.
+ */
+unsigned
+queue_shifted_since(const struct queue *queue, uint32_t version);
+
 /**
  * Is the song at the specified position newer than the specified
  * version?
@@ -209,13 +345,29 @@ static inline bool
 queue_song_newer(const struct queue *queue, unsigned position,
 		 uint32_t version)
 {
-	assert(position < queue->length);
+	const struct queue_item *item = queue_item_at(queue, position);
 
 	return version > queue->version ||
-		queue->items[position].version >= version ||
-		queue->items[position].version == 0;
+		item->version >= version ||
+		item->version == 0 ||
+		position >= queue_shifted_since(queue, version);
 }
 
+/**
+ * Determines the positions of all songs which are newer than the
+ * specified version (see queue_song_newer()), using the change log.
+ *
+ * @param positions_r on success, a sorted array of positions is
+ * returned here; it must be freed with g_free()
+ * @param num_positions_r on success, the number of positions is
+ * returned here
+ * @return false if the change log does not reach back far enough,
+ * and the caller must scan the whole queue
+ */
+bool
+queue_get_changes(const struct queue *queue, uint32_t version,
+		  unsigned **positions_r, unsigned *num_positions_r);
+
 /**
  * Initialize a queue object.
  */
@@ -280,19 +432,27 @@ queue_swap(struct queue *queue, unsigned position1, unsigned position2);
 static inline void
 queue_swap_order(struct queue *queue, unsigned order1, unsigned order2)
 {
-	unsigned tmp = queue->order[order1];
-	queue->order[order1] = queue->order[order2];
-	queue->order[order2] = tmp;
+	unsigned slot1 = queue_index_to_slot(queue, queue->order_head, order1);
+	unsigned slot2 = queue_index_to_slot(queue, queue->order_head, order2);
+	unsigned tmp = queue->order[slot1];
+
+	queue->order[slot1] = queue->order[slot2];
+	queue->order[slot2] = tmp;
+
+	queue->id_to_order_slot[queue->order[slot1]] = slot1;
+	queue->id_to_order_slot[queue->order[slot2]] = slot2;
 }
 
 /**
- * Moves a song to a new position.
+ * Moves a song to a new position.  All songs between the old and
+ * the new position are shifted, so this costs O(|from - to|).
  */
 void
 queue_move(struct queue *queue, unsigned from, unsigned to);
 
 /**
- * Moves a range of songs to a new position.
+ * Moves a range of songs to a new position.  Like queue_move(), this
+ * is linear in the distance and in the size of the range.
  */
 void
 queue_move_range(struct queue *queue, unsigned start, unsigned end, unsigned to);
@@ -303,6 +463,29 @@ queue_move_range(struct queue *queue, unsigned start, unsigned end, unsigned to)
 void
 queue_delete(struct queue *queue, unsigned position);
 
+/**
+ * Removes several songs from the playlist in one pass.
+ *
+ * @param positions an array of positions in ascending order, without
+ * duplicates
+ * @param num_positions the number of elements in the array
+ */
+void
+queue_delete_positions(struct queue *queue, const unsigned *positions,
+		       unsigned num_positions);
+
+/**
+ * Determines the positions of all items which refer to the specified
+ * song.
+ *
+ * @param positions_r a sorted array of positions is returned here; it
+ * must be freed with g_free()
+ * @return the number of positions
+ */
+unsigned
+queue_song_positions(const struct queue *queue, const struct song *song,
+		     unsigned **positions_r);
+
 /**
  * Removes all songs from the playlist.
  */
@@ -312,12 +495,8 @@ queue_clear(struct queue *queue);
 /**
  * Initializes the "order" array, and restores "normal" order.
  */
-static inline void
-queue_restore_order(struct queue *queue)
-{
-	for (unsigned i = 0; i < queue->length; ++i)
-		queue->order[i] = i;
-}
+void
+queue_restore_order(struct queue *queue);
 
 /**
  * Shuffles the virtual order of songs, but does not move them
@@ -73,6 +73,16 @@ void
 queue_print_changes_info(struct client *client, const struct queue *queue,
 			 uint32_t version)
 {
+	unsigned *positions, num_positions;
+
+	if (queue_get_changes(queue, version, &positions, &num_positions)) {
+		for (unsigned i = 0; i < num_positions; ++i)
+			queue_print_song_info(client, queue, positions[i]);
+
+		g_free(positions);
+		return;
+	}
+
 	for (unsigned i = 0; i < queue_length(queue); i++) {
 		if (queue_song_newer(queue, i, version))
 			queue_print_song_info(client, queue, i);
@@ -83,6 +93,19 @@ void
 queue_print_changes_position(struct client *client, const struct queue *queue,
 			     uint32_t version)
 {
+	unsigned *positions, num_positions;
+
+	if (queue_get_changes(queue, version, &positions, &num_positions)) {
+		for (unsigned i = 0; i < num_positions; ++i)
+			client_printf(client, "cpos: %i\nId: %i\n",
+				      positions[i],
+				      queue_position_to_id(queue,
+							   positions[i]));
+
+		g_free(positions);
+		return;
+	}
+
 	for (unsigned i = 0; i < queue_length(queue); i++)
 		if (queue_song_newer(queue, i, version))
 			client_printf(client, "cpos: %i\nId: %i\n",
@@ -70,6 +70,10 @@ static void * update_task(void *_path)
 	if (modified || !db_exists())
 		db_save();
 
+#ifdef ENABLE_ARCHIVE
+	update_archive_save();
+#endif
+
 	if (path != NULL && *path != 0)
 		g_debug("finished: %s", path);
 	else
@@ -162,10 +166,16 @@ void update_global_init(void)
 
 	update_remove_global_init();
 	update_walk_global_init();
+#ifdef ENABLE_ARCHIVE
+	update_archive_global_init();
+#endif
 }
 
 void update_global_finish(void)
 {
+#ifdef ENABLE_ARCHIVE
+	update_archive_global_finish();
+#endif
 	update_walk_global_finish();
 	update_remove_global_finish();
 }
@@ -0,0 +1,325 @@
+/*
+ * Copyright (C) 2003-2010 The Music Player Daemon Project
+ * http://www.musicpd.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * The cache of archive listings.  Enumerating the entries of an
+ * archive may require reading (or decompressing) all of it; the
+ * cache allows the database update to skip this if the archive has
+ * not been modified.  It is stored next to the database.
+ */
+
+#include "config.h"
+#include "update_internal.h"
+#include "text_file.h"
+#include "conf.h"
+
+#include <glib.h>
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define ARCHIVE_BEGIN "archive_begin: "
+#define ARCHIVE_PLUGIN "plugin: "
+#define ARCHIVE_MTIME "mtime: "
+#define ARCHIVE_SIZE "size: "
+#define ARCHIVE_ENTRY "entry: "
+#define ARCHIVE_END "archive_end"
+
+struct archive_listing {
+	char *plugin;
+
+	/**
+	 * The modification time and the size of the archive file.
+	 * The listing is discarded if they change.
+	 */
+	time_t mtime;
+	goffset size;
+
+	/**
+	 * A NULL terminated list of entry names.
+	 */
+	char **entries;
+};
+
+/**
+ * Maps archive paths (file system charset) to struct
+ * archive_listing.  NULL if there is no cache file.
+ */
+static GHashTable *archive_listings;
+
+/**
+ * Protects #archive_listings, which is used by the update thread
+ * and freed by the main thread.
+ */
+static GMutex *archive_listings_mutex;
+
+/**
+ * The path of the cache file.
+ */
+static char *archive_cache_path;
+
+/**
+ * Has the cache been modified since it was saved?
+ */
+static bool archive_cache_modified;
+
+static void
+archive_listing_free(gpointer data)
+{
+	struct archive_listing *listing = data;
+
+	g_free(listing->plugin);
+	g_strfreev(listing->entries);
+	g_free(listing);
+}
+
+static bool
+archive_listing_matches(const struct archive_listing *listing,
+			const struct stat *st, const char *plugin)
+{
+	return listing->mtime == st->st_mtime &&
+		listing->size == (goffset)st->st_size &&
+		strcmp(listing->plugin, plugin) == 0;
+}
+
+static void
+archive_cache_load(FILE *fp)
+{
+	GString *buffer = g_string_sized_new(1024);
+	struct archive_listing *listing = NULL;
+	GPtrArray *entries = NULL;
+	char *line, *path = NULL;
+
+	while ((line = read_text_line(fp, buffer)) != NULL) {
+		if (g_str_has_prefix(line, ARCHIVE_BEGIN)) {
+			if (listing != NULL)
+				break;
+
+			path = g_strdup(line + strlen(ARCHIVE_BEGIN));
+			listing = g_new(struct archive_listing, 1);
+			listing->plugin = NULL;
+			listing->mtime = 0;
+			listing->size = -1;
+			listing->entries = NULL;
+			entries = g_ptr_array_new();
+		} else if (listing == NULL)
+			break;
+		else if (g_str_has_prefix(line, ARCHIVE_PLUGIN)) {
+			g_free(listing->plugin);
+			listing->plugin =
+				g_strdup(line + strlen(ARCHIVE_PLUGIN));
+		} else if (g_str_has_prefix(line, ARCHIVE_MTIME))
+			listing->mtime = (time_t)
+				g_ascii_strtoll(line + strlen(ARCHIVE_MTIME),
+						NULL, 10);
+		else if (g_str_has_prefix(line, ARCHIVE_SIZE))
+			listing->size =
+				g_ascii_strtoll(line + strlen(ARCHIVE_SIZE),
+						NULL, 10);
+		else if (g_str_has_prefix(line, ARCHIVE_ENTRY))
+			g_ptr_array_add(entries,
+					g_strdup(line + strlen(ARCHIVE_ENTRY)));
+		else if (strcmp(line, ARCHIVE_END) == 0 &&
+			 listing->plugin != NULL) {
+			g_ptr_array_add(entries, NULL);
+			listing->entries =
+				(char **)g_ptr_array_free(entries, false);
+			entries = NULL;
+
+			g_hash_table_insert(archive_listings, path, listing);
+			path = NULL;
+			listing = NULL;
+		} else
+			break;
+	}
+
+	if (line != NULL)
+		g_warning("Malformed line in %s: %s",
+			  archive_cache_path, line);
+
+	if (listing != NULL) {
+		/* incomplete listing */
+		g_ptr_array_add(entries, NULL);
+		listing->entries = (char **)g_ptr_array_free(entries, false);
+		archive_listing_free(listing);
+	}
+
+	g_free(path);
+	g_string_free(buffer, true);
+}
+
+void
+update_archive_global_init(void)
+{
+	const char *db_path = config_get_path(CONF_DB_FILE);
+	FILE *fp;
+
+	if (db_path == NULL)
+		return;
+
+	archive_listings = g_hash_table_new_full(g_str_hash, g_str_equal,
+						 g_free, archive_listing_free);
+	archive_listings_mutex = g_mutex_new();
+	archive_cache_path = g_strconcat(db_path, ".archive_cache", NULL);
+	archive_cache_modified = false;
+
+	fp = fopen(archive_cache_path, "r");
+	if (fp != NULL) {
+		archive_cache_load(fp);
+		fclose(fp);
+	}
+}
+
+void
+update_archive_global_finish(void)
+{
+	if (archive_listings == NULL)
+		return;
+
+	g_mutex_lock(archive_listings_mutex);
+	g_hash_table_destroy(archive_listings);
+	archive_listings = NULL;
+	g_mutex_unlock(archive_listings_mutex);
+
+	g_mutex_free(archive_listings_mutex);
+	g_free(archive_cache_path);
+}
+
+char **
+update_archive_lookup(const char *path_fs, const struct stat *st,
+		      const char *plugin)
+{
+	const struct archive_listing *listing;
+	char **entries = NULL;
+
+	if (archive_listings == NULL)
+		return NULL;
+
+	g_mutex_lock(archive_listings_mutex);
+
+	listing = archive_listings != NULL
+		? g_hash_table_lookup(archive_listings, path_fs)
+		: NULL;
+	if (listing != NULL && archive_listing_matches(listing, st, plugin))
+		entries = g_strdupv(listing->entries);
+
+	g_mutex_unlock(archive_listings_mutex);
+
+	return entries;
+}
+
+void
+update_archive_store(const char *path_fs, const struct stat *st,
+		     const char *plugin, char *const*entries)
+{
+	struct archive_listing *listing;
+
+	if (archive_listings == NULL || strchr(path_fs, '\n') != NULL)
+		return;
+
+	for (char *const*p = entries; *p != NULL; ++p)
+		if (strchr(*p, '\n') != NULL)
+			/* can't be stored in the cache file */
+			return;
+
+	listing = g_new(struct archive_listing, 1);
+	listing->plugin = g_strdup(plugin);
+	listing->mtime = st->st_mtime;
+	listing->size = st->st_size;
+	listing->entries = g_strdupv((char **)entries);
+
+	g_mutex_lock(archive_listings_mutex);
+
+	if (archive_listings != NULL) {
+		g_hash_table_insert(archive_listings, g_strdup(path_fs),
+				    listing);
+		archive_cache_modified = true;
+	} else
+		archive_listing_free(listing);
+
+	g_mutex_unlock(archive_listings_mutex);
+}
+
+static void
+archive_cache_save_listing(gpointer key, gpointer value, gpointer user_data)
+{
+	const char *path = key;
+	const struct archive_listing *listing = value;
+	FILE *fp = user_data;
+	struct stat st;
+
+	if (stat(path, &st) < 0 ||
+	    listing->mtime != st.st_mtime ||
+	    listing->size != (goffset)st.st_size)
+		/* forget archives which have been deleted or
+		   modified */
+		return;
+
+	fprintf(fp, ARCHIVE_BEGIN "%s\n", path);
+	fprintf(fp, ARCHIVE_PLUGIN "%s\n", listing->plugin);
+	fprintf(fp, ARCHIVE_MTIME "%lld\n", (long long)listing->mtime);
+	fprintf(fp, ARCHIVE_SIZE "%lld\n", (long long)listing->size);
+
+	for (char **p = listing->entries; *p != NULL; ++p)
+		fprintf(fp, ARCHIVE_ENTRY "%s\n", *p);
+
+	fprintf(fp, ARCHIVE_END "\n");
+}
+
+void
+update_archive_save(void)
+{
+	char *tmp;
+	FILE *fp;
+
+	if (archive_listings == NULL)
+		return;
+
+	g_mutex_lock(archive_listings_mutex);
+
+	if (archive_listings == NULL || !archive_cache_modified) {
+		g_mutex_unlock(archive_listings_mutex);
+		return;
+	}
+
+	tmp = g_strconcat(archive_cache_path, ".tmp", NULL);
+	fp = fopen(tmp, "w");
+	if (fp == NULL) {
+		g_warning("Failed to create %s: %s", tmp, g_strerror(errno));
+	} else {
+		g_hash_table_foreach(archive_listings,
+				     archive_cache_save_listing, fp);
+
+		if (ferror(fp) || fclose(fp) != 0 ||
+		    rename(tmp, archive_cache_path) < 0) {
+			g_warning("Failed to write %s: %s",
+				  archive_cache_path, g_strerror(errno));
+			unlink(tmp);
+		} else
+			archive_cache_modified = false;
+	}
+
+	g_mutex_unlock(archive_listings_mutex);
+
+	g_free(tmp);
+}
@@ -47,6 +47,38 @@ update_walk_global_finish(void);
 bool
 update_walk(const char *path, bool discard);
 
+void
+update_archive_global_init(void);
+
+void
+update_archive_global_finish(void);
+
+/**
+ * Looks up an archive in the cache of archive listings.  The cached
+ * listing is used only if the archive plugin, the modification time
+ * and the size of the file have not changed.
+ *
+ * @param path_fs the path of the archive file (file system charset)
+ * @return a NULL terminated list of entry names (to be freed with
+ * g_strfreev()), or NULL if the archive is not in the cache
+ */
+char **
+update_archive_lookup(const char *path_fs, const struct stat *st,
+		      const char *plugin);
+
+/**
+ * Adds the listing of an archive to the cache.
+ */
+void
+update_archive_store(const char *path_fs, const struct stat *st,
+		     const char *plugin, char *const*entries);
+
+/**
+ * Saves the cache of archive listings if it has been modified.
+ */
+void
+update_archive_save(void);
+
 void
 update_remove_global_init(void);
 
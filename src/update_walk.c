@@ -381,6 +381,42 @@ update_archive_tree(struct directory *directory, char *name)
 	}
 }
 
+/**
+ * Enumerates the entries of an archive file.
+ *
+ * @return a NULL terminated list of entry names (to be freed with
+ * g_strfreev()), or NULL on error
+ */
+static char **
+update_archive_list(const char *path_fs, const struct archive_plugin *plugin)
+{
+	GError *error = NULL;
+	struct archive_file *file;
+	GPtrArray *entries;
+	char *filepath;
+
+	file = archive_file_open(plugin, path_fs, &error);
+	if (file == NULL) {
+		g_warning("%s", error->message);
+		g_error_free(error);
+		return NULL;
+	}
+
+	g_debug("archive %s opened", path_fs);
+
+	entries = g_ptr_array_new();
+
+	archive_file_scan_reset(file);
+
+	while ((filepath = archive_file_scan_next(file)) != NULL)
+		g_ptr_array_add(entries, g_strdup(filepath));
+
+	archive_file_close(file);
+
+	g_ptr_array_add(entries, NULL);
+	return (char **)g_ptr_array_free(entries, false);
+}
+
 /**
  * Updates the file listing from an archive file.
  *
@@ -394,11 +430,9 @@ update_archive_file(struct directory *parent, const char *name,
 		    const struct stat *st,
 		    const struct archive_plugin *plugin)
 {
-	GError *error = NULL;
 	char *path_fs;
-	struct archive_file *file;
 	struct directory *directory;
-	char *filepath;
+	char **entries;
 
 	directory = dirvec_find(&parent->children, name);
 	if (directory != NULL && directory->mtime == st->st_mtime &&
@@ -409,16 +443,22 @@ update_archive_file(struct directory *parent, const char *name,
 
 	path_fs = map_directory_child_fs(parent, name);
 
-	/* open archive */
-	file = archive_file_open(plugin, path_fs, &error);
-	if (file == NULL) {
-		g_free(path_fs);
-		g_warning("%s", error->message);
-		g_error_free(error);
-		return;
+	/* the archive listing does not depend on the "discard" flag,
+	   because no tags are loaded from the archive entries: the
+	   cache may be used for a rescan, too */
+	entries = update_archive_lookup(path_fs, st, plugin->name);
+	if (entries != NULL)
+		g_debug("archive %s listed from cache", path_fs);
+	else {
+		entries = update_archive_list(path_fs, plugin);
+		if (entries == NULL) {
+			g_free(path_fs);
+			return;
+		}
+
+		update_archive_store(path_fs, st, plugin->name, entries);
 	}
 
-	g_debug("archive %s opened", path_fs);
 	g_free(path_fs);
 
 	if (directory == NULL) {
@@ -431,15 +471,13 @@ update_archive_file(struct directory *parent, const char *name,
 
 	directory->mtime = st->st_mtime;
 
-	archive_file_scan_reset(file);
-
-	while ((filepath = archive_file_scan_next(file)) != NULL) {
+	for (char **p = entries; *p != NULL; ++p) {
 		/* split name into directory and file */
-		g_debug("adding archive file: %s", filepath);
-		update_archive_tree(directory, filepath);
+		g_debug("adding archive file: %s", *p);
+		update_archive_tree(directory, *p);
 	}
 
-	archive_file_close(file);
+	g_strfreev(entries);
 }
 #endif
 
@@ -0,0 +1,309 @@
+/*
+ * Copyright (C) 2003-2010 The Music Player Daemon Project
+ * http://www.musicpd.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+/*
+ * This program measures how many reads on the underlying input
+ * plugin are needed to read one minute of CD quality audio (10.1 MB)
+ * from a local file, with and without the read buffer
+ * ("input_buffer_size"), for various request sizes.  For the "file"
+ * plugin, each of these reads is one read() system call, unless the
+ * file is mapped into memory.  The file is read again from the
+ * beginning when its end is reached.
+ */
+
+#include "config.h"
+#include "input_init.h"
+#include "input_plugin.h"
+#include "input_stream.h"
+#include "input/file_input_plugin.h"
+#include "input/buffered_input_plugin.h"
+#include "tag_pool.h"
+#include "conf.h"
+
+#ifdef ENABLE_ARCHIVE
+#include "archive_list.h"
+#endif
+
+#include <glib.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+	/**
+	 * One minute of 44.1 kHz, 16 bit, stereo.
+	 */
+	MINUTE_SIZE = 44100 * 4 * 60,
+};
+
+static const size_t request_sizes[] = {
+	4, 64, 512, 4096, 8192, 40960,
+};
+
+static void
+my_log_func(const gchar *log_domain, GLogLevelFlags log_level,
+	    const gchar *message, G_GNUC_UNUSED gpointer user_data)
+{
+	if (log_level > G_LOG_LEVEL_WARNING)
+		/* the buffer's statistics would disturb the table */
+		return;
+
+	if (log_domain != NULL)
+		g_printerr("%s: %s\n", log_domain, message);
+	else
+		g_printerr("%s\n", message);
+}
+
+/**
+ * A wrapper for the stream opened by the "file" plugin which counts
+ * the reads.
+ */
+struct counting_stream {
+	struct input_stream base;
+
+	struct input_stream *input;
+
+	unsigned reads;
+};
+
+static void
+counting_copy_attributes(struct counting_stream *c)
+{
+	c->base.ready = c->input->ready;
+	c->base.seekable = c->input->seekable;
+	c->base.size = c->input->size;
+	c->base.offset = c->input->offset;
+}
+
+static void
+counting_close(struct input_stream *is)
+{
+	struct counting_stream *c = (struct counting_stream *)is;
+
+	input_stream_close(c->input);
+	input_stream_deinit(&c->base);
+	g_free(c);
+}
+
+static size_t
+counting_read(struct input_stream *is, void *ptr, size_t size,
+	      GError **error_r)
+{
+	struct counting_stream *c = (struct counting_stream *)is;
+	size_t nbytes;
+
+	++c->reads;
+	nbytes = input_stream_read(c->input, ptr, size, error_r);
+	counting_copy_attributes(c);
+	return nbytes;
+}
+
+static bool
+counting_eof(struct input_stream *is)
+{
+	struct counting_stream *c = (struct counting_stream *)is;
+
+	return input_stream_eof(c->input);
+}
+
+static bool
+counting_seek(struct input_stream *is, goffset offset, int whence,
+	      GError **error_r)
+{
+	struct counting_stream *c = (struct counting_stream *)is;
+	bool success;
+
+	success = input_stream_seek(c->input, offset, whence, error_r);
+	counting_copy_attributes(c);
+	return success;
+}
+
+static const void *
+counting_peek(struct input_stream *is, size_t *length_r)
+{
+	struct counting_stream *c = (struct counting_stream *)is;
+
+	return input_stream_peek(c->input, length_r);
+}
+
+static void
+counting_consume(struct input_stream *is, size_t length)
+{
+	struct counting_stream *c = (struct counting_stream *)is;
+
+	input_stream_consume(c->input, length);
+	counting_copy_attributes(c);
+}
+
+static const struct input_plugin counting_input_plugin = {
+	.close = counting_close,
+	.read = counting_read,
+	.eof = counting_eof,
+	.seek = counting_seek,
+	.peek = counting_peek,
+	.consume = counting_consume,
+};
+
+static struct counting_stream *
+counting_open(const char *path)
+{
+	GError *error = NULL;
+	struct input_stream *is;
+	struct counting_stream *c;
+
+	is = input_plugin_file.open(path, &error);
+	if (is == NULL) {
+		if (error != NULL) {
+			g_warning("%s", error->message);
+			g_error_free(error);
+		} else
+			g_printerr("Failed to open %s\n", path);
+		return NULL;
+	}
+
+	c = g_new(struct counting_stream, 1);
+	input_stream_init(&c->base, &counting_input_plugin, path);
+	c->input = is;
+	c->reads = 0;
+	counting_copy_attributes(c);
+
+	return c;
+}
+
+/**
+ * Reads one minute of audio with the specified request size.
+ *
+ * @param buffered read through the read buffer?
+ * @return the number of reads on the underlying stream, or -1 on
+ * error
+ */
+static int
+bench_buffered(const char *path, size_t request_size, bool buffered)
+{
+	GError *error = NULL;
+	struct counting_stream *c = counting_open(path);
+	struct input_stream *is;
+	char *buffer;
+	size_t remaining = MINUTE_SIZE, nbytes;
+	int reads;
+
+	if (c == NULL)
+		return -1;
+
+	is = buffered ? input_buffered_open(&c->base) : &c->base;
+	buffer = g_malloc(request_size);
+
+	while (remaining > 0) {
+		nbytes = input_stream_read(is, buffer,
+					   MIN(request_size, remaining),
+					   &error);
+		if (nbytes == 0) {
+			if (error != NULL || !input_stream_eof(is) ||
+			    is->offset == 0 ||
+			    !input_stream_seek(is, 0, SEEK_SET, &error))
+				break;
+
+			continue;
+		}
+
+		remaining -= nbytes;
+	}
+
+	reads = c->reads;
+
+	g_free(buffer);
+	input_stream_close(is);
+
+	if (error != NULL) {
+		g_warning("%s", error->message);
+		g_error_free(error);
+		return -1;
+	}
+
+	if (remaining > 0) {
+		g_printerr("Failed to read %s\n", path);
+		return -1;
+	}
+
+	return reads;
+}
+
+int main(int argc, char **argv)
+{
+	GError *error = NULL;
+	int ret = 0;
+
+	if (argc != 2 || !g_path_is_absolute(argv[1])) {
+		g_printerr("Usage: bench_buffered /PATH/TO/FILE\n");
+		return 1;
+	}
+
+	/* initialize GLib */
+
+	g_thread_init(NULL);
+	g_log_set_default_handler(my_log_func, NULL);
+
+	/* initialize MPD */
+
+	tag_pool_init();
+	config_global_init();
+
+#ifdef ENABLE_ARCHIVE
+	archive_plugin_init_all();
+#endif
+
+	if (!input_stream_global_init(&error)) {
+		g_warning("%s", error->message);
+		g_error_free(error);
+		return 2;
+	}
+
+	printf("%8s %10s %10s\n", "request", "unbuffered", "buffered");
+
+	for (unsigned i = 0; i < G_N_ELEMENTS(request_sizes); ++i) {
+		int unbuffered = bench_buffered(argv[1], request_sizes[i],
+						false);
+		int buffered = unbuffered >= 0
+			? bench_buffered(argv[1], request_sizes[i], true)
+			: -1;
+
+		if (buffered < 0) {
+			ret = 2;
+			break;
+		}
+
+		printf("%8u %10d %10d\n",
+		       (unsigned)request_sizes[i], unbuffered, buffered);
+	}
+
+	/* deinitialize everything */
+
+	input_stream_global_finish();
+
+#ifdef ENABLE_ARCHIVE
+	archive_plugin_deinit_all();
+#endif
+
+	config_global_finish();
+	tag_pool_deinit();
+
+	return ret;
+}
@@ -0,0 +1,161 @@
+/*
+ * Copyright (C) 2003-2010 The Music Player Daemon Project
+ * http://www.musicpd.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * This program measures the cost of "consume" mode playback on a
+ * large queue: the song which has just been played is deleted, and a
+ * new one is appended at the end.  It measures time only; the
+ * results are checked by test/test_queue.
+ */
+
+#include "config.h"
+#include "queue.h"
+#include "song.h"
+
+#include <glib.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+void
+song_free(struct song *song)
+{
+	g_free(song);
+}
+
+static void
+fill_queue(struct queue *queue, struct song *song, unsigned length)
+{
+	while (queue_length(queue) < length)
+		queue_append(queue, song);
+}
+
+/**
+ * Simulate consume mode: delete the song which has just been played
+ * (order number 0) and append another one.
+ */
+static double
+bench_consume(struct queue *queue, struct song *song, unsigned n)
+{
+	GTimer *timer = g_timer_new();
+	double elapsed;
+
+	for (unsigned i = 0; i < n; ++i) {
+		queue_delete(queue, queue_order_to_position(queue, 0));
+		queue_append(queue, song);
+
+		if (queue->random)
+			queue_shuffle_order_last(queue, 0,
+						 queue_length(queue));
+
+		queue_increment_version(queue);
+	}
+
+	elapsed = g_timer_elapsed(timer, NULL);
+	g_timer_destroy(timer);
+	return elapsed;
+}
+
+/**
+ * Simulate a client which polls "plchangesposid" after each song.
+ */
+static double
+bench_plchanges(struct queue *queue, struct song *song, unsigned n)
+{
+	GTimer *timer = g_timer_new();
+	unsigned long total = 0;
+	double elapsed;
+
+	for (unsigned i = 0; i < n; ++i) {
+		uint32_t version = queue->version;
+		unsigned *positions, num_positions;
+
+		queue_delete(queue, queue_length(queue) - 1);
+		queue_append(queue, song);
+		queue_increment_version(queue);
+
+		if (queue_get_changes(queue, version,
+				      &positions, &num_positions)) {
+			total += num_positions;
+			g_free(positions);
+		} else {
+			for (unsigned j = 0; j < queue_length(queue); ++j)
+				if (queue_song_newer(queue, j, version))
+					++total;
+		}
+	}
+
+	elapsed = g_timer_elapsed(timer, NULL);
+	g_timer_destroy(timer);
+
+	g_debug("%lu changed songs reported", total);
+	return elapsed;
+}
+
+int main(int argc, char **argv)
+{
+	struct queue queue;
+	struct song *song;
+	unsigned length, n;
+	double elapsed;
+
+	if (argc > 3) {
+		g_printerr("Usage: bench_queue [LENGTH [ITERATIONS]]\n");
+		return 1;
+	}
+
+	length = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+	n = argc > 2 ? strtoul(argv[2], NULL, 10) : 10000;
+
+	if (length == 0) {
+		g_printerr("Invalid queue length\n");
+		return 1;
+	}
+
+	/* a fake song which is "in the database", so queue_delete()
+	   doesn't free it */
+	song = g_malloc0(sizeof(*song));
+	song->parent = (struct directory *)song;
+
+	queue_init(&queue, length);
+	fill_queue(&queue, song, length);
+
+	elapsed = bench_consume(&queue, song, n);
+	printf("consume:        %u songs in %.3fs (%.1f us/song)\n",
+	       n, elapsed, elapsed * 1e6 / n);
+
+	queue.random = true;
+	queue_shuffle_order(&queue);
+
+	elapsed = bench_consume(&queue, song, n);
+	printf("consume random: %u songs in %.3fs (%.1f us/song)\n",
+	       n, elapsed, elapsed * 1e6 / n);
+
+	queue.random = false;
+	queue_restore_order(&queue);
+
+	elapsed = bench_plchanges(&queue, song, n);
+	printf("plchanges:      %u polls in %.3fs (%.1f us/poll)\n",
+	       n, elapsed, elapsed * 1e6 / n);
+
+	queue_finish(&queue);
+	g_free(song);
+
+	return 0;
+}
@@ -0,0 +1,196 @@
+/*
+ * Copyright (C) 2003-2010 The Music Player Daemon Project
+ * http://www.musicpd.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+/*
+ * This program measures the latency of a seek: it opens the stream,
+ * seeks to the specified offset and reads 64 kB, twice.  Plugins
+ * which build an index while reading (e.g. "bz2") are faster the
+ * second time.  The data is written to stdout.
+ */
+
+#include "config.h"
+#include "input_init.h"
+#include "input_stream.h"
+#include "tag_pool.h"
+#include "conf.h"
+
+#ifdef ENABLE_ARCHIVE
+#include "archive_list.h"
+#endif
+
+#include <glib.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+enum {
+	READ_SIZE = 64 * 1024,
+};
+
+static void
+my_log_func(const gchar *log_domain, G_GNUC_UNUSED GLogLevelFlags log_level,
+	    const gchar *message, G_GNUC_UNUSED gpointer user_data)
+{
+	if (log_domain != NULL)
+		g_printerr("%s: %s\n", log_domain, message);
+	else
+		g_printerr("%s\n", message);
+}
+
+/**
+ * Opens the stream, seeks and reads.
+ *
+ * @return the number of bytes read, or -1 on error
+ */
+static gssize
+bench_seek(const char *uri, goffset offset, char *buffer, double *elapsed_r)
+{
+	GError *error = NULL;
+	struct input_stream *is;
+	GTimer *timer;
+	size_t length = 0, nbytes;
+
+	is = input_stream_open(uri, &error);
+	if (is == NULL) {
+		if (error != NULL) {
+			g_warning("%s", error->message);
+			g_error_free(error);
+		} else
+			g_printerr("input_stream_open() failed\n");
+		return -1;
+	}
+
+	while (!is->ready) {
+		int ret = input_stream_buffer(is, &error);
+		if (ret < 0) {
+			g_warning("%s", error->message);
+			g_error_free(error);
+			input_stream_close(is);
+			return -1;
+		}
+
+		if (ret == 0)
+			g_usleep(10000);
+	}
+
+	timer = g_timer_new();
+
+	if (!input_stream_seek(is, offset, SEEK_SET, &error)) {
+		if (error != NULL) {
+			g_warning("%s", error->message);
+			g_error_free(error);
+		} else
+			g_printerr("input_stream_seek() failed\n");
+		g_timer_destroy(timer);
+		input_stream_close(is);
+		return -1;
+	}
+
+	while (length < READ_SIZE &&
+	       (nbytes = input_stream_read(is, buffer + length,
+					   READ_SIZE - length,
+					   &error)) > 0)
+		length += nbytes;
+
+	*elapsed_r = g_timer_elapsed(timer, NULL);
+	g_timer_destroy(timer);
+
+	input_stream_close(is);
+
+	if (error != NULL) {
+		g_warning("%s", error->message);
+		g_error_free(error);
+		return -1;
+	}
+
+	return length;
+}
+
+int main(int argc, char **argv)
+{
+	GError *error = NULL;
+	static char buffer1[READ_SIZE], buffer2[READ_SIZE];
+	goffset offset;
+	gssize length1, length2;
+	double elapsed1, elapsed2;
+	char *endptr;
+	int ret = 2;
+
+	if (argc != 3) {
+		g_printerr("Usage: bench_seek URI OFFSET\n");
+		return 1;
+	}
+
+	offset = g_ascii_strtoll(argv[2], &endptr, 10);
+	if (*endptr != 0 || offset < 0) {
+		g_printerr("Invalid offset: %s\n", argv[2]);
+		return 1;
+	}
+
+	/* initialize GLib */
+
+	g_thread_init(NULL);
+	g_log_set_default_handler(my_log_func, NULL);
+
+	/* initialize MPD */
+
+	tag_pool_init();
+	config_global_init();
+
+#ifdef ENABLE_ARCHIVE
+	archive_plugin_init_all();
+#endif
+
+	if (!input_stream_global_init(&error)) {
+		g_warning("%s", error->message);
+		g_error_free(error);
+		return 2;
+	}
+
+	length1 = bench_seek(argv[1], offset, buffer1, &elapsed1);
+	length2 = length1 >= 0
+		? bench_seek(argv[1], offset, buffer2, &elapsed2)
+		: -1;
+
+	if (length2 >= 0) {
+		g_printerr("first seek: %.1f ms\n", elapsed1 * 1000);
+		g_printerr("second seek: %.1f ms\n", elapsed2 * 1000);
+
+		if (length1 != length2 ||
+		    memcmp(buffer1, buffer2, length1) != 0)
+			g_printerr("data mismatch\n");
+		else if (write(1, buffer2, length2) == length2)
+			ret = 0;
+	}
+
+	/* deinitialize everything */
+
+	input_stream_global_finish();
+
+#ifdef ENABLE_ARCHIVE
+	archive_plugin_deinit_all();
+#endif
+
+	config_global_finish();
+	tag_pool_deinit();
+
+	return ret;
+}
@@ -0,0 +1,18 @@
+#!/bin/sh -e
+
+SRC_BASE=configure
+SRC="$(dirname $0)/../${SRC_BASE}"
+DST="$(pwd)/test/tmp/${SRC_BASE}_seek.bz2"
+EXPECTED="$(pwd)/test/tmp/${SRC_BASE}_seek.expected"
+
+mkdir -p test/tmp
+rm -f "$DST"
+
+# use the smallest block size, to get an archive with many blocks
+bzip2 -1 -c "$SRC" >"$DST"
+
+SIZE=$(wc -c <"$SRC")
+for OFFSET in 0 $((SIZE / 3)) $((SIZE - 1000)); do
+	tail -c +$((OFFSET + 1)) "$SRC" |head -c 65536 >"$EXPECTED"
+	./test/bench_seek "$DST/${SRC_BASE}" $OFFSET |cmp "$EXPECTED" -
+done
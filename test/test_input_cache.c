@@ -0,0 +1,303 @@
+/*
+ * Copyright (C) 2003-2010 The Music Player Daemon Project
+ * http://www.musicpd.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Unit tests for the disk cache of remote input streams.  A fake
+ * "remote" input plugin serves a buffer in memory, and counts the
+ * bytes which are fetched from it.
+ */
+
+#include "config.h"
+#include "input/cache_input_plugin.h"
+#include "input_plugin.h"
+#include "input_stream.h"
+#include "conf.h"
+
+#include <glib.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+enum {
+	RESOURCE_SIZE = 256 * 1024,
+};
+
+static const char *cache_path;
+
+const char *
+config_get_path(const char *name)
+{
+	return strcmp(name, CONF_INPUT_CACHE_DIR) == 0 ? cache_path : NULL;
+}
+
+unsigned
+config_get_positive(G_GNUC_UNUSED const char *name, unsigned default_value)
+{
+	return default_value;
+}
+
+/*
+ * The parts of input_stream.c which are used by the cache.
+ */
+
+void
+input_stream_close(struct input_stream *is)
+{
+	is->plugin->close(is);
+}
+
+struct tag *
+input_stream_tag(G_GNUC_UNUSED struct input_stream *is)
+{
+	return NULL;
+}
+
+int
+input_stream_buffer(G_GNUC_UNUSED struct input_stream *is,
+		    G_GNUC_UNUSED GError **error_r)
+{
+	return 0;
+}
+
+size_t
+input_stream_read(struct input_stream *is, void *ptr, size_t size,
+		  GError **error_r)
+{
+	return is->plugin->read(is, ptr, size, error_r);
+}
+
+bool
+input_stream_eof(struct input_stream *is)
+{
+	return is->plugin->eof(is);
+}
+
+bool
+input_stream_seek(struct input_stream *is, goffset offset, int whence,
+		  GError **error_r)
+{
+	return is->plugin->seek(is, offset, whence, error_r);
+}
+
+/*
+ * The fake remote resource.
+ */
+
+static unsigned char resource[RESOURCE_SIZE];
+static const char *resource_etag;
+
+/**
+ * The number of bytes which were read from the fake plugin.
+ */
+static size_t fetched;
+
+static void
+fake_close(struct input_stream *is)
+{
+	input_stream_deinit(is);
+	g_free(is);
+}
+
+static size_t
+fake_read(struct input_stream *is, void *ptr, size_t size,
+	  G_GNUC_UNUSED GError **error_r)
+{
+	if ((goffset)size > is->size - is->offset)
+		size = is->size - is->offset;
+
+	memcpy(ptr, resource + is->offset, size);
+	is->offset += size;
+	fetched += size;
+	return size;
+}
+
+static bool
+fake_eof(struct input_stream *is)
+{
+	return is->offset >= is->size;
+}
+
+static bool
+fake_seek(struct input_stream *is, goffset offset, int whence,
+	  G_GNUC_UNUSED GError **error_r)
+{
+	if (whence != SEEK_SET || offset < 0 || offset > is->size)
+		return false;
+
+	is->offset = offset;
+	return true;
+}
+
+static const struct input_plugin fake_input_plugin = {
+	.close = fake_close,
+	.read = fake_read,
+	.eof = fake_eof,
+	.seek = fake_seek,
+};
+
+static struct input_stream *
+fake_open(void)
+{
+	struct input_stream *is = g_new(struct input_stream, 1);
+
+	input_stream_init(is, &fake_input_plugin, "http://localhost/test");
+	is->ready = true;
+	is->seekable = true;
+	is->size = RESOURCE_SIZE;
+	is->etag = g_strdup(resource_etag);
+
+	return input_cache_open(is);
+}
+
+static unsigned failures;
+
+static void
+fail(const char *test, const char *msg)
+{
+	g_printerr("%s: %s\n", test, msg);
+	++failures;
+}
+
+/**
+ * Opens the resource, reads the specified number of bytes from the
+ * beginning, and compares them with the resource.
+ *
+ * @return the number of bytes which were fetched from the fake
+ * plugin
+ */
+static size_t
+read_resource(const char *test, size_t length)
+{
+	struct input_stream *is = fake_open();
+	unsigned char buffer[4096];
+	size_t position = 0;
+
+	fetched = 0;
+
+	while (position < length) {
+		size_t size = MIN(sizeof(buffer), length - position);
+
+		size = input_stream_read(is, buffer, size, NULL);
+		if (size == 0) {
+			fail(test, "premature end of stream");
+			break;
+		}
+
+		if (memcmp(buffer, resource + position, size) != 0) {
+			fail(test, "wrong data");
+			break;
+		}
+
+		position += size;
+	}
+
+	input_stream_close(is);
+	return fetched;
+}
+
+static void
+fill_resource(unsigned seed)
+{
+	GRand *rand = g_rand_new_with_seed(seed);
+
+	for (unsigned i = 0; i < RESOURCE_SIZE; ++i)
+		resource[i] = g_rand_int(rand);
+
+	g_rand_free(rand);
+}
+
+int main(G_GNUC_UNUSED int argc, G_GNUC_UNUSED char **argv)
+{
+	char directory[] = "/tmp/test_input_cache.XXXXXX";
+	GError *error = NULL;
+	char *command;
+
+	g_thread_init(NULL);
+
+	cache_path = mkdtemp(directory);
+	if (cache_path == NULL) {
+		perror("mkdtemp");
+		return EXIT_FAILURE;
+	}
+
+	if (!input_cache_global_init(&error)) {
+		g_printerr("%s\n", error->message);
+		g_error_free(error);
+		return EXIT_FAILURE;
+	}
+
+	fill_resource(1);
+	resource_etag = "\"1\"";
+
+	/* first playback, stopped in the middle */
+	if (read_resource("miss", RESOURCE_SIZE / 2) != RESOURCE_SIZE / 2)
+		fail("miss", "everything should have been fetched");
+
+	/* the second playback fetches only the rest */
+	if (read_resource("resume", RESOURCE_SIZE) != RESOURCE_SIZE / 2)
+		fail("resume", "only the second half should have been fetched");
+
+	/* the resource is complete now; the cache survives a
+	   restart */
+	input_cache_global_finish();
+	if (!input_cache_global_init(&error)) {
+		g_printerr("%s\n", error->message);
+		g_error_free(error);
+		return EXIT_FAILURE;
+	}
+
+	if (read_resource("hit", RESOURCE_SIZE) != 0)
+		fail("hit", "nothing should have been fetched");
+
+	/* the resource is modified, but its size remains the same */
+	fill_resource(2);
+	resource_etag = "\"2\"";
+
+	if (read_resource("modified", RESOURCE_SIZE) != RESOURCE_SIZE)
+		fail("modified", "everything should have been fetched");
+
+	if (read_resource("modified_hit", RESOURCE_SIZE) != 0)
+		fail("modified_hit", "nothing should have been fetched");
+
+	/* without a validator, the resource is not cached */
+	fill_resource(3);
+	resource_etag = NULL;
+
+	if (read_resource("no_validator", RESOURCE_SIZE) != RESOURCE_SIZE)
+		fail("no_validator", "everything should have been fetched");
+
+	if (read_resource("no_validator", RESOURCE_SIZE) != RESOURCE_SIZE)
+		fail("no_validator", "everything should have been fetched");
+
+	input_cache_global_finish();
+
+	command = g_strdup_printf("rm -rf '%s'", cache_path);
+	if (system(command) != 0)
+		g_printerr("failed to delete %s\n", cache_path);
+	g_free(command);
+
+	if (failures > 0) {
+		g_printerr("%u failures\n", failures);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,430 @@
+/*
+ * Copyright (C) 2003-2010 The Music Player Daemon Project
+ * http://www.musicpd.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Unit tests for the queue: the ring buffer storage is compared with
+ * a naive model after random operations, and the change log used by
+ * "plchanges" is checked.
+ */
+
+#include "config.h"
+#include "queue.h"
+#include "song.h"
+
+#include <glib.h>
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void
+song_free(struct song *song)
+{
+	g_free(song);
+}
+
+static unsigned failures;
+
+static void
+fail(const char *test, const char *fmt, ...)
+{
+	va_list ap;
+
+	g_printerr("%s: ", test);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	g_printerr("\n");
+
+	++failures;
+}
+
+/**
+ * Verifies that queue_get_changes() reports every song which
+ * queue_song_newer() considers newer than the specified version
+ * (or falls back to a full scan).
+ */
+static void
+check_changes(const char *test, const struct queue *queue, uint32_t version)
+{
+	unsigned *positions, num_positions, i = 0;
+
+	if (!queue_get_changes(queue, version, &positions, &num_positions))
+		return;
+
+	for (unsigned position = 0; position < queue_length(queue);
+	     ++position) {
+		if (!queue_song_newer(queue, position, version))
+			continue;
+
+		while (i < num_positions && positions[i] < position)
+			++i;
+
+		if (i == num_positions || positions[i] != position) {
+			fail(test, "position %u is missing in the "
+			     "changes since version %u",
+			     position, (unsigned)version);
+			break;
+		}
+	}
+
+	g_free(positions);
+}
+
+/**
+ * Wraps the version number, and then fills the change log until it
+ * overflows.  The songs which were reset to version 0 by the wrap
+ * are not in the log, so it must not be used anymore.
+ */
+static void
+test_version_wrap(struct song *song)
+{
+	struct queue queue;
+
+	queue_init(&queue, 8);
+	for (unsigned i = 0; i < 4; ++i)
+		queue_append(&queue, song);
+	queue_increment_version(&queue);
+
+	queue.version = ((uint32_t)1 << 31) - 2;
+	queue_increment_version(&queue);
+	if (queue.version != 1)
+		fail("version_wrap", "version did not wrap");
+
+	for (unsigned i = 0; i < queue.max_length * 2; ++i)
+		queue_modify(&queue, 0);
+
+	for (uint32_t version = 1; version <= queue.version; ++version)
+		check_changes("version_wrap", &queue, version);
+
+	/* queue_modify_all() enables the log again */
+	queue_modify_all(&queue);
+	queue_modify(&queue, 1);
+	if (queue.changes_since == G_MAXUINT32)
+		fail("version_wrap", "log not enabled again");
+	check_changes("version_wrap", &queue, queue.version - 1);
+
+	queue_finish(&queue);
+}
+
+enum {
+	MODEL_MAX_LENGTH = 64,
+	MODEL_NUM_SONGS = 5,
+};
+
+/**
+ * A naive model of the queue: plain arrays of song ids in position
+ * and in order.
+ */
+struct model {
+	unsigned length;
+
+	unsigned positions[MODEL_MAX_LENGTH];
+
+	unsigned orders[MODEL_MAX_LENGTH];
+
+	struct song *songs[MODEL_MAX_LENGTH * QUEUE_HASH_MULT];
+};
+
+/**
+ * @return the index of the id in the array, or the length if it was
+ * not found
+ */
+static unsigned
+model_find(const unsigned *ids, unsigned length, unsigned id)
+{
+	unsigned i = 0;
+
+	while (i < length && ids[i] != id)
+		++i;
+
+	return i;
+}
+
+static void
+model_remove(unsigned *ids, unsigned length, unsigned i)
+{
+	memmove(ids + i, ids + i + 1, (length - i - 1) * sizeof(ids[0]));
+}
+
+/**
+ * Moves the range [start,end[ of an id array to the new position
+ * "to", like queue_move_range().
+ */
+static void
+model_move_range(unsigned *ids, unsigned start, unsigned end, unsigned to)
+{
+	unsigned length = end - start, tmp[MODEL_MAX_LENGTH];
+
+	memcpy(tmp, ids + start, length * sizeof(ids[0]));
+	if (to < start)
+		memmove(ids + to + length, ids + to,
+			(start - to) * sizeof(ids[0]));
+	else
+		memmove(ids + start, ids + end, (to - start) * sizeof(ids[0]));
+	memcpy(ids + to, tmp, length * sizeof(ids[0]));
+}
+
+/**
+ * Copies the order from the queue after it has been shuffled, and
+ * checks that it is still a permutation of the songs.
+ */
+static void
+model_load_order(const char *test, struct model *model,
+		 const struct queue *queue)
+{
+	for (unsigned i = 0; i < model->length; ++i)
+		model->orders[i] = queue_position_to_id(queue,
+							queue_order_to_position(queue,
+										i));
+
+	for (unsigned i = 0; i < model->length; ++i)
+		for (unsigned j = i + 1; j < model->length; ++j)
+			if (model->orders[i] == model->orders[j])
+				fail(test, "song id %u is in the order twice",
+				     model->orders[i]);
+}
+
+/**
+ * Compares the queue with the model: positions, ids, order numbers
+ * and the song map.
+ */
+static void
+model_check(const char *test, const struct model *model,
+	    const struct queue *queue, struct song *const*songs)
+{
+	if (queue_length(queue) != model->length) {
+		fail(test, "length %u, expected %u",
+		     queue_length(queue), model->length);
+		return;
+	}
+
+	for (unsigned i = 0; i < model->length; ++i) {
+		unsigned id = model->positions[i];
+
+		if ((unsigned)queue_position_to_id(queue, i) != id ||
+		    queue_id_to_position(queue, id) != (int)i ||
+		    queue_get(queue, i) != model->songs[id])
+			fail(test, "position %u does not match", i);
+
+		if (queue_order_to_position(queue, i) !=
+		    model_find(model->positions, model->length,
+			       model->orders[i]) ||
+		    queue_position_to_order(queue, i) !=
+		    model_find(model->orders, model->length, id))
+			fail(test, "order %u does not match", i);
+	}
+
+	for (unsigned i = 0; i < MODEL_NUM_SONGS; ++i) {
+		unsigned *positions, n, expected = 0;
+
+		n = queue_song_positions(queue, songs[i], &positions);
+		for (unsigned j = 0; j < model->length; ++j) {
+			if (model->songs[model->positions[j]] != songs[i])
+				continue;
+
+			if (expected >= n || positions[expected] != j)
+				fail(test, "song %u: position %u missing",
+				     i, j);
+			++expected;
+		}
+
+		if (expected != n)
+			fail(test, "song %u: %u positions, expected %u",
+			     i, n, expected);
+
+		g_free(positions);
+	}
+}
+
+/**
+ * Applies random operations to a small queue (so the ring buffers
+ * wrap around many times) and to the model, and compares them after
+ * each one.  Every position whose song has changed must be reported
+ * as newer than the version before the operation.
+ */
+static void
+test_model(struct song *const*songs, bool random)
+{
+	const char *test = random ? "model_random" : "model";
+	struct queue queue;
+	struct model model;
+	GRand *rand = g_rand_new_with_seed(42);
+
+	queue_init(&queue, MODEL_MAX_LENGTH);
+	queue.random = random;
+	model.length = 0;
+
+	for (unsigned n = 0; n < 20000 && failures == 0; ++n) {
+		unsigned old_positions[MODEL_MAX_LENGTH];
+		unsigned old_length = model.length;
+		uint32_t version = queue.version;
+		unsigned length = model.length;
+		unsigned a, b, c;
+
+		memcpy(old_positions, model.positions,
+		       sizeof(old_positions));
+
+		switch (length == 0 ? 0 : g_rand_int_range(rand, 0, 6)) {
+		case 0: /* append */
+			if (queue_is_full(&queue))
+				break;
+
+			a = queue_append(&queue,
+					 songs[g_rand_int_range(rand, 0,
+								MODEL_NUM_SONGS)]);
+			model.songs[a] = queue_get(&queue, length);
+			model.positions[length] = a;
+			model.orders[length] = a;
+			++model.length;
+
+			if (random) {
+				queue_shuffle_order_last(&queue, 0,
+							 model.length);
+				model_load_order(test, &model, &queue);
+			}
+			break;
+
+		case 1: /* delete */
+			a = g_rand_int_range(rand, 0, length);
+			queue_delete(&queue, a);
+			model_remove(model.orders, length,
+				     model_find(model.orders, length,
+						model.positions[a]));
+			model_remove(model.positions, length, a);
+			--model.length;
+			break;
+
+		case 2: /* delete several */
+			{
+				unsigned positions[MODEL_MAX_LENGTH], m = 0;
+
+				for (unsigned i = 0; i < length; ++i)
+					if (g_rand_int_range(rand, 0, 4) == 0)
+						positions[m++] = i;
+
+				queue_delete_positions(&queue, positions, m);
+
+				while (m-- > 0) {
+					a = positions[m];
+					model_remove(model.orders,
+						     model.length,
+						     model_find(model.orders,
+								model.length,
+								model.positions[a]));
+					model_remove(model.positions,
+						     model.length, a);
+					--model.length;
+				}
+			}
+			break;
+
+		case 3: /* move */
+			a = g_rand_int_range(rand, 0, length);
+			b = g_rand_int_range(rand, 0, length);
+			queue_move(&queue, a, b);
+			model_move_range(model.positions, a, a + 1, b);
+			if (!random)
+				memcpy(model.orders, model.positions,
+				       sizeof(model.orders));
+			break;
+
+		case 4: /* move range */
+			a = g_rand_int_range(rand, 0, length);
+			b = g_rand_int_range(rand, a, length) + 1;
+			c = g_rand_int_range(rand, 0, length - (b - a) + 1);
+			queue_move_range(&queue, a, b, c);
+			model_move_range(model.positions, a, b, c);
+			if (!random)
+				memcpy(model.orders, model.positions,
+				       sizeof(model.orders));
+			break;
+
+		case 5: /* swap */
+			a = g_rand_int_range(rand, 0, length);
+			b = g_rand_int_range(rand, 0, length);
+			queue_swap(&queue, a, b);
+
+			c = model.positions[a];
+			model.positions[a] = model.positions[b];
+			model.positions[b] = c;
+
+			/* the order numbers are swapped, too */
+			a = model_find(model.orders, length,
+				       model.positions[a]);
+			b = model_find(model.orders, length,
+				       model.positions[b]);
+			c = model.orders[a];
+			model.orders[a] = model.orders[b];
+			model.orders[b] = c;
+			break;
+		}
+
+		if (random && g_rand_int_range(rand, 0, 100) == 0) {
+			queue_shuffle_order(&queue);
+			model_load_order(test, &model, &queue);
+		}
+
+		queue_increment_version(&queue);
+
+		model_check(test, &model, &queue, songs);
+
+		for (unsigned i = 0; i < model.length; ++i)
+			if ((i >= old_length ||
+			     old_positions[i] != model.positions[i]) &&
+			    !queue_song_newer(&queue, i, version))
+				fail(test, "position %u has changed, but is "
+				     "not newer than version %u",
+				     i, (unsigned)version);
+
+		check_changes(test, &queue, version);
+		if (version > 8)
+			check_changes(test, &queue, version - 8);
+	}
+
+	g_rand_free(rand);
+	queue_finish(&queue);
+}
+
+int main(G_GNUC_UNUSED int argc, G_GNUC_UNUSED char **argv)
+{
+	struct song *songs[MODEL_NUM_SONGS];
+
+	/* fake songs which are "in the database", so queue_delete()
+	   doesn't free them */
+	for (unsigned i = 0; i < MODEL_NUM_SONGS; ++i) {
+		songs[i] = g_malloc0(sizeof(*songs[i]));
+		songs[i]->parent = (struct directory *)songs[i];
+	}
+
+	test_model(songs, false);
+	test_model(songs, true);
+	test_version_wrap(songs[0]);
+
+	for (unsigned i = 0; i < MODEL_NUM_SONGS; ++i)
+		g_free(songs[i]);
+
+	if (failures > 0) {
+		g_printerr("%u failures\n", failures);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}